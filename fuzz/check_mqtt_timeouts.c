@@ -0,0 +1,81 @@
+/***********************************************************************
+ *          CHECK_MQTT_TIMEOUTS.C
+ *          The deadlines of a connection run out with the event loop.
+ *
+ *  A truncated CONNECT (fixed header and the first bytes of the payload)
+ *  must be dropped after timeout_payload, even if the handshake timeout
+ *  is longer. Exit 0 if right.
+ *
+ *          Copyright (c) 2022 Niyamaka.
+ *          All Rights Reserved.
+ ***********************************************************************/
+#include <stdio.h>
+#include <unistd.h>
+#include "mqtt_harness.h"
+
+/***************************************************************************
+ *              Constants
+ ***************************************************************************/
+#define CHECK_TIMEOUT_HANDSHAKE (60*1000)
+#define CHECK_TIMEOUT_PAYLOAD   500
+#define CHECK_MAX_WAIT          (5*1000)
+
+/***************************************************************************
+ *  Run the event loop until the connection is dropped or max_wait
+ ***************************************************************************/
+static uint64_t run_until_drop(uint64_t max_wait)
+{
+    uv_loop_t *loop = yuno_uv_event_loop();
+    uint64_t start = time_in_miliseconds();
+    uint64_t elapsed = 0;
+
+    while(mqtt_harness_stats()->drops == 0 && elapsed < max_wait) {
+        uv_run(loop, UV_RUN_NOWAIT);
+        usleep(10*1000);
+        elapsed = time_in_miliseconds() - start;
+    }
+    return elapsed;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+int main(int argc, char *argv[])
+{
+    static const uint8_t truncated_connect[] = {
+        0x10, 0x20,                 // CONNECT, remaining length 32
+        0x00, 0x04, 'M', 'Q', 'T', 'T'
+    };
+
+    if(mqtt_harness_startup("check_mqtt_timeouts", FALSE)<0) {
+        fprintf(stderr, "mqtt_harness_startup() FAILED\n");
+        return 1;
+    }
+    hgobj mqtt = mqtt_harness_gobj();
+    gobj_write_int32_attr(mqtt, "timeout_handshake", CHECK_TIMEOUT_HANDSHAKE);
+    gobj_write_int32_attr(mqtt, "timeout_payload", CHECK_TIMEOUT_PAYLOAD);
+
+    mqtt_harness_reconnect();
+    mqtt_harness_feed_chunk(truncated_connect, sizeof(truncated_connect));
+    uint64_t elapsed = run_until_drop(CHECK_MAX_WAIT);
+
+    int ret = 0;
+    if(mqtt_harness_stats()->drops != 1) {
+        fprintf(stderr, "truncated CONNECT: not dropped in %d ms\n", CHECK_MAX_WAIT);
+        ret = 1;
+    } else if(elapsed < CHECK_TIMEOUT_PAYLOAD) {
+        fprintf(stderr, "truncated CONNECT: dropped in %lu ms, before timeout_payload (%d ms)\n",
+            (unsigned long)elapsed,
+            CHECK_TIMEOUT_PAYLOAD
+        );
+        ret = 1;
+    } else {
+        printf("truncated CONNECT: dropped in %lu ms (timeout_payload %d ms)\n",
+            (unsigned long)elapsed,
+            CHECK_TIMEOUT_PAYLOAD
+        );
+    }
+
+    mqtt_harness_end();
+    return ret;
+}
@@ -0,0 +1,91 @@
+/***********************************************************************
+ *          FUZZ_MQTT_DECODER.C
+ *          Fuzz target of the Mqtt decoder.
+ *
+ *  Input: 4 bytes with the seed of the splits, 1 byte with the maximum
+ *  chunk size, and the stream of bytes received by a server connection.
+ *  The stream is injected in a new connection of a new Mqtt gobj
+ *  (no state is kept between inputs, a crash reproduces with its input alone),
+ *  split at pseudo random boundaries, through
+ *  ac_process_frame_header/ac_process_payload_data.
+ *
+ *  libFuzzer (clang, -DMQTT_FUZZ_LIBFUZZER -fsanitize=fuzzer,address):
+ *      fuzz_mqtt_decoder corpus/
+ *  AFL (afl-clang-fast/afl-gcc, without MQTT_FUZZ_LIBFUZZER):
+ *      afl-fuzz -i corpus -o findings -- fuzz_mqtt_decoder @@
+ *  Reproduce a crash:
+ *      fuzz_mqtt_decoder crash-file
+ *
+ *          Copyright (c) 2022 Niyamaka.
+ *          All Rights Reserved.
+ ***********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include "mqtt_harness.h"
+
+/***************************************************************************
+ *              Constants
+ ***************************************************************************/
+#define FUZZ_HEADER_SIZE    5
+#define FUZZ_MAX_INPUT      (1024*1024)
+
+/***************************************************************************
+ *  Entry point of libFuzzer
+ ***************************************************************************/
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if(mqtt_harness_startup("fuzz_mqtt_decoder", getenv("MQTT_FUZZ_WEBSOCKET")?TRUE:FALSE)<0) {
+        abort();
+    }
+    if(size < FUZZ_HEADER_SIZE) {
+        return 0;
+    }
+
+    uint32_t seed = (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+        ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+    size_t max_chunk = 1 + data[4];
+
+    if(mqtt_harness_reset()<0) {
+        abort();
+    }
+    mqtt_harness_reconnect();
+    mqtt_harness_feed_split(data + FUZZ_HEADER_SIZE, size - FUZZ_HEADER_SIZE, seed, max_chunk);
+    return 0;
+}
+
+#ifndef MQTT_FUZZ_LIBFUZZER
+/***************************************************************************
+ *  Standalone driver: AFL and reproduction of crashes
+ ***************************************************************************/
+static int run_file(FILE *file)
+{
+    static uint8_t buffer[FUZZ_MAX_INPUT];
+    size_t len = fread(buffer, 1, sizeof(buffer), file);
+    return LLVMFuzzerTestOneInput(buffer, len);
+}
+
+int main(int argc, char *argv[])
+{
+#ifdef __AFL_LOOP
+    while(__AFL_LOOP(1000)) {
+#endif
+        if(argc < 2) {
+            run_file(stdin);
+        }
+        for(int i=1; i<argc; i++) {
+            FILE *file = fopen(argv[i], "rb");
+            if(!file) {
+                fprintf(stderr, "Cannot open %s\n", argv[i]);
+                continue;
+            }
+            run_file(file);
+            fclose(file);
+        }
+#ifdef __AFL_LOOP
+    }
+#endif
+
+    mqtt_harness_end();
+    return 0;
+}
+#endif
@@ -0,0 +1,358 @@
+/***********************************************************************
+ *          MQTT_HARNESS.C
+ *          Drive the Mqtt GClass decoder without network.
+ *
+ *          Copyright (c) 2022 Niyamaka.
+ *          All Rights Reserved.
+ ***********************************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include "c_mqtt.h"
+#include "yuneta_iot_register.h"
+#include "mqtt_harness.h"
+
+/***************************************************************************
+ *              Constants
+ ***************************************************************************/
+#define GCLASS_MQTT_SINK_NAME "MqttSink"
+#define GCLASS_MQTT_SINK gclass_mqtt_sink()
+
+/***************************************************************************
+ *              Prototypes
+ ***************************************************************************/
+PRIVATE GCLASS *gclass_mqtt_sink(void);
+
+/***************************************************************************
+ *              Data
+ ***************************************************************************/
+PRIVATE hgobj __yuno__ = 0;
+PRIVATE hgobj __mqtt__ = 0;
+PRIVATE hgobj __sink__ = 0;
+PRIVATE BOOL __connected__ = FALSE;
+PRIVATE BOOL __websocket__ = FALSE;
+PRIVATE mqtt_harness_stats_t __stats__;
+
+
+
+
+            /***************************
+             *      Sink GClass
+             ***************************/
+
+
+
+
+/*---------------------------------------------*
+ *      Attributes - order affect to oid's
+ *---------------------------------------------*/
+PRIVATE sdata_desc_t tattr_desc[] = {
+/*-ATTR-type------------name----------------flag------------default-----description---------- */
+SDATA (ASN_OCTET_STR,   "rHost",            SDF_RD,         "fuzz",     "Connex compatible, no use"),
+SDATA (ASN_OCTET_STR,   "rPort",            SDF_RD,         "0",        "Connex compatible, no use"),
+SDATA (ASN_OCTET_STR,   "peername",         SDF_RD,         "fuzz:0",   "Connex compatible, no use"),
+SDATA (ASN_OCTET_STR,   "sockname",         SDF_RD,         "fuzz:0",   "Connex compatible, no use"),
+SDATA_END()
+};
+
+typedef struct _PRIVATE_DATA {
+    int32_t unused;
+} PRIVATE_DATA;
+
+/***************************************************************************
+ *  Output of the Mqtt gobj, discarded
+ ***************************************************************************/
+PRIVATE int ac_tx_data(hgobj gobj, const char *event, json_t *kw, hgobj src)
+{
+    GBUFFER *gbuf = (GBUFFER *)(size_t)kw_get_int(kw, "gbuffer", 0, FALSE);
+    if(gbuf) {
+        __stats__.tx_bytes += gbuf_leftbytes(gbuf);
+    }
+    KW_DECREF(kw)
+    return 0;
+}
+
+/***************************************************************************
+ *  The Mqtt gobj closes the connection: disconnect as a connex would do
+ ***************************************************************************/
+PRIVATE int ac_drop(hgobj gobj, const char *event, json_t *kw, hgobj src)
+{
+    if(__connected__) {
+        __connected__ = FALSE;
+        __stats__.drops++;
+        gobj_send_event(__mqtt__, "EV_DISCONNECTED", 0, gobj);
+    }
+    KW_DECREF(kw)
+    return 0;
+}
+
+/***************************************************************************
+ *  Publications of the Mqtt gobj
+ ***************************************************************************/
+PRIVATE int ac_on_message(hgobj gobj, const char *event, json_t *kw, hgobj src)
+{
+    __stats__.messages++;
+    KW_DECREF(kw)
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int ac_ignore(hgobj gobj, const char *event, json_t *kw, hgobj src)
+{
+    KW_DECREF(kw)
+    return 0;
+}
+
+PRIVATE const EVENT input_events[] = {
+    {"EV_TX_DATA",          0},
+    {"EV_DROP",             0},
+    {"EV_ON_OPEN",          0},
+    {"EV_ON_CLOSE",         0},
+    {"EV_ON_MESSAGE",       0},
+    {NULL, 0}
+};
+PRIVATE const EVENT output_events[] = {
+    {NULL, 0}
+};
+PRIVATE const char *state_names[] = {
+    "ST_IDLE",
+    NULL
+};
+
+PRIVATE EV_ACTION ST_IDLE[] = {
+    {"EV_TX_DATA",          ac_tx_data,         0},
+    {"EV_DROP",             ac_drop,            0},
+    {"EV_ON_OPEN",          ac_ignore,          0},
+    {"EV_ON_CLOSE",         ac_ignore,          0},
+    {"EV_ON_MESSAGE",       ac_on_message,      0},
+    {0,0,0}
+};
+
+PRIVATE EV_ACTION *states[] = {
+    ST_IDLE,
+    NULL
+};
+
+PRIVATE FSM fsm = {
+    input_events,
+    output_events,
+    state_names,
+    states,
+};
+
+PRIVATE LMETHOD lmt[] = {
+    {0, 0, 0}
+};
+
+PRIVATE GCLASS _gclass = {
+    0,  // base
+    GCLASS_MQTT_SINK_NAME,
+    &fsm,
+    {
+        0, //mt_create,
+    },
+    lmt,
+    tattr_desc,
+    sizeof(PRIVATE_DATA),
+    0,  // acl
+    0,  // s_user_trace_level
+    0,  // command_table
+    0,  // gcflag
+};
+
+PRIVATE GCLASS *gclass_mqtt_sink(void)
+{
+    return &_gclass;
+}
+
+
+
+
+            /***************************
+             *      Harness
+             ***************************/
+
+
+
+
+/***************************************************************************
+ *  The Mqtt gobj is the only one of the yuno:
+ *  when it's destroyed the sessions, topics and pools of the broker go with it.
+ ***************************************************************************/
+PRIVATE int create_mqtt(void)
+{
+    json_t *kw_mqtt = json_pack("{s:b, s:b, s:I}",
+        "iamServer", 1,
+        "websocket", __websocket__,
+        "subscriber", (json_int_t)(size_t)__sink__
+    );
+    __mqtt__ = gobj_create("mqtt", GCLASS_MQTT, kw_mqtt, __yuno__);
+    if(!__mqtt__) {
+        return -1;
+    }
+    gobj_set_bottom_gobj(__mqtt__, __sink__);
+    gobj_start(__mqtt__);
+    return 0;
+}
+
+/***************************************************************************
+ *  Logs are quiet unless MQTT_HARNESS_LOG is set:
+ *  every malformed input is logged and that would be the bottleneck.
+ ***************************************************************************/
+PUBLIC int mqtt_harness_startup(const char *name, BOOL websocket)
+{
+    if(__yuno__) {
+        return 0;
+    }
+
+    init_ghelpers_library(name);
+    log_startup(name, "1.0.0", name);
+    if(getenv("MQTT_HARNESS_LOG")) {
+        log_add_handler("stdout", "stdout", LOG_OPT_ALL, 0);
+    }
+    gobj_start_up(
+        0,      // jn_global_settings
+        0,      // startup_persistent_attrs
+        0,      // end_persistent_attrs
+        0,      // load_persistent_attrs
+        0,      // save_persistent_attrs
+        0,      // remove_persistent_attrs
+        0,      // list_persistent_attrs
+        0,      // global_command_parser
+        0,      // global_stats_parser
+        0,      // global_authz_checker
+        0       // global_authenticate_parser
+    );
+    yuneta_register_c_core();
+    yuneta_register_c_iot();
+    gobj_register_gclass(GCLASS_MQTT_SINK);
+
+    __yuno__ = gobj_create_yuno(name, GCLASS_YUNO, 0);
+    if(!__yuno__) {
+        return -1;
+    }
+    __sink__ = gobj_create("sink", GCLASS_MQTT_SINK, 0, __yuno__);
+    __websocket__ = websocket;
+
+    return create_mqtt();
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC void mqtt_harness_end(void)
+{
+    if(!__yuno__) {
+        return;
+    }
+    if(__connected__) {
+        __connected__ = FALSE;
+        gobj_send_event(__mqtt__, "EV_DISCONNECTED", 0, __sink__);
+    }
+    gobj_stop(__mqtt__);
+    gobj_shutdown();
+    gobj_end();
+    __yuno__ = __mqtt__ = __sink__ = 0;
+}
+
+/***************************************************************************
+ *  Destroy the Mqtt gobj and create a new one
+ ***************************************************************************/
+PUBLIC int mqtt_harness_reset(void)
+{
+    if(!__yuno__) {
+        return -1;
+    }
+    if(__connected__) {
+        __connected__ = FALSE;
+        gobj_send_event(__mqtt__, "EV_DISCONNECTED", 0, __sink__);
+    }
+    if(__mqtt__) {
+        gobj_stop(__mqtt__);
+        gobj_destroy(__mqtt__);
+        __mqtt__ = 0;
+    }
+    return create_mqtt();
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC void mqtt_harness_reconnect(void)
+{
+    if(__connected__) {
+        __connected__ = FALSE;
+        gobj_send_event(__mqtt__, "EV_DISCONNECTED", 0, __sink__);
+    }
+    __connected__ = TRUE;
+    __stats__.connections++;
+    gobj_send_event(__mqtt__, "EV_CONNECTED", 0, __sink__);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC void mqtt_harness_feed_chunk(const uint8_t *data, size_t size)
+{
+    if(!size) {
+        return;
+    }
+    if(!__connected__) {
+        mqtt_harness_reconnect();
+    }
+
+    GBUFFER *gbuf = gbuf_create(size, size, 0, 0);
+    if(!gbuf) {
+        return;
+    }
+    gbuf_append(gbuf, (void *)data, size);
+
+    __stats__.rx_bytes += size;
+    __stats__.rx_chunks++;
+
+    json_t *kw = json_pack("{s:I}",
+        "gbuffer", (json_int_t)(size_t)gbuf
+    );
+    gobj_send_event(__mqtt__, "EV_RX_DATA", kw, __sink__);
+}
+
+/***************************************************************************
+ *  xorshift32, the same splits for the same seed
+ ***************************************************************************/
+PUBLIC void mqtt_harness_feed_split(const uint8_t *data, size_t size, uint32_t seed, size_t max_chunk)
+{
+    uint32_t x = seed? seed : 0x9E3779B9;
+    if(max_chunk == 0) {
+        max_chunk = 1;
+    }
+
+    while(size > 0) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        size_t n = 1 + (x % max_chunk);
+        if(n > size) {
+            n = size;
+        }
+        mqtt_harness_feed_chunk(data, n);
+        data += n;
+        size -= n;
+    }
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC hgobj mqtt_harness_gobj(void)
+{
+    return __mqtt__;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC mqtt_harness_stats_t *mqtt_harness_stats(void)
+{
+    return &__stats__;
+}
@@ -0,0 +1,71 @@
+/****************************************************************************
+ *          MQTT_HARNESS.H
+ *          Drive the Mqtt GClass decoder without network.
+ *
+ *  A Mqtt gobj (server side) is created with a sink gobj as bottom:
+ *  the bytes are injected with EV_RX_DATA, as a connex would do,
+ *  and the output (EV_TX_DATA) is discarded.
+ *  On EV_DROP the sink disconnects the Mqtt gobj,
+ *  the next feed opens a new connection.
+ *
+ *          Copyright (c) 2022 Niyamaka.
+ *          All Rights Reserved.
+ ****************************************************************************/
+#pragma once
+
+#include <yuneta.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*********************************************************************
+ *      Structures
+ *********************************************************************/
+typedef struct {
+    uint64_t rx_bytes;      // bytes injected
+    uint64_t rx_chunks;     // EV_RX_DATA sent
+    uint64_t tx_bytes;      // bytes answered by the Mqtt gobj
+    uint64_t messages;      // EV_ON_MESSAGE published
+    uint64_t connections;   // EV_CONNECTED sent
+    uint64_t drops;         // connections dropped by the Mqtt gobj
+} mqtt_harness_stats_t;
+
+/*********************************************************************
+ *      Prototypes
+ *********************************************************************/
+PUBLIC int mqtt_harness_startup(const char *name, BOOL websocket);
+PUBLIC void mqtt_harness_end(void);
+
+/*
+ *  Destroy the Mqtt gobj and create a new one, without connection:
+ *  nothing of the previous input is left (sessions, subscriptions, topics).
+ */
+PUBLIC int mqtt_harness_reset(void);
+
+/*
+ *  Close the current connection (if any) and open a new one
+ */
+PUBLIC void mqtt_harness_reconnect(void);
+
+/*
+ *  Inject one chunk, as received from the network
+ */
+PUBLIC void mqtt_harness_feed_chunk(const uint8_t *data, size_t size);
+
+/*
+ *  Inject a stream split at pseudo random boundaries of 1..max_chunk bytes,
+ *  the splits are reproducible from `seed`.
+ */
+PUBLIC void mqtt_harness_feed_split(const uint8_t *data, size_t size, uint32_t seed, size_t max_chunk);
+
+/*
+ *  The Mqtt gobj, to write its attributes
+ */
+PUBLIC hgobj mqtt_harness_gobj(void);
+
+PUBLIC mqtt_harness_stats_t *mqtt_harness_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
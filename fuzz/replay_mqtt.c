@@ -0,0 +1,402 @@
+/***********************************************************************
+ *          REPLAY_MQTT.C
+ *          Replay captured MQTT traffic through the decoder at max speed.
+ *
+ *  The traces are:
+ *      - pcap files (Ethernet, Linux cooked or raw IP; IPv4/IPv6 over TCP):
+ *        the TCP payload sent to the broker port (-p, default 1883) is
+ *        replayed, one chunk per captured segment, in capture order
+ *        (no reordering of retransmissions).
+ *      - hex files: pairs of hex digits, spaces and ':' ignored,
+ *        '#' comments to the end of line, an empty line ends a chunk.
+ *
+ *  Every loop (-n) replays all the traces in a new connection and
+ *  the throughput of the decoder is printed at end.
+ *  With -s the chunks are re-split at pseudo random boundaries.
+ *
+ *          Copyright (c) 2022 Niyamaka.
+ *          All Rights Reserved.
+ ***********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "mqtt_harness.h"
+
+/***************************************************************************
+ *              Constants
+ ***************************************************************************/
+#define PCAP_MAGIC          0xA1B2C3D4
+#define PCAP_MAGIC_NSEC     0xA1B23C4D
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_LINUX_SLL  113
+#define LINKTYPE_IPV4       228
+#define LINKTYPE_IPV6       229
+
+/***************************************************************************
+ *              Structures
+ ***************************************************************************/
+typedef struct {
+    uint8_t *data;
+    size_t size;
+} chunk_t;
+
+typedef struct {
+    chunk_t *chunks;
+    size_t count;
+    size_t max;
+    size_t bytes;
+} trace_t;
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+static void trace_add(trace_t *trace, const uint8_t *data, size_t size)
+{
+    if(!size) {
+        return;
+    }
+    if(trace->count == trace->max) {
+        trace->max = trace->max? trace->max*2 : 1024;
+        trace->chunks = realloc(trace->chunks, trace->max * sizeof(chunk_t));
+        if(!trace->chunks) {
+            fprintf(stderr, "No memory\n");
+            exit(-1);
+        }
+    }
+    chunk_t *chunk = &trace->chunks[trace->count++];
+    chunk->data = malloc(size);
+    if(!chunk->data) {
+        fprintf(stderr, "No memory\n");
+        exit(-1);
+    }
+    memcpy(chunk->data, data, size);
+    chunk->size = size;
+    trace->bytes += size;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+static uint32_t rd32(const uint8_t *p, int swap)
+{
+    uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    if(swap) {
+        v = __builtin_bswap32(v);
+    }
+    return v;
+}
+
+static uint16_t rd16be(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+/***************************************************************************
+ *  TCP payload of an IP packet sent to `port`, return its length
+ ***************************************************************************/
+static size_t ip_tcp_payload(const uint8_t *p, size_t len, int port, const uint8_t **payload)
+{
+    if(len < 1) {
+        return 0;
+    }
+    size_t ip_header;
+    size_t ip_total;
+    int version = p[0] >> 4;
+    if(version == 4) {
+        if(len < 20 || p[9] != 6) {     // 6: TCP
+            return 0;
+        }
+        ip_header = (p[0] & 0x0F) * 4;
+        ip_total = rd16be(p + 2);
+    } else if(version == 6) {
+        if(len < 40 || p[6] != 6) {     // No extension headers
+            return 0;
+        }
+        ip_header = 40;
+        ip_total = 40 + rd16be(p + 4);
+    } else {
+        return 0;
+    }
+    if(ip_total > len) {
+        ip_total = len;  // truncated by the snaplen
+    }
+    if(ip_header + 20 > ip_total) {
+        return 0;
+    }
+    const uint8_t *tcp = p + ip_header;
+    if(rd16be(tcp + 2) != port) {
+        return 0;
+    }
+    size_t tcp_header = (tcp[12] >> 4) * 4;
+    if(ip_header + tcp_header > ip_total) {
+        return 0;
+    }
+    *payload = tcp + tcp_header;
+    return ip_total - ip_header - tcp_header;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+static int load_pcap(trace_t *trace, const uint8_t *bf, size_t len, int port)
+{
+    uint32_t magic = rd32(bf, 0);
+    int swap = 0;
+    if(magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC) {
+        swap = 1;
+    }
+    uint32_t linktype = rd32(bf + 20, swap);
+
+    size_t offset = 24;
+    while(offset + 16 <= len) {
+        uint32_t incl_len = rd32(bf + offset + 8, swap);
+        offset += 16;
+        if(offset + incl_len > len) {
+            break;  // truncated capture
+        }
+        const uint8_t *p = bf + offset;
+        size_t plen = incl_len;
+        offset += incl_len;
+
+        switch(linktype) {
+            case LINKTYPE_ETHERNET:
+                {
+                    if(plen < 14) {
+                        continue;
+                    }
+                    size_t l2 = 14;
+                    uint16_t ethertype = rd16be(p + 12);
+                    if(ethertype == 0x8100 && plen >= 18) { // vlan
+                        ethertype = rd16be(p + 16);
+                        l2 = 18;
+                    }
+                    if(ethertype != 0x0800 && ethertype != 0x86DD) {
+                        continue;
+                    }
+                    p += l2;
+                    plen -= l2;
+                }
+                break;
+            case LINKTYPE_LINUX_SLL:
+                if(plen < 16) {
+                    continue;
+                }
+                p += 16;
+                plen -= 16;
+                break;
+            case LINKTYPE_RAW:
+            case LINKTYPE_IPV4:
+            case LINKTYPE_IPV6:
+                break;
+            default:
+                fprintf(stderr, "pcap link type %u not supported\n", linktype);
+                return -1;
+        }
+
+        const uint8_t *payload;
+        size_t n = ip_tcp_payload(p, plen, port, &payload);
+        trace_add(trace, payload, n);
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+static int hex_value(int c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int load_hex(trace_t *trace, const uint8_t *bf, size_t len, const char *path)
+{
+    uint8_t *chunk = malloc(len/2 + 1);
+    if(!chunk) {
+        fprintf(stderr, "No memory\n");
+        return -1;
+    }
+    size_t n = 0;
+    int line = 1;
+    int hi = -1;
+    BOOL empty_line = TRUE;
+
+    for(size_t i=0; i<len; i++) {
+        int c = bf[i];
+        if(c == '#') {
+            empty_line = FALSE;     // a comment line doesn't end the chunk
+            while(i < len && bf[i] != '\n') {
+                i++;
+            }
+            c = '\n';
+            if(i >= len) {
+                break;
+            }
+        }
+        if(c == '\n') {
+            if(empty_line) {
+                trace_add(trace, chunk, n);
+                n = 0;
+            }
+            empty_line = TRUE;
+            line++;
+            continue;
+        }
+        if(c == ' ' || c == '\t' || c == '\r' || c == ':') {
+            continue;
+        }
+        int v = hex_value(c);
+        if(v < 0) {
+            fprintf(stderr, "%s:%d: bad hex char '%c'\n", path, line, c);
+            free(chunk);
+            return -1;
+        }
+        empty_line = FALSE;
+        if(hi < 0) {
+            hi = v;
+        } else {
+            chunk[n++] = (uint8_t)((hi << 4) | v);
+            hi = -1;
+        }
+    }
+    trace_add(trace, chunk, n);
+    free(chunk);
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+static int load_trace(trace_t *trace, const char *path, int port)
+{
+    FILE *file = fopen(path, "rb");
+    if(!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *bf = malloc(len > 0? len : 1);
+    if(!bf || fread(bf, 1, len, file) != (size_t)len) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        fclose(file);
+        free(bf);
+        return -1;
+    }
+    fclose(file);
+
+    int ret;
+    uint32_t magic = len >= 24? rd32(bf, 0) : 0;
+    if(magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC ||
+            magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+        ret = load_pcap(trace, bf, len, port);
+    } else {
+        ret = load_hex(trace, bf, len, path);
+    }
+    free(bf);
+    return ret;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-n loops] [-p port] [-s max_chunk] [-w] trace...\n"
+        "   -n  Replays of the traces (default 1000)\n"
+        "   -p  Broker port of the pcap traces (default 1883)\n"
+        "   -s  Re-split the chunks at random boundaries of 1..max_chunk bytes\n"
+        "   -w  The traffic is MQTT over WebSocket\n",
+        prog
+    );
+}
+
+int main(int argc, char *argv[])
+{
+    int loops = 1000;
+    int port = 1883;
+    int max_chunk = 0;
+    BOOL websocket = FALSE;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:p:s:wh")) != -1) {
+        switch(opt) {
+            case 'n': loops = atoi(optarg); break;
+            case 'p': port = atoi(optarg); break;
+            case 's': max_chunk = atoi(optarg); break;
+            case 'w': websocket = TRUE; break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if(optind >= argc || loops <= 0) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    trace_t trace;
+    memset(&trace, 0, sizeof(trace));
+    for(int i=optind; i<argc; i++) {
+        if(load_trace(&trace, argv[i], port)<0) {
+            return -1;
+        }
+    }
+    if(!trace.bytes) {
+        fprintf(stderr, "No MQTT data in the traces\n");
+        return -1;
+    }
+
+    if(mqtt_harness_startup("replay_mqtt", websocket)<0) {
+        fprintf(stderr, "mqtt_harness_startup() FAILED\n");
+        return -1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(int l=0; l<loops; l++) {
+        mqtt_harness_reconnect();
+        for(size_t c=0; c<trace.count; c++) {
+            if(max_chunk > 0) {
+                mqtt_harness_feed_split(trace.chunks[c].data, trace.chunks[c].size, l*7919 + c, max_chunk);
+            } else {
+                mqtt_harness_feed_chunk(trace.chunks[c].data, trace.chunks[c].size);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    mqtt_harness_stats_t *stats = mqtt_harness_stats();
+    printf("traces: %d, chunks: %zu, bytes: %zu, loops: %d\n",
+        argc - optind, trace.count, trace.bytes, loops);
+    printf("rx: %llu bytes in %llu chunks, %.3f s, %.1f MB/s, %.0f chunks/s\n",
+        (unsigned long long)stats->rx_bytes,
+        (unsigned long long)stats->rx_chunks,
+        seconds,
+        seconds > 0? stats->rx_bytes / seconds / 1e6 : 0.0,
+        seconds > 0? stats->rx_chunks / seconds : 0.0
+    );
+    printf("messages: %llu (%.0f/s), tx: %llu bytes, connections: %llu, drops: %llu\n",
+        (unsigned long long)stats->messages,
+        seconds > 0? stats->messages / seconds : 0.0,
+        (unsigned long long)stats->tx_bytes,
+        (unsigned long long)stats->connections,
+        (unsigned long long)stats->drops
+    );
+
+    mqtt_harness_end();
+
+    for(size_t c=0; c<trace.count; c++) {
+        free(trace.chunks[c].data);
+    }
+    free(trace.chunks);
+    return 0;
+}
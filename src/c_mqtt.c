@@ -18,12 +18,24 @@
  *          All Rights Reserved.
  ***********************************************************************/
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
 #include <endian.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
 #include <openssl/ssl.h>
 #include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <zlib.h>
 #include "c_mqtt.h"
 #include "msglog_iot.h"
 
@@ -423,7 +435,7 @@ enum mosquitto_msg_state {
 };
 
 struct mosquitto_msg_store {
-    char *topic;
+    const char *topic;              // interned
     void *payload;
     int payloadlen; // uint32_t
     int mid;        // uint16_t
@@ -431,11 +443,18 @@ struct mosquitto_msg_store {
     bool retain;
 
     time_t message_expiry_time;
-    char *source_id;
-    char *source_username;
-    int ref_count;
+    const char *source_id;          // interned
+    const char *source_username;    // interned
+    int ref_count;  // the store is shared by the client messages, free with the last reference
     uint16_t source_mid;
     json_t *properties;
+
+    /*
+     *  Spooled payload: the payload is in a mapped temporary file
+     */
+    char *spool_file;
+    void *spool_base;
+    size_t spool_len;
 };
 
 struct mosquitto_client_msg {
@@ -469,12 +488,345 @@ typedef struct _FRAME_HEAD {
     size_t frame_length;
 } FRAME_HEAD;
 
+/*
+ *  Interned string: one refcounted copy of each client id, subscription filter
+ *  and topic of the stored messages, freed with its last reference
+ */
+typedef struct intern_str_s {
+    struct intern_str_s *next;  // hash chain
+    uint32_t hash;
+    uint32_t refcount;
+    struct mqtt_subscription_s *subscribers;    // topic index: subscriptions with this filter
+    char str[];
+} intern_str_t;
+
+/*
+ *  Subscription of a session, the filter is interned
+ */
+typedef struct mqtt_subscription_s {
+    DL_ITEM_FIELDS
+
+    const char *filter;
+    uint8_t qos;
+    BOOL no_local;
+    BOOL retain_as_published;
+    json_int_t identifier;
+
+    /*
+     *  Topic index, list of the subscriptions of the filter of all sessions
+     */
+    struct mqtt_session_s *session;
+    struct mqtt_subscription_s *next_subscriber;
+    struct mqtt_subscription_s *prev_subscriber;
+
+    /*
+     *  List of the subscriptions to $SYS topics of all sessions
+     */
+    struct mqtt_subscription_s *next_sys;
+    struct mqtt_subscription_s *prev_sys;
+} mqtt_subscription_t;
+
+/*
+ *  Session of a client, live in the session table slabs.
+ *  The json client resource is only materialized from it to be persisted.
+ */
+typedef struct mqtt_session_s {
+    const char *client_id;      // interned, NULL when the slot is free
+    uint32_t hash;
+    hgobj gobj;                 // Mqtt gobj while connected
+    hgobj gobj_bottom;
+    uint16_t last_mid;
+    BOOL assigned_id;
+    dl_list_t dl_subscriptions;
+    hgobj will_gobj;            // Mqtt gobj holding the delayed will of the session
+    dl_list_t dl_msgs_offline;  // QoS>0 messages arrived while the client is offline
+    struct mqtt_session_s *next_free;
+} mqtt_session_t;
+
+#define SESSION_SLAB_SIZE       256
+#define INTERN_TABLE_MIN_SIZE   4096    // must be power of 2, doubled when full
+#define SESSION_INDEX_MIN_SIZE  1024    // must be power of 2
+
+typedef struct {
+    int refs;                   // Mqtt gobjs using the table
+    mqtt_session_t **slabs;     // blocks of SESSION_SLAB_SIZE sessions
+    size_t nslabs;
+    mqtt_session_t *free_list;
+
+    /*
+     *  Open addressing index by client_id, linear probing
+     */
+    mqtt_session_t **index;
+    uint32_t index_size;
+    uint32_t index_used;        // live sessions + tombstones
+    uint32_t sessions;          // live sessions
+
+    /*
+     *  Interned strings (client ids, filters, topics), chained hash.
+     *  Doubled when there are more strings than buckets,
+     *  halved when they are less than 1/8 (not below the min size).
+     */
+    intern_str_t **intern;
+    uint32_t intern_size;
+    uint32_t interned;
+} session_table_t;
+
+/*
+ *  Pool of fixed size items, allocated in slabs of POOL_SLAB_ITEMS items.
+ *  The free items are linked through their first bytes.
+ */
+#define POOL_SLAB_ITEMS     256
+
+typedef struct {
+    const char *name;
+    size_t item_size;
+    void **slabs;
+    size_t nslabs;
+    void *free_list;
+    uint32_t in_use;
+    uint32_t peak;
+} mem_pool_t;
+
+/*
+ *  ACL
+ */
+#define MOSQ_ACL_NONE       0x00
+#define MOSQ_ACL_READ       0x01
+#define MOSQ_ACL_WRITE      0x02
+#define MOSQ_ACL_SUBSCRIBE  0x04
+
+typedef enum {
+    ACL_OWNER_ALL = 0,      // "patterns", applied to every client
+    ACL_OWNER_USER,
+    ACL_OWNER_ROLE,
+} acl_owner_t;
+
+typedef struct acl_rule_s {
+    struct acl_rule_s *next;
+    acl_owner_t owner;
+    char *name;             // user or role name
+    uint8_t access;         // MOSQ_ACL_* bits
+    BOOL deny;              // the access bits are denied
+} acl_rule_t;
+
+/*
+ *  Node of the acl trie, one per topic level.
+ *  The levels "+", "#", "%c" (client id) and "%u" (username) are special.
+ */
+typedef struct acl_node_s {
+    char *level;
+    struct acl_node_s *child;
+    struct acl_node_s *sibling;
+    acl_rule_t *rules;      // rules of the topics ending in this node
+} acl_node_t;
+
+typedef struct {
+    char *source;           // compact json of the compiled acl, to detect changes
+    acl_node_t *root;       // NULL: no acl, all is allowed
+    BOOL deny_all;          // the first acl failed to compile, all is denied
+    uint32_t generation;    // changes with every compilation, invalidates the caches
+} acl_table_t;
+
+#define ACL_CACHE_SIZE      64  // must be power of 2
+
+#define MAX_THROTTLED_INPUT (1024*1024) // input still arriving while the bottom is paused
+
+#define BATCH_MAX_SIZE      (8*1024*1024)   // gbuffer of a batch of inbound publishes
+
+#define STREAM_CHUNK_SIZE   (64*1024)   // spooled payloads are sent in chunks of this size
+#define STREAM_CHUNKS_AHEAD 4           // chunks sent before waiting EV_TX_READY
+
+/*
+ *  Payload compression, negotiated with a user property in CONNECT and CONNACK.
+ *  Each compressed PUBLISH is marked with the content-encoding user property.
+ */
+#define COMPRESSION_PROPERTY        "compression"
+#define CONTENT_ENCODING_PROPERTY   "content-encoding"
+#define COMPRESSION_DEFLATE         "deflate"
+
+/*
+ *  WebSocket transport (RFC 6455), the mqtt packets go in binary frames
+ */
+#define WS_GUID                 "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_MAX_REQUEST          (8*1024)    // maximum size of the http upgrade request
+#define WS_HEADROOM             10          // bytes reserved before the packets for the frame header
+
+#define WS_OPCODE_CONTINUATION  0x0
+#define WS_OPCODE_TEXT          0x1
+#define WS_OPCODE_BINARY        0x2
+#define WS_OPCODE_CLOSE         0x8
+#define WS_OPCODE_PING          0x9
+#define WS_OPCODE_PONG          0xA
+
+#define WS_CLOSE_NORMAL             1000
+#define WS_CLOSE_PROTOCOL_ERROR     1002
+#define WS_CLOSE_UNSUPPORTED_DATA   1003
+
+/*
+ *  Broker statistics, published in $SYS/broker/...
+ *  The counters are updated as the packets go, never by scanning the clients.
+ */
+typedef struct {
+    uint32_t clients_connected;
+    uint64_t msgs_received;     // PUBLISH received
+    uint64_t bytes_received;    // bytes of PUBLISH received
+    uint64_t msgs_sent;         // PUBLISH sent
+    uint64_t bytes_sent;        // bytes of PUBLISH sent
+
+    /*
+     *  Values of the last publication, to compute the load
+     */
+    uint64_t last_msgs_received;
+    uint64_t last_bytes_received;
+    uint64_t last_msgs_sent;
+    uint64_t last_bytes_sent;
+    uint64_t last_time;         // msec
+    uint64_t next_time;         // msec of the next publication
+
+    json_t *retained;           // {topic: value} last published values
+    mqtt_subscription_t *subscriptions; // subscriptions with $SYS filters, by next_sys
+} sys_stats_t;
+
+/*
+ *  Timer of the broker-wide tasks, one for all the connections:
+ *  it's a child of one connected server Mqtt gobj, its owner.
+ *  When the owner leaves, other connection takes it.
+ */
+typedef struct {
+    hgobj gobj;                 // owner
+    hgobj timer;
+} broker_timer_t;
+
+/*
+ *  Timer wheel of the deadlines of the server connections (handshake, payload
+ *  and keepalive), driven by the broker timer. A connection is in the slot
+ *  of its nearest deadline, the deadlines beyond the wheel go in its last slot.
+ *  The received data only updates last_rx_time: the deadline is recomputed when
+ *  its slot comes and the connection goes to a later slot if it's alive,
+ *  otherwise its own timer is fired to close it.
+ */
+#define WHEEL_TICK_MS       1000
+#define WHEEL_SLOTS         256
+#define WHEEL_DUE           WHEEL_SLOTS     // slot of the connections being checked
+
+typedef struct {
+    DL_ITEM_FIELDS
+
+    hgobj gobj;
+    int slot;                   // -1 out of the wheel
+    uint64_t tick;              // tick of the slot
+} wheel_entry_t;
+
+typedef struct {
+    dl_list_t slots[WHEEL_SLOTS + 1];
+    uint64_t tick;              // last tick done, msec / WHEEL_TICK_MS
+    size_t size;                // connections in the wheel
+} timer_wheel_t;
+
+/*
+ *  Snapshot of the persistent sessions, their subscriptions and their offline queues,
+ *  and of the retained values, for a fast restart.
+ *  The file is a header and the records of the sessions and of the retained values,
+ *  mapped when loading.
+ *  The changes after the snapshot are appended to a write-ahead log,
+ *  <snapshot_file>.wal, each record followed by its crc32.
+ *  The numbers are in host byte order.
+ *
+ *  The log is synced in batches, SNAPSHOT_WAL_SYNC_MS after the first unsynced record.
+ *  The compaction is done by a forked child, out of the event loop:
+ *  the log is renamed to <snapshot_file>.wal.old, the child writes the new snapshot
+ *  and removes the old log. The load replays .wal.old (if any) and then .wal,
+ *  the records are whole sessions or messages appended to their offline queue,
+ *  a session record replaces the queue so replaying them again is harmless.
+ *  The retained values change often, they are only in the snapshot file.
+ */
+#define SNAPSHOT_MAGIC      0x53514D59  // "YMQS"
+#define SNAPSHOT_VERSION    1
+
+#define SNAPSHOT_OP_PUT     1   // the session with all its subscriptions (old records)
+#define SNAPSHOT_OP_DEL     2   // the session is deleted
+#define SNAPSHOT_OP_SESSION 3   // the session with all its subscriptions and its offline queue
+#define SNAPSHOT_OP_MESSAGE 4   // a message appended to the offline queue of the session
+#define SNAPSHOT_OP_RETAIN  5   // a retained value, the topic in place of the client_id
+
+#define SNAPSHOT_WAL_SYNC_MS    100     // max msec of a change of the log not synced
+#define SNAPSHOT_REAP_MS        1000    // msec between checks of the compaction child
+
+#define SNAPSHOT_NO_LOCAL               0x01
+#define SNAPSHOT_RETAIN_AS_PUBLISHED    0x02
+
+#define SNAPSHOT_MSG_RETAIN             0x01
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sessions;
+    uint32_t crc;           // crc32 of the records
+    uint64_t length;        // bytes of the records
+} snapshot_header_t;
+
+/*
+ *  Record of a session, followed by the client_id and the subscriptions
+ */
+typedef struct {
+    uint8_t op;
+    uint8_t reserved;
+    uint16_t last_mid;
+    uint16_t id_len;
+    uint16_t subscriptions;
+} snapshot_session_t;
+
+/*
+ *  Subscription of a session record, followed by the filter
+ */
+typedef struct {
+    uint32_t identifier;
+    uint16_t filter_len;
+    uint8_t qos;
+    uint8_t flags;
+} snapshot_subscription_t;
+
+/*
+ *  Message of an offline queue, after the subscriptions (and a uint32_t count)
+ *  of a SNAPSHOT_OP_SESSION record, or alone in a SNAPSHOT_OP_MESSAGE record.
+ *  Followed by the topic, the compact json of the properties of the store,
+ *  the compact json of the properties of the message, and the payload.
+ */
+typedef struct {
+    int64_t expiry_time;    // message_expiry_time of the store, 0 if none
+    uint32_t payload_len;
+    uint32_t props_len;
+    uint32_t msg_props_len;
+    uint16_t mid;
+    uint16_t topic_len;
+    uint8_t qos;
+    uint8_t flags;
+} snapshot_message_t;
+
+typedef struct {
+    char *path;             // snapshot file, NULL if there is no snapshot
+    char *wal_path;         // write-ahead log
+    char *wal_old_path;     // write-ahead log being compacted
+    int wal_fd;
+    uint32_t interval;      // seconds between a change and the next snapshot
+    uint64_t next_time;     // msec of the next snapshot, 0 if there are no changes
+    uint32_t wal_records;   // changes since the snapshot
+    uint64_t wal_sync_time; // msec of the next sync of the log, 0 if synced
+    pid_t compact_pid;      // child writing the snapshot
+} snapshot_t;
+
+typedef struct {
+    char *topic;
+    uint32_t hash;
+    uint8_t access;
+    BOOL allowed;
+} acl_cache_entry_t;
+
 /***************************************************************************
  *              Prototypes
  ***************************************************************************/
 PRIVATE int XXX_sub__messages_queue(
     hgobj gobj,
-    json_t *jn_subscribers,
     const char *topic_name,
     uint8_t qos,
     int retain,
@@ -482,6 +834,11 @@ PRIVATE int XXX_sub__messages_queue(
 );
 PRIVATE void db_free_client_msg(void *client_msg);
 PRIVATE void db_free_msg_store(void *store);
+PRIVATE void msgs_in_flush(hgobj gobj);
+PRIVATE void will_clear(hgobj gobj);
+PRIVATE int will_queue(hgobj gobj, const char *client_id, BOOL session_taken);
+PRIVATE void will_send_delayed(hgobj gobj);
+PRIVATE void will_cancel_delayed(hgobj gobj);
 PRIVATE struct mosquitto_msg_store *db_duplicate_msg(
     hgobj gobj,
     struct mosquitto_msg_store *stored
@@ -498,12 +855,50 @@ PRIVATE json_t *hash_password(
     int iterations
 );
 PRIVATE void start_wait_frame_header(hgobj gobj);
+PRIVATE void start_wait_payload_data(hgobj gobj);
+PRIVATE void keepalive_arm(hgobj gobj);
+PRIVATE void wheel_cancel(hgobj gobj);
+PRIVATE int session_table_ref(void);
+PRIVATE void session_table_unref(void);
+PRIVATE mqtt_session_t *session_find(const char *client_id);
+PRIVATE mqtt_session_t *session_create(const char *client_id);
+PRIVATE void session_delete(mqtt_session_t *session);
+PRIVATE void session_clean_subscriptions(mqtt_session_t *session);
+PRIVATE int session_load_json(mqtt_session_t *session, json_t *client);
+PRIVATE int session_to_json(mqtt_session_t *session, json_t *client);
+PRIVATE int snapshot_log_session(mqtt_session_t *session, uint8_t op);
+PRIVATE int snapshot_log_message(
+    mqtt_session_t *session,
+    uint8_t op,
+    struct mosquitto_client_msg *msg
+);
+PRIVATE int snapshot_open(hgobj gobj);
+PRIVATE void snapshot_close(void);
+PRIVATE void snapshot_wal_sync(void);
+PRIVATE int acl_load(hgobj gobj, json_t *jn_acl);
+PRIVATE void acl_free(void);
+PRIVATE void acl_cache_clear(hgobj gobj);
+PRIVATE json_t *pool_stats(mem_pool_t *pool);
 PRIVATE void ws_close(hgobj gobj, int code);
+PRIVATE void ws_send_close(hgobj gobj, uint16_t status);
 
 PRIVATE int framehead_prepare_new_frame(FRAME_HEAD *frame);
 PRIVATE int framehead_consume(hgobj gobj, FRAME_HEAD *frame, istream istream, char *bf, int len);
 PRIVATE int frame_completed(hgobj gobj);
 PRIVATE int set_client_disconnected(hgobj gobj);
+PRIVATE void spool_release(hgobj gobj);
+PRIVATE void stream_reset(hgobj gobj);
+PRIVATE void broker_timer_arm(void);
+PRIVATE void broker_timer_elect(hgobj gobj);
+PRIVATE void broker_timer_resign(hgobj gobj);
+PRIVATE void broker_timer_fired(hgobj gobj);
+PRIVATE int stream_start(hgobj gobj, GBUFFER *gbuf, struct mosquitto_msg_store *store);
+PRIVATE int tx_queue_add(hgobj gobj, GBUFFER *gbuf, struct mosquitto_msg_store *store, BOOL framed);
+PRIVATE int batch_flush(hgobj gobj);
+PRIVATE void throttle_input(hgobj gobj, uint64_t msec);
+PRIVATE BOOL qos0_hold(hgobj gobj, struct mosquitto_client_msg *msg);
+PRIVATE void qos0_flush(hgobj gobj);
+PRIVATE BOOL compression_accepted(hgobj gobj, const char *algorithms);
 
 /***************************************************************************
  *          Data: config, public data, private data
@@ -532,6 +927,7 @@ PRIVATE json_t *cmd_list_topics(hgobj gobj, const char *cmd, json_t *kw, hgobj s
 PRIVATE json_t *cmd_list_clients(hgobj gobj, const char *cmd, json_t *kw, hgobj src);
 PRIVATE json_t *cmd_list_users(hgobj gobj, const char *cmd, json_t *kw, hgobj src);
 PRIVATE json_t *cmd_create_user(hgobj gobj, const char *cmd, json_t *kw, hgobj src);
+PRIVATE json_t *cmd_list_pools(hgobj gobj, const char *cmd, json_t *kw, hgobj src);
 
 PRIVATE sdata_desc_t pm_help[] = {
 /*-PM----type-----------name------------flag------------default-----description---------- */
@@ -555,6 +951,7 @@ SDATACM (ASN_SCHEMA,    "list-topics",      0,                  0,
 SDATACM (ASN_SCHEMA,    "list-clients",     0,                  0,              cmd_list_clients, "List clients"),
 SDATACM (ASN_SCHEMA,    "list-users",       0,                  0,              cmd_list_users, "List users"),
 SDATACM (ASN_SCHEMA,    "create-user",      0,                  pm_create_user, cmd_create_user, "Create user"),
+SDATACM (ASN_SCHEMA,    "list-pools",       0,                  0,              cmd_list_pools, "List occupancy of message pools and interned strings"),
 
 SDATA_END()
 };
@@ -570,6 +967,7 @@ SDATA (ASN_BOOLEAN,     "send_disconnect",  SDF_VOLATIL,                0,
 SDATA (ASN_JSON,        "client",           SDF_VOLATIL,                0,      "client online"),
 SDATA (ASN_INTEGER,     "timeout_handshake",SDF_WR|SDF_PERSIST,    5*1000,      "Timeout to handshake"),
 SDATA (ASN_INTEGER,     "timeout_close",    SDF_WR|SDF_PERSIST,    3*1000,      "Timeout to close"),
+SDATA (ASN_INTEGER,     "timeout_payload",  SDF_WR|SDF_PERSIST,   30*1000,      "Timeout to receive the payload of a frame since its header, the data arriving doesn't extend it. If value <= 0 then No timeout"),
 SDATA (ASN_INTEGER,     "pingT",            SDF_WR|SDF_PERSIST,   50*1000,      "Ping interval. If value <= 0 then No ping"),
 
 SDATA (ASN_POINTER,     "gobj_mqtt_topics", 0,                          0,      "global gobj to save topics"),
@@ -608,6 +1006,50 @@ SDATA (ASN_BOOLEAN,     "allow_anonymous",  SDF_WR|SDF_PERSIST,         TRUE,
 
 SDATA (ASN_UNSIGNED,    "max_topic_alias",  SDF_WR|SDF_PERSIST,         10,     "This option sets the maximum number topic aliases that an MQTT v5 client is allowed to create. This option applies per listener. Defaults to 10. Set to 0 to disallow topic aliases. The maximum value possible is 65535."),
 
+SDATA (ASN_UNSIGNED,    "rate_limit_msgs",  SDF_WR|SDF_PERSIST,         0,      "Maximum PUBLISH messages per second received from a client, with a burst of one second. Over the limit the input of the client is held until the bucket refills. Set to 0 (default) for no limit."),
+
+SDATA (ASN_UNSIGNED,    "rate_limit_bytes", SDF_WR|SDF_PERSIST,         0,      "Maximum PUBLISH bytes per second received from a client, with a burst of one second. Set to 0 (default) for no limit."),
+
+SDATA (ASN_UNSIGNED,    "slow_consumer_queue",SDF_WR|SDF_PERSIST,       0,      "A client with this number of outgoing messages waiting acknowledge or waiting in the write queue of its connection is a slow consumer. Set to 0 (default) to not detect slow consumers."),
+
+SDATA (ASN_OCTET_STR,   "slow_consumer_policy",SDF_WR|SDF_PERSIST,      "drop", "What to do with a slow consumer: 'drop' its oldest QoS 0 messages (up to slow_consumer_queue are held), 'disconnect' it, or 'throttle' the publishers that send to it."),
+
+SDATA (ASN_UNSIGNED,    "slow_consumer_drops",SDF_VOLATIL|SDF_STATS,    0,      "QoS 0 messages not sent because the client was a slow consumer"),
+
+SDATA (ASN_UNSIGNED,    "spool_threshold",  SDF_WR|SDF_PERSIST,         0,      "PUBLISH frames bigger than this number of bytes are written to a temporary file as they arrive, and their payload is mapped from it instead of kept in memory. The upper layer receives them in EV_ON_MESSAGE with 'spool_file' and 'payload_size' instead of 'gbuffer': 'spool_file' is a link to the spooled frame owned by the upper layer, that must remove it when done (the payload is at the end of the file). A deflated payload is spooled as it arrived, marked with 'content_encoding':'deflate'. The subscribers get the payload streamed from the mapping, in chunks. Set to 0 (default) to keep all frames in memory."),
+
+SDATA (ASN_OCTET_STR,   "spool_path",       SDF_WR|SDF_PERSIST,         "/tmp", "Directory of the temporary files of spooled PUBLISH frames"),
+
+SDATA (ASN_OCTET_STR,   "compression",      SDF_WR|SDF_PERSIST,         "",     "Payload compression of MQTT v5 sessions: 'deflate' or empty (default) to not compress. The client asks for it with the user property compression=deflate in CONNECT, and the broker accepts it echoing the property in CONNACK. The compressed PUBLISH have the user property content-encoding=deflate and are decompressed on receipt."),
+
+SDATA (ASN_OCTET_STR,   "compression_dictionary",SDF_WR|SDF_PERSIST,    "",     "Preset dictionary of the payload compression, text with the strings repeated in the payloads (json keys, units, ...). Both sides must use the same dictionary."),
+
+SDATA (ASN_UNSIGNED,    "compression_min_size",SDF_WR|SDF_PERSIST,      64,     "Payloads smaller than this number of bytes are not compressed"),
+
+SDATA (ASN_UNSIGNED,    "decompression_limit",SDF_WR|SDF_PERSIST,       1024*1024,"Maximum size of a decompressed payload, the deflated PUBLISH bigger than this are refused. message_size_limit applies too if it's lower."),
+
+SDATA (ASN_BOOLEAN,     "websocket",        SDF_RD,                     0,      "Listen MQTT over WebSocket: the connection begins with the http upgrade request, and the mqtt packets go in binary frames (subprotocol 'mqtt'). Only in server side."),
+
+SDATA (ASN_UNSIGNED,    "batch_max_messages",SDF_WR|SDF_PERSIST,        0,      "Deliver the inbound publishes to the upper layer in batches of up to this number of messages, with one EV_ON_MESSAGE of mqtt_action 'publishing_batch': 'messages' is the number of messages and 'gbuffer' holds them one after another, each one is a mqtt_batch_entry_t followed by the topic (with the null) and the payload, padded to 8 bytes. Set to 0 (default) to publish an EV_ON_MESSAGE per message."),
+
+SDATA (ASN_OCTET_STR,   "snapshot_file",    SDF_RD,                     "",     "File with the snapshot of the persistent sessions with their subscriptions and offline queues, and of the retained values, loaded on start for a fast restart. The changes are logged in <snapshot_file>.wal until the next snapshot. Empty (default) to not use it."),
+
+SDATA (ASN_UNSIGNED,    "snapshot_interval",SDF_RD,                     60,     "Seconds from a change of the sessions to the next snapshot. With 0 the snapshot is only written at exit."),
+
+SDATA (ASN_UNSIGNED,    "sys_interval",     SDF_WR|SDF_PERSIST,         10,     "Seconds between publications of the broker statistics in the retained $SYS/broker/... topics, only the changed values are published. Set to 0 to disable."),
+
+SDATA (ASN_UNSIGNED,    "batch_interval_us",SDF_WR|SDF_PERSIST,         10000,  "Maximum time in microseconds that an inbound publish waits in a not full batch (rounded up to milliseconds, the resolution of the timer)."),
+
+SDATA (ASN_JSON,        "acl",              SDF_WR|SDF_PERSIST,         0,      "Access control list. Without acl all topics are allowed to all clients. Format: {\"users\": {username: [rule,...]}, \"roles\": {role: [rule,...]}, \"patterns\": [rule,...]}, rule: {\"topic\": topic filter, \"access\": \"read\"|\"write\"|\"readwrite\"|\"subscribe\"|\"deny\"}. Role rules apply to the users with the role in the 'roles' list of the user resource, patterns apply to all clients. A topic level can be %c (client id) or %u (username). Read access allows to subscribe too. With acl, what is not granted is denied."),
+
+/*
+ *  Client side
+ */
+SDATA (ASN_OCTET_STR,   "mqtt_client_id",   SDF_WR|SDF_PERSIST,         "",     "Client side: client id sent in CONNECT"),
+SDATA (ASN_OCTET_STR,   "mqtt_username",    SDF_WR|SDF_PERSIST,         "",     "Client side: username sent in CONNECT, empty to not send it"),
+SDATA (ASN_OCTET_STR,   "mqtt_password",    SDF_WR,                     "",     "Client side: password sent in CONNECT, empty to not send it"),
+SDATA (ASN_UNSIGNED,    "mqtt_keepalive",   SDF_WR|SDF_PERSIST,         60,     "Client side: keepalive in seconds sent in CONNECT"),
+
 /*
  *  Dynamic Data
  */
@@ -624,7 +1066,7 @@ SDATA (ASN_OCTET_STR,   "username",         SDF_VOLATIL,                0,
 SDATA (ASN_OCTET_STR,   "password",         SDF_VOLATIL,                0,      "Password"),
 SDATA (ASN_BOOLEAN,     "clean_start",      SDF_VOLATIL,                0,      "New session"),
 SDATA (ASN_UNSIGNED,    "session_expiry_interval",SDF_VOLATIL,          0,      "Session expiry interval in ?"),
-SDATA (ASN_UNSIGNED,    "keepalive",        SDF_VOLATIL,                0,      "Keepalive in ?"),
+SDATA (ASN_UNSIGNED,    "keepalive",        SDF_VOLATIL,                0,      "Keepalive in seconds. The client is disconnected after 1.5 x keepalive without activity"),
 SDATA (ASN_OCTET_STR,   "auth_method",      SDF_VOLATIL,                0,      "Auth method"),
 SDATA (ASN_OCTET_STR,   "auth_data",        SDF_VOLATIL,                0,      "Auth data (in base64)"),
 SDATA (ASN_UNSIGNED,    "state",            SDF_VOLATIL,                0,      "State"),
@@ -672,6 +1114,7 @@ typedef struct _PRIVATE_DATA {
     hgobj timer;
     char iamServer;         // What side? server or client
     int pingT;
+    int timeout_payload;
 
     FRAME_HEAD frame_head;
     istream istream_frame;
@@ -679,10 +1122,36 @@ typedef struct _PRIVATE_DATA {
 
     FRAME_HEAD message_head;
 
+    /*
+     *  Frame being spooled to a temporary file
+     */
+    int spool_fd;
+    char *spool_file;
+    size_t spool_remaining;
+    void *spool_base;       // frame mapped when completed
+    size_t spool_len;
+    void *spool_payload;    // payload inside the mapped frame
+    size_t spool_payloadlen;
+
+    /*
+     *  Spooled payload being sent in chunks from its mapping.
+     *  The packets sent meanwhile wait in jn_tx_queue: [[gbuffer, store, framed], ...]
+     */
+    struct mosquitto_msg_store *stream_store;   // referenced while streaming
+    size_t stream_offset;
+    json_t *jn_tx_queue;
+
     char must_broadcast_on_close;       // event on_open already broadcasted
     json_t *jn_alias_list;
+    uint64_t last_rx_time;  // msec of last received data, keepalive is checked lazily with it
+    uint64_t payload_deadline;  // msec to receive the payload of the current frame
+    uint64_t handshake_deadline;// msec to receive the CONNECT (CONNACK in client side)
+    wheel_entry_t wheel;        // server side: deadlines in the timer wheel of the broker
     dl_list_t dl_msgs_out;  // Output queue of messages
+    dl_list_t dl_msgs_qos0; // QoS 0 messages held for a slow consumer, oldest first
     dl_list_t dl_msgs_in;   // Input queue of messages (qos 2, waiting for pubrel)
+    uint32_t msgs_in_inflight;  // messages in dl_msgs_in, limited by the receive maximum
+    uint8_t *mids_in;       // bitmap of the 65536 mids in dl_msgs_in, allocated with the first qos 2
 
     /*
      *  Config
@@ -701,6 +1170,20 @@ typedef struct _PRIVATE_DATA {
     BOOL use_username_as_clientid;
     BOOL allow_anonymous;
     uint32_t max_topic_alias;
+    uint32_t rate_limit_msgs;
+    uint32_t rate_limit_bytes;
+    uint32_t slow_consumer_queue;
+    const char *slow_consumer_policy;
+    uint32_t spool_threshold;
+    uint32_t sys_interval;
+    uint32_t batch_max_messages;
+    uint32_t batch_interval_us;
+    json_t *acl;
+    const char *compression;
+    const char *compression_dictionary;
+    uint32_t compression_min_size;
+    uint32_t decompression_limit;
+    BOOL websocket;
 
     /*
      *  Dynamic data (reset per connection)
@@ -708,6 +1191,8 @@ typedef struct _PRIVATE_DATA {
     BOOL in_session;
     BOOL send_disconnect;
     json_t *client;
+    mqtt_session_t *session;
+    uint16_t last_mid;          // mids of the connection without session (client/bridge)
     const char *protocol_name;
     uint32_t protocol_version;
     BOOL is_bridge;
@@ -731,10 +1216,82 @@ typedef struct _PRIVATE_DATA {
     uint32_t will_delay_interval;
     uint32_t will_expiry_interval;
     const char *will_topic;
-    GBUFFER *gbuf_will_payload;
+    void *will_payload;     // owned until the will is stored
+    uint32_t will_payloadlen;
+
+    /*
+     *  Will waiting its delay interval after the disconnection
+     */
+    struct mosquitto_msg_store *will_msg;
+    uint64_t will_deadline; // msec
+    const char *will_client_id; // interned
+
+    json_t *acl_roles;      // roles of the user, to check the acl
+    uint32_t acl_generation;
+    acl_cache_entry_t acl_cache[ACL_CACHE_SIZE];
+
+    /*
+     *  Batch of inbound publishes to the upper layer
+     */
+    GBUFFER *gbuf_batch;    // entries of the batch, one after another
+    uint32_t batch_count;   // messages in gbuf_batch
+    uint64_t batch_deadline;// msec when the batch must be delivered
+
+    /*
+     *  Rate limit of the input, token buckets in thousandths of message/byte
+     */
+    int64_t rl_msgs_tokens;
+    int64_t rl_bytes_tokens;
+    uint64_t rl_last_time;      // msec of the last refill
+    uint64_t throttle_until;    // msec, the input is held until then
+    GBUFFER *gbuf_throttled;    // input read before the bottom was paused
+    BOOL input_paused;          // the reads of the bottom are paused by the throttle
+    BOOL slow_consumer;
+
+    /*
+     *  Payload compression, negotiated per connection
+     */
+    BOOL compress;
+    z_stream *zs_deflate;
+    z_stream *zs_inflate;
+
+    /*
+     *  WebSocket transport
+     */
+    BOOL ws_upgraded;           // http upgrade done, the input is in frames
+    BOOL ws_close_sent;
+    GBUFFER *gbuf_ws_request;   // http upgrade request being received
+    uint8_t ws_header[14];      // header of the frame being received
+    size_t ws_header_len;
+    BOOL ws_in_frame;           // header received, waiting the payload
+    uint8_t ws_opcode;
+    uint64_t ws_remaining;      // payload bytes of the frame still to receive
+    uint8_t ws_mask[4];
+    uint32_t ws_mask_offset;
+    uint8_t ws_control[125];    // payload of the control frame being received
+    size_t ws_control_len;
 
 } PRIVATE_DATA;
 
+/*
+ *  Sessions of all Mqtt gobjs of the yuno, like gobj_mqtt_clients.
+ */
+PRIVATE session_table_t session_table;
+PRIVATE mqtt_session_t session_tombstone;
+
+/*
+ *  Pools of the messages, live with the session table
+ */
+PRIVATE mem_pool_t pool_msg_store = {"msg_store", sizeof(struct mosquitto_msg_store)};
+PRIVATE mem_pool_t pool_client_msg = {"client_msg", sizeof(struct mosquitto_client_msg)};
+#define SESSION_TOMBSTONE (&session_tombstone)
+
+PRIVATE acl_table_t acl_table;
+PRIVATE sys_stats_t sys_stats;
+PRIVATE broker_timer_t broker_timer;
+PRIVATE timer_wheel_t timer_wheel;
+PRIVATE snapshot_t snapshot;
+
 
 
 
@@ -754,9 +1311,14 @@ PRIVATE void mt_create(hgobj gobj)
 
     priv->iamServer = gobj_read_bool_attr(gobj, "iamServer");
     priv->timer = gobj_create("", GCLASS_TIMER, 0, gobj);
+    priv->wheel.gobj = gobj;
+    priv->wheel.slot = -1;
+    session_table_ref();
 
     dl_init(&priv->dl_msgs_out);
+    dl_init(&priv->dl_msgs_qos0);
     dl_init(&priv->dl_msgs_in);
+    priv->spool_fd = -1;
 
     priv->istream_frame = istream_create(gobj, 14, 14, 0,0);
     if(!priv->istream_frame) {
@@ -779,6 +1341,7 @@ PRIVATE void mt_create(hgobj gobj)
      *  HACK The writable attributes must be repeated in mt_writing method.
      */
     SET_PRIV(pingT,                     gobj_read_int32_attr)
+    SET_PRIV(timeout_payload,           gobj_read_int32_attr)
     SET_PRIV(in_session,                gobj_read_bool_attr)
     SET_PRIV(send_disconnect,           gobj_read_bool_attr)
     SET_PRIV(client,                    gobj_read_json_attr)
@@ -801,6 +1364,23 @@ PRIVATE void mt_create(hgobj gobj)
     SET_PRIV(use_username_as_clientid,  gobj_read_bool_attr)
     SET_PRIV(allow_anonymous,           gobj_read_bool_attr)
     SET_PRIV(max_topic_alias,           gobj_read_uint32_attr)
+    SET_PRIV(rate_limit_msgs,           gobj_read_uint32_attr)
+    SET_PRIV(rate_limit_bytes,          gobj_read_uint32_attr)
+    SET_PRIV(slow_consumer_queue,       gobj_read_uint32_attr)
+    SET_PRIV(slow_consumer_policy,      gobj_read_str_attr)
+    SET_PRIV(spool_threshold,           gobj_read_uint32_attr)
+    SET_PRIV(sys_interval,              gobj_read_uint32_attr)
+    SET_PRIV(batch_max_messages,        gobj_read_uint32_attr)
+    SET_PRIV(batch_interval_us,         gobj_read_uint32_attr)
+    SET_PRIV(acl,                       gobj_read_json_attr)
+    SET_PRIV(compression,               gobj_read_str_attr)
+    SET_PRIV(compression_dictionary,    gobj_read_str_attr)
+    SET_PRIV(compression_min_size,      gobj_read_uint32_attr)
+    SET_PRIV(decompression_limit,       gobj_read_uint32_attr)
+    SET_PRIV(websocket,                 gobj_read_bool_attr)
+    if(!priv->iamServer) {
+        priv->websocket = FALSE;
+    }
 
     SET_PRIV(protocol_name,             gobj_read_str_attr)
     SET_PRIV(protocol_version,          gobj_read_uint32_attr)
@@ -827,6 +1407,8 @@ PRIVATE void mt_create(hgobj gobj)
     SET_PRIV(will_expiry_interval,      gobj_read_uint32_attr)
     SET_PRIV(will_topic,                gobj_read_str_attr)
 
+    acl_load(gobj, priv->acl);
+    snapshot_open(gobj);
 }
 
 /***************************************************************************
@@ -837,6 +1419,7 @@ PRIVATE void mt_writing(hgobj gobj, const char *path)
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
     IF_EQ_SET_PRIV(pingT,                       gobj_read_int32_attr)
+    ELIF_EQ_SET_PRIV(timeout_payload,           gobj_read_int32_attr)
     ELIF_EQ_SET_PRIV(in_session,                gobj_read_bool_attr)
     ELIF_EQ_SET_PRIV(send_disconnect,           gobj_read_bool_attr)
     ELIF_EQ_SET_PRIV(client,                    gobj_read_json_attr)
@@ -859,6 +1442,24 @@ PRIVATE void mt_writing(hgobj gobj, const char *path)
     ELIF_EQ_SET_PRIV(use_username_as_clientid,  gobj_read_bool_attr)
     ELIF_EQ_SET_PRIV(allow_anonymous,           gobj_read_bool_attr)
     ELIF_EQ_SET_PRIV(max_topic_alias,           gobj_read_uint32_attr)
+    ELIF_EQ_SET_PRIV(rate_limit_msgs,           gobj_read_uint32_attr)
+    ELIF_EQ_SET_PRIV(rate_limit_bytes,          gobj_read_uint32_attr)
+    ELIF_EQ_SET_PRIV(slow_consumer_queue,       gobj_read_uint32_attr)
+    ELIF_EQ_SET_PRIV(slow_consumer_policy,      gobj_read_str_attr)
+    ELIF_EQ_SET_PRIV(spool_threshold,           gobj_read_uint32_attr)
+    ELIF_EQ_SET_PRIV(sys_interval,              gobj_read_uint32_attr)
+        if(broker_timer.gobj == gobj) {
+            sys_stats.next_time = 0;
+            broker_timer_arm();
+        }
+    ELIF_EQ_SET_PRIV(batch_max_messages,        gobj_read_uint32_attr)
+    ELIF_EQ_SET_PRIV(batch_interval_us,         gobj_read_uint32_attr)
+    ELIF_EQ_SET_PRIV(acl,                       gobj_read_json_attr)
+        acl_load(gobj, priv->acl);
+    ELIF_EQ_SET_PRIV(compression,               gobj_read_str_attr)
+    ELIF_EQ_SET_PRIV(compression_dictionary,    gobj_read_str_attr)
+    ELIF_EQ_SET_PRIV(compression_min_size,      gobj_read_uint32_attr)
+    ELIF_EQ_SET_PRIV(decompression_limit,       gobj_read_uint32_attr)
 
     ELIF_EQ_SET_PRIV(protocol_name,             gobj_read_str_attr)
     ELIF_EQ_SET_PRIV(protocol_version,          gobj_read_uint32_attr)
@@ -928,7 +1529,10 @@ PRIVATE int mt_stop(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
+    batch_flush(gobj);
     set_client_disconnected(gobj);
+    wheel_cancel(gobj);
+    broker_timer_resign(gobj);
 
     if(priv->timer) {
         clear_timeout(priv->timer);
@@ -960,13 +1564,36 @@ PRIVATE void mt_destroy(hgobj gobj)
         istream_destroy(priv->istream_payload);
         priv->istream_payload = 0;
     }
+    spool_release(gobj);
+    stream_reset(gobj);
 
+    batch_flush(gobj);
+    will_send_delayed(gobj);
+    set_client_disconnected(gobj);
+    wheel_cancel(gobj);
+    broker_timer_resign(gobj);
     priv->client = 0;
+    acl_cache_clear(gobj);
+    JSON_DECREF(priv->acl_roles)
     JSON_DECREF(priv->jn_alias_list)
-    GBUF_DECREF(priv->gbuf_will_payload);
+    GBMEM_FREE(priv->will_payload);
+    GBUF_DECREF(priv->gbuf_batch);
+    GBUF_DECREF(priv->gbuf_throttled);
+    if(priv->zs_deflate) {
+        deflateEnd(priv->zs_deflate);
+        GBMEM_FREE(priv->zs_deflate);
+    }
+    if(priv->zs_inflate) {
+        inflateEnd(priv->zs_inflate);
+        GBMEM_FREE(priv->zs_inflate);
+    }
+    GBUF_DECREF(priv->gbuf_ws_request);
 
-    dl_flush(&priv->dl_msgs_in, db_free_client_msg);
+    msgs_in_flush(gobj);
     dl_flush(&priv->dl_msgs_out, db_free_client_msg);
+    dl_flush(&priv->dl_msgs_qos0, db_free_client_msg);
+
+    session_table_unref();
 }
 
 
@@ -1100,6 +1727,29 @@ PRIVATE json_t *cmd_create_user(hgobj gobj, const char *cmd, json_t *kw, hgobj s
     );
 }
 
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE json_t *cmd_list_pools(hgobj gobj, const char *cmd, json_t *kw, hgobj src)
+{
+    json_t *jn_resp = json_pack("{s:o, s:o, s:I, s:I, s:I}",
+        "msg_store", pool_stats(&pool_msg_store),
+        "client_msg", pool_stats(&pool_client_msg),
+        "interned_strings", (json_int_t)session_table.interned,
+        "intern_buckets", (json_int_t)session_table.intern_size,
+        "sessions", (json_int_t)session_table.sessions
+    );
+
+    return msg_iev_build_webix(
+        gobj,
+        0,
+        jn_resp,
+        0,
+        0,
+        kw  // owned
+    );
+}
+
 
 
 
@@ -1489,7 +2139,11 @@ PRIVATE void ws_close(hgobj gobj, int reason)
             //send_disconnect(gobj, code, NULL);
         }
     }
+    if(priv->ws_upgraded) {
+        ws_send_close(gobj, WS_CLOSE_NORMAL);
+    }
 
+    wheel_cancel(gobj);
     do_disconnect(gobj, reason);
 
     if(priv->iamServer) {
@@ -1828,932 +2482,1338 @@ PRIVATE void start_wait_frame_header(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
+    priv->payload_deadline = 0;
     if(!gobj_is_running(gobj)) {
         return;
     }
     gobj_change_state(gobj, "ST_WAITING_FRAME_HEADER");
-    if(priv->pingT>0) {
-        set_timeout(priv->timer, priv->pingT);
-    }
     istream_reset_wr(priv->istream_frame);  // Reset buffer for next frame
     memset(&priv->frame_head, 0, sizeof(priv->frame_head));
 }
 
 /***************************************************************************
- *  Reset variables for a new read.
+ *  The payload must arrive in timeout_payload, however slowly it comes,
+ *  before CONNECT too: the handshake timeout can be longer.
  ***************************************************************************/
-PRIVATE int framehead_prepare_new_frame(FRAME_HEAD *frame)
+PRIVATE void start_wait_payload_data(hgobj gobj)
 {
-    /*
-     *  state of frame
-     */
-    memset(frame, 0, sizeof(*frame));
-    frame->busy = 1;    //in half of header
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    return 0;
+    gobj_change_state(gobj, "ST_WAITING_PAYLOAD_DATA");
+    if(priv->timeout_payload > 0) {
+        priv->payload_deadline = time_in_miliseconds() + priv->timeout_payload;
+        keepalive_arm(gobj);
+    }
 }
 
 /***************************************************************************
- *  Decode the two bytes head.
+ *  Nearest deadline of the connection: handshake, payload or keepalive
+ *  (1.5 x keepalive since the last received data). 0 if none.
  ***************************************************************************/
-PRIVATE int decode_head(hgobj gobj, FRAME_HEAD *frame, char *data)
+PRIVATE uint64_t connection_deadline(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
-    unsigned char byte1, byte2;
 
-    byte1 = *(data+0);
-    byte2 = *(data+1);
+    uint64_t deadline = 0;
+    if(!priv->in_session) {
+        deadline = priv->handshake_deadline;
+    } else if(priv->keepalive > 0) {
+        deadline = priv->last_rx_time + (uint64_t)priv->keepalive * 1500;
+    }
+    if(priv->payload_deadline && (!deadline || priv->payload_deadline < deadline)) {
+        deadline = priv->payload_deadline;
+    }
+    return deadline;
+}
 
-    /*
-     *  decod byte1
-     */
-    frame->command = byte1 & 0xF0;
-    frame->flags = byte1 & 0x0F;
+/***************************************************************************
+ *  Put the connection in the slot of the wheel of its deadline.
+ *  It's only moved to an earlier slot: in a later one it would be checked
+ *  and moved when its slot comes.
+ ***************************************************************************/
+PRIVATE void wheel_schedule(hgobj gobj, uint64_t deadline)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    wheel_entry_t *entry = &priv->wheel;
 
-    if(!priv->in_session) {
-        if(frame->command != CMD_CONNECT) {
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_MQTT_ERROR,
-                "msg",          "%s", "First command MUST be CONNECT",
-                "command",      "%s", get_command_name(frame->command),
-                NULL
-            );
-            return -1;
+    if(!timer_wheel.tick) {
+        for(int i=0; i<=WHEEL_SLOTS; i++) {
+            dl_init(&timer_wheel.slots[i]);
         }
     }
+    if(!timer_wheel.size) {
+        timer_wheel.tick = time_in_miliseconds() / WHEEL_TICK_MS;
+    }
 
-    /*
-     *  decod byte2
-     */
-    frame->frame_length = byte2 & 0x7F;
-    if(byte2 & 0x80) {
-        frame->must_read_remaining_length_2 = 1;
+    uint64_t tick = (deadline + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if(tick <= timer_wheel.tick) {
+        tick = timer_wheel.tick + 1;
+    } else if(tick > timer_wheel.tick + WHEEL_SLOTS) {
+        tick = timer_wheel.tick + WHEEL_SLOTS;
     }
 
-    /*
-     *  analize
-     */
+    if(entry->slot >= 0 && entry->slot != WHEEL_DUE && entry->tick <= tick) {
+        return;
+    }
 
-    return 0;
+    BOOL was_empty = (timer_wheel.size == 0)? TRUE : FALSE;
+    if(entry->slot >= 0) {
+        dl_delete(&timer_wheel.slots[entry->slot], entry, 0);
+    } else {
+        timer_wheel.size++;
+    }
+    entry->slot = (int)(tick % WHEEL_SLOTS);
+    entry->tick = tick;
+    dl_add(&timer_wheel.slots[entry->slot], entry);
+
+    if(was_empty) {
+        broker_timer_arm();
+    }
 }
 
 /***************************************************************************
- *  Consume input data to get and analyze the frame header.
- *  Return the consumed size.
+ *  Take the connection out of the wheel
  ***************************************************************************/
-PRIVATE int framehead_consume(hgobj gobj, FRAME_HEAD *frame, istream istream, char *bf, int len)
+PRIVATE void wheel_cancel(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    wheel_entry_t *entry = &priv->wheel;
 
-    int total_consumed = 0;
-    int consumed;
-    char *data;
+    if(entry->slot < 0) {
+        return;
+    }
+    dl_delete(&timer_wheel.slots[entry->slot], entry, 0);
+    entry->slot = -1;
+    timer_wheel.size--;
+}
 
-    /*
-     *
-     */
-    if (!frame->busy) {
-        /*
-         * waiting the first two byte's head
-         */
-        istream_read_until_num_bytes(istream, 2, 0); // idempotent
-        consumed = istream_consume(istream, bf, len);
-        total_consumed += consumed;
-        bf += consumed;
-        len -= consumed;
-        if(!istream_is_completed(istream)) {
-            return total_consumed;  // wait more data
-        }
+/***************************************************************************
+ *  Broker timer: check the connections of the slots passed.
+ *  They go to the due slot first, checking one can move or close others.
+ ***************************************************************************/
+PRIVATE void wheel_advance(void)
+{
+    uint64_t now = time_in_miliseconds();
+    uint64_t now_tick = now / WHEEL_TICK_MS;
 
-        /*
-         *  we've got enough data! Start a new frame
-         */
-        framehead_prepare_new_frame(frame);  // `busy` flag is set.
-        data = istream_extract_matched_data(istream, 0);
-        if(decode_head(gobj, frame, data)<0) {
-            // Error already logged
-            return -1;
-        }
+    if(!timer_wheel.size) {
+        timer_wheel.tick = now_tick;
+        return;
     }
 
-    /*
-     *  processing remaining_length
-     */
-    if(frame->must_read_remaining_length_2) {
-        istream_read_until_num_bytes(istream, 1, 0);  // idempotent
-        consumed = istream_consume(istream, bf, len);
-        total_consumed += consumed;
-        bf += consumed;
-        len -= consumed;
-        if(!istream_is_completed(istream)) {
-            return total_consumed;  // wait more data
+    dl_list_t *due = &timer_wheel.slots[WHEEL_DUE];
+    uint64_t ticks = now_tick - timer_wheel.tick;
+    if(ticks > WHEEL_SLOTS) {
+        ticks = WHEEL_SLOTS;
+    }
+    for(uint64_t t=1; t<=ticks; t++) {
+        dl_list_t *slot = &timer_wheel.slots[(timer_wheel.tick + t) % WHEEL_SLOTS];
+        wheel_entry_t *entry;
+        while((entry = dl_first(slot))) {
+            dl_delete(slot, entry, 0);
+            dl_add(due, entry);
+            entry->slot = WHEEL_DUE;
         }
+    }
+    timer_wheel.tick = now_tick;
 
-        /*
-         *  Read 1 bytes of remaining_length
-         */
-        data = istream_extract_matched_data(istream, 0);
-        unsigned char byte = *data;
-        frame->frame_length += (byte & 0x7F) * (1*128);
-        if(byte & 0x80) {
-            frame->must_read_remaining_length_3 = 1;
+    wheel_entry_t *entry;
+    while((entry = dl_first(due))) {
+        hgobj gobj = entry->gobj;
+        PRIVATE_DATA *priv = gobj_priv_data(gobj);
+        uint64_t deadline = connection_deadline(gobj);
+        if(deadline > now) {
+            wheel_schedule(gobj, deadline);
+        } else {
+            /*
+             *  Expired (or nothing to wait): the connection decides with its timer
+             */
+            wheel_cancel(gobj);
+            if(deadline) {
+                set_timeout(priv->timer, 1);
+            }
         }
     }
-    if(frame->must_read_remaining_length_3) {
-        istream_read_until_num_bytes(istream, 1, 0);  // idempotent
-        consumed = istream_consume(istream, bf, len);
-        total_consumed += consumed;
-        bf += consumed;
-        len -= consumed;
-        if(!istream_is_completed(istream)) {
-            return total_consumed;  // wait more data
-        }
+}
 
-        /*
-         *  Read 1 bytes of remaining_length
-         */
-        data = istream_extract_matched_data(istream, 0);
-        unsigned char byte = *data;
-        frame->frame_length += (byte & 0x7F) * (128*128);
-        if(byte & 0x80) {
-            frame->must_read_remaining_length_4 = 1;
+/***************************************************************************
+ *  Schedule the deadlines of the connection.
+ *  Server side the handshake, payload and keepalive deadlines are in the
+ *  timer wheel of the broker, the own timer is only for the pending batch
+ *  and the held input. Client side (no broker timer) all go in the own timer.
+ ***************************************************************************/
+PRIVATE void keepalive_arm(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    uint64_t deadline = connection_deadline(gobj);
+    if(priv->iamServer) {
+        if(deadline) {
+            wheel_schedule(gobj, deadline);
+        } else {
+            wheel_cancel(gobj);
         }
+        deadline = 0;
     }
-    if(frame->must_read_remaining_length_4) {
-        istream_read_until_num_bytes(istream, 1, 0);  // idempotent
-        consumed = istream_consume(istream, bf, len);
-        total_consumed += consumed;
-        bf += consumed;
-        len -= consumed;
-        if(!istream_is_completed(istream)) {
-            return total_consumed;  // wait more data
-        }
 
-        /*
-         *  Read 1 bytes of remaining_length
-         */
-        data = istream_extract_matched_data(istream, 0);
-        unsigned char byte = *data;
-        frame->frame_length += (byte & 0x7F) * (128*128*128);
-        if(byte & 0x80) {
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_MQTT_ERROR,
-                "msg",          "%s", "Fourth remaining_length byte MUST be without 0x80",
-                NULL
-            );
-            return MOSQ_ERR_PROTOCOL;
-        }
+    if(priv->gbuf_batch && (!deadline || priv->batch_deadline < deadline)) {
+        deadline = priv->batch_deadline;
+    }
+    if(priv->throttle_until && (!deadline || priv->throttle_until < deadline)) {
+        deadline = priv->throttle_until;
     }
 
-    frame->header_complete = TRUE;
+    if(deadline) {
+        uint64_t now = time_in_miliseconds();
+        set_timeout(priv->timer, (deadline > now)? (int)(deadline - now) : 1);
+    }
+}
 
-    if(priv->iamServer) {
-        switch(frame->command) {
-            case CMD_CONNECT:
-                if(frame->frame_length > 100000) {
-                    log_error(0,
-                        "gobj",         "%s", gobj_full_name(gobj),
-                        "function",     "%s", __FUNCTION__,
-                        "msgset",       "%s", MSGSET_MQTT_ERROR,
-                        "msg",          "%s", "CONNECT command too large",
-                        "frame_length", "%d", (int)frame->frame_length,
-                        NULL
-                    );
-                    return -1;
-                }
-                break;
-            case CMD_DISCONNECT:
-                break;
+/***************************************************************************
+ *  Return TRUE if the client is silent more than 1.5 x keepalive
+ ***************************************************************************/
+PRIVATE BOOL keepalive_expired(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-            case CMD_CONNACK:
-            case CMD_PUBLISH:
-            case CMD_PUBACK:
-            case CMD_PUBREC:
-            case CMD_PUBREL:
-            case CMD_PUBCOMP:
-            case CMD_SUBSCRIBE:
-            case CMD_SUBACK:
-            case CMD_UNSUBSCRIBE:
-            case CMD_UNSUBACK:
-            case CMD_AUTH:
-                break;
+    if(!priv->in_session || priv->keepalive == 0) {
+        return FALSE;
+    }
+    uint64_t grace = (uint64_t)priv->keepalive * 1500;
+    return (time_in_miliseconds() - priv->last_rx_time >= grace)? TRUE: FALSE;
+}
 
-            case CMD_PINGREQ:
-            case CMD_PINGRESP:
-                if(frame->frame_length != 0) {
-                    log_error(0,
-                        "gobj",         "%s", gobj_full_name(gobj),
-                        "function",     "%s", __FUNCTION__,
-                        "msgset",       "%s", MSGSET_MQTT_ERROR,
-                        "msg",          "%s", "PING command must be 0 large",
-                        "frame_length", "%d", (int)frame->frame_length,
-                        NULL
-                    );
-                    return -1;
-                }
-                break;
+/***************************************************************************
+ *  Close the connection if the handshake, the payload or the keepalive
+ *  has expired. Return TRUE if closed.
+ ***************************************************************************/
+PRIVATE BOOL deadlines_check(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    uint64_t now = time_in_miliseconds();
 
-            default:
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt command unknown",
-                    "command",      "%d", (int)frame->command,
-                    NULL
-                );
-                if(priv->in_session) {
-                    send_disconnect(gobj, MQTT_RC_PROTOCOL_ERROR, NULL);
-                }
-                return -1;
+    if(!priv->in_session && priv->handshake_deadline && now >= priv->handshake_deadline) {
+        log_info(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", priv->iamServer?
+                "Timeout waiting mqtt CONNECT" : "Timeout waiting mqtt CONNACK",
+            NULL
+        );
+        ws_close(gobj, MQTT_RC_MAXIMUM_CONNECT_TIME);
+        return TRUE;
+    }
+
+    if(priv->payload_deadline && now >= priv->payload_deadline) {
+        log_info(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Timeout waiting mqtt PAYLOAD data",
+            NULL
+        );
+        ws_close(gobj, MOSQ_ERR_PROTOCOL);
+        return TRUE;
+    }
+
+    if(keepalive_expired(gobj)) {
+        log_info(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt keepalive expired, disconnecting",
+            "client_id",    "%s", priv->client_id,
+            "keepalive",    "%d", (int)priv->keepalive,
+            NULL
+        );
+        if(priv->protocol_version == mosq_p_mqtt5) {
+            send_disconnect(gobj, MQTT_RC_KEEP_ALIVE_TIMEOUT, NULL);
         }
+        ws_close(gobj, MQTT_RC_KEEP_ALIVE_TIMEOUT);
+        return TRUE;
     }
 
-    return total_consumed;
+    return FALSE;
 }
 
 /***************************************************************************
- *
+ *  Release the frame being spooled, if not taken by a message
  ***************************************************************************/
-PRIVATE GBUFFER *build_mqtt_packet(hgobj gobj, uint8_t command, uint32_t size)
+PRIVATE void spool_release(hgobj gobj)
 {
-    uint32_t remaining_length = size;
-    uint8_t remaining_bytes[5], byte;
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    int remaining_count = 0;
-    do {
-        byte = remaining_length % 128;
-        remaining_length = remaining_length / 128;
-        /* If there are more digits to encode, set the top bit of this digit */
-        if(remaining_length > 0) {
-            byte = byte | 0x80;
+    if(priv->spool_fd >= 0) {
+        close(priv->spool_fd);
+        priv->spool_fd = -1;
+    }
+    if(priv->spool_base) {
+        munmap(priv->spool_base, priv->spool_len);
+        priv->spool_base = 0;
+    }
+    if(priv->spool_file) {
+        unlink(priv->spool_file);
+        GBMEM_FREE(priv->spool_file);
+    }
+    priv->spool_remaining = 0;
+    priv->spool_len = 0;
+    priv->spool_payload = 0;
+    priv->spool_payloadlen = 0;
+}
+
+/***************************************************************************
+ *  Open a temporary file to spool a big frame
+ ***************************************************************************/
+PRIVATE int spool_open(hgobj gobj, size_t frame_length)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    spool_release(gobj);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mqtt-spool-XXXXXX", gobj_read_str_attr(gobj, "spool_path"));
+    int fd = mkstemp(path);
+    if(fd < 0) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "mkstemp() FAILED",
+            "path",         "%s", path,
+            "errno",        "%d", errno,
+            "serrno",       "%s", strerror(errno),
+            NULL
+        );
+        return -1;
+    }
+    priv->spool_fd = fd;
+    priv->spool_file = gbmem_strdup(path);
+    priv->spool_remaining = frame_length;
+    priv->spool_len = frame_length;
+    return 0;
+}
+
+/***************************************************************************
+ *  Write the received data of the frame in the spool file.
+ *  Return the bytes consumed or -1
+ ***************************************************************************/
+PRIVATE int spool_write(hgobj gobj, const char *bf, size_t len)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(len > priv->spool_remaining) {
+        len = priv->spool_remaining;
+    }
+    size_t written = 0;
+    while(written < len) {
+        ssize_t n = write(priv->spool_fd, bf + written, len - written);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+                "msg",          "%s", "write() spool file FAILED",
+                "path",         "%s", priv->spool_file,
+                "errno",        "%d", errno,
+                "serrno",       "%s", strerror(errno),
+                NULL
+            );
+            return -1;
         }
-        remaining_bytes[remaining_count] = byte;
-        remaining_count++;
-    } while(remaining_length > 0 && remaining_count < 5);
+        written += (size_t)n;
+    }
+    priv->spool_remaining -= len;
+    return (int)len;
+}
 
-    if(remaining_count == 5) {
-        // return MOSQ_ERR_PAYLOAD_SIZE;
+/***************************************************************************
+ *  The spooled PUBLISH frame is complete: map it,
+ *  and return a gbuffer with its variable header (topic, mid, properties).
+ *  The payload is left in the mapping, for handle_publish().
+ ***************************************************************************/
+PRIVATE GBUFFER *spool_map_frame(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    close(priv->spool_fd);
+    priv->spool_fd = -1;
+
+    int fd = open(priv->spool_file, O_RDONLY);
+    if(fd >= 0) {
+        priv->spool_base = mmap(0, priv->spool_len, PROT_READ, MAP_SHARED, fd, 0);
+        if(priv->spool_base == MAP_FAILED) {
+            priv->spool_base = 0;
+        }
+        close(fd);
+    }
+    if(!priv->spool_base) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt packet TOO LARGE",
-            "size",         "%d", (int)size,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "mmap() spool file FAILED",
+            "path",         "%s", priv->spool_file,
+            "errno",        "%d", errno,
+            "serrno",       "%s", strerror(errno),
             NULL
         );
         return 0;
     }
 
-    uint32_t packet_length = size + 1 + (uint8_t)remaining_count;
-
-    GBUFFER *gbuf = gbuf_create(packet_length, packet_length, 0, 0);
-    if(!gbuf) {
+    /*
+     *  Length of the variable header
+     */
+    const uint8_t *p = priv->spool_base;
+    size_t len = priv->spool_len;
+    size_t off = 2;
+    if(len >= 2) {
+        off += ((size_t)p[0] << 8) | p[1];
+    }
+    if(priv->frame_head.flags & 0x06) {
+        off += 2;   // mid of qos > 0
+    }
+    if(priv->protocol_version == mosq_p_mqtt5 && off < len) {
+        size_t proplen = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            if(off >= len || shift > 21) {
+                off = len + 1;
+                break;
+            }
+            byte = p[off++];
+            proplen += (size_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while(byte & 0x80);
+        off += proplen;
+    }
+    if(off > len) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MEMORY_ERROR,
-            "msg",          "%s", "Mqtt Not enough memory",
-            "size",         "%d", (int)packet_length,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt malformed spooled PUBLISH",
+            "frame_length", "%lu", (unsigned long)len,
             NULL
         );
         return 0;
     }
-    gbuf_append_char(gbuf, command);
 
-    for(int i=0; i<remaining_count; i++) {
-        gbuf_append_char(gbuf, remaining_bytes[i]);
+    GBUFFER *gbuf = gbuf_create(off, off, 0, 0);
+    if(!gbuf) {
+        // Error already logged
+        return 0;
     }
+    gbuf_append(gbuf, (void *)p, off);
+    priv->spool_payload = (char *)priv->spool_base + off;
+    priv->spool_payloadlen = len - off;
+
     return gbuf;
 }
 
 /***************************************************************************
- *
+ *  Send a websocket frame, for the handshake and control frames.
+ *  The mqtt packets are framed in send_packet().
  ***************************************************************************/
-PRIVATE unsigned int packet_varint_bytes(uint32_t word)
+PRIVATE int ws_send_frame(hgobj gobj, uint8_t opcode, const void *data, size_t len)
 {
-    if(word < 128) {
-        return 1;
-    } else if(word < 16384) {
-        return 2;
-    } else if(word < 2097152) {
-        return 3;
-    } else if(word < 268435456) {
-        return 4;
-    } else {
-        return 5;
+    GBUFFER *gbuf = gbuf_create(2 + len, 2 + len, 0, 0);
+    if(!gbuf) {
+        // Error already logged
+        return -1;
     }
+    gbuf_append_char(gbuf, 0x80 | opcode);
+    gbuf_append_char(gbuf, (uint8_t)len);   // only control frames, < 126
+    if(len) {
+        gbuf_append(gbuf, (void *)data, len);
+    }
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    if(priv->stream_store) {
+        return tx_queue_add(gobj, gbuf, 0, TRUE);
+    }
+    json_t *kw = json_pack("{s:I}",
+        "gbuffer", (json_int_t)(size_t)gbuf
+    );
+    return gobj_send_event(gobj_bottom_gobj(gobj), "EV_TX_DATA", kw, gobj);
 }
 
 /***************************************************************************
- *
+ *  Send the close frame, only once
  ***************************************************************************/
-PRIVATE unsigned int property_get_length(const char *property_name, json_t *value)
+PRIVATE void ws_send_close(hgobj gobj, uint16_t status)
 {
-    int str_len = 0;
-    unsigned long v = 0;
-    const char *name = 0;
-    int identifier;
-    int type;
-    mosquitto_string_to_property_info(property_name, &identifier, &type);
-
-    if(json_is_object(value)) {
-        name = kw_get_str(value, "name", "", KW_REQUIRED);
-        value = kw_get_dict_value(value, "value", 0, KW_REQUIRED);
-    }
-
-    if(json_is_string(value)) {
-        if(strcmp(
-            property_name, mqtt_property_identifier_to_string(MQTT_PROP_CORRELATION_DATA))==0
-        ) {
-            GBUFFER *gbuf_correlation_data = 0;
-            const char *b64 = json_string_value(value);
-            gbuf_correlation_data = gbuf_decodebase64string(b64);
-            str_len += gbuf_leftbytes(gbuf_correlation_data);
-            GBUF_DECREF(gbuf_correlation_data);
-
-        } else if(strcmp(
-            property_name, mqtt_property_identifier_to_string(MQTT_PROP_USER_PROPERTY))==0
-        ) {
-            str_len += strlen(name);
-            str_len += strlen(json_string_value(value));
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-        } else {
-            str_len += strlen(json_string_value(value));
-        }
-    }
-    if(json_is_integer(value)) {
-        v = json_integer_value(value);
+    if(priv->ws_close_sent) {
+        return;
     }
+    priv->ws_close_sent = TRUE;
 
-    switch(identifier) {
-        /* Byte */
-        case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
-        case MQTT_PROP_REQUEST_PROBLEM_INFORMATION:
-        case MQTT_PROP_REQUEST_RESPONSE_INFORMATION:
-        case MQTT_PROP_MAXIMUM_QOS:
-        case MQTT_PROP_RETAIN_AVAILABLE:
-        case MQTT_PROP_WILDCARD_SUB_AVAILABLE:
-        case MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE:
-        case MQTT_PROP_SHARED_SUB_AVAILABLE:
-            return 2; /* 1 (identifier) + 1 byte */
-
-        /* uint16 */
-        case MQTT_PROP_SERVER_KEEP_ALIVE:
-        case MQTT_PROP_RECEIVE_MAXIMUM:
-        case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
-        case MQTT_PROP_TOPIC_ALIAS:
-            return 3; /* 1 (identifier) + 2 bytes */
-
-        /* uint32 */
-        case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
-        case MQTT_PROP_WILL_DELAY_INTERVAL:
-        case MQTT_PROP_MAXIMUM_PACKET_SIZE:
-        case MQTT_PROP_SESSION_EXPIRY_INTERVAL:
-            return 5; /* 1 (identifier) + 4 bytes */
-
-        /* varint */
-        case MQTT_PROP_SUBSCRIPTION_IDENTIFIER:
-            if(v < 128) {
-                return 2;
-            } else if(v < 16384) {
-                return 3;
-            } else if(v < 2097152) {
-                return 4;
-            } else if(v < 268435456) {
-                return 5;
-            } else {
-                return 0;
-            }
-
-        /* binary */
-        case MQTT_PROP_CORRELATION_DATA:
-        case MQTT_PROP_AUTHENTICATION_DATA:
-            return 3U + str_len; /* 1 + 2 bytes (len) + X bytes (payload) */
-
-        /* string */
-        case MQTT_PROP_CONTENT_TYPE:
-        case MQTT_PROP_RESPONSE_TOPIC:
-        case MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER:
-        case MQTT_PROP_AUTHENTICATION_METHOD:
-        case MQTT_PROP_RESPONSE_INFORMATION:
-        case MQTT_PROP_SERVER_REFERENCE:
-        case MQTT_PROP_REASON_STRING:
-            return 3U + str_len; /* 1 + 2 bytes (len) + X bytes (string) */
-
-        /* string pair */
-        case MQTT_PROP_USER_PROPERTY:
-            return 5U + str_len;
+    uint8_t bf[2];
+    bf[0] = (uint8_t)(status >> 8);
+    bf[1] = (uint8_t)status;
+    ws_send_frame(gobj, WS_OPCODE_CLOSE, bf, sizeof(bf));
+}
 
-        default:
-            break;
+/***************************************************************************
+ *  Send a raw http response of the upgrade
+ ***************************************************************************/
+PRIVATE int ws_send_http(hgobj gobj, const char *response)
+{
+    size_t len = strlen(response);
+    GBUFFER *gbuf = gbuf_create(len, len, 0, 0);
+    if(!gbuf) {
+        // Error already logged
+        return -1;
     }
-
-    return 0;
+    gbuf_append_string(gbuf, response);
+    json_t *kw = json_pack("{s:I}",
+        "gbuffer", (json_int_t)(size_t)gbuf
+    );
+    return gobj_send_event(gobj_bottom_gobj(gobj), "EV_TX_DATA", kw, gobj);
 }
 
 /***************************************************************************
- *
+ *  Return the value of a header of the http request, NULL if not found.
+ *  The value is not nul terminated, its length is returned in vlen.
  ***************************************************************************/
-PRIVATE unsigned int property_get_length_all(json_t *props)
+PRIVATE const char *ws_http_header(const char *request, const char *name, size_t *vlen)
 {
-    unsigned int len = 0;
+    size_t nlen = strlen(name);
+    const char *line = strstr(request, "\r\n");
 
-    const char *property_name; json_t *value;
-    json_object_foreach(props, property_name, value) {
-        len += property_get_length(property_name, value);
+    while(line && line[2] != '\r') {
+        line += 2;
+        const char *eol = strstr(line, "\r\n");
+        if(!eol) {
+            break;
+        }
+        if((size_t)(eol - line) > nlen && line[nlen] == ':' && strncasecmp(line, name, nlen)==0) {
+            const char *v = line + nlen + 1;
+            while(v < eol && (*v == ' ' || *v == '\t')) {
+                v++;
+            }
+            const char *e = eol;
+            while(e > v && (e[-1] == ' ' || e[-1] == '\t')) {
+                e--;
+            }
+            *vlen = (size_t)(e - v);
+            return v;
+        }
+        line = eol;
     }
-    return len;
+    return 0;
 }
 
 /***************************************************************************
- * Return the number of bytes we need to add on to the remaining length when
- * encoding these properties.
+ *  Return TRUE if the comma separated list of the header has the token
  ***************************************************************************/
-PRIVATE unsigned int property_get_remaining_length(json_t *props)
+PRIVATE BOOL ws_header_has_token(const char *value, size_t vlen, const char *token)
 {
-    unsigned int proplen, varbytes;
+    size_t tlen = strlen(token);
+    const char *end = value + vlen;
+    const char *p = value;
 
-    proplen = property_get_length_all(props);
-    varbytes = packet_varint_bytes(proplen);
-    return proplen + varbytes;
+    while(p < end) {
+        while(p < end && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+        const char *e = p;
+        while(e < end && *e != ',' && *e != ' ') {
+            e++;
+        }
+        if((size_t)(e - p) == tlen && strncasecmp(p, token, tlen)==0) {
+            return TRUE;
+        }
+        p = e;
+    }
+    return FALSE;
 }
 
 /***************************************************************************
- *
+ *  Answer the http upgrade request.
+ *  Return -1 if the request is rejected.
  ***************************************************************************/
-PRIVATE int mqtt_property_add_byte(hgobj gobj, json_t *proplist, int identifier, uint8_t value)
+PRIVATE int ws_upgrade(hgobj gobj, const char *request)
 {
-    if(!proplist) {
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    const char *upgrade, *key, *version, *protocol;
+    size_t upgrade_len = 0, key_len = 0, version_len = 0, protocol_len = 0;
+
+    upgrade = ws_http_header(request, "Upgrade", &upgrade_len);
+    key = ws_http_header(request, "Sec-WebSocket-Key", &key_len);
+    version = ws_http_header(request, "Sec-WebSocket-Version", &version_len);
+    protocol = ws_http_header(request, "Sec-WebSocket-Protocol", &protocol_len);
+
+    if(strncmp(request, "GET ", 4)!=0 ||
+            !upgrade || !ws_header_has_token(upgrade, upgrade_len, "websocket") ||
+            !key || key_len == 0 || key_len > 64 ||
+            !version || version_len != 2 || strncmp(version, "13", 2)!=0 ||
+            (protocol && !ws_header_has_token(protocol, protocol_len, "mqtt"))) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt proplist NULL",
-            "identifier",   "%d", identifier,
+            "msgset",       "%s", MSGSET_PROTOCOL_ERROR,
+            "msg",          "%s", "Mqtt websocket: bad upgrade request",
             NULL
         );
+        ws_send_http(gobj,
+            "HTTP/1.1 400 Bad Request\r\n"
+            "Sec-WebSocket-Version: 13\r\n"
+            "Connection: close\r\n"
+            "\r\n"
+        );
         return -1;
     }
-    if(identifier != MQTT_PROP_PAYLOAD_FORMAT_INDICATOR
-            && identifier != MQTT_PROP_REQUEST_PROBLEM_INFORMATION
-            && identifier != MQTT_PROP_REQUEST_RESPONSE_INFORMATION
-            && identifier != MQTT_PROP_MAXIMUM_QOS
-            && identifier != MQTT_PROP_RETAIN_AVAILABLE
-            && identifier != MQTT_PROP_WILDCARD_SUB_AVAILABLE
-            && identifier != MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE
-            && identifier != MQTT_PROP_SHARED_SUB_AVAILABLE)
-    {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt property byte unknown",
-            "identifier",   "%d", identifier,
-            NULL
-        );
+
+    /*
+     *  Sec-WebSocket-Accept: base64(sha1(key + GUID))
+     */
+    char key_guid[64 + sizeof(WS_GUID)];
+    snprintf(key_guid, sizeof(key_guid), "%.*s%s", (int)key_len, key, WS_GUID);
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char *)key_guid, strlen(key_guid), digest);
+    GBUFFER *gbuf_accept = gbuf_string2base64((const char *)digest, SHA_DIGEST_LENGTH);
+
+    char response[256];
+    snprintf(response, sizeof(response),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n"
+        "%s"
+        "\r\n",
+        (char *)gbuf_cur_rd_pointer(gbuf_accept),
+        protocol? "Sec-WebSocket-Protocol: mqtt\r\n" : ""
+    );
+    GBUF_DECREF(gbuf_accept);
+
+    if(ws_send_http(gobj, response)<0) {
         return -1;
-        return MOSQ_ERR_INVAL;
     }
+    priv->ws_upgraded = TRUE;
 
-    const char *property_name = mqtt_property_identifier_to_string(identifier);
-    json_object_set_new(proplist, property_name, json_integer(value));
-    //prop->client_generated = true;
+    if(gobj_trace_level(gobj) & TRACE_CONNECT_DISCONNECT) {
+        trace_msg("🌐 Mqtt websocket upgraded, %s", gobj_short_name(gobj_bottom_gobj(gobj)));
+    }
     return 0;
 }
 
 /***************************************************************************
- *
+ *  Receive the http upgrade request.
+ *  The bytes of the request are taken out of gbuf, what is left are frames.
+ *  Return -1 if the connection must be closed.
  ***************************************************************************/
-PRIVATE int mqtt_property_add_int16(hgobj gobj, json_t *proplist, int identifier, uint16_t value)
+PRIVATE int ws_receive_request(hgobj gobj, GBUFFER *gbuf)
 {
-    if(!proplist) {
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    size_t len = gbuf_leftbytes(gbuf);
+    if(!priv->gbuf_ws_request) {
+        priv->gbuf_ws_request = gbuf_create(len + 1, WS_MAX_REQUEST + 1, 0, 0);
+        if(!priv->gbuf_ws_request) {
+            // Error already logged
+            return -1;
+        }
+    }
+    size_t total = gbuf_leftbytes(priv->gbuf_ws_request) + len;
+    if(total > WS_MAX_REQUEST) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt proplist NULL",
-            "identifier",   "%d", identifier,
+            "msgset",       "%s", MSGSET_PROTOCOL_ERROR,
+            "msg",          "%s", "Mqtt websocket: upgrade request too large",
             NULL
         );
         return -1;
     }
-    if(identifier != MQTT_PROP_SERVER_KEEP_ALIVE
-            && identifier != MQTT_PROP_RECEIVE_MAXIMUM
-            && identifier != MQTT_PROP_TOPIC_ALIAS_MAXIMUM
-            && identifier != MQTT_PROP_TOPIC_ALIAS)
-    {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt property int16 unknown",
-            "identifier",   "%d", identifier,
-            NULL
-        );
+    gbuf_append(priv->gbuf_ws_request, gbuf_cur_rd_pointer(gbuf), len);
+
+    const char *request = gbuf_cur_rd_pointer(priv->gbuf_ws_request);
+    const char *eoh = memmem(request, total, "\r\n\r\n", 4);
+    if(!eoh) {
+        gbuf_get(gbuf, len);    // all taken, wait more
+        return 0;
+    }
+
+    /*
+     *  The bytes after the request, if any, are frames of the current gbuf
+     */
+    size_t request_len = (size_t)(eoh - request) + 4;
+    gbuf_get(gbuf, len - (total - request_len));
+
+    char *req = gbmem_strndup(request, request_len);
+    GBUF_DECREF(priv->gbuf_ws_request);
+    if(!req) {
+        // Error already logged
         return -1;
     }
+    int ret = ws_upgrade(gobj, req);
+    gbmem_free(req);
+    return ret;
+}
+
+/***************************************************************************
+ *  Unmask a payload in place, a word at a time.
+ *  offset is the position of the first byte in the masking key.
+ ***************************************************************************/
+PRIVATE void ws_unmask(uint8_t *p, size_t len, const uint8_t mask[4], uint32_t offset)
+{
+    uint8_t m[4];
+    for(int i=0; i<4; i++) {
+        m[i] = mask[(offset + i) & 3];
+    }
 
-    const char *property_name = mqtt_property_identifier_to_string(identifier);
-    json_object_set_new(proplist, property_name, json_integer(value));
-    // prop->client_generated = true; TODO vale para algo?
-    return 0;
+    /*
+     *  The key repeated in a 64 bits word, the loop is vectorized by the compiler
+     */
+    uint32_t m32;
+    memcpy(&m32, m, 4);
+    uint64_t m64 = ((uint64_t)m32 << 32) | m32;
+
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        w ^= m64;
+        memcpy(p + i, &w, 8);
+    }
+    for(; i < len; i++) {
+        p[i] ^= m[i & 3];
+    }
 }
 
 /***************************************************************************
- *
+ *  Length of the frame header, with the first bytes received
  ***************************************************************************/
-PRIVATE int mqtt_property_add_int32(hgobj gobj, json_t *proplist, int identifier, uint32_t value)
+PRIVATE size_t ws_header_length(const uint8_t *h, size_t have)
 {
-    if(!proplist) {
+    if(have < 2) {
+        return 2;
+    }
+    size_t n = 2;
+    uint8_t len7 = h[1] & 0x7F;
+    if(len7 == 126) {
+        n += 2;
+    } else if(len7 == 127) {
+        n += 8;
+    }
+    if(h[1] & 0x80) {
+        n += 4;
+    }
+    return n;
+}
+
+/***************************************************************************
+ *  The frame header is complete, check it.
+ *  Return -1 if the connection must be closed.
+ ***************************************************************************/
+PRIVATE int ws_frame_begin(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    const uint8_t *h = priv->ws_header;
+
+    BOOL fin = (h[0] & 0x80)? TRUE : FALSE;
+    uint8_t opcode = h[0] & 0x0F;
+    uint64_t len = h[1] & 0x7F;
+    size_t off = 2;
+    if(len == 126) {
+        len = ((uint64_t)h[2] << 8) | h[3];
+        off = 4;
+    } else if(len == 127) {
+        len = 0;
+        for(int i=0; i<8; i++) {
+            len = (len << 8) | h[2+i];
+        }
+        off = 10;
+    }
+
+    uint16_t status = 0;
+    if((h[0] & 0x70) || !(h[1] & 0x80)) {
+        status = WS_CLOSE_PROTOCOL_ERROR;   // no extensions, the client must mask
+    } else if(opcode >= WS_OPCODE_CLOSE) {
+        if(opcode > WS_OPCODE_PONG || !fin || len > sizeof(priv->ws_control)) {
+            status = WS_CLOSE_PROTOCOL_ERROR;
+        }
+    } else if(opcode == WS_OPCODE_TEXT) {
+        status = WS_CLOSE_UNSUPPORTED_DATA; // mqtt goes in binary frames
+    } else if(opcode != WS_OPCODE_BINARY && opcode != WS_OPCODE_CONTINUATION) {
+        status = WS_CLOSE_PROTOCOL_ERROR;
+    }
+    if(status) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt proplist NULL",
-            "identifier",   "%d", identifier,
-            NULL
-        );
-        return -1;
-    }
-    if(identifier != MQTT_PROP_MESSAGE_EXPIRY_INTERVAL
-            && identifier != MQTT_PROP_SESSION_EXPIRY_INTERVAL
-            && identifier != MQTT_PROP_WILL_DELAY_INTERVAL
-            && identifier != MQTT_PROP_MAXIMUM_PACKET_SIZE)
-    {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt property int32 unknown",
-            "identifier",   "%d", identifier,
+            "msgset",       "%s", MSGSET_PROTOCOL_ERROR,
+            "msg",          "%s", "Mqtt websocket: bad frame",
+            "opcode",       "%d", (int)opcode,
+            "status",       "%d", (int)status,
             NULL
         );
+        ws_send_close(gobj, status);
         return -1;
     }
 
-    const char *property_name = mqtt_property_identifier_to_string(identifier);
-    json_object_set_new(proplist, property_name, json_integer(value));
-    // prop->client_generated = true; TODO vale para algo?
+    memcpy(priv->ws_mask, h + off, 4);
+    priv->ws_mask_offset = 0;
+    priv->ws_opcode = opcode;
+    priv->ws_remaining = len;
+    priv->ws_control_len = 0;
+    priv->ws_header_len = 0;
+    priv->ws_in_frame = TRUE;
     return 0;
 }
 
 /***************************************************************************
- *
+ *  The frame payload is complete, process the control frames.
+ *  Return -1 if the connection must be closed.
  ***************************************************************************/
-PRIVATE int mosquitto_property_add_varint(hgobj gobj, json_t *proplist, int identifier, uint32_t value)
+PRIVATE int ws_frame_end(hgobj gobj)
 {
-    if(!proplist || value > 268435455) {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt proplist NULL or value too big",
-            "identifier",   "%d", identifier,
-            NULL
-        );
-        return MOSQ_ERR_INVAL;
-    }
-    if(identifier != MQTT_PROP_SUBSCRIPTION_IDENTIFIER) {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "No MQTT_PROP_SUBSCRIPTION_IDENTIFIER",
-            "identifier",   "%d", identifier,
-            NULL
-        );
-        return MOSQ_ERR_INVAL;
-    }
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    const char *property_name = mqtt_property_identifier_to_string(identifier);
-    json_object_set_new(proplist, property_name, json_integer(value));
+    priv->ws_in_frame = FALSE;
 
-    return MOSQ_ERR_SUCCESS;
+    switch(priv->ws_opcode) {
+        case WS_OPCODE_PING:
+            ws_send_frame(gobj, WS_OPCODE_PONG, priv->ws_control, priv->ws_control_len);
+            break;
+
+        case WS_OPCODE_CLOSE:
+            if(gobj_trace_level(gobj) & TRACE_CONNECT_DISCONNECT) {
+                trace_msg("🌐 Mqtt websocket close received, %s",
+                    gobj_short_name(gobj_bottom_gobj(gobj))
+                );
+            }
+            ws_send_close(gobj, WS_CLOSE_NORMAL);
+            return -1;
+
+        default:
+            break;
+    }
+    return 0;
 }
 
 /***************************************************************************
- *
+ *  Decode the websocket frames received, in place.
+ *  The payloads are unmasked where they are, and joined at the end of gbuf,
+ *  the headers and control frames are taken out: gbuf is left with the mqtt bytes,
+ *  ready for framehead_consume().
+ *  Usually a read has one frame, or a piece of it, and no byte is moved.
+ *  Return -1 if the connection must be closed.
  ***************************************************************************/
-PRIVATE int mqtt_property_add_string(
-    hgobj gobj,
-    json_t *proplist,
-    int identifier,
-    const char *value
-)
+PRIVATE int ws_decode_frames(hgobj gobj, GBUFFER *gbuf)
 {
-    size_t slen = 0;
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    if(!proplist) {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt proplist NULL",
-            "identifier",   "%d", identifier,
-            NULL
-        );
-        return -1;
-    }
-    if(value) {
-        slen = strlen(value);
-        if(mosquitto_validate_utf8(value, (int)slen)<0) {
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_MQTT_ERROR,
-                "msg",          "%s", "Mqtt bad utf8",
-                NULL
-            );
+    if(!priv->ws_upgraded) {
+        if(ws_receive_request(gobj, gbuf)<0) {
             return -1;
         }
+        if(!priv->ws_upgraded) {
+            return 0;
+        }
     }
 
-    if(identifier != MQTT_PROP_CONTENT_TYPE
-            && identifier != MQTT_PROP_RESPONSE_TOPIC
-            && identifier != MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER
-            && identifier != MQTT_PROP_AUTHENTICATION_METHOD
-            && identifier != MQTT_PROP_RESPONSE_INFORMATION
-            && identifier != MQTT_PROP_SERVER_REFERENCE
-            && identifier != MQTT_PROP_REASON_STRING
-      ) {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt property int16 unknown",
-            "identifier",   "%d", identifier,
-            NULL
-        );
-        return -1;
-    }
+    size_t len = gbuf_leftbytes(gbuf);
+    uint8_t *start = gbuf_cur_rd_pointer(gbuf);
+    uint8_t *end = start + len;
+    uint8_t *p = start;
+    uint8_t *blk = 0, *out = 0; // mqtt bytes decoded [blk, out)
 
-    //prop->client_generated = true; // TODO
-    const char *property_name = mqtt_property_identifier_to_string(identifier);
-    json_object_set_new(proplist, property_name, json_string(value?value:""));
+    while(p < end) {
+        if(!priv->ws_in_frame) {
+            priv->ws_header[priv->ws_header_len++] = *p++;
+            if(priv->ws_header_len < ws_header_length(priv->ws_header, priv->ws_header_len)) {
+                continue;
+            }
+            if(ws_frame_begin(gobj)<0) {
+                return -1;
+            }
+            if(priv->ws_remaining == 0) {
+                if(ws_frame_end(gobj)<0) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+
+        size_t n = (size_t)(end - p);
+        if(n > priv->ws_remaining) {
+            n = (size_t)priv->ws_remaining;
+        }
+        ws_unmask(p, n, priv->ws_mask, priv->ws_mask_offset);
+        priv->ws_mask_offset = (uint32_t)((priv->ws_mask_offset + n) & 3);
+
+        if(priv->ws_opcode >= WS_OPCODE_CLOSE) {
+            memcpy(priv->ws_control + priv->ws_control_len, p, n);
+            priv->ws_control_len += n;
+        } else {
+            if(!blk) {
+                blk = out = p;
+            } else if(out != p) {
+                memmove(out, p, n);
+            }
+            out += n;
+        }
+        p += n;
+        priv->ws_remaining -= n;
+
+        if(priv->ws_remaining == 0) {
+            if(ws_frame_end(gobj)<0) {
+                return -1;
+            }
+        }
+    }
 
+    size_t decoded = blk? (size_t)(out - blk) : 0;
+    if(decoded && out != end) {
+        memmove(end - decoded, blk, decoded);
+    }
+    if(len > decoded) {
+        gbuf_get(gbuf, len - decoded);
+    }
     return 0;
 }
 
 /***************************************************************************
- *
+ *  Reset variables for a new read.
  ***************************************************************************/
-PRIVATE void mqtt_write_byte(GBUFFER *gbuf, uint8_t byte)
+PRIVATE int framehead_prepare_new_frame(FRAME_HEAD *frame)
 {
-    gbuf_append_char(gbuf, byte);
-}
+    /*
+     *  state of frame
+     */
+    memset(frame, 0, sizeof(*frame));
+    frame->busy = 1;    //in half of header
 
-/***************************************************************************
- *
- ***************************************************************************/
-PRIVATE void mqtt_write_uint16(GBUFFER *gbuf, uint16_t word)
-{
-    gbuf_append_char(gbuf, MOSQ_MSB(word));
-    gbuf_append_char(gbuf, MOSQ_LSB(word));
+    return 0;
 }
 
 /***************************************************************************
- *
+ *  Decode the two bytes head.
  ***************************************************************************/
-PRIVATE void mqtt_write_uint32(GBUFFER *gbuf, uint32_t word)
+PRIVATE int decode_head(hgobj gobj, FRAME_HEAD *frame, char *data)
 {
-    gbuf_append_char(gbuf, (uint8_t)((word & 0xFF000000) >> 24));
-    gbuf_append_char(gbuf, (uint8_t)((word & 0x00FF0000) >> 16));
-    gbuf_append_char(gbuf, (uint8_t)((word & 0x0000FF00) >> 8));
-    gbuf_append_char(gbuf, (uint8_t)((word & 0x000000FF)));
-}
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    unsigned char byte1, byte2;
 
-/***************************************************************************
- *
- ***************************************************************************/
-PRIVATE int mqtt_write_varint(GBUFFER *gbuf, uint32_t word)
-{
-    uint8_t byte;
-    int count = 0;
+    byte1 = *(data+0);
+    byte2 = *(data+1);
 
-    do {
-        byte = (uint8_t)(word % 128);
-        word = word / 128;
-        /* If there are more digits to encode, set the top bit of this digit */
-        if(word > 0) {
-            byte = byte | 0x80;
+    /*
+     *  decod byte1
+     */
+    frame->command = byte1 & 0xF0;
+    frame->flags = byte1 & 0x0F;
+
+    if(!priv->in_session) {
+        if(frame->command != (priv->iamServer? CMD_CONNECT : CMD_CONNACK)) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MQTT_ERROR,
+                "msg",          "%s", priv->iamServer?
+                    "First command MUST be CONNECT" : "First command MUST be CONNACK",
+                "command",      "%s", get_command_name(frame->command),
+                NULL
+            );
+            return -1;
         }
-        mqtt_write_byte(gbuf, byte);
-        count++;
-    } while(word > 0 && count < 5);
+    }
 
-    if(count == 5) {
-        return -1;
+    /*
+     *  decod byte2
+     */
+    frame->frame_length = byte2 & 0x7F;
+    if(byte2 & 0x80) {
+        frame->must_read_remaining_length_2 = 1;
     }
-    return 0;
-}
 
-/***************************************************************************
- *
- ***************************************************************************/
-PRIVATE void mqtt_write_bytes(GBUFFER *gbuf, const void *bytes, uint32_t count)
-{
-    gbuf_append(gbuf, (void *)bytes, count);
-}
+    /*
+     *  analize
+     */
 
-/***************************************************************************
- *
- ***************************************************************************/
-PRIVATE void mqtt_write_string(GBUFFER *gbuf, const char *str)
-{
-    uint16_t length = strlen(str);
-    mqtt_write_uint16(gbuf, length);
-    mqtt_write_bytes(gbuf, str, length);
+    return 0;
 }
 
 /***************************************************************************
- *
+ *  Consume input data to get and analyze the frame header.
+ *  Return the consumed size.
  ***************************************************************************/
-PRIVATE int property__write(hgobj gobj, GBUFFER *gbuf, const char *property_name, json_t *value_)
+PRIVATE int framehead_consume(hgobj gobj, FRAME_HEAD *frame, istream istream, char *bf, int len)
 {
-    json_t *value;
-    int identifier;
-    int type;
-    mosquitto_string_to_property_info(property_name, &identifier, &type);
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    if(json_is_object(value_)) {
-        value = kw_get_dict_value(value_, "value", 0, KW_REQUIRED);
-    } else {
-        value = value_;
-    }
+    int total_consumed = 0;
+    int consumed;
+    char *data;
 
-    mqtt_write_varint(gbuf, identifier);
+    /*
+     *
+     */
+    if (!frame->busy) {
+        /*
+         * waiting the first two byte's head
+         */
+        istream_read_until_num_bytes(istream, 2, 0); // idempotent
+        consumed = istream_consume(istream, bf, len);
+        total_consumed += consumed;
+        bf += consumed;
+        len -= consumed;
+        if(!istream_is_completed(istream)) {
+            return total_consumed;  // wait more data
+        }
 
-    switch(identifier) {
-        case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
-        case MQTT_PROP_REQUEST_PROBLEM_INFORMATION:
-        case MQTT_PROP_REQUEST_RESPONSE_INFORMATION:
-        case MQTT_PROP_MAXIMUM_QOS:
-        case MQTT_PROP_RETAIN_AVAILABLE:
-        case MQTT_PROP_WILDCARD_SUB_AVAILABLE:
-        case MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE:
-        case MQTT_PROP_SHARED_SUB_AVAILABLE:
-            mqtt_write_byte(gbuf, json_integer_value(value));
-            break;
-
-        case MQTT_PROP_SERVER_KEEP_ALIVE:
-        case MQTT_PROP_RECEIVE_MAXIMUM:
-        case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
-        case MQTT_PROP_TOPIC_ALIAS:
-            mqtt_write_uint16(gbuf, json_integer_value(value));
-            break;
-
-        case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
-        case MQTT_PROP_SESSION_EXPIRY_INTERVAL:
-        case MQTT_PROP_WILL_DELAY_INTERVAL:
-        case MQTT_PROP_MAXIMUM_PACKET_SIZE:
-            mqtt_write_uint32(gbuf, json_integer_value(value));
-            break;
-
-        case MQTT_PROP_SUBSCRIPTION_IDENTIFIER:
-            return mqtt_write_varint(gbuf, json_integer_value(value));
+        /*
+         *  we've got enough data! Start a new frame
+         */
+        framehead_prepare_new_frame(frame);  // `busy` flag is set.
+        data = istream_extract_matched_data(istream, 0);
+        if(decode_head(gobj, frame, data)<0) {
+            // Error already logged
+            return -1;
+        }
+    }
 
-        case MQTT_PROP_CONTENT_TYPE:
-        case MQTT_PROP_RESPONSE_TOPIC:
-        case MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER:
-        case MQTT_PROP_AUTHENTICATION_METHOD:
-        case MQTT_PROP_RESPONSE_INFORMATION:
-        case MQTT_PROP_SERVER_REFERENCE:
-        case MQTT_PROP_REASON_STRING:
-            mqtt_write_string(gbuf, json_string_value(value));
-            break;
+    /*
+     *  processing remaining_length
+     */
+    if(frame->must_read_remaining_length_2) {
+        istream_read_until_num_bytes(istream, 1, 0);  // idempotent
+        consumed = istream_consume(istream, bf, len);
+        total_consumed += consumed;
+        bf += consumed;
+        len -= consumed;
+        if(!istream_is_completed(istream)) {
+            return total_consumed;  // wait more data
+        }
 
-        case MQTT_PROP_AUTHENTICATION_DATA:
-        case MQTT_PROP_CORRELATION_DATA:
-            {
-                const char *b64 = json_string_value(value);
-                GBUFFER *gbuf_binary_data = gbuf_decodebase64string(b64);
-                void *p = gbuf_cur_rd_pointer(gbuf_binary_data);
-                uint16_t len = gbuf_leftbytes(gbuf_binary_data);
-                mqtt_write_uint16(gbuf, len);
-                mqtt_write_bytes(gbuf, p, len);
-                GBUF_DECREF(gbuf_binary_data);
-            }
-            break;
+        /*
+         *  Read 1 bytes of remaining_length
+         */
+        data = istream_extract_matched_data(istream, 0);
+        unsigned char byte = *data;
+        frame->frame_length += (byte & 0x7F) * (1*128);
+        frame->must_read_remaining_length_2 = 0; // Don't repeat this step if the next byte is delayed
+        if(byte & 0x80) {
+            frame->must_read_remaining_length_3 = 1;
+        }
+    }
+    if(frame->must_read_remaining_length_3) {
+        istream_read_until_num_bytes(istream, 1, 0);  // idempotent
+        consumed = istream_consume(istream, bf, len);
+        total_consumed += consumed;
+        bf += consumed;
+        len -= consumed;
+        if(!istream_is_completed(istream)) {
+            return total_consumed;  // wait more data
+        }
 
-        case MQTT_PROP_USER_PROPERTY:
-            {
-                const char *name = kw_get_str(value_, "name", "", KW_REQUIRED);
-                mqtt_write_string(gbuf, name);
-                mqtt_write_string(gbuf, json_string_value(value));
-            }
-            break;
+        /*
+         *  Read 1 bytes of remaining_length
+         */
+        data = istream_extract_matched_data(istream, 0);
+        unsigned char byte = *data;
+        frame->frame_length += (byte & 0x7F) * (128*128);
+        frame->must_read_remaining_length_3 = 0; // Don't repeat this step if the next byte is delayed
+        if(byte & 0x80) {
+            frame->must_read_remaining_length_4 = 1;
+        }
+    }
+    if(frame->must_read_remaining_length_4) {
+        istream_read_until_num_bytes(istream, 1, 0);  // idempotent
+        consumed = istream_consume(istream, bf, len);
+        total_consumed += consumed;
+        bf += consumed;
+        len -= consumed;
+        if(!istream_is_completed(istream)) {
+            return total_consumed;  // wait more data
+        }
 
-        default:
+        /*
+         *  Read 1 bytes of remaining_length
+         */
+        data = istream_extract_matched_data(istream, 0);
+        unsigned char byte = *data;
+        frame->frame_length += (byte & 0x7F) * (128*128*128);
+        frame->must_read_remaining_length_4 = 0;
+        if(byte & 0x80) {
             log_error(0,
                 "gobj",         "%s", gobj_full_name(gobj),
                 "function",     "%s", __FUNCTION__,
                 "msgset",       "%s", MSGSET_MQTT_ERROR,
-                "msg",          "%s", "Mqtt auth: Unsupported property",
-                "identifier",   "%d", identifier,
+                "msg",          "%s", "Fourth remaining_length byte MUST be without 0x80",
                 NULL
             );
-            return -1;
+            return MOSQ_ERR_PROTOCOL;
+        }
     }
 
-    return 0;
-}
+    frame->header_complete = TRUE;
 
-/***************************************************************************
- *
- ***************************************************************************/
-PRIVATE int property_write_all(hgobj gobj, GBUFFER *gbuf, json_t *props, BOOL write_len)
-{
-    if(write_len) {
-        mqtt_write_varint(gbuf, property_get_length_all(props));
-    }
+    if(priv->iamServer) {
+        switch(frame->command) {
+            case CMD_CONNECT:
+                if(frame->frame_length > 100000) {
+                    log_error(0,
+                        "gobj",         "%s", gobj_full_name(gobj),
+                        "function",     "%s", __FUNCTION__,
+                        "msgset",       "%s", MSGSET_MQTT_ERROR,
+                        "msg",          "%s", "CONNECT command too large",
+                        "frame_length", "%d", (int)frame->frame_length,
+                        NULL
+                    );
+                    return -1;
+                }
+                break;
+            case CMD_DISCONNECT:
+                break;
 
-    const char *property_name; json_t *value;
-    json_object_foreach(props, property_name, value) {
-        property__write(gobj, gbuf, property_name, value);
+            case CMD_CONNACK:
+            case CMD_PUBLISH:
+            case CMD_PUBACK:
+            case CMD_PUBREC:
+            case CMD_PUBREL:
+            case CMD_PUBCOMP:
+            case CMD_SUBSCRIBE:
+            case CMD_SUBACK:
+            case CMD_UNSUBSCRIBE:
+            case CMD_UNSUBACK:
+            case CMD_AUTH:
+                break;
+
+            case CMD_PINGREQ:
+            case CMD_PINGRESP:
+                if(frame->frame_length != 0) {
+                    log_error(0,
+                        "gobj",         "%s", gobj_full_name(gobj),
+                        "function",     "%s", __FUNCTION__,
+                        "msgset",       "%s", MSGSET_MQTT_ERROR,
+                        "msg",          "%s", "PING command must be 0 large",
+                        "frame_length", "%d", (int)frame->frame_length,
+                        NULL
+                    );
+                    return -1;
+                }
+                break;
+
+            default:
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt command unknown",
+                    "command",      "%d", (int)frame->command,
+                    NULL
+                );
+                if(priv->in_session) {
+                    send_disconnect(gobj, MQTT_RC_PROTOCOL_ERROR, NULL);
+                }
+                return -1;
+        }
     }
 
-    return 0;
+    return total_consumed;
 }
 
 /***************************************************************************
- *
+ *  Build the fixed header of a packet of `size` bytes of remaining length,
+ *  in a gbuffer with room for the first `head_size` bytes of them.
  ***************************************************************************/
-PUBLIC int mqtt_read_uint16(hgobj gobj, GBUFFER *gbuf, uint16_t *word)
+PRIVATE GBUFFER *build_mqtt_packet_head(hgobj gobj, uint8_t command, uint32_t size, uint32_t head_size)
 {
-    uint8_t msb, lsb;
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    uint32_t remaining_length = size;
+    uint8_t remaining_bytes[5], byte;
 
-    if(gbuf_leftbytes(gbuf) < 2) {
+    int remaining_count = 0;
+    do {
+        byte = remaining_length % 128;
+        remaining_length = remaining_length / 128;
+        /* If there are more digits to encode, set the top bit of this digit */
+        if(remaining_length > 0) {
+            byte = byte | 0x80;
+        }
+        remaining_bytes[remaining_count] = byte;
+        remaining_count++;
+    } while(remaining_length > 0 && remaining_count < 5);
+
+    if(remaining_count == 5) {
+        // return MOSQ_ERR_PAYLOAD_SIZE;
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
             "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt malformed packet, not enough data",
+            "msg",          "%s", "Mqtt packet TOO LARGE",
+            "size",         "%d", (int)size,
             NULL
         );
-        //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
-        return MOSQ_ERR_MALFORMED_PACKET;
+        return 0;
     }
 
-    msb = gbuf_getchar(gbuf);
-    lsb = gbuf_getchar(gbuf);
-
-    *word = (uint16_t)((msb<<8) + lsb);
-
-    return 0;
-}
-
-/***************************************************************************
- *
- ***************************************************************************/
-PUBLIC int mqtt_read_uint32(hgobj gobj, GBUFFER *gbuf, uint32_t *word)
-{
-    uint32_t val = 0;
+    uint32_t packet_length = head_size + 1 + (uint8_t)remaining_count;
+    if(priv->websocket) {
+        packet_length += WS_HEADROOM;
+    }
 
-    if(gbuf_leftbytes(gbuf) < 4) {
+    GBUFFER *gbuf = gbuf_create(packet_length, packet_length, 0, 0);
+    if(!gbuf) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt malformed packet, not enough data",
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "Mqtt Not enough memory",
+            "size",         "%d", (int)packet_length,
             NULL
         );
-        //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
-        return MOSQ_ERR_MALFORMED_PACKET;
+        return 0;
+    }
+    if(priv->websocket) {
+        /*
+         *  Room for the frame header, filled in send_packet()
+         */
+        static const char headroom[WS_HEADROOM] = {0};
+        gbuf_append(gbuf, (void *)headroom, WS_HEADROOM);
     }
+    gbuf_append_char(gbuf, command);
 
-    for(int i=0; i<4; i++) {
-        uint8_t c = gbuf_getchar(gbuf);
-        val = (val << 8) + c;
+    for(int i=0; i<remaining_count; i++) {
+        gbuf_append_char(gbuf, remaining_bytes[i]);
     }
+    return gbuf;
+}
 
-    *word = val;
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE GBUFFER *build_mqtt_packet(hgobj gobj, uint8_t command, uint32_t size)
+{
+    return build_mqtt_packet_head(gobj, command, size, size);
+}
 
-    return 0;
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE unsigned int packet_varint_bytes(uint32_t word)
+{
+    if(word < 128) {
+        return 1;
+    } else if(word < 16384) {
+        return 2;
+    } else if(word < 2097152) {
+        return 3;
+    } else if(word < 268435456) {
+        return 4;
+    } else {
+        return 5;
+    }
 }
 
 /***************************************************************************
  *
  ***************************************************************************/
-PUBLIC int mqtt_read_bytes(hgobj gobj, GBUFFER *gbuf, void *bf, int bflen)
+PRIVATE unsigned int property_get_length(const char *property_name, json_t *value)
 {
-    if(gbuf_leftbytes(gbuf) < bflen) {
-        log_error(LOG_OPT_TRACE_STACK,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt malformed packet, not enough data",
-            NULL
-        );
-        //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
-        return MOSQ_ERR_MALFORMED_PACKET;
+    int str_len = 0;
+    unsigned long v = 0;
+    const char *name = 0;
+    int identifier;
+    int type;
+    mosquitto_string_to_property_info(property_name, &identifier, &type);
+
+    if(json_is_object(value)) {
+        name = kw_get_str(value, "name", "", KW_REQUIRED);
+        value = kw_get_dict_value(value, "value", 0, KW_REQUIRED);
     }
 
-    memmove(bf, gbuf_get(gbuf, bflen), bflen);
+    if(json_is_string(value)) {
+        if(strcmp(
+            property_name, mqtt_property_identifier_to_string(MQTT_PROP_CORRELATION_DATA))==0
+        ) {
+            GBUFFER *gbuf_correlation_data = 0;
+            const char *b64 = json_string_value(value);
+            gbuf_correlation_data = gbuf_decodebase64string(b64);
+            str_len += gbuf_leftbytes(gbuf_correlation_data);
+            GBUF_DECREF(gbuf_correlation_data);
+
+        } else if(strcmp(
+            property_name, mqtt_property_identifier_to_string(MQTT_PROP_USER_PROPERTY))==0
+        ) {
+            str_len += strlen(name);
+            str_len += strlen(json_string_value(value));
+
+        } else {
+            str_len += strlen(json_string_value(value));
+        }
+    }
+    if(json_is_integer(value)) {
+        v = json_integer_value(value);
+    }
+
+    switch(identifier) {
+        /* Byte */
+        case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
+        case MQTT_PROP_REQUEST_PROBLEM_INFORMATION:
+        case MQTT_PROP_REQUEST_RESPONSE_INFORMATION:
+        case MQTT_PROP_MAXIMUM_QOS:
+        case MQTT_PROP_RETAIN_AVAILABLE:
+        case MQTT_PROP_WILDCARD_SUB_AVAILABLE:
+        case MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE:
+        case MQTT_PROP_SHARED_SUB_AVAILABLE:
+            return 2; /* 1 (identifier) + 1 byte */
+
+        /* uint16 */
+        case MQTT_PROP_SERVER_KEEP_ALIVE:
+        case MQTT_PROP_RECEIVE_MAXIMUM:
+        case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+        case MQTT_PROP_TOPIC_ALIAS:
+            return 3; /* 1 (identifier) + 2 bytes */
+
+        /* uint32 */
+        case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
+        case MQTT_PROP_WILL_DELAY_INTERVAL:
+        case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+        case MQTT_PROP_SESSION_EXPIRY_INTERVAL:
+            return 5; /* 1 (identifier) + 4 bytes */
+
+        /* varint */
+        case MQTT_PROP_SUBSCRIPTION_IDENTIFIER:
+            if(v < 128) {
+                return 2;
+            } else if(v < 16384) {
+                return 3;
+            } else if(v < 2097152) {
+                return 4;
+            } else if(v < 268435456) {
+                return 5;
+            } else {
+                return 0;
+            }
+
+        /* binary */
+        case MQTT_PROP_CORRELATION_DATA:
+        case MQTT_PROP_AUTHENTICATION_DATA:
+            return 3U + str_len; /* 1 + 2 bytes (len) + X bytes (payload) */
+
+        /* string */
+        case MQTT_PROP_CONTENT_TYPE:
+        case MQTT_PROP_RESPONSE_TOPIC:
+        case MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER:
+        case MQTT_PROP_AUTHENTICATION_METHOD:
+        case MQTT_PROP_RESPONSE_INFORMATION:
+        case MQTT_PROP_SERVER_REFERENCE:
+        case MQTT_PROP_REASON_STRING:
+            return 3U + str_len; /* 1 + 2 bytes (len) + X bytes (string) */
+
+        /* string pair */
+        case MQTT_PROP_USER_PROPERTY:
+            return 5U + str_len;
+
+        default:
+            break;
+    }
 
     return 0;
 }
@@ -2761,1463 +3821,4942 @@ PUBLIC int mqtt_read_bytes(hgobj gobj, GBUFFER *gbuf, void *bf, int bflen)
 /***************************************************************************
  *
  ***************************************************************************/
-PUBLIC int mqtt_read_byte(hgobj gobj, GBUFFER *gbuf, uint8_t *byte)
+PRIVATE unsigned int property_get_length_all(json_t *props)
 {
-    if(gbuf_leftbytes(gbuf) < 1) {
-        log_error(LOG_OPT_TRACE_STACK,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt malformed packet, not enough data",
-            NULL
-        );
-        //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
-        return MOSQ_ERR_MALFORMED_PACKET;
+    unsigned int len = 0;
+
+    const char *property_name; json_t *value;
+    json_object_foreach(props, property_name, value) {
+        len += property_get_length(property_name, value);
     }
+    return len;
+}
 
-    *byte = gbuf_getchar(gbuf);
+/***************************************************************************
+ * Return the number of bytes we need to add on to the remaining length when
+ * encoding these properties.
+ ***************************************************************************/
+PRIVATE unsigned int property_get_remaining_length(json_t *props)
+{
+    unsigned int proplen, varbytes;
 
-    return 0;
+    proplen = property_get_length_all(props);
+    varbytes = packet_varint_bytes(proplen);
+    return proplen + varbytes;
 }
 
 /***************************************************************************
  *
  ***************************************************************************/
-PUBLIC int mqtt_read_binary(hgobj gobj, GBUFFER *gbuf, uint8_t **data, uint16_t *length)
+PRIVATE int mqtt_property_add_byte(hgobj gobj, json_t *proplist, int identifier, uint8_t value)
 {
-    uint16_t slen;
-
-    *data = NULL;
-    *length = 0;
-
-    if(mqtt_read_uint16(gobj, gbuf, &slen)<0) {
-        log_error(LOG_OPT_TRACE_STACK,
+    if(!proplist) {
+        log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
             "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt malformed packet, not enough data",
+            "msg",          "%s", "Mqtt proplist NULL",
+            "identifier",   "%d", identifier,
             NULL
         );
-        //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
-        return MOSQ_ERR_MALFORMED_PACKET;
-    }
-
-    if(slen == 0) {
-        *data = NULL;
-        *length = 0;
-        return 0;
+        return -1;
     }
-
-    if(gbuf_leftbytes(gbuf) < slen) {
+    if(identifier != MQTT_PROP_PAYLOAD_FORMAT_INDICATOR
+            && identifier != MQTT_PROP_REQUEST_PROBLEM_INFORMATION
+            && identifier != MQTT_PROP_REQUEST_RESPONSE_INFORMATION
+            && identifier != MQTT_PROP_MAXIMUM_QOS
+            && identifier != MQTT_PROP_RETAIN_AVAILABLE
+            && identifier != MQTT_PROP_WILDCARD_SUB_AVAILABLE
+            && identifier != MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE
+            && identifier != MQTT_PROP_SHARED_SUB_AVAILABLE)
+    {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
             "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt malformed packet, not enough data",
+            "msg",          "%s", "Mqtt property byte unknown",
+            "identifier",   "%d", identifier,
             NULL
         );
-        //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
-        return MOSQ_ERR_MALFORMED_PACKET;
+        return -1;
+        return MOSQ_ERR_INVAL;
     }
 
-    *data = gbuf_get(gbuf, slen);
-    *length = slen;
+    const char *property_name = mqtt_property_identifier_to_string(identifier);
+    json_object_set_new(proplist, property_name, json_integer(value));
+    //prop->client_generated = true;
     return 0;
 }
 
 /***************************************************************************
  *
  ***************************************************************************/
-PUBLIC int mqtt_read_string(hgobj gobj, GBUFFER *gbuf, char **str, uint16_t *length)
+PRIVATE int mqtt_property_add_int16(hgobj gobj, json_t *proplist, int identifier, uint16_t value)
 {
-    *str = NULL;
-
-    if(mqtt_read_binary(gobj, gbuf, (uint8_t **)str, length)<0) {
-        // Error already logged
-        return -1;
-    }
-    if(*length == 0) {
-        return 0;
-    }
-
-    if(mosquitto_validate_utf8(*str, *length)<0) {
-        *str = NULL;
-        *length = 0;
-        log_error(LOG_OPT_TRACE_STACK,
+    if(!proplist) {
+        log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-            "msg",          "%s", "malformed utf8",
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt proplist NULL",
+            "identifier",   "%d", identifier,
             NULL
         );
-        //log_debug_full_gbuf(0, gbuf, "malformed utf8");
-        return MOSQ_ERR_MALFORMED_UTF8;
+        return -1;
     }
-
-    return 0;
-}
-
-/***************************************************************************
- *
- ***************************************************************************/
+    if(identifier != MQTT_PROP_SERVER_KEEP_ALIVE
+            && identifier != MQTT_PROP_RECEIVE_MAXIMUM
+            && identifier != MQTT_PROP_TOPIC_ALIAS_MAXIMUM
+            && identifier != MQTT_PROP_TOPIC_ALIAS)
+    {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt property int16 unknown",
+            "identifier",   "%d", identifier,
+            NULL
+        );
+        return -1;
+    }
+
+    const char *property_name = mqtt_property_identifier_to_string(identifier);
+    json_object_set_new(proplist, property_name, json_integer(value));
+    // prop->client_generated = true; TODO vale para algo?
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int mqtt_property_add_int32(hgobj gobj, json_t *proplist, int identifier, uint32_t value)
+{
+    if(!proplist) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt proplist NULL",
+            "identifier",   "%d", identifier,
+            NULL
+        );
+        return -1;
+    }
+    if(identifier != MQTT_PROP_MESSAGE_EXPIRY_INTERVAL
+            && identifier != MQTT_PROP_SESSION_EXPIRY_INTERVAL
+            && identifier != MQTT_PROP_WILL_DELAY_INTERVAL
+            && identifier != MQTT_PROP_MAXIMUM_PACKET_SIZE)
+    {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt property int32 unknown",
+            "identifier",   "%d", identifier,
+            NULL
+        );
+        return -1;
+    }
+
+    const char *property_name = mqtt_property_identifier_to_string(identifier);
+    json_object_set_new(proplist, property_name, json_integer(value));
+    // prop->client_generated = true; TODO vale para algo?
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int mosquitto_property_add_varint(hgobj gobj, json_t *proplist, int identifier, uint32_t value)
+{
+    if(!proplist || value > 268435455) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt proplist NULL or value too big",
+            "identifier",   "%d", identifier,
+            NULL
+        );
+        return MOSQ_ERR_INVAL;
+    }
+    if(identifier != MQTT_PROP_SUBSCRIPTION_IDENTIFIER) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "No MQTT_PROP_SUBSCRIPTION_IDENTIFIER",
+            "identifier",   "%d", identifier,
+            NULL
+        );
+        return MOSQ_ERR_INVAL;
+    }
+
+    const char *property_name = mqtt_property_identifier_to_string(identifier);
+    json_object_set_new(proplist, property_name, json_integer(value));
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int mqtt_property_add_string(
+    hgobj gobj,
+    json_t *proplist,
+    int identifier,
+    const char *value
+)
+{
+    size_t slen = 0;
+
+    if(!proplist) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt proplist NULL",
+            "identifier",   "%d", identifier,
+            NULL
+        );
+        return -1;
+    }
+    if(value) {
+        slen = strlen(value);
+        if(mosquitto_validate_utf8(value, (int)slen)<0) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MQTT_ERROR,
+                "msg",          "%s", "Mqtt bad utf8",
+                NULL
+            );
+            return -1;
+        }
+    }
+
+    if(identifier != MQTT_PROP_CONTENT_TYPE
+            && identifier != MQTT_PROP_RESPONSE_TOPIC
+            && identifier != MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER
+            && identifier != MQTT_PROP_AUTHENTICATION_METHOD
+            && identifier != MQTT_PROP_RESPONSE_INFORMATION
+            && identifier != MQTT_PROP_SERVER_REFERENCE
+            && identifier != MQTT_PROP_REASON_STRING
+      ) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt property int16 unknown",
+            "identifier",   "%d", identifier,
+            NULL
+        );
+        return -1;
+    }
+
+    //prop->client_generated = true; // TODO
+    const char *property_name = mqtt_property_identifier_to_string(identifier);
+    json_object_set_new(proplist, property_name, json_string(value?value:""));
+
+    return 0;
+}
+
+/***************************************************************************
+ *  A proplist holds only one user property
+ ***************************************************************************/
+PRIVATE int mqtt_property_add_user(
+    hgobj gobj,
+    json_t *proplist,
+    const char *name,
+    const char *value
+)
+{
+    if(!proplist || !name || !value) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt proplist, name or value NULL",
+            NULL
+        );
+        return -1;
+    }
+    if(mosquitto_validate_utf8(name, (int)strlen(name))<0 ||
+            mosquitto_validate_utf8(value, (int)strlen(value))<0) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt bad utf8",
+            NULL
+        );
+        return -1;
+    }
+
+    const char *property_name = mqtt_property_identifier_to_string(MQTT_PROP_USER_PROPERTY);
+    json_object_set_new(proplist, property_name, json_pack("{s:s, s:s}",
+        "name", name,
+        "value", value
+    ));
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void mqtt_write_byte(GBUFFER *gbuf, uint8_t byte)
+{
+    gbuf_append_char(gbuf, byte);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void mqtt_write_uint16(GBUFFER *gbuf, uint16_t word)
+{
+    gbuf_append_char(gbuf, MOSQ_MSB(word));
+    gbuf_append_char(gbuf, MOSQ_LSB(word));
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void mqtt_write_uint32(GBUFFER *gbuf, uint32_t word)
+{
+    gbuf_append_char(gbuf, (uint8_t)((word & 0xFF000000) >> 24));
+    gbuf_append_char(gbuf, (uint8_t)((word & 0x00FF0000) >> 16));
+    gbuf_append_char(gbuf, (uint8_t)((word & 0x0000FF00) >> 8));
+    gbuf_append_char(gbuf, (uint8_t)((word & 0x000000FF)));
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int mqtt_write_varint(GBUFFER *gbuf, uint32_t word)
+{
+    uint8_t byte;
+    int count = 0;
+
+    do {
+        byte = (uint8_t)(word % 128);
+        word = word / 128;
+        /* If there are more digits to encode, set the top bit of this digit */
+        if(word > 0) {
+            byte = byte | 0x80;
+        }
+        mqtt_write_byte(gbuf, byte);
+        count++;
+    } while(word > 0 && count < 5);
+
+    if(count == 5) {
+        return -1;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void mqtt_write_bytes(GBUFFER *gbuf, const void *bytes, uint32_t count)
+{
+    gbuf_append(gbuf, (void *)bytes, count);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void mqtt_write_string(GBUFFER *gbuf, const char *str)
+{
+    uint16_t length = strlen(str);
+    mqtt_write_uint16(gbuf, length);
+    mqtt_write_bytes(gbuf, str, length);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int property__write(hgobj gobj, GBUFFER *gbuf, const char *property_name, json_t *value_)
+{
+    json_t *value;
+    int identifier;
+    int type;
+    mosquitto_string_to_property_info(property_name, &identifier, &type);
+
+    if(json_is_object(value_)) {
+        value = kw_get_dict_value(value_, "value", 0, KW_REQUIRED);
+    } else {
+        value = value_;
+    }
+
+    mqtt_write_varint(gbuf, identifier);
+
+    switch(identifier) {
+        case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
+        case MQTT_PROP_REQUEST_PROBLEM_INFORMATION:
+        case MQTT_PROP_REQUEST_RESPONSE_INFORMATION:
+        case MQTT_PROP_MAXIMUM_QOS:
+        case MQTT_PROP_RETAIN_AVAILABLE:
+        case MQTT_PROP_WILDCARD_SUB_AVAILABLE:
+        case MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE:
+        case MQTT_PROP_SHARED_SUB_AVAILABLE:
+            mqtt_write_byte(gbuf, json_integer_value(value));
+            break;
+
+        case MQTT_PROP_SERVER_KEEP_ALIVE:
+        case MQTT_PROP_RECEIVE_MAXIMUM:
+        case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+        case MQTT_PROP_TOPIC_ALIAS:
+            mqtt_write_uint16(gbuf, json_integer_value(value));
+            break;
+
+        case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
+        case MQTT_PROP_SESSION_EXPIRY_INTERVAL:
+        case MQTT_PROP_WILL_DELAY_INTERVAL:
+        case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+            mqtt_write_uint32(gbuf, json_integer_value(value));
+            break;
+
+        case MQTT_PROP_SUBSCRIPTION_IDENTIFIER:
+            return mqtt_write_varint(gbuf, json_integer_value(value));
+
+        case MQTT_PROP_CONTENT_TYPE:
+        case MQTT_PROP_RESPONSE_TOPIC:
+        case MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER:
+        case MQTT_PROP_AUTHENTICATION_METHOD:
+        case MQTT_PROP_RESPONSE_INFORMATION:
+        case MQTT_PROP_SERVER_REFERENCE:
+        case MQTT_PROP_REASON_STRING:
+            mqtt_write_string(gbuf, json_string_value(value));
+            break;
+
+        case MQTT_PROP_AUTHENTICATION_DATA:
+        case MQTT_PROP_CORRELATION_DATA:
+            {
+                const char *b64 = json_string_value(value);
+                GBUFFER *gbuf_binary_data = gbuf_decodebase64string(b64);
+                void *p = gbuf_cur_rd_pointer(gbuf_binary_data);
+                uint16_t len = gbuf_leftbytes(gbuf_binary_data);
+                mqtt_write_uint16(gbuf, len);
+                mqtt_write_bytes(gbuf, p, len);
+                GBUF_DECREF(gbuf_binary_data);
+            }
+            break;
+
+        case MQTT_PROP_USER_PROPERTY:
+            {
+                const char *name = kw_get_str(value_, "name", "", KW_REQUIRED);
+                mqtt_write_string(gbuf, name);
+                mqtt_write_string(gbuf, json_string_value(value));
+            }
+            break;
+
+        default:
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MQTT_ERROR,
+                "msg",          "%s", "Mqtt auth: Unsupported property",
+                "identifier",   "%d", identifier,
+                NULL
+            );
+            return -1;
+    }
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int property_write_all(hgobj gobj, GBUFFER *gbuf, json_t *props, BOOL write_len)
+{
+    if(write_len) {
+        mqtt_write_varint(gbuf, property_get_length_all(props));
+    }
+
+    const char *property_name; json_t *value;
+    json_object_foreach(props, property_name, value) {
+        property__write(gobj, gbuf, property_name, value);
+    }
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC int mqtt_read_uint16(hgobj gobj, GBUFFER *gbuf, uint16_t *word)
+{
+    uint8_t msb, lsb;
+
+    if(gbuf_leftbytes(gbuf) < 2) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt malformed packet, not enough data",
+            NULL
+        );
+        //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+
+    msb = gbuf_getchar(gbuf);
+    lsb = gbuf_getchar(gbuf);
+
+    *word = (uint16_t)((msb<<8) + lsb);
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC int mqtt_read_uint32(hgobj gobj, GBUFFER *gbuf, uint32_t *word)
+{
+    uint32_t val = 0;
+
+    if(gbuf_leftbytes(gbuf) < 4) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt malformed packet, not enough data",
+            NULL
+        );
+        //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+
+    for(int i=0; i<4; i++) {
+        uint8_t c = gbuf_getchar(gbuf);
+        val = (val << 8) + c;
+    }
+
+    *word = val;
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC int mqtt_read_bytes(hgobj gobj, GBUFFER *gbuf, void *bf, int bflen)
+{
+    if(gbuf_leftbytes(gbuf) < bflen) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt malformed packet, not enough data",
+            NULL
+        );
+        //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+
+    memmove(bf, gbuf_get(gbuf, bflen), bflen);
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC int mqtt_read_byte(hgobj gobj, GBUFFER *gbuf, uint8_t *byte)
+{
+    if(gbuf_leftbytes(gbuf) < 1) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt malformed packet, not enough data",
+            NULL
+        );
+        //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+
+    *byte = gbuf_getchar(gbuf);
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC int mqtt_read_binary(hgobj gobj, GBUFFER *gbuf, uint8_t **data, uint16_t *length)
+{
+    uint16_t slen;
+
+    *data = NULL;
+    *length = 0;
+
+    if(mqtt_read_uint16(gobj, gbuf, &slen)<0) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt malformed packet, not enough data",
+            NULL
+        );
+        //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+
+    if(slen == 0) {
+        *data = NULL;
+        *length = 0;
+        return 0;
+    }
+
+    if(gbuf_leftbytes(gbuf) < slen) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt malformed packet, not enough data",
+            NULL
+        );
+        //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+
+    *data = gbuf_get(gbuf, slen);
+    *length = slen;
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC int mqtt_read_string(hgobj gobj, GBUFFER *gbuf, char **str, uint16_t *length)
+{
+    *str = NULL;
+
+    if(mqtt_read_binary(gobj, gbuf, (uint8_t **)str, length)<0) {
+        // Error already logged
+        return -1;
+    }
+    if(*length == 0) {
+        return 0;
+    }
+
+    if(mosquitto_validate_utf8(*str, *length)<0) {
+        *str = NULL;
+        *length = 0;
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+            "msg",          "%s", "malformed utf8",
+            NULL
+        );
+        //log_debug_full_gbuf(0, gbuf, "malformed utf8");
+        return MOSQ_ERR_MALFORMED_UTF8;
+    }
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
 PRIVATE int mqtt_read_varint(hgobj gobj, GBUFFER *gbuf, uint32_t *word, uint8_t *bytes)
 {
-    int i;
-    uint8_t byte;
-    unsigned int remaining_mult = 1;
-    uint32_t lword = 0;
-    uint8_t lbytes = 0;
+    int i;
+    uint8_t byte;
+    unsigned int remaining_mult = 1;
+    uint32_t lword = 0;
+    uint8_t lbytes = 0;
+
+    for(i=0; i<4; i++) {
+        if(gbuf_leftbytes(gbuf)>0) {
+            lbytes++;
+            byte = gbuf_getchar(gbuf);
+            lword += (byte & 127) * remaining_mult;
+            remaining_mult *= 128;
+            if((byte & 128) == 0) {
+                if(lbytes > 1 && byte == 0) {
+                    /* Catch overlong encodings */
+                    break;
+                } else {
+                    *word = lword;
+                    if(bytes) {
+                        (*bytes) = lbytes;
+                    }
+                    return 0;
+                }
+            }
+        } else {
+            break;
+        }
+    }
+
+    log_error(LOG_OPT_TRACE_STACK,
+        "gobj",         "%s", gobj_full_name(gobj),
+        "function",     "%s", __FUNCTION__,
+        "msgset",       "%s", MSGSET_MQTT_ERROR,
+        "msg",          "%s", "Mqtt malformed packet, not enough data",
+        NULL
+    );
+    //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
+    return MOSQ_ERR_MALFORMED_PACKET;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int mosquitto_property_check_command(hgobj gobj, int command, int identifier)
+{
+    switch(identifier) {
+        case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
+        case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
+        case MQTT_PROP_CONTENT_TYPE:
+        case MQTT_PROP_RESPONSE_TOPIC:
+        case MQTT_PROP_CORRELATION_DATA:
+            if(command != CMD_PUBLISH && command != CMD_WILL) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt invalid property of command",
+                    "command",      "%d", get_command_name(command),
+                    "identifier",   "%d", identifier,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+            break;
+
+        case MQTT_PROP_SUBSCRIPTION_IDENTIFIER:
+            if(command != CMD_PUBLISH && command != CMD_SUBSCRIBE) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt invalid property of command",
+                    "command",      "%d", get_command_name(command),
+                    "identifier",   "%d", identifier,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+            break;
+
+        case MQTT_PROP_SESSION_EXPIRY_INTERVAL:
+            if(command != CMD_CONNECT && command != CMD_CONNACK && command != CMD_DISCONNECT) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt invalid property of command",
+                    "command",      "%d", get_command_name(command),
+                    "identifier",   "%d", identifier,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+            break;
+
+        case MQTT_PROP_AUTHENTICATION_METHOD:
+        case MQTT_PROP_AUTHENTICATION_DATA:
+            if(command != CMD_CONNECT && command != CMD_CONNACK && command != CMD_AUTH) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt invalid property of command",
+                    "command",      "%d", get_command_name(command),
+                    "identifier",   "%d", identifier,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+            break;
+
+        case MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER:
+        case MQTT_PROP_SERVER_KEEP_ALIVE:
+        case MQTT_PROP_RESPONSE_INFORMATION:
+        case MQTT_PROP_MAXIMUM_QOS:
+        case MQTT_PROP_RETAIN_AVAILABLE:
+        case MQTT_PROP_WILDCARD_SUB_AVAILABLE:
+        case MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE:
+        case MQTT_PROP_SHARED_SUB_AVAILABLE:
+            if(command != CMD_CONNACK) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt invalid property of command",
+                    "command",      "%d", get_command_name(command),
+                    "identifier",   "%d", identifier,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+            break;
+
+        case MQTT_PROP_WILL_DELAY_INTERVAL:
+            if(command != CMD_WILL) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt invalid property of command",
+                    "command",      "%d", get_command_name(command),
+                    "identifier",   "%d", identifier,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+            break;
+
+        case MQTT_PROP_REQUEST_PROBLEM_INFORMATION:
+        case MQTT_PROP_REQUEST_RESPONSE_INFORMATION:
+            if(command != CMD_CONNECT) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt invalid property of command",
+                    "command",      "%d", get_command_name(command),
+                    "identifier",   "%d", identifier,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+            break;
+
+        case MQTT_PROP_SERVER_REFERENCE:
+            if(command != CMD_CONNACK && command != CMD_DISCONNECT) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt invalid property of command",
+                    "command",      "%d", get_command_name(command),
+                    "identifier",   "%d", identifier,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+            break;
+
+        case MQTT_PROP_REASON_STRING:
+            if(command == CMD_CONNECT || command == CMD_PUBLISH ||
+                command == CMD_SUBSCRIBE || command == CMD_UNSUBSCRIBE) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt invalid property of command",
+                    "command",      "%d", get_command_name(command),
+                    "identifier",   "%d", identifier,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+            break;
+
+        case MQTT_PROP_RECEIVE_MAXIMUM:
+        case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+        case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+            if(command != CMD_CONNECT && command != CMD_CONNACK) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt invalid property of command",
+                    "command",      "%d", get_command_name(command),
+                    "identifier",   "%d", identifier,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+            break;
+
+        case MQTT_PROP_TOPIC_ALIAS:
+            if(command != CMD_PUBLISH) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt invalid property of command",
+                    "command",      "%d", get_command_name(command),
+                    "identifier",   "%d", identifier,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+            break;
+
+        case MQTT_PROP_USER_PROPERTY:
+            break;
+
+        default:
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MQTT_ERROR,
+                "msg",          "%s", "Mqtt unknown property of command",
+                "command",      "%d", get_command_name(command),
+                "identifier",   "%d", identifier,
+                NULL
+            );
+            return MOSQ_ERR_PROTOCOL;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int property_read(hgobj gobj, GBUFFER *gbuf, uint32_t *len, json_t *all_properties)
+{
+    uint8_t byte;
+    uint8_t byte_count;
+    uint16_t uint16;
+    uint32_t uint32;
+    uint32_t varint;
+    char *str1, *str2;
+    uint16_t slen1, slen2;
+
+    uint32_t property_identifier;
+    if(mqtt_read_varint(gobj, gbuf, &property_identifier, NULL)<0) {
+        // Error already logged
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+    const char *property_name = mqtt_property_identifier_to_string(property_identifier);
+
+    /* Check for duplicates (only if not MQTT_PROP_USER_PROPERTY, why?)*/
+    if(property_identifier != MQTT_PROP_USER_PROPERTY) {
+        if(kw_has_key(all_properties, property_name)) {
+            log_warning(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MQTT_ERROR,
+                "msg",          "%s", "Mqtt duplicate property",
+                "property_type","%d", (int)property_identifier,
+                "property_name","%s", property_name,
+                "mqtt_error",   "%d", MOSQ_ERR_DUPLICATE_PROPERTY,
+                NULL
+            );
+            return MOSQ_ERR_DUPLICATE_PROPERTY;
+        }
+    }
+
+    json_t *property = json_object();
+    json_object_set_new(property, "identifier", json_integer(property_identifier));
+    json_object_set_new(
+        property,
+        "name",
+        json_string(property_name)
+    );
+    int identifier_, type_;
+    mosquitto_string_to_property_info(property_name, &identifier_, &type_);
+    json_object_set_new(
+        property,
+        "type",
+        json_integer(type_)
+    );
+
+    *len -= 1;
+
+    switch(property_identifier) {
+        case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
+        case MQTT_PROP_REQUEST_PROBLEM_INFORMATION:
+        case MQTT_PROP_REQUEST_RESPONSE_INFORMATION:
+        case MQTT_PROP_MAXIMUM_QOS:
+        case MQTT_PROP_RETAIN_AVAILABLE:
+        case MQTT_PROP_WILDCARD_SUB_AVAILABLE:
+        case MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE:
+        case MQTT_PROP_SHARED_SUB_AVAILABLE:
+            if(mqtt_read_byte(gobj, gbuf, &byte)<0) {
+                // Error already logged
+                JSON_DECREF(property);
+                return MOSQ_ERR_MALFORMED_PACKET;
+            }
+            *len -= 1; /* byte */
+            json_object_set_new(property, "value", json_integer(byte));
+            break;
+
+        case MQTT_PROP_SERVER_KEEP_ALIVE:
+        case MQTT_PROP_RECEIVE_MAXIMUM:
+        case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+        case MQTT_PROP_TOPIC_ALIAS:
+            if(mqtt_read_uint16(gobj, gbuf, &uint16)<0) {
+                // Error already logged
+                JSON_DECREF(property);
+                return MOSQ_ERR_MALFORMED_PACKET;
+            }
+            *len -= 2; /* uint16 */
+            json_object_set_new(property, "value", json_integer(uint16));
+            break;
+
+        case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
+        case MQTT_PROP_SESSION_EXPIRY_INTERVAL:
+        case MQTT_PROP_WILL_DELAY_INTERVAL:
+        case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+            if(mqtt_read_uint32(gobj, gbuf, &uint32)<0) {
+                // Error already logged
+                JSON_DECREF(property);
+                return MOSQ_ERR_MALFORMED_PACKET;
+            }
+            *len -= 4; /* uint32 */
+            json_object_set_new(property, "value", json_integer(uint32));
+            break;
+
+        case MQTT_PROP_SUBSCRIPTION_IDENTIFIER:
+            if(mqtt_read_varint(gobj, gbuf, &varint, &byte_count)<0) {
+                // Error already logged
+                JSON_DECREF(property);
+                return MOSQ_ERR_MALFORMED_PACKET;
+            }
+            *len -= byte_count;
+            json_object_set_new(property, "value", json_integer(varint));
+            break;
+
+        case MQTT_PROP_CONTENT_TYPE:
+        case MQTT_PROP_RESPONSE_TOPIC:
+        case MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER:
+        case MQTT_PROP_AUTHENTICATION_METHOD:
+        case MQTT_PROP_RESPONSE_INFORMATION:
+        case MQTT_PROP_SERVER_REFERENCE:
+        case MQTT_PROP_REASON_STRING:
+            if(mqtt_read_string(gobj, gbuf, &str1, &slen1)<0) {
+                // Error already logged
+                JSON_DECREF(property);
+                return MOSQ_ERR_MALFORMED_PACKET;
+            }
+            *len = (*len) - 2 - slen1; /* uint16, string len */
+            json_object_set_new(property, "value", json_sprintf("%*.*s", slen1, slen1, str1));
+            json_object_set_new(property, "value_length", json_integer(slen1));
+            break;
+
+        case MQTT_PROP_AUTHENTICATION_DATA:
+        case MQTT_PROP_CORRELATION_DATA:
+            if(mqtt_read_binary(gobj, gbuf, (uint8_t **)&str1, &slen1)<0) {
+                // Error already logged
+                JSON_DECREF(property);
+                return MOSQ_ERR_MALFORMED_PACKET;
+            }
+            *len = (*len) - 2 - slen1; /* uint16, binary len */
+
+            // Save binary data in base64
+            GBUFFER *gbuf_b64 = gbuf_string2base64(str1, slen1);
+            json_object_set_new(property, "value", json_string(gbuf_cur_rd_pointer(gbuf_b64)));
+            json_object_set_new(property, "value_length", json_integer(slen1));
+            GBUF_DECREF(gbuf_b64);
+            break;
+
+        case MQTT_PROP_USER_PROPERTY:
+            if(mqtt_read_string(gobj, gbuf, &str1, &slen1)<0) {
+                // Error already logged
+                JSON_DECREF(property);
+                return MOSQ_ERR_MALFORMED_PACKET;
+            }
+            *len = (*len) - 2 - slen1; /* uint16, string len */
+
+            if(mqtt_read_string(gobj, gbuf, &str2, &slen2)<0) {
+                // Error already logged
+                JSON_DECREF(property);
+                return MOSQ_ERR_MALFORMED_PACKET;
+            }
+
+            *len = (*len) - 2 - slen2; /* uint16, string len */
+
+            json_object_set_new(property, "name", json_sprintf("%*.*s", slen1, slen1, str1));
+            json_object_set_new(property, "name_length", json_integer(slen1));
+
+            json_object_set_new(property, "value", json_sprintf("%*.*s", slen2, slen2, str2));
+            json_object_set_new(property, "value_length", json_integer(slen2));
+            break;
+
+        default:
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MQTT_ERROR,
+                "msg",          "%s", "Mqtt Unsupported property type",
+                "property_type","%d", (int)property_identifier,
+                NULL
+            );
+            JSON_DECREF(property);
+            return MOSQ_ERR_MALFORMED_PACKET;
+    }
+
+    json_object_set_new(all_properties, property_name, property);
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int mqtt_property_check_all(hgobj gobj, int command, json_t *all_properties)
+{
+    int ret = 0;
+    const char *property_name; json_t *property;
+    json_object_foreach(all_properties, property_name, property) {
+        /* Validity checks */
+        int identifier = kw_get_int(property, "identifier", 0, KW_REQUIRED);
+        if(identifier == MQTT_PROP_REQUEST_PROBLEM_INFORMATION
+                || identifier == MQTT_PROP_PAYLOAD_FORMAT_INDICATOR
+                || identifier == MQTT_PROP_REQUEST_RESPONSE_INFORMATION
+                || identifier == MQTT_PROP_MAXIMUM_QOS
+                || identifier == MQTT_PROP_RETAIN_AVAILABLE
+                || identifier == MQTT_PROP_WILDCARD_SUB_AVAILABLE
+                || identifier == MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE
+                || identifier == MQTT_PROP_SHARED_SUB_AVAILABLE) {
+
+            int value = kw_get_int(property, "value", 0, KW_REQUIRED);
+            if(value > 1) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt check property failed 1",
+                    "property",     "%j", property,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+        } else if(identifier == MQTT_PROP_MAXIMUM_PACKET_SIZE) {
+            int value = kw_get_int(property, "value", 0, KW_REQUIRED);
+            if(value == 0) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt check property failed 2",
+                    "property",     "%j", property,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+        } else if(identifier == MQTT_PROP_RECEIVE_MAXIMUM
+                || identifier == MQTT_PROP_TOPIC_ALIAS) {
+
+            int value = kw_get_int(property, "value", 0, KW_REQUIRED);
+            if(value == 0) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt check property failed 3",
+                    "property",     "%j", property,
+                    NULL
+                );
+                return MOSQ_ERR_PROTOCOL;
+            }
+        }
+
+        /* Check for properties on incorrect commands */
+        if((ret=mosquitto_property_check_command(gobj, command, identifier))<0) {
+            // Error already logged
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE json_t *property_read_all(hgobj gobj, GBUFFER *gbuf, int command, int *error)
+{
+    uint32_t proplen;
+    int ret;
+    if(error) {
+        *error = 0;
+    }
+
+    if(mqtt_read_varint(gobj, gbuf, &proplen, NULL)<0) {
+        // Error already logged
+        if(error) {
+            *error = MOSQ_ERR_MALFORMED_PACKET;
+        }
+        return 0;
+    }
+
+    /*
+     *  The property length comes from the peer, don't trust it:
+     *  the properties must fit in the packet and be consumed exactly.
+     */
+    size_t leftbytes = gbuf_leftbytes(gbuf);
+    if(proplen > leftbytes) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt malformed packet, properties length too large",
+            "proplen",      "%d", (int)proplen,
+            "leftbytes",    "%d", (int)leftbytes,
+            NULL
+        );
+        if(error) {
+            *error = MOSQ_ERR_MALFORMED_PACKET;
+        }
+        return 0;
+    }
+    size_t end_of_properties = leftbytes - proplen;
+
+    json_t *all_properties = json_object();
+
+    while(gbuf_leftbytes(gbuf) > end_of_properties) {
+        if((ret=property_read(gobj, gbuf, &proplen, all_properties))<0) {
+            // Error already logged
+            JSON_DECREF(all_properties);
+            if(error) {
+                *error = ret;
+            }
+            return 0;
+        }
+    }
+    if(gbuf_leftbytes(gbuf) != end_of_properties) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt malformed packet, property overflows properties length",
+            NULL
+        );
+        JSON_DECREF(all_properties);
+        if(error) {
+            *error = MOSQ_ERR_MALFORMED_PACKET;
+        }
+        return 0;
+    }
+
+    if((ret=mqtt_property_check_all(gobj, command, all_properties))<0) {
+        // Error already logged
+        JSON_DECREF(all_properties);
+        if(error) {
+            *error = ret;
+        }
+        return 0;
+    }
+
+    if(gobj_trace_level(gobj) & SHOW_DECODE) {
+        log_debug_json(0, all_properties, "all_properties, command %s", get_command_name(command));
+    }
+
+    return all_properties;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE json_t *property_get_property(json_t *properties, int identifier)
+{
+    const char *identifier_name = mqtt_property_identifier_to_string(identifier);
+    json_t *property = kw_get_dict(properties, identifier_name, 0, 0);
+    return property;
+}
+
+/***************************************************************************
+ *  Use instead of: mosquitto_property_read_varint
+ ***************************************************************************/
+PRIVATE json_int_t property_get_int(json_t *properties, int identifier)
+{
+    json_t *property = property_get_property(properties, identifier);
+    return kw_get_int(property, "value", -1, 0);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int property_process_connect(hgobj gobj, json_t *all_properties)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    const char *property_name; json_t *property;
+    json_object_foreach(all_properties, property_name, property) {
+        json_int_t identifier = kw_get_int(property, "identifier", 0, KW_REQUIRED);
+
+        switch(identifier) {
+            case MQTT_PROP_SESSION_EXPIRY_INTERVAL:
+                {
+                    json_int_t value = kw_get_int(property, "value", 0, KW_REQUIRED);
+                    gobj_write_uint32_attr(gobj, "session_expiry_interval", value);
+                }
+                break;
+
+            case MQTT_PROP_RECEIVE_MAXIMUM:
+                {
+                    json_int_t value = kw_get_int(property, "value", 0, KW_REQUIRED);
+                    if(value != 0) {
+                        //return -1;
+                    } else {
+                        gobj_write_uint32_attr(gobj, "msgs_out_inflight_maximum", value);
+                        gobj_write_uint32_attr(gobj, "msgs_out_inflight_quota", value);
+                    }
+                }
+                break;
+
+            case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+                {
+                    json_int_t value = kw_get_int(property, "value", 0, KW_REQUIRED);
+                    if(value == 0) {
+                        //return -1;
+                    } else {
+                        gobj_write_uint32_attr(gobj, "maximum_packet_size", value);
+                    }
+                }
+                break;
+
+            case MQTT_PROP_AUTHENTICATION_METHOD:
+                {
+                    const char *value = kw_get_str(property, "value", "", KW_REQUIRED);
+                    gobj_write_str_attr(gobj, "auth_method", value);
+                }
+                break;
+
+            case MQTT_PROP_AUTHENTICATION_DATA:
+                {
+                    const char *value = kw_get_str(property, "value", "", KW_REQUIRED);
+                    gobj_write_str_attr(gobj, "auth_data", value);
+                }
+                break;
+
+            case MQTT_PROP_USER_PROPERTY:
+                {
+                    const char *name = kw_get_str(property, "name", "", KW_REQUIRED);
+                    const char *value = kw_get_str(property, "value", "", KW_REQUIRED);
+                    if(strcmp(name, COMPRESSION_PROPERTY)==0) {
+                        priv->compress = compression_accepted(gobj, value);
+                    }
+                }
+                break;
+        }
+    }
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int property_process_will(hgobj gobj, json_t *all_properties)
+{
+    const char *property_name; json_t *property;
+    json_object_foreach(all_properties, property_name, property) {
+        json_int_t identifier = kw_get_int(property, "identifier", 0, KW_REQUIRED);
+        switch(identifier) {
+            case MQTT_PROP_CONTENT_TYPE:
+            case MQTT_PROP_CORRELATION_DATA:
+            case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
+            case MQTT_PROP_RESPONSE_TOPIC:
+            case MQTT_PROP_USER_PROPERTY:
+                break;
+
+            case MQTT_PROP_WILL_DELAY_INTERVAL:
+                {
+                    json_int_t value = kw_get_int(property, "value", 0, KW_REQUIRED);
+                    gobj_write_uint32_attr(gobj, "will_delay_interval", value);
+                }
+                break;
+
+            case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
+                {
+                    json_int_t value = kw_get_int(property, "value", 0, KW_REQUIRED);
+                    gobj_write_uint32_attr(gobj, "will_expiry_interval", value);
+                }
+                break;
+
+            default:
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt auth: will property unknown",
+                    "identifier",   "%d", identifier,
+                    NULL
+                );
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int packet_check_oversize(hgobj gobj, uint32_t remaining_length)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    uint32_t len;
+
+    if(priv->maximum_packet_size == 0) {
+        return 0;
+    }
+
+    len = remaining_length + packet_varint_bytes(remaining_length);
+    if(len > priv->maximum_packet_size) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+/***************************************************************************
+ *  Send a packet, its last `tail_len` bytes are not in gbuf,
+ *  they are streamed after it.
+ ***************************************************************************/
+PRIVATE int send_packet_head(hgobj gobj, GBUFFER *gbuf, size_t tail_len)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    uint8_t *p = gbuf_cur_rd_pointer(gbuf);
+    size_t len = gbuf_leftbytes(gbuf);
+    if(priv->websocket) {
+        p += WS_HEADROOM;
+        len -= WS_HEADROOM;
+    }
+    len += tail_len;
+    if(len > 0 && (*p & 0xF0) == CMD_PUBLISH) {
+        sys_stats.msgs_sent++;
+        sys_stats.bytes_sent += len;
+    }
+
+    if(priv->websocket) {
+        /*
+         *  Binary frame, the header goes in the room left before the packet
+         */
+        size_t hlen = (len < 126)? 2 : (len < 65536)? 4 : 10;
+        uint8_t *h = p - hlen;
+        h[0] = 0x80 | WS_OPCODE_BINARY;
+        if(len < 126) {
+            h[1] = (uint8_t)len;
+        } else if(len < 65536) {
+            h[1] = 126;
+            h[2] = (uint8_t)(len >> 8);
+            h[3] = (uint8_t)len;
+        } else {
+            h[1] = 127;
+            for(int i=0; i<8; i++) {
+                h[2+i] = (uint8_t)((uint64_t)len >> (56 - 8*i));
+            }
+        }
+        gbuf_get(gbuf, WS_HEADROOM - hlen);
+    }
+
+    if(gobj_trace_level(gobj) & TRAFFIC) {
+        log_debug_gbuf(LOG_DUMP_OUTPUT, gbuf, "%s ==> %s",
+            gobj_short_name(gobj),
+            gobj_short_name(gobj_bottom_gobj(gobj))
+        );
+    }
+    json_t *kw = json_pack("{s:I}",
+        "gbuffer", (json_int_t)(size_t)gbuf
+    );
+    return gobj_send_event(gobj_bottom_gobj(gobj), "EV_TX_DATA", kw, gobj);
+}
+
+/***************************************************************************
+ *  Keep a packet (or a spooled publish) until the current stream ends
+ ***************************************************************************/
+PRIVATE int tx_queue_add(hgobj gobj, GBUFFER *gbuf, struct mosquitto_msg_store *store, BOOL framed)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->jn_tx_queue) {
+        priv->jn_tx_queue = json_array();
+    }
+    json_array_append_new(
+        priv->jn_tx_queue,
+        json_pack("[I, I, b]",
+            (json_int_t)(size_t)gbuf,
+            (json_int_t)(size_t)(store? db_duplicate_msg(gobj, store) : 0),
+            framed
+        )
+    );
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int send_packet(hgobj gobj, GBUFFER *gbuf)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(priv->stream_store) {
+        return tx_queue_add(gobj, gbuf, 0, FALSE);
+    }
+    return send_packet_head(gobj, gbuf, 0);
+}
+
+/***************************************************************************
+ *  Send the next chunk of the spooled payload being streamed.
+ *  When the stream ends the queued packets are sent.
+ ***************************************************************************/
+PRIVATE int stream_next_chunk(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    struct mosquitto_msg_store *store = priv->stream_store;
+
+    if(!store) {
+        return 0;
+    }
+
+    size_t left = (size_t)store->payloadlen - priv->stream_offset;
+    size_t len = (left > STREAM_CHUNK_SIZE)? STREAM_CHUNK_SIZE : left;
+    if(len > 0) {
+        GBUFFER *gbuf = gbuf_create(len, len, 0, 0);
+        if(!gbuf) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "gbuf_create() FAILED",
+                NULL
+            );
+            /*
+             *  The packet cannot be completed, the connection is broken
+             */
+            stream_reset(gobj);
+            gobj_send_event(gobj_bottom_gobj(gobj), "EV_DROP", 0, gobj);
+            return -1;
+        }
+        gbuf_append(gbuf, (char *)store->payload + priv->stream_offset, len);
+        priv->stream_offset += len;
+        json_t *kw = json_pack("{s:I}",
+            "gbuffer", (json_int_t)(size_t)gbuf
+        );
+        gobj_send_event(gobj_bottom_gobj(gobj), "EV_TX_DATA", kw, gobj);
+    }
+
+    if(priv->stream_offset < (size_t)store->payloadlen) {
+        return 0;
+    }
+
+    /*
+     *  End of stream, send what was waiting for it
+     */
+    priv->stream_store = 0;
+    priv->stream_offset = 0;
+    db_free_msg_store(store);
+
+    while(!priv->stream_store && json_array_size(priv->jn_tx_queue) > 0) {
+        json_t *jn_item = json_incref(json_array_get(priv->jn_tx_queue, 0));
+        json_array_remove(priv->jn_tx_queue, 0);
+
+        GBUFFER *gbuf = (GBUFFER *)(size_t)json_integer_value(json_array_get(jn_item, 0));
+        struct mosquitto_msg_store *next = (struct mosquitto_msg_store *)(size_t)
+            json_integer_value(json_array_get(jn_item, 1));
+        BOOL framed = json_is_true(json_array_get(jn_item, 2));
+        JSON_DECREF(jn_item);
+
+        if(next) {
+            stream_start(gobj, gbuf, next);
+            db_free_msg_store(next);    // the stream has its own reference
+        } else if(framed) {
+            json_t *kw = json_pack("{s:I}",
+                "gbuffer", (json_int_t)(size_t)gbuf
+            );
+            gobj_send_event(gobj_bottom_gobj(gobj), "EV_TX_DATA", kw, gobj);
+        } else {
+            send_packet_head(gobj, gbuf, 0);
+        }
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Send a publish with a spooled payload: the packet without payload
+ *  in gbuf, and the payload from the mapping of the store, in chunks.
+ *  The next chunks are sent with EV_TX_READY of the bottom.
+ ***************************************************************************/
+PRIVATE int stream_start(hgobj gobj, GBUFFER *gbuf, struct mosquitto_msg_store *store)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(priv->stream_store) {
+        return tx_queue_add(gobj, gbuf, store, FALSE);
+    }
+
+    send_packet_head(gobj, gbuf, (size_t)store->payloadlen);
+    priv->stream_store = db_duplicate_msg(gobj, store);
+    priv->stream_offset = 0;
+    for(int i=0; i<STREAM_CHUNKS_AHEAD && priv->stream_store == store; i++) {
+        stream_next_chunk(gobj);
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Drop the stream and the packets waiting for it
+ ***************************************************************************/
+PRIVATE void stream_reset(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(priv->stream_store) {
+        db_free_msg_store(priv->stream_store);
+        priv->stream_store = 0;
+    }
+    priv->stream_offset = 0;
+
+    size_t idx;
+    json_t *jn_item;
+    json_array_foreach(priv->jn_tx_queue, idx, jn_item) {
+        GBUFFER *gbuf = (GBUFFER *)(size_t)json_integer_value(json_array_get(jn_item, 0));
+        struct mosquitto_msg_store *store = (struct mosquitto_msg_store *)(size_t)
+            json_integer_value(json_array_get(jn_item, 1));
+        GBUF_DECREF(gbuf);
+        if(store) {
+            db_free_msg_store(store);
+        }
+    }
+    JSON_DECREF(priv->jn_tx_queue);
+}
+
+/***************************************************************************
+ *  For DISCONNECT, PINGREQ and PINGRESP
+ ***************************************************************************/
+PRIVATE int send_simple_command(hgobj gobj, uint8_t command)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    GBUFFER *gbuf = build_mqtt_packet(gobj, command, 0);
+    if(!gbuf) {
+        // Error already logged
+        return MOSQ_ERR_NOMEM;
+    }
+
+    if(gobj_trace_level(gobj) & SHOW_DECODE) {
+        trace_msg("👉👉 Sending %s to '%s'",
+            get_command_name(command),
+            priv->client_id
+        );
+    }
+    return send_packet(gobj, gbuf);
+}
+
+/***************************************************************************
+ *  Client side: CONNECT with MQTT v5, offering the configured compression.
+ *  The compression is used only if the broker echoes it in CONNACK.
+ ***************************************************************************/
+PRIVATE int send_connect(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    const char *client_id = gobj_read_str_attr(gobj, "mqtt_client_id");
+    const char *username = gobj_read_str_attr(gobj, "mqtt_username");
+    const char *password = gobj_read_str_attr(gobj, "mqtt_password");
+    uint16_t keepalive = (uint16_t)gobj_read_uint32_attr(gobj, "mqtt_keepalive");
+    if(!client_id) {
+        client_id = "";
+    }
+
+    gobj_write_str_attr(gobj, "client_id", client_id);
+    gobj_write_uint32_attr(gobj, "protocol_version", mosq_p_mqtt5);
+    gobj_write_uint32_attr(gobj, "keepalive", keepalive);
+
+    json_t *connect_props = json_object();
+    if(!empty_string(priv->compression)) {
+        mqtt_property_add_user(gobj, connect_props, COMPRESSION_PROPERTY, priv->compression);
+    }
+
+    if(gobj_trace_level(gobj) & SHOW_DECODE) {
+        trace_msg("👉👉 Sending CONNECT as '%s' %s",
+            client_id,
+            gobj_short_name(gobj_bottom_gobj(gobj))
+        );
+        log_debug_json(0, connect_props, "Sending CONNECT properties");
+    }
+
+    uint8_t connect_flags = 0x02; // clean start
+    uint32_t remaining_length = 2 + (uint32_t)strlen(PROTOCOL_NAME) + 1 + 1 + 2;
+    remaining_length += property_get_remaining_length(connect_props);
+    remaining_length += 2 + (uint32_t)strlen(client_id);
+    if(!empty_string(username)) {
+        connect_flags |= 0x80;
+        remaining_length += 2 + (uint32_t)strlen(username);
+    }
+    if(!empty_string(password)) {
+        connect_flags |= 0x40;
+        remaining_length += 2 + (uint32_t)strlen(password);
+    }
+
+    if(packet_check_oversize(gobj, remaining_length)) {
+        JSON_DECREF(connect_props);
+        return -1;
+    }
+
+    GBUFFER *gbuf = build_mqtt_packet(gobj, CMD_CONNECT, remaining_length);
+    if(!gbuf) {
+        // Error already logged
+        JSON_DECREF(connect_props);
+        return MOSQ_ERR_NOMEM;
+    }
+
+    /* Variable header */
+    mqtt_write_string(gbuf, PROTOCOL_NAME);
+    gbuf_append_char(gbuf, PROTOCOL_VERSION_v5);
+    gbuf_append_char(gbuf, connect_flags);
+    mqtt_write_uint16(gbuf, keepalive);
+    property_write_all(gobj, gbuf, connect_props, true);
+    JSON_DECREF(connect_props);
+
+    /* Payload */
+    mqtt_write_string(gbuf, client_id);
+    if(connect_flags & 0x80) {
+        mqtt_write_string(gbuf, username);
+    }
+    if(connect_flags & 0x40) {
+        mqtt_write_string(gbuf, password);
+    }
+
+    return send_packet(gobj, gbuf);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int send_connack(
+    hgobj gobj,
+    uint8_t ack,
+    uint8_t reason_code,
+    json_t *connack_props // owned
+)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    uint32_t remaining_length = 2;
+
+    if(gobj_trace_level(gobj) & SHOW_DECODE) {
+        trace_msg("👉👉 Sending CONNACK to '%s' %s (ack %d, reason code %d)",
+            priv->client_id,
+            gobj_short_name(gobj_bottom_gobj(gobj)),
+            ack,
+            reason_code
+        );
+        if(connack_props) {
+            log_debug_json(0, connack_props, "Sending CONNACK properties");
+        }
+    }
+
+    if(priv->protocol_version == mosq_p_mqtt5) {
+        if(reason_code < 128 && priv->retain_available == false) {
+            mqtt_property_add_byte(gobj, connack_props, MQTT_PROP_RETAIN_AVAILABLE, 0);
+        }
+        if(reason_code < 128 && priv->max_packet_size > 0) {
+            mqtt_property_add_int32(gobj, connack_props, MQTT_PROP_MAXIMUM_PACKET_SIZE, priv->max_packet_size);
+        }
+        if(reason_code < 128 && priv->max_inflight_messages > 0) {
+            mqtt_property_add_int16(
+                gobj, connack_props, MQTT_PROP_RECEIVE_MAXIMUM, priv->max_inflight_messages
+            );
+        }
+        if(priv->max_qos != 2) {
+            mqtt_property_add_byte(gobj, connack_props, MQTT_PROP_MAXIMUM_QOS, priv->max_qos);
+        }
+
+        remaining_length += property_get_remaining_length(connack_props);
+    }
+
+    if(packet_check_oversize(gobj, remaining_length)) {
+        JSON_DECREF(connack_props);
+        return -1;
+    }
+
+    GBUFFER *gbuf = build_mqtt_packet(gobj, CMD_CONNACK, remaining_length);
+    if(!gbuf) {
+        // Error already logged
+        JSON_DECREF(connack_props);
+        return MOSQ_ERR_NOMEM;
+    }
+    gbuf_append_char(gbuf, ack);
+    gbuf_append_char(gbuf, reason_code);
+    if(priv->protocol_version == mosq_p_mqtt5) {
+        property_write_all(gobj, gbuf, connack_props, true);
+    }
+    JSON_DECREF(connack_props);
+    return send_packet(gobj, gbuf);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int send_disconnect(
+    hgobj gobj,
+    uint8_t reason_code,
+    json_t *properties
+)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    gobj_write_bool_attr(gobj, "send_disconnect", FALSE);
+
+    if(gobj_trace_level(gobj) & SHOW_DECODE) {
+        if(priv->iamServer) {
+            if(priv->is_bridge) {
+                trace_msg("👉👉 Bridge Sending DISCONNECT to '%s' ('%s', %d)",
+                    priv->client_id,
+                    mosquitto_reason_string(reason_code),
+                    reason_code
+                );
+            } else  {
+                trace_msg("👉👉 Sending DISCONNECT to '%s' ('%s', %d)",
+                    priv->client_id,
+                    mosquitto_reason_string(reason_code),
+                    reason_code
+                );
+            }
+        } else {
+            trace_msg("👉👉 Sending client DISCONNECT to '%s'", priv->client_id);
+        }
+    }
+
+    uint32_t remaining_length;
+
+    if(priv->protocol_version == mosq_p_mqtt5 && (reason_code != 0 || properties)) {
+        remaining_length = 1;
+        if(properties) {
+            remaining_length += property_get_remaining_length(properties);
+        }
+    } else {
+        remaining_length = 0;
+    }
+
+    GBUFFER *gbuf = build_mqtt_packet(gobj, CMD_DISCONNECT, remaining_length);
+    if(!gbuf) {
+        // Error already logged
+        return MOSQ_ERR_NOMEM;
+    }
+
+    if(priv->protocol_version == mosq_p_mqtt5 && (reason_code != 0 || properties)) {
+        gbuf_append_char(gbuf, reason_code);
+        if(properties) {
+            property_write_all(gobj, gbuf, properties, true);
+        }
+    }
+
+    return send_packet(gobj, gbuf);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int send__suback(hgobj gobj, uint16_t mid, uint32_t payloadlen, const void *payload)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    json_t *properties = NULL;
+    uint32_t remaining_length = 2 + payloadlen;
+
+    if(priv->protocol_version == mosq_p_mqtt5) {
+        /* We don't use Reason String or User Property yet. */
+        remaining_length += property_get_remaining_length(properties);
+    }
+
+    if(gobj_trace_level(gobj) & SHOW_DECODE) {
+        trace_msg("👉👉 Sending SUBACK to '%s' %s",
+            priv->client_id,
+            gobj_short_name(gobj_bottom_gobj(gobj))
+        );
+        if(payloadlen > 0) {
+            log_debug_dump(0, payload, payloadlen, "   SUBACK payload");
+        }
+        if(properties) {
+            log_debug_json(0, properties, "   SUBACK properties");
+        }
+    }
+
+    GBUFFER *gbuf = build_mqtt_packet(gobj, CMD_SUBACK, remaining_length);
+    if(!gbuf) {
+        // Error already logged
+        return MOSQ_ERR_NOMEM;
+    }
+
+    mqtt_write_uint16(gbuf, mid);
+
+    if(priv->protocol_version == mosq_p_mqtt5) {
+        property_write_all(gobj, gbuf, properties, true);
+    }
+
+    if(payloadlen) {
+        mqtt_write_bytes(gbuf, payload, payloadlen);
+    }
+
+    return send_packet(gobj, gbuf);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int send__unsuback(
+    hgobj gobj,
+    uint16_t mid,
+    int reason_code_count,
+    uint8_t *reason_codes,
+    json_t *properties)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(gobj_trace_level(gobj) & SHOW_DECODE) {
+        trace_msg("👉👉 Sending UNSUBACK to '%s' %s",
+            priv->client_id,
+            gobj_short_name(gobj_bottom_gobj(gobj))
+        );
+    }
+
+    uint32_t remaining_length = 2;
+
+    if(priv->protocol_version == mosq_p_mqtt5) {
+        remaining_length += property_get_remaining_length(properties);
+        remaining_length += (uint32_t)reason_code_count;
+    }
+
+    GBUFFER *gbuf = build_mqtt_packet(gobj, CMD_UNSUBACK, remaining_length);
+    if(!gbuf) {
+        // Error already logged
+        return MOSQ_ERR_NOMEM;
+    }
+
+    mqtt_write_uint16(gbuf, mid);
+
+    if(priv->protocol_version == mosq_p_mqtt5) {
+        property_write_all(gobj, gbuf, properties, true);
+        mqtt_write_bytes(gbuf, reason_codes, (uint32_t)reason_code_count);
+    }
+
+    return send_packet(gobj, gbuf);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int handle_pingreq(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->in_session) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt CMD_PINGREQ: not in session",
+            NULL
+        );
+        return -1;
+    }
+    if(!priv->iamServer) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt CMD_PINGREQ: not server",
+            NULL
+        );
+        return -1;
+    }
+
+    if(priv->frame_head.flags != 0) {
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+
+    // TODO mosq->ping_t = mosquitto_time(); esto no está en esta función!!
+    return send_simple_command(gobj, CMD_PINGRESP);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int handle_pingresp(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->in_session) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt CMD_PINGRESP: not in session",
+            NULL
+        );
+        return -1;
+    }
+
+    // mosq->ping_t = 0; /* No longer waiting for a PINGRESP. */
+
+    if(!priv->is_bridge) {
+        // Parece que el broker no debe recibir pingresp
+        return MOSQ_ERR_PROTOCOL;
+    }
+
+    return send_simple_command(gobj, CMD_PINGRESP);
+}
+
+/***************************************************************************
+ *  For PUBACK, PUBCOMP, PUBREC, and PUBREL
+ ***************************************************************************/
+PRIVATE int send_command_with_mid(
+    hgobj gobj,
+    uint8_t command,
+    uint16_t mid,
+    bool dup,
+    uint8_t reason_code,
+    json_t *properties
+)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    int remaining_length = 2;
+
+    if(gobj_trace_level(gobj) & SHOW_DECODE) {
+        trace_msg("👉👉 Sending %s to '%s', mid %ld ('%s', %d)",
+            get_command_name(command & 0xF0),
+            priv->client_id,
+            (long)mid,
+            mosquitto_reason_string(reason_code),
+            reason_code
+        );
+    }
+
+    if(dup) {
+        command |= 8;
+    }
+    if(priv->protocol_version == mosq_p_mqtt5) {
+        if(reason_code != 0 || properties) {
+            remaining_length += 1;
+        }
+
+        if(properties) {
+            remaining_length += property_get_remaining_length(properties);
+        }
+    }
+    GBUFFER *gbuf = build_mqtt_packet(gobj, command, remaining_length);
+    if(!gbuf) {
+        // Error already logged
+        return MOSQ_ERR_NOMEM;
+    }
+
+    mqtt_write_uint16(gbuf, mid);
+
+    if(priv->protocol_version == mosq_p_mqtt5) {
+        if(reason_code != 0 || properties) {
+            mqtt_write_byte(gbuf, reason_code);
+        }
+        if(properties) {
+            property_write_all(gobj, gbuf, properties, true);
+        }
+    }
+
+    JSON_DECREF(properties)
+
+    return send_packet(gobj, gbuf);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int send_puback(hgobj gobj, uint16_t mid, uint8_t reason_code, json_t *properties)
+{
+    //util__increment_receive_quota(mosq);
+    /* We don't use Reason String or User Property yet. */
+    return send_command_with_mid(gobj, CMD_PUBACK, mid, false, reason_code, properties);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int send_pubcomp(hgobj gobj, uint16_t mid, json_t *properties)
+{
+    //util__increment_receive_quota(mosq);
+    /* We don't use Reason String or User Property yet. */
+    return send_command_with_mid(gobj, CMD_PUBCOMP, mid, false, 0, properties);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int send_pubrec(hgobj gobj, uint16_t mid, uint8_t reason_code, json_t *properties)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(reason_code >= 0x80 && priv->protocol_version == mosq_p_mqtt5) {
+        //util__increment_receive_quota(mosq);
+    }
+    /* We don't use Reason String or User Property yet. */
+    return send_command_with_mid(gobj, CMD_PUBREC, mid, false, reason_code, properties);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int send__pubrel(hgobj gobj, uint16_t mid, json_t *properties)
+{
+    /* We don't use Reason String or User Property yet. */
+    return send_command_with_mid(gobj, CMD_PUBREL|2, mid, false, 0, properties);
+}
+
+/***************************************************************************
+ *  Return TRUE if the configured compression is in the list of algorithms
+ *  ("deflate" or "deflate,..."), offered in CONNECT or accepted in CONNACK
+ ***************************************************************************/
+PRIVATE BOOL compression_accepted(hgobj gobj, const char *algorithms)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(empty_string(priv->compression) || strcmp(priv->compression, COMPRESSION_DEFLATE)!=0) {
+        return FALSE;
+    }
+    size_t len = strlen(priv->compression);
+    const char *p = algorithms;
+    while(p && *p) {
+        while(*p == ' ' || *p == ',') {
+            p++;
+        }
+        size_t n = strcspn(p, ", ");
+        if(n == len && strncmp(p, priv->compression, len)==0) {
+            return TRUE;
+        }
+        p += n;
+    }
+    return FALSE;
+}
+
+/***************************************************************************
+ *  Return TRUE if the payload of the PUBLISH with these properties is deflated
+ ***************************************************************************/
+PRIVATE BOOL payload_is_deflated(json_t *properties)
+{
+    json_t *user_property = property_get_property(properties, MQTT_PROP_USER_PROPERTY);
+    if(!user_property ||
+            strcmp(kw_get_str(user_property, "name", "", 0), CONTENT_ENCODING_PROPERTY)!=0) {
+        return FALSE;
+    }
+    return strcmp(kw_get_str(user_property, "value", "", 0), COMPRESSION_DEFLATE)==0;
+}
+
+/***************************************************************************
+ *  Maximum size of a decompressed payload
+ ***************************************************************************/
+PRIVATE uint32_t payload_inflate_limit(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    uint32_t limit = priv->decompression_limit? priv->decompression_limit : MQTT_MAX_PAYLOAD;
+    if(priv->message_size_limit && priv->message_size_limit < limit) {
+        limit = priv->message_size_limit;
+    }
+    return limit;
+}
+
+/***************************************************************************
+ *  Compress a payload with raw deflate and the preset dictionary.
+ *  Every payload is compressed alone, the stream is only reused to not
+ *  allocate its window each time.
+ *  Return a gbmem buffer, or NULL if the payload doesn't shrink.
+ ***************************************************************************/
+PRIVATE void *payload_deflate(
+    hgobj gobj,
+    const void *payload,
+    uint32_t payloadlen,
+    uint32_t *zlen
+)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    z_stream *zs = priv->zs_deflate;
+
+    if(payloadlen < 2) {
+        return 0;
+    }
+    if(!zs) {
+        zs = gbmem_malloc(sizeof(z_stream));
+        if(!zs) {
+            // Error already logged
+            return 0;
+        }
+        memset(zs, 0, sizeof(z_stream));
+        if(deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY)
+                != Z_OK) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+                "msg",          "%s", "deflateInit2() FAILED",
+                NULL
+            );
+            GBMEM_FREE(zs);
+            return 0;
+        }
+        priv->zs_deflate = zs;
+    } else {
+        deflateReset(zs);
+    }
+    if(!empty_string(priv->compression_dictionary)) {
+        deflateSetDictionary(
+            zs,
+            (const Bytef *)priv->compression_dictionary,
+            (uInt)strlen(priv->compression_dictionary)
+        );
+    }
+
+    /*
+     *  Output no bigger than the input: if it doesn't fit, it's not worth it
+     */
+    void *out = gbmem_malloc(payloadlen);
+    if(!out) {
+        // Error already logged
+        return 0;
+    }
+    zs->next_in = (Bytef *)payload;
+    zs->avail_in = payloadlen;
+    zs->next_out = out;
+    zs->avail_out = payloadlen - 1;
+    if(deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        gbmem_free(out);
+        return 0;
+    }
+
+    *zlen = (uint32_t)zs->total_out;
+    return out;
+}
+
+/***************************************************************************
+ *  Decompress a deflated payload, up to limit bytes.
+ *  Return 0 and a gbmem buffer (nul terminated) in *out, or a MOSQ_ERR_*
+ ***************************************************************************/
+PRIVATE int payload_inflate(
+    hgobj gobj,
+    const void *payload,
+    uint32_t payloadlen,
+    uint32_t limit,
+    void **out,
+    uint32_t *outlen
+)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    z_stream *zs = priv->zs_inflate;
+
+    if(!zs) {
+        zs = gbmem_malloc(sizeof(z_stream));
+        if(!zs) {
+            // Error already logged
+            return MOSQ_ERR_NOMEM;
+        }
+        memset(zs, 0, sizeof(z_stream));
+        if(inflateInit2(zs, -MAX_WBITS) != Z_OK) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+                "msg",          "%s", "inflateInit2() FAILED",
+                NULL
+            );
+            GBMEM_FREE(zs);
+            return MOSQ_ERR_NOMEM;
+        }
+        priv->zs_inflate = zs;
+    } else {
+        inflateReset(zs);
+    }
+    if(!empty_string(priv->compression_dictionary)) {
+        inflateSetDictionary(
+            zs,
+            (const Bytef *)priv->compression_dictionary,
+            (uInt)strlen(priv->compression_dictionary)
+        );
+    }
+
+    /*
+     *  Repetitive telemetry shrinks 3-10 times, start with 4x and grow
+     */
+    size_t size = (size_t)payloadlen * 4;
+    if(size < 256) {
+        size = 256;
+    }
+    if(size > limit) {
+        size = limit;
+    }
+    char *bf = gbmem_malloc(size + 1);
+    if(!bf) {
+        // Error already logged
+        return MOSQ_ERR_NOMEM;
+    }
+
+    zs->next_in = (Bytef *)payload;
+    zs->avail_in = payloadlen;
+    zs->next_out = (Bytef *)bf;
+    zs->avail_out = (uInt)size;
+
+    int ret;
+    while((ret = inflate(zs, Z_FINISH)) != Z_STREAM_END) {
+        if((ret != Z_BUF_ERROR && ret != Z_OK) || zs->avail_out > 0) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MQTT_ERROR,
+                "msg",          "%s", "Mqtt: bad deflated payload",
+                "client_id",    "%s", SAFE_PRINT(priv->client_id),
+                "zerror",       "%s", zs->msg?zs->msg:"",
+                NULL
+            );
+            gbmem_free(bf);
+            return MOSQ_ERR_MALFORMED_PACKET;
+        }
+        if(size >= limit) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MQTT_ERROR,
+                "msg",          "%s", "Mqtt: deflated payload too large",
+                "client_id",    "%s", SAFE_PRINT(priv->client_id),
+                "limit",        "%u", (unsigned)limit,
+                NULL
+            );
+            gbmem_free(bf);
+            return MOSQ_ERR_PAYLOAD_SIZE;
+        }
+        size_t new_size = size * 2;
+        if(new_size > limit) {
+            new_size = limit;
+        }
+        char *new_bf = gbmem_realloc(bf, new_size + 1);
+        if(!new_bf) {
+            // Error already logged
+            gbmem_free(bf);
+            return MOSQ_ERR_NOMEM;
+        }
+        bf = new_bf;
+        zs->next_out = (Bytef *)bf + size;
+        zs->avail_out = (uInt)(new_size - size);
+        size = new_size;
+    }
+
+    *outlen = (uint32_t)zs->total_out;
+    bf[*outlen] = 0;
+    *out = bf;
+    return 0;
+}
+
+/***************************************************************************
+ *  Check that a deflated payload decompresses within limit bytes,
+ *  streaming it through a small buffer, without keeping the output.
+ *  Return 0 or a MOSQ_ERR_*
+ ***************************************************************************/
+PRIVATE int payload_inflate_check(
+    hgobj gobj,
+    const void *payload,
+    uint32_t payloadlen,
+    uint32_t limit
+)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    z_stream zs;
+    char bf[16*1024];
+
+    memset(&zs, 0, sizeof(zs));
+    if(inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+            "msg",          "%s", "inflateInit2() FAILED",
+            NULL
+        );
+        return MOSQ_ERR_NOMEM;
+    }
+    if(!empty_string(priv->compression_dictionary)) {
+        inflateSetDictionary(
+            &zs,
+            (const Bytef *)priv->compression_dictionary,
+            (uInt)strlen(priv->compression_dictionary)
+        );
+    }
+
+    zs.next_in = (Bytef *)payload;
+    zs.avail_in = payloadlen;
+    int ret;
+    do {
+        zs.next_out = (Bytef *)bf;
+        zs.avail_out = sizeof(bf);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if(zs.total_out > limit) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MQTT_ERROR,
+                "msg",          "%s", "Mqtt: deflated payload too large",
+                "client_id",    "%s", SAFE_PRINT(priv->client_id),
+                "limit",        "%u", (unsigned)limit,
+                NULL
+            );
+            inflateEnd(&zs);
+            return MOSQ_ERR_PAYLOAD_SIZE;
+        }
+    } while(ret == Z_OK);
+
+    inflateEnd(&zs);
+    if(ret != Z_STREAM_END) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt: bad deflated payload",
+            "client_id",    "%s", SAFE_PRINT(priv->client_id),
+            NULL
+        );
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int send_publish(
+    hgobj gobj,
+    uint16_t mid,
+    const char *topic,
+    uint32_t payloadlen,
+    const void *payload,
+    uint8_t qos,
+    bool retain,
+    bool dup,
+    json_t *cmsg_props, // not owned
+    json_t *store_props, // not owned
+    uint32_t expiry_interval,
+    struct mosquitto_msg_store *stored // not owned, the payload's store if any
+)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->retain_available) {
+        retain = false;
+    }
+
+    if(gobj_trace_level(gobj) & SHOW_DECODE) {
+        trace_msg("👉👉 Sending PUBLISH to '%s', topic '%s' (dup %d, qos %d, retain %d, mid %d)",
+            SAFE_PRINT(priv->client_id),
+            topic,
+            dup,
+            qos,
+            retain,
+            mid
+        );
+    }
+
+    unsigned int packetlen;
+    unsigned int proplen = 0, varbytes;
+    json_t *expiry_prop = 0;
+    json_t *encoding_prop = 0;
+    json_t *plain_props = 0;
+    void *zpayload = 0;
+
+    /*
+     *  Spooled payload, streamed from its mapping.
+     *  Only in server side, the client connex has not EV_TX_READY.
+     */
+    BOOL streamed = (priv->iamServer && stored && stored->spool_base &&
+        payloadlen > STREAM_CHUNK_SIZE)? TRUE : FALSE;
+
+    /*
+     *  Deflated payload (spooled as received) to a client without the compression:
+     *  it gets the original payload, without the content-encoding.
+     */
+    if(!(priv->compress && priv->protocol_version == mosq_p_mqtt5) &&
+            payload_is_deflated(store_props)) {
+        uint32_t plen;
+        int rc = payload_inflate(
+            gobj, payload, payloadlen, payload_inflate_limit(gobj), &zpayload, &plen
+        );
+        if(rc < 0) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MQTT_ERROR,
+                "msg",          "%s", "Dropping deflated PUBLISH, cannot decompress it",
+                "client_id",    "%s", SAFE_PRINT(priv->client_id),
+                "topic",        "%s", topic?topic:"",
+                "payloadlen",   "%u", (unsigned)payloadlen,
+                "limit",        "%u", (unsigned)payload_inflate_limit(gobj),
+                "rc",           "%d", rc,
+                NULL
+            );
+            return (rc == MOSQ_ERR_NOMEM)? rc : MOSQ_ERR_OVERSIZE_PACKET;
+        }
+        payload = zpayload;
+        payloadlen = plen;
+        plain_props = json_deep_copy(store_props);
+        json_object_del(
+            plain_props, mqtt_property_identifier_to_string(MQTT_PROP_USER_PROPERTY)
+        );
+        store_props = plain_props;
+        streamed = FALSE;
+    }
+
+    /*
+     *  Compress the payload if negotiated, and the message has not its own user property
+     */
+    if(!streamed && priv->compress && priv->protocol_version == mosq_p_mqtt5 &&
+            payloadlen >= priv->compression_min_size &&
+            !(cmsg_props && property_get_property(cmsg_props, MQTT_PROP_USER_PROPERTY)) &&
+            !(store_props && property_get_property(store_props, MQTT_PROP_USER_PROPERTY))) {
+        uint32_t zlen;
+        zpayload = payload_deflate(gobj, payload, payloadlen, &zlen);
+        if(zpayload) {
+            payload = zpayload;
+            payloadlen = zlen;
+            encoding_prop = json_object();
+            mqtt_property_add_user(
+                gobj, encoding_prop, CONTENT_ENCODING_PROPERTY, priv->compression
+            );
+        }
+    }
+
+    if(topic) {
+        packetlen = 2 + (unsigned int)strlen(topic) + payloadlen;
+    } else {
+        packetlen = 2 + payloadlen;
+    }
+    if(qos > 0) {
+        packetlen += 2; /* For message id */
+    }
+    if(priv->protocol_version == mosq_p_mqtt5) {
+        proplen = 0;
+        proplen += property_get_length_all(cmsg_props);
+        proplen += property_get_length_all(store_props);
+        if(expiry_interval > 0) {
+            expiry_prop = json_object();
+
+            mqtt_property_add_int32(
+                gobj, expiry_prop, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, expiry_interval
+            );
+            // expiry_prop.client_generated = false;
+            proplen += property_get_length_all(expiry_prop);
+        }
+        proplen += property_get_length_all(encoding_prop);
+
+        varbytes = packet_varint_bytes(proplen);
+        if(varbytes > 4) {
+            /* FIXME - Properties too big, don't publish any - should remove some first really */
+            cmsg_props = NULL;
+            store_props = NULL;
+            expiry_interval = 0;
+        } else {
+            packetlen += proplen + varbytes;
+        }
+    }
+    if(packet_check_oversize(gobj, packetlen)) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+            "msg",          "%s", "Dropping too large outgoing PUBLISH",
+            "packetlen",    "%d", packetlen,
+            NULL
+        );
+        JSON_DECREF(expiry_prop);
+        JSON_DECREF(encoding_prop);
+        JSON_DECREF(plain_props);
+        GBMEM_FREE(zpayload);
+        return MOSQ_ERR_OVERSIZE_PACKET;
+    }
+
+    uint8_t command = (uint8_t)(CMD_PUBLISH | (uint8_t)((dup&0x1)<<3) | (uint8_t)(qos<<1) | retain);
+
+    GBUFFER *gbuf = build_mqtt_packet_head(
+        gobj, command, packetlen, streamed? packetlen - payloadlen : packetlen
+    );
+    if(!gbuf) {
+        // Error already logged
+        JSON_DECREF(expiry_prop);
+        JSON_DECREF(encoding_prop);
+        JSON_DECREF(plain_props);
+        GBMEM_FREE(zpayload);
+        return MOSQ_ERR_NOMEM;
+    }
+
+    /* Variable header (topic string) */
+    if(topic) {
+        mqtt_write_string(gbuf, topic);
+    } else {
+        mqtt_write_uint16(gbuf, 0);
+    }
+    if(qos > 0) {
+        mqtt_write_uint16(gbuf, mid);
+    }
+
+    if(priv->protocol_version == mosq_p_mqtt5) {
+        mqtt_write_varint(gbuf, proplen);
+        property_write_all(gobj, gbuf, cmsg_props, false);
+        property_write_all(gbuf, gbuf, store_props, false);
+        if(expiry_interval > 0) {
+            property_write_all(gobj, gbuf, expiry_prop, false);
+        }
+        property_write_all(gobj, gbuf, encoding_prop, false);
+    }
+    JSON_DECREF(expiry_prop);
+    JSON_DECREF(encoding_prop);
+    JSON_DECREF(plain_props);
+
+    if(streamed) {
+        return stream_start(gobj, gbuf, stored);
+    }
+
+    /* Payload */
+    if(payloadlen) {
+        mqtt_write_bytes(gbuf, payload, payloadlen);
+    }
+    GBMEM_FREE(zpayload);
+
+    return send_packet(gobj, gbuf);
+}
+
+/***************************************************************************
+ * Check that a topic used for publishing is valid.
+ * Search for + or # in a topic. Return MOSQ_ERR_INVAL if found.
+ * Also returns MOSQ_ERR_INVAL if the topic string is too long.
+ * Returns MOSQ_ERR_SUCCESS if everything is fine.
+ ***************************************************************************/
+PRIVATE int mosquitto_pub_topic_check(const char *str)
+{
+    int len = 0;
+    int hier_count = 0;
 
-    for(i=0; i<4; i++) {
-        if(gbuf_leftbytes(gbuf)>0) {
-            lbytes++;
-            byte = gbuf_getchar(gbuf);
-            lword += (byte & 127) * remaining_mult;
-            remaining_mult *= 128;
-            if((byte & 128) == 0) {
-                if(lbytes > 1 && byte == 0) {
-                    /* Catch overlong encodings */
-                    break;
-                } else {
-                    *word = lword;
-                    if(bytes) {
-                        (*bytes) = lbytes;
-                    }
-                    return 0;
-                }
+    if(str == NULL) {
+        return -1;
+    }
+
+    while(str && str[0]) {
+        if(str[0] == '+' || str[0] == '#') {
+            return MOSQ_ERR_INVAL;
+        } else if(str[0] == '/') {
+            hier_count++;
+        }
+        len++;
+        str = &str[1];
+    }
+    if(len > 65535) {
+        return -1;
+    }
+    if(hier_count > TOPIC_HIERARCHY_LIMIT) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/***************************************************************************
+ * Check that a topic used for subscriptions is valid.
+ * Search for + or # in a topic, check they aren't in invalid positions such as
+ * foo/#/bar, foo/+bar or foo/bar#.
+ * Return MOSQ_ERR_INVAL if invalid position found.
+ * Also returns MOSQ_ERR_INVAL if the topic string is too long.
+ * Returns MOSQ_ERR_SUCCESS if everything is fine.
+ ***************************************************************************/
+PRIVATE int mosquitto_sub_topic_check(const char *str)
+{
+    char c = '\0';
+    int len = 0;
+    int hier_count = 0;
+
+    if(str == NULL) {
+        return MOSQ_ERR_INVAL;
+    }
+
+    while(str[0]) {
+        if(str[0] == '+') {
+            if((c != '\0' && c != '/') || (str[1] != '\0' && str[1] != '/')) {
+                return MOSQ_ERR_INVAL;
             }
-        } else {
+        } else if(str[0] == '#') {
+            if((c != '\0' && c != '/')  || str[1] != '\0') {
+                return MOSQ_ERR_INVAL;
+            }
+        } else if(str[0] == '/') {
+            hier_count++;
+        }
+        len++;
+        c = str[0];
+        str = &str[1];
+    }
+    if(len > 65535) {
+        return MOSQ_ERR_INVAL;
+    }
+    if(hier_count > TOPIC_HIERARCHY_LIMIT) {
+        return MOSQ_ERR_INVAL;
+    }
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+/***************************************************************************
+ *  FNV-1a hash
+ ***************************************************************************/
+PRIVATE uint32_t str_hashn(const char *str, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    while(len-- > 0) {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE uint32_t str_hash(const char *str)
+{
+    return str_hashn(str, strlen(str));
+}
+
+/***************************************************************************
+ *  Rehash the interned strings in new_size buckets
+ ***************************************************************************/
+PRIVATE int intern_resize(uint32_t new_size)
+{
+    intern_str_t **intern = gbmem_malloc(new_size * sizeof(intern_str_t *));
+    if(!intern) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for intern table",
+            "size",         "%d", (int)new_size,
+            NULL
+        );
+        return -1;
+    }
+
+    for(uint32_t i=0; i<session_table.intern_size; i++) {
+        intern_str_t *is = session_table.intern[i];
+        while(is) {
+            intern_str_t *next = is->next;
+            intern_str_t **head = &intern[is->hash & (new_size-1)];
+            is->next = *head;
+            *head = is;
+            is = next;
+        }
+    }
+    GBMEM_FREE(session_table.intern);
+    session_table.intern = intern;
+    session_table.intern_size = new_size;
+    return 0;
+}
+
+/***************************************************************************
+ *  Return the interned copy of the string, with a new reference.
+ ***************************************************************************/
+PRIVATE const char *intern_stringn(const char *str, size_t len)
+{
+    uint32_t hash = str_hashn(str, len);
+    intern_str_t **head = &session_table.intern[hash & (session_table.intern_size-1)];
+
+    intern_str_t *is = *head;
+    while(is) {
+        if(is->hash == hash && strncmp(is->str, str, len)==0 && is->str[len]==0) {
+            is->refcount++;
+            return is->str;
+        }
+        is = is->next;
+    }
+
+    is = gbmem_malloc(sizeof(intern_str_t) + len + 1);
+    if(!is) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for interned string",
+            "len",          "%d", (int)len,
+            NULL
+        );
+        return 0;
+    }
+    is->hash = hash;
+    is->refcount = 1;
+    memcpy(is->str, str, len);
+    is->str[len] = 0;
+    is->next = *head;
+    *head = is;
+    session_table.interned++;
+
+    if(session_table.interned > session_table.intern_size) {
+        intern_resize(session_table.intern_size * 2); // on failure the chains grow
+    }
+
+    return is->str;
+}
+
+/***************************************************************************
+ *  Return the interned copy of the string, with a new reference.
+ ***************************************************************************/
+PRIVATE const char *intern_string(const char *str)
+{
+    return intern_stringn(str, strlen(str));
+}
+
+/***************************************************************************
+ *  Find an interned string, without adding a reference
+ ***************************************************************************/
+PRIVATE intern_str_t *intern_find(const char *str)
+{
+    if(!session_table.intern) {
+        return 0;
+    }
+    uint32_t hash = str_hash(str);
+    intern_str_t *is = session_table.intern[hash & (session_table.intern_size-1)];
+    while(is) {
+        if(is->hash == hash && strcmp(is->str, str)==0) {
+            return is;
+        }
+        is = is->next;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Return a new reference of an interned string
+ ***************************************************************************/
+PRIVATE const char *intern_incref(const char *str)
+{
+    if(str) {
+        intern_str_t *is = (intern_str_t *)(str - offsetof(intern_str_t, str));
+        is->refcount++;
+    }
+    return str;
+}
+
+/***************************************************************************
+ *  Get a zeroed item of the pool
+ ***************************************************************************/
+PRIVATE void *pool_alloc(mem_pool_t *pool)
+{
+    if(!pool->free_list) {
+        char *slab = gbmem_malloc(POOL_SLAB_ITEMS * pool->item_size);
+        void **slabs = gbmem_realloc(pool->slabs, (pool->nslabs + 1) * sizeof(void *));
+        if(!slab || !slabs) {
+            log_error(0,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "no memory for pool slab",
+                "pool",         "%s", pool->name,
+                NULL
+            );
+            GBMEM_FREE(slab);
+            if(slabs) {
+                pool->slabs = slabs;
+            }
+            return 0;
+        }
+        pool->slabs = slabs;
+        pool->slabs[pool->nslabs++] = slab;
+        for(int i=POOL_SLAB_ITEMS-1; i>=0; i--) {
+            void **item = (void **)(slab + i * pool->item_size);
+            *item = pool->free_list;
+            pool->free_list = item;
+        }
+    }
+
+    void **item = pool->free_list;
+    pool->free_list = *item;
+    memset(item, 0, pool->item_size);
+
+    pool->in_use++;
+    if(pool->in_use > pool->peak) {
+        pool->peak = pool->in_use;
+    }
+    return item;
+}
+
+/***************************************************************************
+ *  Return an item to the pool
+ ***************************************************************************/
+PRIVATE void pool_free(mem_pool_t *pool, void *item_)
+{
+    void **item = item_;
+    if(!item) {
+        return;
+    }
+    *item = pool->free_list;
+    pool->free_list = item;
+    pool->in_use--;
+}
+
+/***************************************************************************
+ *  Free the slabs of the pool
+ ***************************************************************************/
+PRIVATE void pool_destroy(mem_pool_t *pool)
+{
+    for(size_t i=0; i<pool->nslabs; i++) {
+        GBMEM_FREE(pool->slabs[i]);
+    }
+    GBMEM_FREE(pool->slabs);
+    pool->nslabs = 0;
+    pool->free_list = 0;
+    pool->in_use = 0;
+    pool->peak = 0;
+}
+
+/***************************************************************************
+ *  Occupancy of the pool
+ ***************************************************************************/
+PRIVATE json_t *pool_stats(mem_pool_t *pool)
+{
+    return json_pack("{s:s, s:I, s:I, s:I, s:I, s:I}",
+        "name", pool->name,
+        "item_size", (json_int_t)pool->item_size,
+        "slabs", (json_int_t)pool->nslabs,
+        "capacity", (json_int_t)(pool->nslabs * POOL_SLAB_ITEMS),
+        "in_use", (json_int_t)pool->in_use,
+        "peak", (json_int_t)pool->peak
+    );
+}
+
+/***************************************************************************
+ *  Release a reference of an interned string
+ ***************************************************************************/
+PRIVATE void intern_release(const char *str)
+{
+    if(!str) {
+        return;
+    }
+    intern_str_t *is = (intern_str_t *)(str - offsetof(intern_str_t, str));
+    if(--is->refcount > 0) {
+        return;
+    }
+
+    intern_str_t **pp = &session_table.intern[is->hash & (session_table.intern_size-1)];
+    while(*pp) {
+        if(*pp == is) {
+            *pp = is->next;
             break;
         }
+        pp = &(*pp)->next;
     }
+    session_table.interned--;
+    GBMEM_FREE(is);
 
-    log_error(LOG_OPT_TRACE_STACK,
-        "gobj",         "%s", gobj_full_name(gobj),
-        "function",     "%s", __FUNCTION__,
-        "msgset",       "%s", MSGSET_MQTT_ERROR,
-        "msg",          "%s", "Mqtt malformed packet, not enough data",
-        NULL
-    );
-    //log_debug_full_gbuf(0, gbuf, "Mqtt malformed packet, not enough data");
-    return MOSQ_ERR_MALFORMED_PACKET;
+    if(session_table.intern_size > INTERN_TABLE_MIN_SIZE &&
+            session_table.interned < session_table.intern_size/8) {
+        intern_resize(session_table.intern_size / 2);
+    }
 }
 
 /***************************************************************************
- *
+ *  Create the session table with the first Mqtt gobj
  ***************************************************************************/
-PRIVATE int mosquitto_property_check_command(hgobj gobj, int command, int identifier)
+PRIVATE int session_table_ref(void)
 {
-    switch(identifier) {
-        case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
-        case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
-        case MQTT_PROP_CONTENT_TYPE:
-        case MQTT_PROP_RESPONSE_TOPIC:
-        case MQTT_PROP_CORRELATION_DATA:
-            if(command != CMD_PUBLISH && command != CMD_WILL) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt invalid property of command",
-                    "command",      "%d", get_command_name(command),
-                    "identifier",   "%d", identifier,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
-            break;
+    if(session_table.refs++ > 0) {
+        return 0;
+    }
 
-        case MQTT_PROP_SUBSCRIPTION_IDENTIFIER:
-            if(command != CMD_PUBLISH && command != CMD_SUBSCRIBE) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt invalid property of command",
-                    "command",      "%d", get_command_name(command),
-                    "identifier",   "%d", identifier,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
-            break;
+    session_table.intern_size = INTERN_TABLE_MIN_SIZE;
+    session_table.intern = gbmem_malloc(session_table.intern_size * sizeof(intern_str_t *));
+    session_table.index_size = SESSION_INDEX_MIN_SIZE;
+    session_table.index = gbmem_malloc(session_table.index_size * sizeof(mqtt_session_t *));
+    if(!session_table.intern || !session_table.index) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for session table",
+            NULL
+        );
+        return -1;
+    }
+    return 0;
+}
 
-        case MQTT_PROP_SESSION_EXPIRY_INTERVAL:
-            if(command != CMD_CONNECT && command != CMD_CONNACK && command != CMD_DISCONNECT) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt invalid property of command",
-                    "command",      "%d", get_command_name(command),
-                    "identifier",   "%d", identifier,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
-            break;
+/***************************************************************************
+ *  Destroy the session table with the last Mqtt gobj
+ ***************************************************************************/
+PRIVATE void session_table_unref(void)
+{
+    if(--session_table.refs > 0) {
+        return;
+    }
 
-        case MQTT_PROP_AUTHENTICATION_METHOD:
-        case MQTT_PROP_AUTHENTICATION_DATA:
-            if(command != CMD_CONNECT && command != CMD_CONNACK && command != CMD_AUTH) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt invalid property of command",
-                    "command",      "%d", get_command_name(command),
-                    "identifier",   "%d", identifier,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
-            break;
+    snapshot_close();
 
-        case MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER:
-        case MQTT_PROP_SERVER_KEEP_ALIVE:
-        case MQTT_PROP_RESPONSE_INFORMATION:
-        case MQTT_PROP_MAXIMUM_QOS:
-        case MQTT_PROP_RETAIN_AVAILABLE:
-        case MQTT_PROP_WILDCARD_SUB_AVAILABLE:
-        case MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE:
-        case MQTT_PROP_SHARED_SUB_AVAILABLE:
-            if(command != CMD_CONNACK) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt invalid property of command",
-                    "command",      "%d", get_command_name(command),
-                    "identifier",   "%d", identifier,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
+    for(size_t i=0; i<session_table.nslabs; i++) {
+        mqtt_session_t *slab = session_table.slabs[i];
+        for(int j=0; j<SESSION_SLAB_SIZE; j++) {
+            mqtt_session_t *session = &slab[j];
+            if(session->client_id) {
+                session_clean_subscriptions(session);
+                dl_flush(&session->dl_msgs_offline, db_free_client_msg);
+                intern_release(session->client_id);
             }
-            break;
+        }
+        GBMEM_FREE(slab);
+    }
+    GBMEM_FREE(session_table.slabs);
+    GBMEM_FREE(session_table.index);
+    GBMEM_FREE(session_table.intern);
 
-        case MQTT_PROP_WILL_DELAY_INTERVAL:
-            if(command != CMD_WILL) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt invalid property of command",
-                    "command",      "%d", get_command_name(command),
-                    "identifier",   "%d", identifier,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
-            break;
+    memset(&session_table, 0, sizeof(session_table));
 
-        case MQTT_PROP_REQUEST_PROBLEM_INFORMATION:
-        case MQTT_PROP_REQUEST_RESPONSE_INFORMATION:
-            if(command != CMD_CONNECT) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt invalid property of command",
-                    "command",      "%d", get_command_name(command),
-                    "identifier",   "%d", identifier,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
-            break;
+    JSON_DECREF(sys_stats.retained)
+    memset(&sys_stats, 0, sizeof(sys_stats));
 
-        case MQTT_PROP_SERVER_REFERENCE:
-            if(command != CMD_CONNACK && command != CMD_DISCONNECT) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt invalid property of command",
-                    "command",      "%d", get_command_name(command),
-                    "identifier",   "%d", identifier,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
-            break;
+    pool_destroy(&pool_msg_store);
+    pool_destroy(&pool_client_msg);
+    acl_free();
+}
 
-        case MQTT_PROP_REASON_STRING:
-            if(command == CMD_CONNECT || command == CMD_PUBLISH ||
-                command == CMD_SUBSCRIBE || command == CMD_UNSUBSCRIBE) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt invalid property of command",
-                    "command",      "%d", get_command_name(command),
-                    "identifier",   "%d", identifier,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
-            break;
+/***************************************************************************
+ *  Rebuild the index without tombstones
+ ***************************************************************************/
+PRIVATE int session_index_resize(uint32_t new_size)
+{
+    mqtt_session_t **index = gbmem_malloc(new_size * sizeof(mqtt_session_t *));
+    if(!index) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for session index",
+            "size",         "%d", (int)new_size,
+            NULL
+        );
+        return -1;
+    }
 
-        case MQTT_PROP_RECEIVE_MAXIMUM:
-        case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
-        case MQTT_PROP_MAXIMUM_PACKET_SIZE:
-            if(command != CMD_CONNECT && command != CMD_CONNACK) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt invalid property of command",
-                    "command",      "%d", get_command_name(command),
-                    "identifier",   "%d", identifier,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
-            break;
+    uint32_t mask = new_size - 1;
+    for(uint32_t j=0; j<session_table.index_size; j++) {
+        mqtt_session_t *session = session_table.index[j];
+        if(!session || session == SESSION_TOMBSTONE) {
+            continue;
+        }
+        uint32_t i = session->hash & mask;
+        while(index[i]) {
+            i = (i + 1) & mask;
+        }
+        index[i] = session;
+    }
 
-        case MQTT_PROP_TOPIC_ALIAS:
-            if(command != CMD_PUBLISH) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt invalid property of command",
-                    "command",      "%d", get_command_name(command),
-                    "identifier",   "%d", identifier,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
-            break;
+    GBMEM_FREE(session_table.index);
+    session_table.index = index;
+    session_table.index_size = new_size;
+    session_table.index_used = session_table.sessions;
+    return 0;
+}
 
-        case MQTT_PROP_USER_PROPERTY:
-            break;
+/***************************************************************************
+ *  Find the session of a client
+ ***************************************************************************/
+PRIVATE mqtt_session_t *session_find(const char *client_id)
+{
+    if(!session_table.index || empty_string(client_id)) {
+        return 0;
+    }
 
-        default:
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_MQTT_ERROR,
-                "msg",          "%s", "Mqtt unknown property of command",
-                "command",      "%d", get_command_name(command),
-                "identifier",   "%d", identifier,
-                NULL
-            );
-            return MOSQ_ERR_PROTOCOL;
+    uint32_t hash = str_hash(client_id);
+    uint32_t mask = session_table.index_size - 1;
+    uint32_t i = hash & mask;
+    mqtt_session_t *session;
+    while((session = session_table.index[i])) {
+        if(session != SESSION_TOMBSTONE &&
+                session->hash == hash &&
+                strcmp(session->client_id, client_id)==0) {
+            return session;
+        }
+        i = (i + 1) & mask;
     }
     return 0;
 }
 
 /***************************************************************************
- *
+ *  Create a session, it must not exist
  ***************************************************************************/
-PRIVATE int property_read(hgobj gobj, GBUFFER *gbuf, uint32_t *len, json_t *all_properties)
+PRIVATE mqtt_session_t *session_create(const char *client_id)
 {
-    uint8_t byte;
-    uint8_t byte_count;
-    uint16_t uint16;
-    uint32_t uint32;
-    uint32_t varint;
-    char *str1, *str2;
-    uint16_t slen1, slen2;
+    if(!session_table.index || empty_string(client_id)) {
+        return 0;
+    }
 
-    uint32_t property_identifier;
-    if(mqtt_read_varint(gobj, gbuf, &property_identifier, NULL)<0) {
-        // Error already logged
-        return MOSQ_ERR_MALFORMED_PACKET;
+    /*
+     *  Keep the load factor of the index under 75%
+     */
+    if((session_table.index_used + 1) * 4 > session_table.index_size * 3) {
+        uint32_t new_size = session_table.index_size;
+        if((session_table.sessions + 1) * 2 > new_size) {
+            new_size *= 2;
+        }
+        if(session_index_resize(new_size)<0) {
+            // Error already logged
+            return 0;
+        }
     }
-    const char *property_name = mqtt_property_identifier_to_string(property_identifier);
 
-    /* Check for duplicates (only if not MQTT_PROP_USER_PROPERTY, why?)*/
-    if(property_identifier != MQTT_PROP_USER_PROPERTY) {
-        if(kw_has_key(all_properties, property_name)) {
-            log_warning(0,
-                "gobj",         "%s", gobj_full_name(gobj),
+    /*
+     *  Get a free session from the slabs
+     */
+    if(!session_table.free_list) {
+        mqtt_session_t *slab = gbmem_malloc(SESSION_SLAB_SIZE * sizeof(mqtt_session_t));
+        mqtt_session_t **slabs = gbmem_malloc((session_table.nslabs + 1) * sizeof(mqtt_session_t *));
+        if(!slab || !slabs) {
+            log_error(0,
+                "gobj",         "%s", __FILE__,
                 "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_MQTT_ERROR,
-                "msg",          "%s", "Mqtt duplicate property",
-                "property_type","%d", (int)property_identifier,
-                "property_name","%s", property_name,
-                "mqtt_error",   "%d", MOSQ_ERR_DUPLICATE_PROPERTY,
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "no memory for session slab",
                 NULL
             );
-            return MOSQ_ERR_DUPLICATE_PROPERTY;
+            GBMEM_FREE(slab);
+            GBMEM_FREE(slabs);
+            return 0;
         }
-    }
+        if(session_table.nslabs) {
+            memcpy(slabs, session_table.slabs, session_table.nslabs * sizeof(mqtt_session_t *));
+        }
+        GBMEM_FREE(session_table.slabs);
+        session_table.slabs = slabs;
+        session_table.slabs[session_table.nslabs++] = slab;
 
-    json_t *property = json_object();
-    json_object_set_new(property, "identifier", json_integer(property_identifier));
-    json_object_set_new(
-        property,
-        "name",
-        json_string(property_name)
-    );
-    int identifier_, type_;
-    mosquitto_string_to_property_info(property_name, &identifier_, &type_);
-    json_object_set_new(
-        property,
-        "type",
-        json_integer(type_)
-    );
+        for(int j=SESSION_SLAB_SIZE-1; j>=0; j--) {
+            slab[j].client_id = 0;
+            slab[j].next_free = session_table.free_list;
+            session_table.free_list = &slab[j];
+        }
+    }
 
-    *len -= 1;
+    const char *id = intern_string(client_id);
+    if(!id) {
+        // Error already logged
+        return 0;
+    }
 
-    switch(property_identifier) {
-        case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
-        case MQTT_PROP_REQUEST_PROBLEM_INFORMATION:
-        case MQTT_PROP_REQUEST_RESPONSE_INFORMATION:
-        case MQTT_PROP_MAXIMUM_QOS:
-        case MQTT_PROP_RETAIN_AVAILABLE:
-        case MQTT_PROP_WILDCARD_SUB_AVAILABLE:
-        case MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE:
-        case MQTT_PROP_SHARED_SUB_AVAILABLE:
-            if(mqtt_read_byte(gobj, gbuf, &byte)<0) {
-                // Error already logged
-                JSON_DECREF(property);
-                return MOSQ_ERR_MALFORMED_PACKET;
-            }
-            *len -= 1; /* byte */
-            json_object_set_new(property, "value", json_integer(byte));
-            break;
+    mqtt_session_t *session = session_table.free_list;
+    session_table.free_list = session->next_free;
+    memset(session, 0, sizeof(mqtt_session_t));
+    session->client_id = id;
+    session->hash = str_hash(client_id);
+    dl_init(&session->dl_subscriptions);
+    dl_init(&session->dl_msgs_offline);
 
-        case MQTT_PROP_SERVER_KEEP_ALIVE:
-        case MQTT_PROP_RECEIVE_MAXIMUM:
-        case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
-        case MQTT_PROP_TOPIC_ALIAS:
-            if(mqtt_read_uint16(gobj, gbuf, &uint16)<0) {
-                // Error already logged
-                JSON_DECREF(property);
-                return MOSQ_ERR_MALFORMED_PACKET;
-            }
-            *len -= 2; /* uint16 */
-            json_object_set_new(property, "value", json_integer(uint16));
-            break;
+    uint32_t mask = session_table.index_size - 1;
+    uint32_t i = session->hash & mask;
+    while(session_table.index[i] && session_table.index[i] != SESSION_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if(!session_table.index[i]) {
+        session_table.index_used++;
+    }
+    session_table.index[i] = session;
+    session_table.sessions++;
 
-        case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
-        case MQTT_PROP_SESSION_EXPIRY_INTERVAL:
-        case MQTT_PROP_WILL_DELAY_INTERVAL:
-        case MQTT_PROP_MAXIMUM_PACKET_SIZE:
-            if(mqtt_read_uint32(gobj, gbuf, &uint32)<0) {
-                // Error already logged
-                JSON_DECREF(property);
-                return MOSQ_ERR_MALFORMED_PACKET;
-            }
-            *len -= 4; /* uint32 */
-            json_object_set_new(property, "value", json_integer(uint32));
-            break;
+    return session;
+}
 
-        case MQTT_PROP_SUBSCRIPTION_IDENTIFIER:
-            if(mqtt_read_varint(gobj, gbuf, &varint, &byte_count)<0) {
-                // Error already logged
-                JSON_DECREF(property);
-                return MOSQ_ERR_MALFORMED_PACKET;
-            }
-            *len -= byte_count;
-            json_object_set_new(property, "value", json_integer(varint));
-            break;
+/***************************************************************************
+ *  Delete a session
+ ***************************************************************************/
+PRIVATE void session_delete(mqtt_session_t *session)
+{
+    snapshot_log_session(session, SNAPSHOT_OP_DEL);
 
-        case MQTT_PROP_CONTENT_TYPE:
-        case MQTT_PROP_RESPONSE_TOPIC:
-        case MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER:
-        case MQTT_PROP_AUTHENTICATION_METHOD:
-        case MQTT_PROP_RESPONSE_INFORMATION:
-        case MQTT_PROP_SERVER_REFERENCE:
-        case MQTT_PROP_REASON_STRING:
-            if(mqtt_read_string(gobj, gbuf, &str1, &slen1)<0) {
-                // Error already logged
-                JSON_DECREF(property);
-                return MOSQ_ERR_MALFORMED_PACKET;
-            }
-            *len = (*len) - 2 - slen1; /* uint16, string len */
-            json_object_set_new(property, "value", json_sprintf("%*.*s", slen1, slen1, str1));
-            json_object_set_new(property, "value_length", json_integer(slen1));
+    uint32_t mask = session_table.index_size - 1;
+    uint32_t i = session->hash & mask;
+    while(session_table.index[i]) {
+        if(session_table.index[i] == session) {
+            session_table.index[i] = SESSION_TOMBSTONE;
             break;
+        }
+        i = (i + 1) & mask;
+    }
 
-        case MQTT_PROP_AUTHENTICATION_DATA:
-        case MQTT_PROP_CORRELATION_DATA:
-            if(mqtt_read_binary(gobj, gbuf, (uint8_t **)&str1, &slen1)<0) {
-                // Error already logged
-                JSON_DECREF(property);
-                return MOSQ_ERR_MALFORMED_PACKET;
-            }
-            *len = (*len) - 2 - slen1; /* uint16, binary len */
-
-            // Save binary data in base64
-            GBUFFER *gbuf_b64 = gbuf_string2base64(str1, slen1);
-            json_object_set_new(property, "value", json_string(gbuf_cur_rd_pointer(gbuf_b64)));
-            json_object_set_new(property, "value_length", json_integer(slen1));
-            GBUF_DECREF(gbuf_b64);
-            break;
+    session_clean_subscriptions(session);
+    dl_flush(&session->dl_msgs_offline, db_free_client_msg);
+    intern_release(session->client_id);
+    session->client_id = 0;
+    session->next_free = session_table.free_list;
+    session_table.free_list = session;
+    session_table.sessions--;
+}
 
-        case MQTT_PROP_USER_PROPERTY:
-            if(mqtt_read_string(gobj, gbuf, &str1, &slen1)<0) {
-                // Error already logged
-                JSON_DECREF(property);
-                return MOSQ_ERR_MALFORMED_PACKET;
-            }
-            *len = (*len) - 2 - slen1; /* uint16, string len */
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void db_free_subscription(void *subscription_)
+{
+    mqtt_subscription_t *subscription = subscription_;
 
-            if(mqtt_read_string(gobj, gbuf, &str2, &slen2)<0) {
-                // Error already logged
-                JSON_DECREF(property);
-                return MOSQ_ERR_MALFORMED_PACKET;
-            }
+    /*
+     *  Out of the topic index
+     */
+    intern_str_t *is = (intern_str_t *)(subscription->filter - offsetof(intern_str_t, str));
+    if(subscription->prev_subscriber) {
+        subscription->prev_subscriber->next_subscriber = subscription->next_subscriber;
+    } else {
+        is->subscribers = subscription->next_subscriber;
+    }
+    if(subscription->next_subscriber) {
+        subscription->next_subscriber->prev_subscriber = subscription->prev_subscriber;
+    }
 
-            *len = (*len) - 2 - slen2; /* uint16, string len */
+    /*
+     *  Out of the $SYS subscriptions
+     */
+    if(subscription->prev_sys) {
+        subscription->prev_sys->next_sys = subscription->next_sys;
+    } else if(sys_stats.subscriptions == subscription) {
+        sys_stats.subscriptions = subscription->next_sys;
+    }
+    if(subscription->next_sys) {
+        subscription->next_sys->prev_sys = subscription->prev_sys;
+    }
 
-            json_object_set_new(property, "name", json_sprintf("%*.*s", slen1, slen1, str1));
-            json_object_set_new(property, "name_length", json_integer(slen1));
+    intern_release(subscription->filter);
+    GBMEM_FREE(subscription);
+}
 
-            json_object_set_new(property, "value", json_sprintf("%*.*s", slen2, slen2, str2));
-            json_object_set_new(property, "value_length", json_integer(slen2));
-            break;
+/***************************************************************************
+ *  Remove all subscriptions of a session
+ ***************************************************************************/
+PRIVATE void session_clean_subscriptions(mqtt_session_t *session)
+{
+    dl_flush(&session->dl_subscriptions, db_free_subscription);
+}
 
-        default:
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_MQTT_ERROR,
-                "msg",          "%s", "Mqtt Unsupported property type",
-                "property_type","%d", (int)property_identifier,
-                NULL
-            );
-            JSON_DECREF(property);
-            return MOSQ_ERR_MALFORMED_PACKET;
+/***************************************************************************
+ *  Find a subscription of a session
+ ***************************************************************************/
+PRIVATE mqtt_subscription_t *session_find_subscription(
+    mqtt_session_t *session,
+    const char *filter
+)
+{
+    mqtt_subscription_t *subscription = dl_first(&session->dl_subscriptions);
+    while(subscription) {
+        if(strcmp(subscription->filter, filter)==0) {
+            return subscription;
+        }
+        subscription = dl_next(subscription);
     }
-
-    json_object_set_new(all_properties, property_name, property);
     return 0;
 }
 
 /***************************************************************************
- *
+ *  Add a new subscription to a session
  ***************************************************************************/
-PRIVATE int mqtt_property_check_all(hgobj gobj, int command, json_t *all_properties)
+PRIVATE mqtt_subscription_t *session_add_subscription(
+    mqtt_session_t *session,
+    const char *filter
+)
 {
-    int ret = 0;
-    const char *property_name; json_t *property;
-    json_object_foreach(all_properties, property_name, property) {
-        /* Validity checks */
-        int identifier = kw_get_int(property, "identifier", 0, KW_REQUIRED);
-        if(identifier == MQTT_PROP_REQUEST_PROBLEM_INFORMATION
-                || identifier == MQTT_PROP_PAYLOAD_FORMAT_INDICATOR
-                || identifier == MQTT_PROP_REQUEST_RESPONSE_INFORMATION
-                || identifier == MQTT_PROP_MAXIMUM_QOS
-                || identifier == MQTT_PROP_RETAIN_AVAILABLE
-                || identifier == MQTT_PROP_WILDCARD_SUB_AVAILABLE
-                || identifier == MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE
-                || identifier == MQTT_PROP_SHARED_SUB_AVAILABLE) {
-
-            int value = kw_get_int(property, "value", 0, KW_REQUIRED);
-            if(value > 1) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt check property failed 1",
-                    "property",     "%j", property,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
-        } else if(identifier == MQTT_PROP_MAXIMUM_PACKET_SIZE) {
-            int value = kw_get_int(property, "value", 0, KW_REQUIRED);
-            if(value == 0) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt check property failed 2",
-                    "property",     "%j", property,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
-        } else if(identifier == MQTT_PROP_RECEIVE_MAXIMUM
-                || identifier == MQTT_PROP_TOPIC_ALIAS) {
+    mqtt_subscription_t *subscription = gbmem_malloc(sizeof(mqtt_subscription_t));
+    if(!subscription) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for subscription",
+            NULL
+        );
+        return 0;
+    }
+    subscription->filter = intern_string(filter);
+    if(!subscription->filter) {
+        // Error already logged
+        GBMEM_FREE(subscription);
+        return 0;
+    }
+    subscription->session = session;
 
-            int value = kw_get_int(property, "value", 0, KW_REQUIRED);
-            if(value == 0) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt check property failed 3",
-                    "property",     "%j", property,
-                    NULL
-                );
-                return MOSQ_ERR_PROTOCOL;
-            }
+    /*
+     *  Into the topic index
+     */
+    intern_str_t *is = (intern_str_t *)(subscription->filter - offsetof(intern_str_t, str));
+    subscription->next_subscriber = is->subscribers;
+    if(is->subscribers) {
+        is->subscribers->prev_subscriber = subscription;
+    }
+    is->subscribers = subscription;
+
+    /*
+     *  Into the $SYS subscriptions, the wildcards of the first level don't match $ topics
+     */
+    if(strncmp(subscription->filter, "$SYS/", strlen("$SYS/"))==0) {
+        subscription->next_sys = sys_stats.subscriptions;
+        if(sys_stats.subscriptions) {
+            sys_stats.subscriptions->prev_sys = subscription;
         }
+        sys_stats.subscriptions = subscription;
+    }
 
-        /* Check for properties on incorrect commands */
-        if((ret=mosquitto_property_check_command(gobj, command, identifier))<0) {
+    dl_add(&session->dl_subscriptions, subscription);
+    return subscription;
+}
+
+/***************************************************************************
+ *  Load the session from the persistent json client
+ ***************************************************************************/
+PRIVATE int session_load_json(mqtt_session_t *session, json_t *client)
+{
+    session->last_mid = (uint16_t)kw_get_int(client, "last_mid", 0, 0);
+    session->assigned_id = kw_get_bool(client, "assigned_id", 0, 0);
+
+    json_t *jn_subscriptions = kw_get_dict(client, "subscriptions", 0, 0);
+    const char *filter; json_t *jn_subscription;
+    json_object_foreach(jn_subscriptions, filter, jn_subscription) {
+        mqtt_subscription_t *subscription = session_add_subscription(session, filter);
+        if(!subscription) {
             // Error already logged
-            return ret;
+            return -1;
         }
+        subscription->qos = (uint8_t)kw_get_int(jn_subscription, "qos", 0, 0);
+        subscription->identifier = kw_get_int(jn_subscription, "identifier", 0, 0);
+        subscription->no_local = kw_get_bool(jn_subscription, "no_local", 0, 0);
+        subscription->retain_as_published = kw_get_bool(
+            jn_subscription, "retain_as_published", 0, 0
+        );
     }
-
     return 0;
 }
 
 /***************************************************************************
- *
+ *  Materialize the session in the json client, to persist or to list it
  ***************************************************************************/
-PRIVATE json_t *property_read_all(hgobj gobj, GBUFFER *gbuf, int command, int *error)
+PRIVATE int session_to_json(mqtt_session_t *session, json_t *client)
 {
-    uint32_t proplen;
-    int ret;
-    if(error) {
-        *error = 0;
-    }
+    kw_set_dict_value(client, "last_mid", json_integer(session->last_mid));
+    kw_set_dict_value(client, "isConnected", session->gobj? json_true(): json_false());
+    kw_set_dict_value(
+        client, "_gobj", json_integer((json_int_t)(size_t)session->gobj)
+    );
+    kw_set_dict_value(
+        client, "_gobj_bottom", json_integer((json_int_t)(size_t)session->gobj_bottom)
+    );
 
-    if(mqtt_read_varint(gobj, gbuf, &proplen, NULL)<0) {
-        // Error already logged
-        return 0;
+    json_t *jn_subscriptions = json_object();
+    mqtt_subscription_t *subscription = dl_first(&session->dl_subscriptions);
+    while(subscription) {
+        json_t *jn_subscription = json_pack("{s:s, s:i, s:I, s:b, s:b}",
+            "id", subscription->filter,
+            "qos", (int)subscription->qos,
+            "identifier", (json_int_t)subscription->identifier,
+            "no_local", subscription->no_local,
+            "retain_as_published", subscription->retain_as_published
+        );
+        json_object_set_new(jn_subscriptions, subscription->filter, jn_subscription);
+        subscription = dl_next(subscription);
     }
+    kw_set_dict_value(client, "subscriptions", jn_subscriptions);
 
-    json_t *all_properties = json_object();
+    return 0;
+}
 
-    while(proplen > 0) {
-        if((ret=property_read(gobj, gbuf, &proplen, all_properties))<0) {
-            // Error already logged
-            JSON_DECREF(all_properties);
-            if(error) {
-                *error = ret;
+/***************************************************************************
+ *  crc32 (IEEE) of the snapshot and of the write-ahead log records
+ ***************************************************************************/
+PRIVATE uint32_t snapshot_crc32(uint32_t crc, const void *data, size_t len)
+{
+    static uint32_t table[256];
+    if(!table[1]) {
+        for(uint32_t i=0; i<256; i++) {
+            uint32_t c = i;
+            for(int k=0; k<8; k++) {
+                c = (c & 1)? 0xEDB88320 ^ (c >> 1) : c >> 1;
             }
-            return 0;
+            table[i] = c;
         }
     }
 
-    if((ret=mqtt_property_check_all(gobj, command, all_properties))<0) {
-        // Error already logged
-        JSON_DECREF(all_properties);
-        if(error) {
-            *error = ret;
+    const uint8_t *p = data;
+    crc = ~crc;
+    while(len--) {
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/***************************************************************************
+ *  Write all the buffer
+ ***************************************************************************/
+PRIVATE int snapshot_write_fd(int fd, const void *bf, size_t len)
+{
+    const char *p = bf;
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            log_error(0,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+                "msg",          "%s", "write() FAILED",
+                "errno",        "%d", errno,
+                "serrno",       "%s", strerror(errno),
+                NULL
+            );
+            return -1;
         }
-        return 0;
+        p += n;
+        len -= (size_t)n;
     }
+    return 0;
+}
 
-    if(gobj_trace_level(gobj) & SHOW_DECODE) {
-        log_debug_json(0, all_properties, "all_properties, command %s", get_command_name(command));
+/***************************************************************************
+ *  Encode a message of an offline queue in p, if not NULL.
+ *  Return its length.
+ ***************************************************************************/
+PRIVATE size_t snapshot_encode_message(char *p, struct mosquitto_client_msg *msg)
+{
+    struct mosquitto_msg_store *stored = msg->store;
+    char *props = stored->properties? json2uglystr(stored->properties) : 0;
+    char *msg_props = msg->properties? json2uglystr(msg->properties) : 0;
+
+    snapshot_message_t m;
+    memset(&m, 0, sizeof(m));
+    m.expiry_time = (int64_t)stored->message_expiry_time;
+    m.payload_len = (uint32_t)stored->payloadlen;
+    m.props_len = props? (uint32_t)strlen(props) : 0;
+    m.msg_props_len = msg_props? (uint32_t)strlen(msg_props) : 0;
+    m.mid = msg->mid;
+    m.topic_len = (uint16_t)strlen(stored->topic);
+    m.qos = msg->qos;
+    m.flags = msg->retain? SNAPSHOT_MSG_RETAIN : 0;
+
+    size_t size = sizeof(m) + m.topic_len + m.props_len + m.msg_props_len + m.payload_len;
+    if(p) {
+        memcpy(p, &m, sizeof(m));
+        p += sizeof(m);
+        memcpy(p, stored->topic, m.topic_len);
+        p += m.topic_len;
+        if(m.props_len) {
+            memcpy(p, props, m.props_len);
+            p += m.props_len;
+        }
+        if(m.msg_props_len) {
+            memcpy(p, msg_props, m.msg_props_len);
+            p += m.msg_props_len;
+        }
+        if(m.payload_len) {
+            memcpy(p, stored->payload, m.payload_len);
+        }
+    }
+    GBMEM_FREE(props);
+    GBMEM_FREE(msg_props);
+    return size;
+}
+
+/***************************************************************************
+ *  Encode a record of the session, with room for a trailing crc.
+ *  With SNAPSHOT_OP_MESSAGE the record has only the message `msg`.
+ *  Return the buffer (free with GBMEM_FREE) and its length in `len`.
+ ***************************************************************************/
+PRIVATE char *snapshot_encode(
+    mqtt_session_t *session,
+    uint8_t op,
+    struct mosquitto_client_msg *msg,
+    size_t *len
+)
+{
+    snapshot_session_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.op = op;
+    rec.last_mid = session->last_mid;
+    rec.id_len = (uint16_t)strlen(session->client_id);
+
+    size_t size = sizeof(rec) + rec.id_len;
+    uint32_t messages = 0;
+    if(op == SNAPSHOT_OP_SESSION) {
+        mqtt_subscription_t *subscription = dl_first(&session->dl_subscriptions);
+        while(subscription) {
+            size += sizeof(snapshot_subscription_t) + strlen(subscription->filter);
+            rec.subscriptions++;
+            subscription = dl_next(subscription);
+        }
+        size += sizeof(messages);
+        struct mosquitto_client_msg *m = dl_first(&session->dl_msgs_offline);
+        while(m) {
+            size += snapshot_encode_message(0, m);
+            messages++;
+            m = dl_next(m);
+        }
+    } else if(op == SNAPSHOT_OP_MESSAGE) {
+        size += snapshot_encode_message(0, msg);
+    }
+
+    char *bf = gbmem_malloc(size + sizeof(uint32_t));
+    if(!bf) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for snapshot record",
+            "size",         "%lu", (unsigned long)size,
+            NULL
+        );
+        return 0;
     }
 
-    return all_properties;
+    char *p = bf;
+    memcpy(p, &rec, sizeof(rec));
+    p += sizeof(rec);
+    memcpy(p, session->client_id, rec.id_len);
+    p += rec.id_len;
+
+    if(op == SNAPSHOT_OP_SESSION) {
+        mqtt_subscription_t *subscription = dl_first(&session->dl_subscriptions);
+        while(subscription) {
+            snapshot_subscription_t sub;
+            sub.identifier = (uint32_t)subscription->identifier;
+            sub.filter_len = (uint16_t)strlen(subscription->filter);
+            sub.qos = subscription->qos;
+            sub.flags = (uint8_t)((subscription->no_local? SNAPSHOT_NO_LOCAL : 0) |
+                (subscription->retain_as_published? SNAPSHOT_RETAIN_AS_PUBLISHED : 0));
+            memcpy(p, &sub, sizeof(sub));
+            p += sizeof(sub);
+            memcpy(p, subscription->filter, sub.filter_len);
+            p += sub.filter_len;
+            subscription = dl_next(subscription);
+        }
+        memcpy(p, &messages, sizeof(messages));
+        p += sizeof(messages);
+        struct mosquitto_client_msg *m = dl_first(&session->dl_msgs_offline);
+        while(m) {
+            p += snapshot_encode_message(p, m);
+            m = dl_next(m);
+        }
+    } else if(op == SNAPSHOT_OP_MESSAGE) {
+        snapshot_encode_message(p, msg);
+    }
+
+    *len = size;
+    return bf;
 }
 
 /***************************************************************************
- *
+ *  Encode a record of a retained value, with room for a trailing crc.
+ *  Return the buffer (free with GBMEM_FREE) and its length in `len`.
  ***************************************************************************/
-PRIVATE json_t *property_get_property(json_t *properties, int identifier)
+PRIVATE char *snapshot_encode_retained(const char *topic, const char *value, size_t *len)
 {
-    const char *identifier_name = mqtt_property_identifier_to_string(identifier);
-    json_t *property = kw_get_dict(properties, identifier_name, 0, 0);
-    return property;
+    snapshot_session_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.op = SNAPSHOT_OP_RETAIN;
+    rec.id_len = (uint16_t)strlen(topic);
+    uint32_t value_len = (uint32_t)strlen(value);
+
+    size_t size = sizeof(rec) + rec.id_len + sizeof(value_len) + value_len;
+    char *bf = gbmem_malloc(size + sizeof(uint32_t));
+    if(!bf) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for snapshot record",
+            "size",         "%lu", (unsigned long)size,
+            NULL
+        );
+        return 0;
+    }
+
+    char *p = bf;
+    memcpy(p, &rec, sizeof(rec));
+    p += sizeof(rec);
+    memcpy(p, topic, rec.id_len);
+    p += rec.id_len;
+    memcpy(p, &value_len, sizeof(value_len));
+    p += sizeof(value_len);
+    memcpy(p, value, value_len);
+
+    *len = size;
+    return bf;
 }
 
 /***************************************************************************
- *  Use instead of: mosquitto_property_read_varint
+ *  Return the length of the message at p, 0 if it's incomplete
  ***************************************************************************/
-PRIVATE json_int_t property_get_int(json_t *properties, int identifier)
+PRIVATE size_t snapshot_message_length(const char *p, size_t avail)
 {
-    json_t *property = property_get_property(properties, identifier);
-    return kw_get_int(property, "value", -1, 0);
+    snapshot_message_t m;
+    if(avail < sizeof(m)) {
+        return 0;
+    }
+    memcpy(&m, p, sizeof(m));
+    size_t size = sizeof(m) + m.topic_len +
+        (size_t)m.props_len + (size_t)m.msg_props_len + (size_t)m.payload_len;
+    return (size <= avail)? size : 0;
 }
 
 /***************************************************************************
- *
+ *  Return the length of the record at p, 0 if it's incomplete
  ***************************************************************************/
-PRIVATE int property_process_connect(hgobj gobj, json_t *all_properties)
+PRIVATE size_t snapshot_record_length(const char *p, size_t avail)
 {
-    const char *property_name; json_t *property;
-    json_object_foreach(all_properties, property_name, property) {
-        json_int_t identifier = kw_get_int(property, "identifier", 0, KW_REQUIRED);
+    snapshot_session_t rec;
+    if(avail < sizeof(rec)) {
+        return 0;
+    }
+    memcpy(&rec, p, sizeof(rec));
+    size_t size = sizeof(rec) + rec.id_len;
+    if(size > avail) {
+        return 0;
+    }
 
-        switch(identifier) {
-            case MQTT_PROP_SESSION_EXPIRY_INTERVAL:
-                {
-                    json_int_t value = kw_get_int(property, "value", 0, KW_REQUIRED);
-                    gobj_write_uint32_attr(gobj, "session_expiry_interval", value);
-                }
-                break;
+    switch(rec.op) {
+        case SNAPSHOT_OP_DEL:
+            return size;
 
-            case MQTT_PROP_RECEIVE_MAXIMUM:
-                {
-                    json_int_t value = kw_get_int(property, "value", 0, KW_REQUIRED);
-                    if(value != 0) {
-                        //return -1;
-                    } else {
-                        gobj_write_uint32_attr(gobj, "msgs_out_inflight_maximum", value);
-                        gobj_write_uint32_attr(gobj, "msgs_out_inflight_quota", value);
-                    }
+        case SNAPSHOT_OP_RETAIN:
+            {
+                uint32_t value_len;
+                if(size + sizeof(value_len) > avail) {
+                    return 0;
                 }
-                break;
+                memcpy(&value_len, p + size, sizeof(value_len));
+                size += sizeof(value_len) + value_len;
+            }
+            return (size <= avail)? size : 0;
 
-            case MQTT_PROP_MAXIMUM_PACKET_SIZE:
-                {
-                    json_int_t value = kw_get_int(property, "value", 0, KW_REQUIRED);
-                    if(value == 0) {
-                        //return -1;
-                    } else {
-                        gobj_write_uint32_attr(gobj, "maximum_packet_size", value);
-                    }
-                }
-                break;
+        case SNAPSHOT_OP_MESSAGE:
+            {
+                size_t mlen = snapshot_message_length(p + size, avail - size);
+                return mlen? size + mlen : 0;
+            }
 
-            case MQTT_PROP_AUTHENTICATION_METHOD:
-                {
-                    const char *value = kw_get_str(property, "value", "", KW_REQUIRED);
-                    gobj_write_str_attr(gobj, "auth_method", value);
-                }
-                break;
+        case SNAPSHOT_OP_PUT:
+        case SNAPSHOT_OP_SESSION:
+            break;
 
-            case MQTT_PROP_AUTHENTICATION_DATA:
-                {
-                    const char *value = kw_get_str(property, "value", "", KW_REQUIRED);
-                    gobj_write_str_attr(gobj, "auth_data", value);
-                }
-                break;
+        default:
+            return 0;
+    }
+
+    for(uint16_t i=0; i<rec.subscriptions; i++) {
+        snapshot_subscription_t sub;
+        if(size + sizeof(sub) > avail) {
+            return 0;
         }
+        memcpy(&sub, p + size, sizeof(sub));
+        size += sizeof(sub) + sub.filter_len;
+    }
+    if(size > avail) {
+        return 0;
     }
 
-    return 0;
+    if(rec.op == SNAPSHOT_OP_SESSION) {
+        uint32_t messages;
+        if(size + sizeof(messages) > avail) {
+            return 0;
+        }
+        memcpy(&messages, p + size, sizeof(messages));
+        size += sizeof(messages);
+        for(uint32_t i=0; i<messages; i++) {
+            size_t mlen = snapshot_message_length(p + size, avail - size);
+            if(!mlen) {
+                return 0;
+            }
+            size += mlen;
+        }
+    }
+    return size;
 }
 
 /***************************************************************************
- *
+ *  Append a message of a record to the offline queue of the session.
+ *  Return its length, 0 on error.
  ***************************************************************************/
-PRIVATE int property_process_will(hgobj gobj, json_t *all_properties)
+PRIVATE size_t snapshot_apply_message(mqtt_session_t *session, const char *p)
 {
-    const char *property_name; json_t *property;
-    json_object_foreach(all_properties, property_name, property) {
-        json_int_t identifier = kw_get_int(property, "identifier", 0, KW_REQUIRED);
-        switch(identifier) {
-            case MQTT_PROP_CONTENT_TYPE:
-            case MQTT_PROP_CORRELATION_DATA:
-            case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
-            case MQTT_PROP_RESPONSE_TOPIC:
-            case MQTT_PROP_USER_PROPERTY:
-                break;
+    snapshot_message_t m;
+    memcpy(&m, p, sizeof(m));
+    size_t size = sizeof(m) + m.topic_len +
+        (size_t)m.props_len + (size_t)m.msg_props_len + (size_t)m.payload_len;
+    p += sizeof(m);
 
-            case MQTT_PROP_WILL_DELAY_INTERVAL:
-                {
-                    json_int_t value = kw_get_int(property, "value", 0, KW_REQUIRED);
-                    gobj_write_uint32_attr(gobj, "will_delay_interval", value);
-                }
-                break;
+    if(m.expiry_time && time_in_seconds() > m.expiry_time) {
+        /*
+         *  Expired while the broker was down
+         */
+        return size;
+    }
 
-            case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
-                {
-                    json_int_t value = kw_get_int(property, "value", 0, KW_REQUIRED);
-                    gobj_write_uint32_attr(gobj, "will_expiry_interval", value);
-                }
-                break;
+    struct mosquitto_msg_store *stored = pool_alloc(&pool_msg_store);
+    struct mosquitto_client_msg *msg = pool_alloc(&pool_client_msg);
+    if(!stored || !msg) {
+        // Error already logged
+        if(stored) {
+            pool_free(&pool_msg_store, stored);
+        }
+        if(msg) {
+            pool_free(&pool_client_msg, msg);
+        }
+        return 0;
+    }
+    stored->ref_count = 1;
+    stored->qos = m.qos;
+    stored->retain = (m.flags & SNAPSHOT_MSG_RETAIN)? TRUE : FALSE;
+    stored->message_expiry_time = (time_t)m.expiry_time;
+    stored->topic = intern_stringn(p, m.topic_len);
+    p += m.topic_len;
+    if(m.props_len) {
+        stored->properties = anystring2json(p, m.props_len, FALSE);
+        p += m.props_len;
+    }
+    json_t *msg_props = 0;
+    if(m.msg_props_len) {
+        msg_props = anystring2json(p, m.msg_props_len, FALSE);
+        p += m.msg_props_len;
+    }
+    stored->payloadlen = (int)m.payload_len;
+    stored->payload = gbmem_malloc(m.payload_len + 1);
+
+    msg->store = stored;
+    msg->mid = m.mid;
+    msg->qos = m.qos;
+    msg->retain = stored->retain;
+    msg->timestamp = time_in_seconds();
+    msg->direction = mosq_md_out;
+    msg->state = mosq_ms_queued;
+    msg->dup = false;
+    msg->properties = msg_props;
 
-            default:
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_MQTT_ERROR,
-                    "msg",          "%s", "Mqtt auth: will property unknown",
-                    "identifier",   "%d", identifier,
-                    NULL
-                );
+    if(!stored->topic || !stored->payload) {
+        // Error already logged
+        db_free_client_msg(msg);
+        return 0;
+    }
+    if(m.payload_len) {
+        memcpy(stored->payload, p, m.payload_len);
+    }
+
+    dl_add(&session->dl_msgs_offline, msg);
+    return size;
+}
+
+/***************************************************************************
+ *  Apply a record, already checked with snapshot_record_length()
+ ***************************************************************************/
+PRIVATE int snapshot_apply(const char *p)
+{
+    snapshot_session_t rec;
+    memcpy(&rec, p, sizeof(rec));
+    p += sizeof(rec);
+
+    if(rec.op == SNAPSHOT_OP_RETAIN) {
+        const char *topic = p;
+        p += rec.id_len;
+        uint32_t value_len;
+        memcpy(&value_len, p, sizeof(value_len));
+        p += sizeof(value_len);
+        if(!sys_stats.retained) {
+            sys_stats.retained = json_object();
+        }
+        char *key = gbmem_strndup(topic, rec.id_len);
+        char *value = gbmem_strndup(p, value_len);
+        if(!key || !value) {
+            // Error already logged
+            GBMEM_FREE(key);
+            GBMEM_FREE(value);
+            return -1;
+        }
+        json_object_set_new(sys_stats.retained, key, json_string(value));
+        GBMEM_FREE(key);
+        GBMEM_FREE(value);
+        return 0;
+    }
+
+    const char *client_id = intern_stringn(p, rec.id_len);
+    if(!client_id) {
+        // Error already logged
+        return -1;
+    }
+    p += rec.id_len;
+
+    mqtt_session_t *session = session_find(client_id);
+    if(rec.op == SNAPSHOT_OP_DEL) {
+        if(session) {
+            session_delete(session);
+        }
+        intern_release(client_id);
+        return 0;
+    }
+    if(rec.op == SNAPSHOT_OP_MESSAGE) {
+        intern_release(client_id);
+        if(!session) {
+            /*
+             *  The session was deleted later
+             */
+            return 0;
+        }
+        return snapshot_apply_message(session, p)? 0 : -1;
+    }
+
+    if(!session) {
+        session = session_create(client_id);
+    }
+    intern_release(client_id);
+    if(!session) {
+        // Error already logged
+        return -1;
+    }
+    session_clean_subscriptions(session);
+    session->last_mid = rec.last_mid;
+    if(rec.op == SNAPSHOT_OP_SESSION) {
+        dl_flush(&session->dl_msgs_offline, db_free_client_msg);
+    }
+
+    for(uint16_t i=0; i<rec.subscriptions; i++) {
+        snapshot_subscription_t sub;
+        memcpy(&sub, p, sizeof(sub));
+        p += sizeof(sub);
+        const char *filter = intern_stringn(p, sub.filter_len);
+        p += sub.filter_len;
+        if(!filter) {
+            // Error already logged
+            return -1;
+        }
+        mqtt_subscription_t *subscription = session_add_subscription(session, filter);
+        intern_release(filter);
+        if(!subscription) {
+            // Error already logged
+            return -1;
+        }
+        subscription->qos = sub.qos;
+        subscription->identifier = sub.identifier;
+        subscription->no_local = (sub.flags & SNAPSHOT_NO_LOCAL)? TRUE : FALSE;
+        subscription->retain_as_published = (sub.flags & SNAPSHOT_RETAIN_AS_PUBLISHED)? TRUE : FALSE;
+    }
+
+    if(rec.op == SNAPSHOT_OP_SESSION) {
+        uint32_t messages;
+        memcpy(&messages, p, sizeof(messages));
+        p += sizeof(messages);
+        for(uint32_t i=0; i<messages; i++) {
+            size_t mlen = snapshot_apply_message(session, p);
+            if(!mlen) {
+                // Error already logged
                 return -1;
+            }
+            p += mlen;
         }
     }
-
     return 0;
 }
 
 /***************************************************************************
- *
+ *  Map a file, return the mapping or 0 if it doesn't exist or is empty
  ***************************************************************************/
-PRIVATE int packet_check_oversize(hgobj gobj, uint32_t remaining_length)
+PRIVATE const char *snapshot_map(const char *path, size_t *len)
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
-
-    uint32_t len;
-
-    if(priv->maximum_packet_size == 0) {
+    *len = 0;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    void *base = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "mmap() FAILED",
+            "path",         "%s", path,
+            "errno",        "%d", errno,
+            "serrno",       "%s", strerror(errno),
+            NULL
+        );
         return 0;
     }
+    *len = (size_t)st.st_size;
+    return base;
+}
 
-    len = remaining_length + packet_varint_bytes(remaining_length);
-    if(len > priv->maximum_packet_size) {
-        return -1;
-    } else {
+/***************************************************************************
+ *  Replay a write-ahead log, up to the first torn record.
+ *  Return the number of changes, the length of the good records in `good`
+ *  and the length of the file in `len`.
+ ***************************************************************************/
+PRIVATE uint32_t snapshot_replay(const char *path, size_t *good, size_t *len)
+{
+    uint32_t changes = 0;
+
+    *good = 0;
+    const char *base = snapshot_map(path, len);
+    if(!base) {
         return 0;
     }
+    const char *p = base;
+    const char *end = base + *len;
+    while(p < end) {
+        size_t rlen = snapshot_record_length(p, (size_t)(end - p));
+        uint32_t crc;
+        if(!rlen || (size_t)(end - p) < rlen + sizeof(crc)) {
+            break;
+        }
+        memcpy(&crc, p + rlen, sizeof(crc));
+        if(crc != snapshot_crc32(0, p, rlen) || snapshot_apply(p)<0) {
+            break;
+        }
+        p += rlen + sizeof(crc);
+        changes++;
+    }
+    *good = (size_t)(p - base);
+    munmap((void *)base, *len);
+    return changes;
 }
 
 /***************************************************************************
- *
+ *  Load the snapshot and replay the write-ahead log
  ***************************************************************************/
-PRIVATE int send_packet(hgobj gobj, GBUFFER *gbuf)
+PRIVATE int snapshot_load(void)
 {
-    if(gobj_trace_level(gobj) & TRAFFIC) {
-        log_debug_gbuf(LOG_DUMP_OUTPUT, gbuf, "%s ==> %s",
-            gobj_short_name(gobj),
-            gobj_short_name(gobj_bottom_gobj(gobj))
+    uint64_t t = time_in_miliseconds();
+    uint32_t sessions = 0;
+    uint32_t changes = 0;
+
+    size_t len;
+    const char *base = snapshot_map(snapshot.path, &len);
+    if(base) {
+        snapshot_header_t header;
+        BOOL valid = FALSE;
+        if(len >= sizeof(header)) {
+            memcpy(&header, base, sizeof(header));
+            valid = (header.magic == SNAPSHOT_MAGIC &&
+                header.version == SNAPSHOT_VERSION &&
+                header.length == len - sizeof(header) &&
+                header.crc == snapshot_crc32(0, base + sizeof(header), (size_t)header.length)
+            )? TRUE : FALSE;
+        }
+        if(!valid) {
+            log_error(0,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MQTT_ERROR,
+                "msg",          "%s", "Mqtt snapshot: bad file, ignored",
+                "path",         "%s", snapshot.path,
+                NULL
+            );
+        } else {
+            const char *p = base + sizeof(header);
+            const char *end = base + len;
+            while(p < end) {
+                size_t rlen = snapshot_record_length(p, (size_t)(end - p));
+                if(!rlen || snapshot_apply(p)<0) {
+                    break;
+                }
+                p += rlen;
+                sessions++;
+            }
+        }
+        munmap((void *)base, len);
+    }
+
+    /*
+     *  Replay the changes after the snapshot: first the log of an unfinished compaction
+     */
+    size_t good;
+    changes += snapshot_replay(snapshot.wal_old_path, &good, &len);
+    changes += snapshot_replay(snapshot.wal_path, &good, &len);
+
+    snapshot.wal_fd = open(snapshot.wal_path, O_WRONLY|O_CREAT|O_APPEND, 0660);
+    if(snapshot.wal_fd < 0) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "open() write-ahead log FAILED",
+            "path",         "%s", snapshot.wal_path,
+            "errno",        "%d", errno,
+            "serrno",       "%s", strerror(errno),
+            NULL
         );
+        return -1;
     }
-    json_t *kw = json_pack("{s:I}",
-        "gbuffer", (json_int_t)(size_t)gbuf
+    if(good < len && ftruncate(snapshot.wal_fd, (off_t)good) < 0) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "ftruncate() write-ahead log FAILED",
+            "path",         "%s", snapshot.wal_path,
+            "errno",        "%d", errno,
+            "serrno",       "%s", strerror(errno),
+            NULL
+        );
+    }
+    snapshot.wal_records = changes;
+    if(changes && snapshot.interval) {
+        snapshot.next_time = time_in_miliseconds() + (uint64_t)snapshot.interval * 1000;
+    }
+
+    log_info(0,
+        "gobj",         "%s", __FILE__,
+        "msgset",       "%s", MSGSET_INFO,
+        "msg",          "%s", "Mqtt snapshot loaded",
+        "path",         "%s", snapshot.path,
+        "sessions",     "%lu", (unsigned long)sessions,
+        "changes",      "%lu", (unsigned long)changes,
+        "msec",         "%lu", (unsigned long)(time_in_miliseconds() - t),
+        NULL
     );
-    return gobj_send_event(gobj_bottom_gobj(gobj), "EV_TX_DATA", kw, gobj);
+    return 0;
 }
 
 /***************************************************************************
- *  For DISCONNECT, PINGREQ and PINGRESP
+ *  Open the snapshot with the first Mqtt gobj that has one configured
  ***************************************************************************/
-PRIVATE int send_simple_command(hgobj gobj, uint8_t command)
+PRIVATE int snapshot_open(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    const char *path = gobj_read_str_attr(gobj, "snapshot_file");
 
-    GBUFFER *gbuf = build_mqtt_packet(gobj, command, 0);
-    if(!gbuf) {
+    if(snapshot.path || !priv->iamServer || empty_string(path)) {
+        return 0;
+    }
+    snapshot.path = gbmem_strdup(path);
+    snapshot.wal_path = gbmem_malloc(strlen(path) + sizeof(".wal"));
+    snapshot.wal_old_path = gbmem_malloc(strlen(path) + sizeof(".wal.old"));
+    if(!snapshot.path || !snapshot.wal_path || !snapshot.wal_old_path) {
         // Error already logged
-        return MOSQ_ERR_NOMEM;
+        GBMEM_FREE(snapshot.path);
+        GBMEM_FREE(snapshot.wal_path);
+        GBMEM_FREE(snapshot.wal_old_path);
+        return -1;
     }
+    strcpy(snapshot.wal_path, path);
+    strcat(snapshot.wal_path, ".wal");
+    strcpy(snapshot.wal_old_path, path);
+    strcat(snapshot.wal_old_path, ".wal.old");
+    snapshot.wal_fd = -1;
+    snapshot.interval = gobj_read_uint32_attr(gobj, "snapshot_interval");
 
-    if(gobj_trace_level(gobj) & SHOW_DECODE) {
-        trace_msg("👉👉 Sending %s to '%s'",
-            get_command_name(command),
-            priv->client_id
-        );
-    }
-    return send_packet(gobj, gbuf);
+    return snapshot_load();
 }
 
 /***************************************************************************
- *
+ *  Log a persistent session, or its deletion
  ***************************************************************************/
-PRIVATE int send_connack(
-    hgobj gobj,
-    uint8_t ack,
-    uint8_t reason_code,
-    json_t *connack_props // owned
-)
+PRIVATE int snapshot_log_session(mqtt_session_t *session, uint8_t op)
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    return snapshot_log_message(session, op, 0);
+}
 
-    uint32_t remaining_length = 2;
+/***************************************************************************
+ *  Log a change of a persistent session,
+ *  with SNAPSHOT_OP_MESSAGE a message appended to its offline queue
+ ***************************************************************************/
+PRIVATE int snapshot_log_message(
+    mqtt_session_t *session,
+    uint8_t op,
+    struct mosquitto_client_msg *msg
+)
+{
+    if(!snapshot.path || snapshot.wal_fd < 0 || !session || session->assigned_id) {
+        return 0;
+    }
 
-    if(gobj_trace_level(gobj) & SHOW_DECODE) {
-        trace_msg("👉👉 Sending CONNACK to '%s' %s (ack %d, reason code %d)",
-            priv->client_id,
-            gobj_short_name(gobj_bottom_gobj(gobj)),
-            ack,
-            reason_code
-        );
-        if(connack_props) {
-            log_debug_json(0, connack_props, "Sending CONNACK properties");
-        }
+    size_t len;
+    char *bf = snapshot_encode(session, op, msg, &len);
+    if(!bf) {
+        // Error already logged
+        return -1;
     }
+    uint32_t crc = snapshot_crc32(0, bf, len);
+    memcpy(bf + len, &crc, sizeof(crc));
+    int ret = snapshot_write_fd(snapshot.wal_fd, bf, len + sizeof(crc));
+    GBMEM_FREE(bf);
 
-    if(priv->protocol_version == mosq_p_mqtt5) {
-        if(reason_code < 128 && priv->retain_available == false) {
-            mqtt_property_add_byte(gobj, connack_props, MQTT_PROP_RETAIN_AVAILABLE, 0);
-        }
-        if(reason_code < 128 && priv->max_packet_size > 0) {
-            mqtt_property_add_int32(gobj, connack_props, MQTT_PROP_MAXIMUM_PACKET_SIZE, priv->max_packet_size);
+    if(ret == 0) {
+        if(!snapshot.wal_records++ && snapshot.interval) {
+            snapshot.next_time = time_in_miliseconds() + (uint64_t)snapshot.interval * 1000;
         }
-        if(reason_code < 128 && priv->max_inflight_messages > 0) {
-            mqtt_property_add_int16(
-                gobj, connack_props, MQTT_PROP_RECEIVE_MAXIMUM, priv->max_inflight_messages
-            );
+        if(!snapshot.wal_sync_time) {
+            snapshot.wal_sync_time = time_in_miliseconds() + SNAPSHOT_WAL_SYNC_MS;
         }
-        if(priv->max_qos != 2) {
-            mqtt_property_add_byte(gobj, connack_props, MQTT_PROP_MAXIMUM_QOS, priv->max_qos);
+        if(broker_timer.timer) {
+            broker_timer_arm();
+        } else {
+            snapshot_wal_sync();    // nobody to sync it later
         }
-
-        remaining_length += property_get_remaining_length(connack_props);
-    }
-
-    if(packet_check_oversize(gobj, remaining_length)) {
-        JSON_DECREF(connack_props);
-        return -1;
     }
+    return ret;
+}
 
-    GBUFFER *gbuf = build_mqtt_packet(gobj, CMD_CONNACK, remaining_length);
-    if(!gbuf) {
-        // Error already logged
-        JSON_DECREF(connack_props);
-        return MOSQ_ERR_NOMEM;
-    }
-    gbuf_append_char(gbuf, ack);
-    gbuf_append_char(gbuf, reason_code);
-    if(priv->protocol_version == mosq_p_mqtt5) {
-        property_write_all(gobj, gbuf, connack_props, true);
+/***************************************************************************
+ *  Sync the changes of the write-ahead log
+ ***************************************************************************/
+PRIVATE void snapshot_wal_sync(void)
+{
+    if(snapshot.wal_sync_time && snapshot.wal_fd >= 0 && fdatasync(snapshot.wal_fd) < 0) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "fdatasync() write-ahead log FAILED",
+            "path",         "%s", snapshot.wal_path,
+            "errno",        "%d", errno,
+            "serrno",       "%s", strerror(errno),
+            NULL
+        );
     }
-    JSON_DECREF(connack_props);
-    return send_packet(gobj, gbuf);
+    snapshot.wal_sync_time = 0;
 }
 
 /***************************************************************************
- *
+ *  Write the snapshot file of all the persistent sessions
  ***************************************************************************/
-PRIVATE int send_disconnect(
-    hgobj gobj,
-    uint8_t reason_code,
-    json_t *properties
-)
+PRIVATE int snapshot_write_file(void)
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", snapshot.path);
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0660);
+    if(fd < 0) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "open() snapshot FAILED",
+            "path",         "%s", tmp,
+            "errno",        "%d", errno,
+            "serrno",       "%s", strerror(errno),
+            NULL
+        );
+        return -1;
+    }
 
-    gobj_write_bool_attr(gobj, "send_disconnect", FALSE);
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    int ret = snapshot_write_fd(fd, &header, sizeof(header));   // rewritten at end
 
-    if(gobj_trace_level(gobj) & SHOW_DECODE) {
-        if(priv->iamServer) {
-            if(priv->is_bridge) {
-                trace_msg("👉👉 Bridge Sending DISCONNECT to '%s' ('%s', %d)",
-                    priv->client_id,
-                    mosquitto_reason_string(reason_code),
-                    reason_code
-                );
-            } else  {
-                trace_msg("👉👉 Sending DISCONNECT to '%s' ('%s', %d)",
-                    priv->client_id,
-                    mosquitto_reason_string(reason_code),
-                    reason_code
-                );
+    for(size_t i=0; i<session_table.nslabs && ret==0; i++) {
+        mqtt_session_t *slab = session_table.slabs[i];
+        for(int j=0; j<SESSION_SLAB_SIZE && ret==0; j++) {
+            mqtt_session_t *session = &slab[j];
+            if(!session->client_id || session->assigned_id) {
+                continue;
             }
-        } else {
-            trace_msg("👉👉 Sending client DISCONNECT to '%s'", priv->client_id);
+            size_t len;
+            char *bf = snapshot_encode(session, SNAPSHOT_OP_SESSION, 0, &len);
+            if(!bf) {
+                // Error already logged
+                ret = -1;
+                break;
+            }
+            header.crc = snapshot_crc32(header.crc, bf, len);
+            header.length += len;
+            header.sessions++;
+            ret = snapshot_write_fd(fd, bf, len);
+            GBMEM_FREE(bf);
         }
     }
 
-    uint32_t remaining_length;
+    const char *topic;
+    json_t *jn_value;
+    json_object_foreach(sys_stats.retained, topic, jn_value) {
+        if(ret < 0) {
+            break;
+        }
+        size_t len;
+        char *bf = snapshot_encode_retained(topic, json_string_value(jn_value), &len);
+        if(!bf) {
+            // Error already logged
+            ret = -1;
+            break;
+        }
+        header.crc = snapshot_crc32(header.crc, bf, len);
+        header.length += len;
+        ret = snapshot_write_fd(fd, bf, len);
+        GBMEM_FREE(bf);
+    }
 
-    if(priv->protocol_version == mosq_p_mqtt5 && (reason_code != 0 || properties)) {
-        remaining_length = 1;
-        if(properties) {
-            remaining_length += property_get_remaining_length(properties);
+    if(ret == 0) {
+        header.magic = SNAPSHOT_MAGIC;
+        header.version = SNAPSHOT_VERSION;
+        if(pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fsync(fd) < 0) {
+            log_error(0,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+                "msg",          "%s", "write snapshot header FAILED",
+                "path",         "%s", tmp,
+                "errno",        "%d", errno,
+                "serrno",       "%s", strerror(errno),
+                NULL
+            );
+            ret = -1;
         }
-    } else {
-        remaining_length = 0;
     }
+    close(fd);
 
-    GBUFFER *gbuf = build_mqtt_packet(gobj, CMD_DISCONNECT, remaining_length);
-    if(!gbuf) {
+    if(ret == 0 && rename(tmp, snapshot.path) < 0) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "rename() snapshot FAILED",
+            "path",         "%s", snapshot.path,
+            "errno",        "%d", errno,
+            "serrno",       "%s", strerror(errno),
+            NULL
+        );
+        ret = -1;
+    }
+    if(ret < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Write the snapshot in the loop and empty the logs, at exit
+ ***************************************************************************/
+PRIVATE int snapshot_write(void)
+{
+    if(!snapshot.path) {
+        return 0;
+    }
+    if(!snapshot.wal_records && access(snapshot.wal_old_path, F_OK) != 0) {
+        return 0;
+    }
+    snapshot_wal_sync();
+    if(snapshot_write_file()<0) {
         // Error already logged
-        return MOSQ_ERR_NOMEM;
+        return -1;
     }
 
-    if(priv->protocol_version == mosq_p_mqtt5 && (reason_code != 0 || properties)) {
-        gbuf_append_char(gbuf, reason_code);
-        if(properties) {
-            property_write_all(gobj, gbuf, properties, true);
+    /*
+     *  The changes are in the snapshot now
+     */
+    unlink(snapshot.wal_old_path);
+    if(snapshot.wal_fd >= 0 && ftruncate(snapshot.wal_fd, 0) < 0) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "ftruncate() write-ahead log FAILED",
+            "path",         "%s", snapshot.wal_path,
+            "errno",        "%d", errno,
+            "serrno",       "%s", strerror(errno),
+            NULL
+        );
+    }
+    snapshot.wal_records = 0;
+    snapshot.next_time = 0;
+    return 0;
+}
+
+/***************************************************************************
+ *  Append a file to other
+ ***************************************************************************/
+PRIVATE int snapshot_append_file(const char *dst, const char *src)
+{
+    size_t len;
+    const char *base = snapshot_map(src, &len);
+    if(!base) {
+        return 0;
+    }
+    int ret = -1;
+    int fd = open(dst, O_WRONLY|O_APPEND);
+    if(fd >= 0) {
+        ret = snapshot_write_fd(fd, base, len);
+        if(ret == 0 && fsync(fd) < 0) {
+            ret = -1;
         }
+        close(fd);
+    }
+    munmap((void *)base, len);
+    if(ret < 0) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "append write-ahead log FAILED",
+            "path",         "%s", dst,
+            "errno",        "%d", errno,
+            "serrno",       "%s", strerror(errno),
+            NULL
+        );
     }
-
-    return send_packet(gobj, gbuf);
+    return ret;
 }
 
 /***************************************************************************
- *
+ *  Move the write-ahead log to .wal.old, for the compaction,
+ *  and start a new one. If the previous compaction failed
+ *  its .wal.old is still there: the log is appended to it.
  ***************************************************************************/
-PRIVATE int send__suback(hgobj gobj, uint16_t mid, uint32_t payloadlen, const void *payload)
+PRIVATE int snapshot_wal_rotate(void)
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
-    json_t *properties = NULL;
-    uint32_t remaining_length = 2 + payloadlen;
+    snapshot_wal_sync();
 
-    if(priv->protocol_version == mosq_p_mqtt5) {
-        /* We don't use Reason String or User Property yet. */
-        remaining_length += property_get_remaining_length(properties);
+    int ret = 0;
+    if(access(snapshot.wal_old_path, F_OK) != 0) {
+        if(rename(snapshot.wal_path, snapshot.wal_old_path) < 0) {
+            log_error(0,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+                "msg",          "%s", "rename() write-ahead log FAILED",
+                "path",         "%s", snapshot.wal_path,
+                "errno",        "%d", errno,
+                "serrno",       "%s", strerror(errno),
+                NULL
+            );
+            return -1;
+        }
+    } else {
+        ret = snapshot_append_file(snapshot.wal_old_path, snapshot.wal_path);
+        if(ret < 0) {
+            // Error already logged
+            return -1;
+        }
     }
 
-    if(gobj_trace_level(gobj) & SHOW_DECODE) {
-        trace_msg("👉👉 Sending SUBACK to '%s' %s",
-            priv->client_id,
-            gobj_short_name(gobj_bottom_gobj(gobj))
+    if(snapshot.wal_fd >= 0) {
+        close(snapshot.wal_fd);
+    }
+    snapshot.wal_fd = open(snapshot.wal_path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0660);
+    if(snapshot.wal_fd < 0) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "open() write-ahead log FAILED",
+            "path",         "%s", snapshot.wal_path,
+            "errno",        "%d", errno,
+            "serrno",       "%s", strerror(errno),
+            NULL
         );
-        if(payloadlen > 0) {
-            log_debug_dump(0, payload, payloadlen, "   SUBACK payload");
-        }
-        if(properties) {
-            log_debug_json(0, properties, "   SUBACK properties");
-        }
+        return -1;
     }
+    return 0;
+}
 
-    GBUFFER *gbuf = build_mqtt_packet(gobj, CMD_SUBACK, remaining_length);
-    if(!gbuf) {
+/***************************************************************************
+ *  Compact the log into a new snapshot, written by a forked child.
+ *  The child sees the sessions as they are now (copy on write)
+ *  and the loop goes on appending the new changes to a new log.
+ ***************************************************************************/
+PRIVATE int snapshot_compact(void)
+{
+    if(!snapshot.path || !snapshot.wal_records || snapshot.compact_pid > 0) {
+        return 0;
+    }
+    if(snapshot_wal_rotate()<0) {
         // Error already logged
-        return MOSQ_ERR_NOMEM;
+        return -1;
     }
 
-    mqtt_write_uint16(gbuf, mid);
-
-    if(priv->protocol_version == mosq_p_mqtt5) {
-        property_write_all(gobj, gbuf, properties, true);
+    pid_t pid = fork();
+    if(pid == 0) {
+        /*
+         *  Child
+         */
+        int ret = snapshot_write_file();
+        if(ret == 0) {
+            unlink(snapshot.wal_old_path);
+        }
+        _exit(ret==0? 0 : 1);
     }
-
-    if(payloadlen) {
-        mqtt_write_bytes(gbuf, payload, payloadlen);
+    if(pid < 0) {
+        log_warning(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "fork() FAILED, snapshot written in the loop",
+            "errno",        "%d", errno,
+            "serrno",       "%s", strerror(errno),
+            NULL
+        );
+        return snapshot_write();
     }
-
-    return send_packet(gobj, gbuf);
+    snapshot.compact_pid = pid;
+    snapshot.wal_records = 0;
+    snapshot.next_time = 0;
+    return 0;
 }
 
 /***************************************************************************
- *
+ *  Check the end of the compaction child.
+ *  The compaction is done when .wal.old is removed.
  ***************************************************************************/
-PRIVATE int send__unsuback(
-    hgobj gobj,
-    uint16_t mid,
-    int reason_code_count,
-    uint8_t *reason_codes,
-    json_t *properties)
+PRIVATE void snapshot_compact_reap(BOOL wait)
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
-
-    if(gobj_trace_level(gobj) & SHOW_DECODE) {
-        trace_msg("👉👉 Sending UNSUBACK to '%s' %s",
-            priv->client_id,
-            gobj_short_name(gobj_bottom_gobj(gobj))
-        );
+    if(snapshot.compact_pid <= 0) {
+        return;
     }
-
-    uint32_t remaining_length = 2;
-
-    if(priv->protocol_version == mosq_p_mqtt5) {
-        remaining_length += property_get_remaining_length(properties);
-        remaining_length += (uint32_t)reason_code_count;
+    int status;
+    if(waitpid(snapshot.compact_pid, &status, wait? 0 : WNOHANG) == 0) {
+        return; // still working
     }
+    snapshot.compact_pid = 0;
 
-    GBUFFER *gbuf = build_mqtt_packet(gobj, CMD_UNSUBACK, remaining_length);
-    if(!gbuf) {
-        // Error already logged
-        return MOSQ_ERR_NOMEM;
+    if(access(snapshot.wal_old_path, F_OK) == 0) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "Mqtt snapshot: compaction FAILED, changes kept in the log",
+            "path",         "%s", snapshot.wal_old_path,
+            NULL
+        );
+        /*
+         *  Try again later
+         */
+        snapshot.wal_records++;
+        if(snapshot.interval && !snapshot.next_time) {
+            snapshot.next_time = time_in_miliseconds() + (uint64_t)snapshot.interval * 1000;
+        }
     }
+}
 
-    mqtt_write_uint16(gbuf, mid);
+/***************************************************************************
+ *  Broker timer: sync the log, check the compaction, compact if its time is over
+ ***************************************************************************/
+PRIVATE void snapshot_tick(void)
+{
+    uint64_t now = time_in_miliseconds();
 
-    if(priv->protocol_version == mosq_p_mqtt5) {
-        property_write_all(gobj, gbuf, properties, true);
-        mqtt_write_bytes(gbuf, reason_codes, (uint32_t)reason_code_count);
+    if(snapshot.wal_sync_time && now >= snapshot.wal_sync_time) {
+        snapshot_wal_sync();
+    }
+    snapshot_compact_reap(FALSE);
+    if(snapshot.next_time && now >= snapshot.next_time) {
+        if(snapshot_compact()<0) {
+            // Error already logged, try again later
+            snapshot.next_time = now + (uint64_t)snapshot.interval * 1000;
+        }
     }
-
-    return send_packet(gobj, gbuf);
 }
 
 /***************************************************************************
- *
+ *  Write the last snapshot and close, with the last Mqtt gobj
  ***************************************************************************/
-PRIVATE int handle_pingreq(hgobj gobj)
+PRIVATE void snapshot_close(void)
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
-
-    if(!priv->in_session) {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt CMD_PINGREQ: not in session",
-            NULL
-        );
-        return -1;
+    if(!snapshot.path) {
+        return;
     }
-    if(!priv->iamServer) {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt CMD_PINGREQ: not server",
-            NULL
-        );
-        return -1;
+    snapshot_compact_reap(TRUE);
+    snapshot_write();
+    if(snapshot.wal_fd >= 0) {
+        close(snapshot.wal_fd);
     }
+    GBMEM_FREE(snapshot.path);
+    GBMEM_FREE(snapshot.wal_path);
+    GBMEM_FREE(snapshot.wal_old_path);
+    memset(&snapshot, 0, sizeof(snapshot));
+}
 
-    if(priv->frame_head.flags != 0) {
-        return MOSQ_ERR_MALFORMED_PACKET;
+/***************************************************************************
+ *  Free a acl trie
+ ***************************************************************************/
+PRIVATE void acl_free_node(acl_node_t *node)
+{
+    while(node) {
+        acl_node_t *sibling = node->sibling;
+        acl_rule_t *rule = node->rules;
+        while(rule) {
+            acl_rule_t *next = rule->next;
+            GBMEM_FREE(rule->name);
+            GBMEM_FREE(rule);
+            rule = next;
+        }
+        acl_free_node(node->child);
+        GBMEM_FREE(node->level);
+        GBMEM_FREE(node);
+        node = sibling;
     }
+}
 
-    // TODO mosq->ping_t = mosquitto_time(); esto no está en esta función!!
-    return send_simple_command(gobj, CMD_PINGRESP);
+/***************************************************************************
+ *  Free the compiled acl
+ ***************************************************************************/
+PRIVATE void acl_free(void)
+{
+    acl_free_node(acl_table.root);
+    acl_table.root = 0;
+    GBMEM_FREE(acl_table.source);
 }
 
 /***************************************************************************
- *
+ *  Get or create the child of a node with this level
  ***************************************************************************/
-PRIVATE int handle_pingresp(hgobj gobj)
+PRIVATE acl_node_t *acl_node_child(acl_node_t *node, const char *level, size_t len)
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    acl_node_t *child = node->child;
+    while(child) {
+        if(strlen(child->level) == len && strncmp(child->level, level, len)==0) {
+            return child;
+        }
+        child = child->sibling;
+    }
 
-    if(!priv->in_session) {
+    child = gbmem_malloc(sizeof(acl_node_t));
+    if(!child) {
         log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
+            "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt CMD_PINGRESP: not in session",
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for acl node",
             NULL
         );
-        return -1;
-    }
-
-    // mosq->ping_t = 0; /* No longer waiting for a PINGRESP. */
-
-    if(!priv->is_bridge) {
-        // Parece que el broker no debe recibir pingresp
-        return MOSQ_ERR_PROTOCOL;
+        return 0;
     }
-
-    return send_simple_command(gobj, CMD_PINGRESP);
+    child->level = gbmem_strndup(level, len);
+    child->sibling = node->child;
+    node->child = child;
+    return child;
 }
 
 /***************************************************************************
- *  For PUBACK, PUBCOMP, PUBREC, and PUBREL
+ *  Add the rules of a list to the trie
  ***************************************************************************/
-PRIVATE int send_command_with_mid(
+PRIVATE int acl_compile_rules(
     hgobj gobj,
-    uint8_t command,
-    uint16_t mid,
-    bool dup,
-    uint8_t reason_code,
-    json_t *properties
+    acl_node_t *root,
+    acl_owner_t owner,
+    const char *name,
+    json_t *jn_rules
 )
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
-    int remaining_length = 2;
+    int idx; json_t *jn_rule;
+    json_array_foreach(jn_rules, idx, jn_rule) {
+        const char *topic = kw_get_str(jn_rule, "topic", "", 0);
+        const char *access = kw_get_str(jn_rule, "access", "readwrite", 0);
+
+        uint8_t access_bits = MOSQ_ACL_NONE;
+        BOOL deny = FALSE;
+        if(strcmp(access, "read")==0) {
+            access_bits = MOSQ_ACL_READ|MOSQ_ACL_SUBSCRIBE;
+        } else if(strcmp(access, "write")==0) {
+            access_bits = MOSQ_ACL_WRITE;
+        } else if(strcmp(access, "readwrite")==0) {
+            access_bits = MOSQ_ACL_READ|MOSQ_ACL_WRITE|MOSQ_ACL_SUBSCRIBE;
+        } else if(strcmp(access, "subscribe")==0) {
+            access_bits = MOSQ_ACL_SUBSCRIBE;
+        } else if(strcmp(access, "deny")==0) {
+            access_bits = MOSQ_ACL_READ|MOSQ_ACL_WRITE|MOSQ_ACL_SUBSCRIBE;
+            deny = TRUE;
+        }
+        if(empty_string(topic) || access_bits == MOSQ_ACL_NONE ||
+                mosquitto_sub_topic_check(topic) != MOSQ_ERR_SUCCESS) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "Bad acl rule, acl rejected",
+                "name",         "%s", SAFE_PRINT(name),
+                "topic",        "%s", topic,
+                "access",       "%s", access,
+                NULL
+            );
+            return -1;
+        }
 
-    if(gobj_trace_level(gobj) & SHOW_DECODE) {
-        trace_msg("👉👉 Sending %s to '%s', mid %ld ('%s', %d)",
-            get_command_name(command & 0xF0),
-            priv->client_id,
-            (long)mid,
-            mosquitto_reason_string(reason_code),
-            reason_code
-        );
+        /*
+         *  Walk/build the levels of the topic filter
+         */
+        acl_node_t *node = root;
+        const char *level = topic;
+        while(node) {
+            const char *slash = strchr(level, '/');
+            size_t len = slash? (size_t)(slash - level) : strlen(level);
+            node = acl_node_child(node, level, len);
+            if(!slash) {
+                break;
+            }
+            level = slash + 1;
+        }
+        if(!node) {
+            // Error already logged
+            return -1;
+        }
+
+        acl_rule_t *rule = gbmem_malloc(sizeof(acl_rule_t));
+        if(!rule) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "no memory for acl rule",
+                NULL
+            );
+            return -1;
+        }
+        rule->owner = owner;
+        rule->name = name? gbmem_strdup(name) : 0;
+        rule->access = access_bits;
+        rule->deny = deny;
+        rule->next = node->rules;
+        node->rules = rule;
     }
+    return 0;
+}
 
-    if(dup) {
-        command |= 8;
+/***************************************************************************
+ *  A new acl can't be compiled: keep the current one,
+ *  or deny all if there is none, never fall back to allow all.
+ ***************************************************************************/
+PRIVATE int acl_reject(hgobj gobj)
+{
+    if(!acl_table.root && !acl_table.deny_all) {
+        acl_table.deny_all = TRUE;
+        acl_table.generation++;
     }
-    if(priv->protocol_version == mosq_p_mqtt5) {
-        if(reason_code != 0 || properties) {
-            remaining_length += 1;
-        }
+    log_error(0,
+        "gobj",         "%s", gobj_full_name(gobj),
+        "function",     "%s", __FUNCTION__,
+        "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+        "msg",          "%s", acl_table.root?
+            "Acl rejected, keeping the previous acl" : "Acl rejected, denying all",
+        NULL
+    );
+    return -1;
+}
 
-        if(properties) {
-            remaining_length += property_get_remaining_length(properties);
+/***************************************************************************
+ *  Compile the acl in the trie, only if it has changed.
+ *  The new trie replaces the current one only if it compiles completely.
+ ***************************************************************************/
+PRIVATE int acl_load(hgobj gobj, json_t *jn_acl)
+{
+    char *source = 0;
+    if(json_object_size(jn_acl) > 0) {
+        source = json2uglystr(jn_acl);
+        if(!source) {
+            // Error already logged
+            return acl_reject(gobj);
         }
     }
-    GBUFFER *gbuf = build_mqtt_packet(gobj, command, remaining_length);
-    if(!gbuf) {
-        // Error already logged
-        return MOSQ_ERR_NOMEM;
+
+    if(!source && !acl_table.source && !acl_table.deny_all) {
+        return 0;
+    }
+    if(source && acl_table.source && strcmp(source, acl_table.source)==0) {
+        GBMEM_FREE(source);
+        return 0;
+    }
+
+    if(!source) {
+        acl_free();
+        acl_table.deny_all = FALSE;
+        acl_table.generation++;
+        return 0;
+    }
+
+    acl_node_t *root = gbmem_malloc(sizeof(acl_node_t));
+    if(!root) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for acl",
+            NULL
+        );
+        GBMEM_FREE(source);
+        return acl_reject(gobj);
     }
 
-    mqtt_write_uint16(gbuf, mid);
+    int ret = 0;
+    ret += acl_compile_rules(gobj, root, ACL_OWNER_ALL, 0, kw_get_list(jn_acl, "patterns", 0, 0));
 
-    if(priv->protocol_version == mosq_p_mqtt5) {
-        if(reason_code != 0 || properties) {
-            mqtt_write_byte(gbuf, reason_code);
-        }
-        if(properties) {
-            property_write_all(gobj, gbuf, properties, true);
-        }
+    const char *name; json_t *jn_rules;
+    json_object_foreach(kw_get_dict(jn_acl, "users", 0, 0), name, jn_rules) {
+        ret += acl_compile_rules(gobj, root, ACL_OWNER_USER, name, jn_rules);
+    }
+    json_object_foreach(kw_get_dict(jn_acl, "roles", 0, 0), name, jn_rules) {
+        ret += acl_compile_rules(gobj, root, ACL_OWNER_ROLE, name, jn_rules);
+    }
+    if(ret < 0) {
+        acl_free_node(root);
+        GBMEM_FREE(source);
+        return acl_reject(gobj);
     }
 
-    JSON_DECREF(properties)
-
-    return send_packet(gobj, gbuf);
+    acl_free();
+    acl_table.root = root;
+    acl_table.source = source;
+    acl_table.deny_all = FALSE;
+    acl_table.generation++;
+    return 0;
 }
 
 /***************************************************************************
- *
+ *  Accumulate the access of the rules of a node that apply to the client
  ***************************************************************************/
-PRIVATE int send_puback(hgobj gobj, uint16_t mid, uint8_t reason_code, json_t *properties)
+PRIVATE void acl_apply_rules(
+    hgobj gobj,
+    acl_rule_t *rule,
+    uint8_t *granted,
+    uint8_t *denied
+)
 {
-    //util__increment_receive_quota(mosq);
-    /* We don't use Reason String or User Property yet. */
-    return send_command_with_mid(gobj, CMD_PUBACK, mid, false, reason_code, properties);
-}
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-/***************************************************************************
- *
- ***************************************************************************/
-PRIVATE int send_pubcomp(hgobj gobj, uint16_t mid, json_t *properties)
-{
-    //util__increment_receive_quota(mosq);
-    /* We don't use Reason String or User Property yet. */
-    return send_command_with_mid(gobj, CMD_PUBCOMP, mid, false, 0, properties);
+    for(; rule; rule = rule->next) {
+        switch(rule->owner) {
+            case ACL_OWNER_ALL:
+                break;
+            case ACL_OWNER_USER:
+                if(empty_string(priv->username) || strcmp(rule->name, priv->username)!=0) {
+                    continue;
+                }
+                break;
+            case ACL_OWNER_ROLE:
+                {
+                    BOOL has_role = FALSE;
+                    int idx; json_t *jn_role;
+                    json_array_foreach(priv->acl_roles, idx, jn_role) {
+                        const char *role = json_string_value(jn_role);
+                        if(role && strcmp(role, rule->name)==0) {
+                            has_role = TRUE;
+                            break;
+                        }
+                    }
+                    if(!has_role) {
+                        continue;
+                    }
+                }
+                break;
+        }
+        if(rule->deny) {
+            *denied |= rule->access;
+        } else {
+            *granted |= rule->access;
+        }
+    }
 }
 
 /***************************************************************************
- *
+ *  Walk the trie with the levels of topic.
+ *  `level` is NULL when all the levels of topic are consumed.
+ *  The topic can be a subscription filter: a "+" level is only covered
+ *  by "+" or "#" rules, and a "#" level only by "#" rules.
  ***************************************************************************/
-PRIVATE int send_pubrec(hgobj gobj, uint16_t mid, uint8_t reason_code, json_t *properties)
+PRIVATE void acl_match(
+    hgobj gobj,
+    acl_node_t *node,
+    const char *level,
+    BOOL first_level,
+    uint8_t *granted,
+    uint8_t *denied
+)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    if(reason_code >= 0x80 && priv->protocol_version == mosq_p_mqtt5) {
-        //util__increment_receive_quota(mosq);
+    if(!level) {
+        acl_apply_rules(gobj, node->rules, granted, denied);
+        /*
+         *  "a/#" matches "a" too
+         */
+        for(acl_node_t *child = node->child; child; child = child->sibling) {
+            if(strcmp(child->level, "#")==0) {
+                acl_apply_rules(gobj, child->rules, granted, denied);
+            }
+        }
+        return;
+    }
+
+    const char *slash = strchr(level, '/');
+    size_t len = slash? (size_t)(slash - level) : strlen(level);
+    const char *next_level = slash? slash + 1 : 0;
+    BOOL is_plus = (len == 1 && level[0] == '+');
+    BOOL is_hash = (len == 1 && level[0] == '#');
+    BOOL is_sys = (first_level && level[0] == '$'); // wildcards don't match $ topics
+
+    for(acl_node_t *child = node->child; child; child = child->sibling) {
+        const char *cl = child->level;
+        if(strcmp(cl, "#")==0) {
+            if(!is_sys) {
+                acl_apply_rules(gobj, child->rules, granted, denied);
+            }
+            continue;
+        }
+        if(is_hash) {
+            continue;
+        }
+        if(strcmp(cl, "+")==0) {
+            if(!is_sys) {
+                acl_match(gobj, child, next_level, FALSE, granted, denied);
+            }
+            continue;
+        }
+        if(is_plus) {
+            continue;
+        }
+        if(strcmp(cl, "%c")==0) {
+            cl = priv->client_id;
+        } else if(strcmp(cl, "%u")==0) {
+            cl = priv->username;
+        }
+        if(!empty_string(cl) && strlen(cl) == len && strncmp(cl, level, len)==0) {
+            acl_match(gobj, child, next_level, FALSE, granted, denied);
+        }
     }
-    /* We don't use Reason String or User Property yet. */
-    return send_command_with_mid(gobj, CMD_PUBREC, mid, false, reason_code, properties);
 }
 
 /***************************************************************************
- *
+ *  Clear the acl decisions cached in the connection
  ***************************************************************************/
-PRIVATE int send__pubrel(hgobj gobj, uint16_t mid, json_t *properties)
+PRIVATE void acl_cache_clear(hgobj gobj)
 {
-    /* We don't use Reason String or User Property yet. */
-    return send_command_with_mid(gobj, CMD_PUBREL|2, mid, false, 0, properties);
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    for(int i=0; i<ACL_CACHE_SIZE; i++) {
+        GBMEM_FREE(priv->acl_cache[i].topic);
+    }
+    priv->acl_generation = acl_table.generation;
 }
 
 /***************************************************************************
- *
+ *  Set the roles of the connected user, used by role rules of acl
  ***************************************************************************/
-PRIVATE int send_publish(
-    hgobj gobj,
-    uint16_t mid,
-    const char *topic,
-    uint32_t payloadlen,
-    const void *payload,
-    uint8_t qos,
-    bool retain,
-    bool dup,
-    json_t *cmsg_props, // not owned
-    json_t *store_props, // not owned
-    uint32_t expiry_interval
-)
+PRIVATE void acl_set_roles(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    if(!priv->retain_available) {
-        retain = false;
-    }
-
-    if(gobj_trace_level(gobj) & SHOW_DECODE) {
-        trace_msg("👉👉 Sending PUBLISH to '%s', topic '%s' (dup %d, qos %d, retain %d, mid %d)",
-            SAFE_PRINT(priv->client_id),
-            topic,
-            dup,
-            qos,
-            retain,
-            mid
-        );
-    }
-
-    unsigned int packetlen;
-    unsigned int proplen = 0, varbytes;
-    json_t *expiry_prop = 0;
+    JSON_DECREF(priv->acl_roles)
+    acl_cache_clear(gobj);
 
-    if(topic) {
-        packetlen = 2 + (unsigned int)strlen(topic) + payloadlen;
-    } else {
-        packetlen = 2 + payloadlen;
+    if(!acl_table.root || empty_string(priv->username) || !priv->gobj_mqtt_users) {
+        return;
     }
-    if(qos > 0) {
-        packetlen += 2; /* For message id */
+    json_t *user = gobj_get_resource(priv->gobj_mqtt_users, priv->username, 0, 0);
+    json_t *roles = kw_get_list(user, "roles", 0, 0);
+    if(roles) {
+        priv->acl_roles = json_incref(roles);
     }
-    if(priv->protocol_version == mosq_p_mqtt5) {
-        proplen = 0;
-        proplen += property_get_length_all(cmsg_props);
-        proplen += property_get_length_all(store_props);
-        if(expiry_interval > 0) {
-            expiry_prop = json_object();
+}
 
-            mqtt_property_add_int32(
-                gobj, expiry_prop, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, expiry_interval
-            );
-            // expiry_prop.client_generated = false;
-            proplen += property_get_length_all(expiry_prop);
-        }
+/***************************************************************************
+ *  Check the access of the client of gobj to topic.
+ *  Return MOSQ_ERR_SUCCESS or MOSQ_ERR_ACL_DENIED
+ ***************************************************************************/
+PRIVATE int mosquitto_acl_check(hgobj gobj, const char *topic, uint8_t access)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-        varbytes = packet_varint_bytes(proplen);
-        if(varbytes > 4) {
-            /* FIXME - Properties too big, don't publish any - should remove some first really */
-            cmsg_props = NULL;
-            store_props = NULL;
-            expiry_interval = 0;
-        } else {
-            packetlen += proplen + varbytes;
-        }
+    if(acl_table.deny_all) {
+        return MOSQ_ERR_ACL_DENIED;
     }
-    if(packet_check_oversize(gobj, packetlen)) {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-            "msg",          "%s", "Dropping too large outgoing PUBLISH",
-            "packetlen",    "%d", packetlen,
-            NULL
-        );
-        return MOSQ_ERR_OVERSIZE_PACKET;
+    if(!acl_table.root) {
+        return MOSQ_ERR_SUCCESS;
     }
-
-    uint8_t command = (uint8_t)(CMD_PUBLISH | (uint8_t)((dup&0x1)<<3) | (uint8_t)(qos<<1) | retain);
-
-    GBUFFER *gbuf = build_mqtt_packet(gobj, command, packetlen);
-    if(!gbuf) {
-        // Error already logged
-        return MOSQ_ERR_NOMEM;
+    if(priv->acl_generation != acl_table.generation) {
+        acl_cache_clear(gobj);
     }
 
-    /* Variable header (topic string) */
-    if(topic) {
-        mqtt_write_string(gbuf, topic);
-    } else {
-        mqtt_write_uint16(gbuf, 0);
-    }
-    if(qos > 0) {
-        mqtt_write_uint16(gbuf, mid);
+    uint32_t hash = str_hash(topic);
+    acl_cache_entry_t *entry = &priv->acl_cache[(hash + access) & (ACL_CACHE_SIZE-1)];
+    if(entry->topic && entry->hash == hash && entry->access == access &&
+            strcmp(entry->topic, topic)==0) {
+        return entry->allowed? MOSQ_ERR_SUCCESS : MOSQ_ERR_ACL_DENIED;
     }
 
-    if(priv->protocol_version == mosq_p_mqtt5) {
-        mqtt_write_varint(gbuf, proplen);
-        property_write_all(gobj, gbuf, cmsg_props, false);
-        property_write_all(gbuf, gbuf, store_props, false);
-        if(expiry_interval > 0) {
-            property_write_all(gobj, gbuf, expiry_prop, false);
-        }
-    }
-    JSON_DECREF(expiry_prop);
+    uint8_t granted = 0;
+    uint8_t denied = 0;
+    acl_match(gobj, acl_table.root, topic, TRUE, &granted, &denied);
+    BOOL allowed = ((granted & access) && !(denied & access))? TRUE : FALSE;
 
-    /* Payload */
-    if(payloadlen) {
-        mqtt_write_bytes(gbuf, payload, payloadlen);
-    }
+    GBMEM_FREE(entry->topic);
+    entry->topic = gbmem_strdup(topic);
+    entry->hash = hash;
+    entry->access = access;
+    entry->allowed = allowed;
 
-    return send_packet(gobj, gbuf);
+    return allowed? MOSQ_ERR_SUCCESS : MOSQ_ERR_ACL_DENIED;
 }
 
 /***************************************************************************
- * Check that a topic used for publishing is valid.
- * Search for + or # in a topic. Return MOSQ_ERR_INVAL if found.
- * Also returns MOSQ_ERR_INVAL if the topic string is too long.
- * Returns MOSQ_ERR_SUCCESS if everything is fine.
+ *  Is the mid in dl_msgs_in?
  ***************************************************************************/
-PRIVATE int mosquitto_pub_topic_check(const char *str)
+PRIVATE BOOL msgs_in_has_mid(PRIVATE_DATA *priv, uint16_t mid)
 {
-    int len = 0;
-    int hier_count = 0;
-
-    if(str == NULL) {
-        return -1;
-    }
-
-    while(str && str[0]) {
-        if(str[0] == '+' || str[0] == '#') {
-            return MOSQ_ERR_INVAL;
-        } else if(str[0] == '/') {
-            hier_count++;
-        }
-        len++;
-        str = &str[1];
-    }
-    if(len > 65535) {
-        return -1;
-    }
-    if(hier_count > TOPIC_HIERARCHY_LIMIT) {
-        return -1;
+    if(!priv->mids_in) {
+        return FALSE;
     }
-
-    return 0;
+    return (priv->mids_in[mid >> 3] & (1 << (mid & 7)))? TRUE: FALSE;
 }
 
 /***************************************************************************
- * Check that a topic used for subscriptions is valid.
- * Search for + or # in a topic, check they aren't in invalid positions such as
- * foo/#/bar, foo/+bar or foo/bar#.
- * Return MOSQ_ERR_INVAL if invalid position found.
- * Also returns MOSQ_ERR_INVAL if the topic string is too long.
- * Returns MOSQ_ERR_SUCCESS if everything is fine.
+ *  Add a message to dl_msgs_in, waiting for PUBREL
  ***************************************************************************/
-PRIVATE int mosquitto_sub_topic_check(const char *str)
+PRIVATE int msgs_in_add(hgobj gobj, struct mosquitto_client_msg *msg)
 {
-    char c = '\0';
-    int len = 0;
-    int hier_count = 0;
-
-    if(str == NULL) {
-        return MOSQ_ERR_INVAL;
-    }
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    while(str[0]) {
-        if(str[0] == '+') {
-            if((c != '\0' && c != '/') || (str[1] != '\0' && str[1] != '/')) {
-                return MOSQ_ERR_INVAL;
-            }
-        } else if(str[0] == '#') {
-            if((c != '\0' && c != '/')  || str[1] != '\0') {
-                return MOSQ_ERR_INVAL;
-            }
-        } else if(str[0] == '/') {
-            hier_count++;
-        }
-        len++;
-        c = str[0];
-        str = &str[1];
-    }
-    if(len > 65535) {
-        return MOSQ_ERR_INVAL;
-    }
-    if(hier_count > TOPIC_HIERARCHY_LIMIT) {
-        return MOSQ_ERR_INVAL;
+    if(!priv->mids_in) {
+        priv->mids_in = gbmem_malloc(65536/8);
+        if(!priv->mids_in) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "no memory for mids bitmap",
+                NULL
+            );
+            return MOSQ_ERR_NOMEM;
+        }
     }
+    priv->mids_in[msg->mid >> 3] |= (uint8_t)(1 << (msg->mid & 7));
+    priv->msgs_in_inflight++;
 
-    return MOSQ_ERR_SUCCESS;
+    dl_insert(&priv->dl_msgs_in, msg);
+    return 0;
 }
 
 /***************************************************************************
- *  Publishing: get subscribers
+ *  Remove a message from dl_msgs_in
  ***************************************************************************/
-PRIVATE json_t *sub_get_subscribers(
-    hgobj gobj,
-    const char *topic_name
-)
+PRIVATE void msgs_in_delete(hgobj gobj, struct mosquitto_client_msg *msg)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
-    json_t *jn_subscribers = json_object();
-
-    /*
-     *  Search subscriptions in clients
-     */
-    json_t *jn_clients = gobj_list_resource(priv->gobj_mqtt_clients, "", 0, 0);
 
-    int idx; json_t *client;
-    json_array_foreach(jn_clients, idx, client) {
-        json_t *jn_subscriptions = kw_get_dict(client, "subscriptions", 0, KW_REQUIRED);
-        if(json_object_size(jn_subscriptions)==0) {
-            continue;
-        }
-        BOOL isConnected = kw_get_bool(client, "isConnected", 0, KW_REQUIRED);
-        const char *client_id = kw_get_str(client, "id", "", KW_REQUIRED);
-        const char *topic_name_; json_t *subscription;
-        json_object_foreach(jn_subscriptions, topic_name_, subscription) {
-            int qos = kw_get_int(subscription, "qos", 0, KW_REQUIRED);
-            if(isConnected || (!isConnected && qos > 0)) {
-                if(strcmp(topic_name, topic_name_)==0) { // TODO change strcmp() by match_topic()
-                    json_t *client_with_subscriptions = kw_get_dict(
-                        jn_subscribers, client_id, json_object(), KW_CREATE
-                    );
-                    json_t *subscriptions = kw_get_dict(
-                        client_with_subscriptions, "subscriptions", json_object(), KW_CREATE
-                    );
-                    json_object_set(subscriptions, topic_name, subscription);
-                }
-            }
-        }
+    if(priv->mids_in) {
+        priv->mids_in[msg->mid >> 3] &= (uint8_t)~(1 << (msg->mid & 7));
+    }
+    if(priv->msgs_in_inflight > 0) {
+        priv->msgs_in_inflight--;
     }
-    JSON_DECREF(jn_clients);
-    return jn_subscribers;
+    dl_delete(&priv->dl_msgs_in, msg, db_free_client_msg);
 }
 
 /***************************************************************************
- *
+ *  Remove all messages from dl_msgs_in
+ ***************************************************************************/
+PRIVATE void msgs_in_flush(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    dl_flush(&priv->dl_msgs_in, db_free_client_msg);
+    priv->msgs_in_inflight = 0;
+    GBMEM_FREE(priv->mids_in);
+}
+
+/***************************************************************************
+ *  Return a new reference of the store of the incoming mid, or NULL.
+ *  The bitmap avoids walking dl_msgs_in for the mids not in flight.
  ***************************************************************************/
 PRIVATE struct mosquitto_msg_store *db_message_store_find(hgobj gobj, int mid)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
+    if(!msgs_in_has_mid(priv, (uint16_t)mid)) {
+        return 0;
+    }
+
     struct mosquitto_client_msg *tail = dl_first(&priv->dl_msgs_in);
     while(tail) {
         if(tail->store->source_mid == mid) {
-            return tail->store;
+            return db_duplicate_msg(gobj, tail->store);
         }
         /*
          *  Next
@@ -4235,7 +8774,7 @@ PRIVATE int db__message_release_incoming(hgobj gobj, uint16_t mid)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    char *topic;
+    const char *topic;
     bool deleted = false;
 
     struct mosquitto_client_msg *tail = dl_first(&priv->dl_msgs_in);
@@ -4251,21 +8790,19 @@ PRIVATE int db__message_release_incoming(hgobj gobj, uint16_t mid)
              * keep resending it. That means we don't send it to other
              * clients. */
             if(topic == NULL) {
-                dl_delete(&priv->dl_msgs_in, tail, db_free_client_msg);
+                msgs_in_delete(gobj, tail);
                 deleted = true;
             } else {
                 struct mosquitto_msg_store *stored = tail->store;
-                json_t *jn_subscribers = sub_get_subscribers(gobj, stored->topic);
                 XXX_sub__messages_queue(
                     gobj,
-                    jn_subscribers,
                     stored->topic,
                     2,
                     stored->retain,
                     stored
                 );
 
-                dl_delete(&priv->dl_msgs_in, tail, db_free_client_msg);
+                msgs_in_delete(gobj, tail);
                 deleted = true;
             }
             break; // TODO salgo? sino salgo asegura el bucle
@@ -4297,7 +8834,7 @@ PRIVATE int db__message_remove_incoming(hgobj gobj, int mid)
             if(tail->qos != 2) {
                 return MOSQ_ERR_PROTOCOL;
             }
-            dl_delete(&priv->dl_msgs_in, tail, db_free_client_msg);
+            msgs_in_delete(gobj, tail);
             return MOSQ_ERR_SUCCESS;
         }
         /*
@@ -4369,6 +8906,18 @@ PRIVATE int db__message_update_outgoing(
  ***************************************************************************/
 PRIVATE bool db__ready_for_flight(hgobj gobj, enum mosquitto_msg_direction dir, int qos)
 {
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(dir == mosq_md_in) {
+        /*
+         *  Only qos 2 messages stay in flight (waiting PUBREL),
+         *  qos 1 are acknowledged at reception.
+         */
+        if(qos < 2 || priv->max_inflight_messages == 0) {
+            return true;
+        }
+        return (priv->msgs_in_inflight < priv->max_inflight_messages)? true : false;
+    }
     return true;
 }
 
@@ -4385,24 +8934,25 @@ PRIVATE int db__message_store(
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    GBMEM_FREE(stored->source_id);
-    if(priv->client_id) {
-        stored->source_id = gbmem_strdup(priv->client_id);
+    intern_release(stored->source_id);
+    if(priv->session) {
+        stored->source_id = intern_incref(priv->session->client_id);
     } else {
-        stored->source_id = gbmem_strdup("");
+        stored->source_id = intern_string(priv->client_id? priv->client_id : "");
     }
     if(!stored->source_id) {
         // Error already logged
-        GBMEM_FREE(stored);
+        db_free_msg_store(stored);
         return MOSQ_ERR_NOMEM;
     }
 
-    GBMEM_FREE(stored->source_username);
+    intern_release(stored->source_username);
+    stored->source_username = 0;
     if(priv->username) {
-        stored->source_username = gbmem_strdup(priv->username);
+        stored->source_username = intern_string(priv->username);
         if(!stored->source_username) {
             // Error already logged
-            GBMEM_FREE(stored);
+            db_free_msg_store(stored);
             return MOSQ_ERR_NOMEM;
         }
     }
@@ -4428,24 +8978,11 @@ PRIVATE struct mosquitto_msg_store *db_duplicate_msg(
     struct mosquitto_msg_store *stored
 )
 {
-    struct mosquitto_msg_store *store_dup = gbmem_malloc(sizeof(struct mosquitto_msg_store));
-
-    store_dup->topic = gbmem_strdup(stored->topic);
-    store_dup->payload = gbmem_malloc(stored->payloadlen);
-    memcpy(store_dup->payload, stored->payload, stored->payloadlen);
-    store_dup->payloadlen = stored->payloadlen;
-    store_dup->mid = stored->mid;
-    store_dup->qos = stored->qos;
-    store_dup->retain = stored->retain;
-
-    store_dup->message_expiry_time = stored->message_expiry_time;
-    store_dup->source_id = gbmem_strdup(stored->source_id);
-    store_dup->source_username = gbmem_strdup(stored->source_username);
-    // TODO int ref_count; usa referencias
-    store_dup->source_mid = stored->source_mid;
-    store_dup->properties = json_incref(stored->properties);
-
-    return store_dup;
+    /*
+     *  The store is not modified once stored, share it.
+     */
+    stored->ref_count++;
+    return stored;
 }
 
 /***************************************************************************
@@ -4457,7 +8994,7 @@ PRIVATE void db_free_client_msg(void *client_msg_)
 
     JSON_DECREF(client_msg->properties);
     db_free_msg_store(client_msg->store);
-    GBMEM_FREE(client_msg);
+    pool_free(&pool_client_msg, client_msg);
 }
 
 /***************************************************************************
@@ -4467,12 +9004,21 @@ PRIVATE void db_free_msg_store(void *store_)
 {
     struct mosquitto_msg_store *store = store_;
 
-    GBMEM_FREE(store->source_id);
-    GBMEM_FREE(store->source_username);
-    GBMEM_FREE(store->topic);
+    if(--store->ref_count > 0) {
+        return;
+    }
+    intern_release(store->source_id);
+    intern_release(store->source_username);
+    intern_release(store->topic);
     JSON_DECREF(store->properties);
-    GBMEM_FREE(store->payload);
-    GBMEM_FREE(store);
+    if(store->spool_base) {
+        munmap(store->spool_base, store->spool_len);
+        unlink(store->spool_file);
+        GBMEM_FREE(store->spool_file);
+    } else {
+        GBMEM_FREE(store->payload);
+    }
+    pool_free(&pool_msg_store, store);
 }
 
 /***************************************************************************
@@ -4553,7 +9099,7 @@ PRIVATE int XXX_db__message_insert(
             break;
     }
 
-    msg = gbmem_malloc(sizeof(struct mosquitto_client_msg));
+    msg = pool_alloc(&pool_client_msg);
     if(!msg) {
         // Error already logged
         return MOSQ_ERR_NOMEM;
@@ -4573,6 +9119,13 @@ PRIVATE int XXX_db__message_insert(
     msg->retain = retain;
     msg->properties = json_incref(properties);
 
+    if(msg->state == mosq_ms_publish_qos0) {
+        qos0_flush(gobj);
+        if(qos0_hold(gobj, msg)) {
+            return MOSQ_ERR_SUCCESS;
+        }
+    }
+
     dl_insert(&priv->dl_msgs_out, msg);
 
     switch(msg->state) {
@@ -4588,7 +9141,8 @@ PRIVATE int XXX_db__message_insert(
                 msg->dup,
                 properties,
                 stored->properties,
-                expiry_interval
+                expiry_interval,
+                stored
             );
             dl_delete(&priv->dl_msgs_out, msg, db_free_client_msg);
             break;
@@ -4605,7 +9159,8 @@ PRIVATE int XXX_db__message_insert(
                 msg->dup,
                 properties,
                 stored->properties,
-                expiry_interval
+                expiry_interval,
+                stored
             );
             if(rc == MOSQ_ERR_SUCCESS) {
                 msg->timestamp = time_in_seconds();
@@ -4628,7 +9183,8 @@ PRIVATE int XXX_db__message_insert(
                 msg->dup,
                 properties,
                 stored->properties,
-                expiry_interval
+                expiry_interval,
+                stored
             );
             if(rc == MOSQ_ERR_SUCCESS) {
                 msg->timestamp = time_in_seconds();
@@ -4639,216 +9195,892 @@ PRIVATE int XXX_db__message_insert(
             }
             break;
 
-        case mosq_ms_resend_pubrel:
-            send__pubrel(gobj, mid, NULL);
-            msg->state = mosq_ms_wait_for_pubcomp;
-            break;
+        case mosq_ms_resend_pubrel:
+            send__pubrel(gobj, mid, NULL);
+            msg->state = mosq_ms_wait_for_pubcomp;
+            break;
+
+        case mosq_ms_invalid:
+        case mosq_ms_send_pubrec:
+        case mosq_ms_resend_pubcomp:
+        case mosq_ms_wait_for_puback:
+        case mosq_ms_wait_for_pubrec:
+        case mosq_ms_wait_for_pubrel:
+        case mosq_ms_wait_for_pubcomp:
+        case mosq_ms_queued:
+            break;
+    }
+
+    return rc;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int XXX_save_message_to_pubrec(
+    hgobj gobj,
+    uint16_t mid,
+    uint8_t qos,
+    bool retain,
+    struct mosquitto_msg_store *stored,
+    json_t *properties
+)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    int rc = 0;
+
+    //printf("================> IN Client %s\n", priv->client_id);
+    //print_queue("dl_msgs_in", &priv->dl_msgs_in);
+
+    struct mosquitto_client_msg *msg;
+    enum mosquitto_msg_state state = mosq_ms_invalid;
+//     int i;
+//     char **dest_ids;
+
+    if(qos == 2) {
+        state = mosq_ms_wait_for_pubrel;
+    } else {
+        JSON_DECREF(properties)
+        return 1;
+    }
+
+    msg = pool_alloc(&pool_client_msg);
+    if(!msg) {
+        // Error already logged
+        return MOSQ_ERR_NOMEM;
+    }
+
+    msg->store = db_duplicate_msg(gobj, stored);
+    msg->mid = mid;
+    msg->timestamp = time_in_seconds();
+    msg->direction = mosq_md_in;
+    msg->state = state;
+    msg->dup = false;
+    if(qos > priv->max_qos) {
+        msg->qos = priv->max_qos;
+    } else {
+        msg->qos = qos;
+    }
+    msg->retain = retain;
+    msg->properties = properties;
+
+    rc = msgs_in_add(gobj, msg);
+    if(rc < 0) {
+        // Error already logged
+        db_free_client_msg(msg);
+    }
+
+    return rc;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE uint16_t mosquitto__mid_generate(mqtt_session_t *session)
+{
+    session->last_mid++;
+    if(session->last_mid == 0) {
+        session->last_mid++;
+    }
+    return session->last_mid;
+}
+
+/***************************************************************************
+ *  Take a received PUBLISH from the token buckets of the client.
+ *  When a bucket is empty the input is held until it refills.
+ ***************************************************************************/
+PRIVATE void rate_limit_consume(hgobj gobj, size_t bytes)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->rate_limit_msgs && !priv->rate_limit_bytes) {
+        return;
+    }
+
+    uint64_t now = time_in_miliseconds();
+    int64_t elapsed = priv->rl_last_time? (int64_t)(now - priv->rl_last_time) : 1000;
+    priv->rl_last_time = now;
+
+    uint64_t wait = 0;
+    if(priv->rate_limit_msgs) {
+        int64_t rate = priv->rate_limit_msgs;
+        priv->rl_msgs_tokens += elapsed * rate;
+        if(priv->rl_msgs_tokens > rate * 1000) {
+            priv->rl_msgs_tokens = rate * 1000;   // burst of one second
+        }
+        priv->rl_msgs_tokens -= 1000;
+        if(priv->rl_msgs_tokens < 0) {
+            uint64_t w = (uint64_t)((-priv->rl_msgs_tokens + rate - 1) / rate);
+            if(w > wait) {
+                wait = w;
+            }
+        }
+    }
+    if(priv->rate_limit_bytes) {
+        int64_t rate = priv->rate_limit_bytes;
+        priv->rl_bytes_tokens += elapsed * rate;
+        if(priv->rl_bytes_tokens > rate * 1000) {
+            priv->rl_bytes_tokens = rate * 1000;
+        }
+        priv->rl_bytes_tokens -= (int64_t)bytes * 1000;
+        if(priv->rl_bytes_tokens < 0) {
+            uint64_t w = (uint64_t)((-priv->rl_bytes_tokens + rate - 1) / rate);
+            if(w > wait) {
+                wait = w;
+            }
+        }
+    }
+
+    if(wait > 0) {
+        throttle_input(gobj, wait);
+    }
+}
+
+/***************************************************************************
+ *  Hold the input of the client for msec
+ ***************************************************************************/
+PRIVATE void throttle_input(hgobj gobj, uint64_t msec)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    uint64_t until = time_in_miliseconds() + msec;
+    if(until > priv->throttle_until) {
+        priv->throttle_until = until;
+        keepalive_arm(gobj);
+    }
+
+    /*
+     *  Stop reading the socket, the data stays in the kernel until the resume
+     */
+    hgobj gobj_bottom = gobj_bottom_gobj(gobj);
+    if(!priv->input_paused && gobj_bottom && gobj_is_running(gobj_bottom)) {
+        gobj_pause(gobj_bottom);
+        priv->input_paused = TRUE;
+    }
+}
+
+/***************************************************************************
+ *  Keep the data received while throttled, the data read by the bottom
+ *  before it was paused. More than MAX_THROTTLED_INPUT means that
+ *  the bottom doesn't stop reading, the client is disconnected.
+ *  Return TRUE if the data was held.
+ ***************************************************************************/
+PRIVATE BOOL throttle_hold_input(hgobj gobj, GBUFFER *gbuf)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->throttle_until) {
+        return FALSE;
+    }
+    size_t len = gbuf_leftbytes(gbuf);
+    if(!len) {
+        return TRUE;
+    }
+    size_t held = priv->gbuf_throttled? gbuf_leftbytes(priv->gbuf_throttled) : 0;
+    if(held + len > MAX_THROTTLED_INPUT) {
+        log_warning(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt: input not paused by rate limit, disconnecting",
+            "client_id",    "%s", SAFE_PRINT(priv->client_id),
+            "held",         "%lu", (unsigned long)held,
+            NULL
+        );
+        if(priv->protocol_version == mosq_p_mqtt5) {
+            send_disconnect(gobj, MQTT_RC_MESSAGE_RATE_TOO_HIGH, NULL);
+        }
+        ws_close(gobj, MQTT_RC_MESSAGE_RATE_TOO_HIGH);
+        return TRUE;
+    }
+    if(!priv->gbuf_throttled) {
+        priv->gbuf_throttled = gbuf_create(len, MAX_THROTTLED_INPUT, 0, 0);
+        if(!priv->gbuf_throttled) {
+            // Error already logged
+            ws_close(gobj, MQTT_RC_UNSPECIFIED);
+            return TRUE;
+        }
+    }
+    gbuf_append_gbuf(priv->gbuf_throttled, gbuf);
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Process the held input if the throttle is over.
+ *  Return TRUE if the throttle was over.
+ ***************************************************************************/
+PRIVATE BOOL throttle_resume_if_due(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->throttle_until || time_in_miliseconds() < priv->throttle_until) {
+        return FALSE;
+    }
+    priv->throttle_until = 0;
+
+    hgobj gobj_bottom = gobj_bottom_gobj(gobj);
+    if(priv->input_paused) {
+        priv->input_paused = FALSE;
+        if(gobj_bottom && gobj_is_running(gobj_bottom)) {
+            gobj_play(gobj_bottom);
+        }
+    }
+
+    GBUFFER *gbuf = priv->gbuf_throttled;
+    priv->gbuf_throttled = 0;
+    if(gbuf) {
+        json_t *kw = json_pack("{s:I}",
+            "gbuffer", (json_int_t)(size_t)gbuf
+        );
+        gobj_send_event(gobj, "EV_RX_DATA", kw, gobj);
+    }
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Is the client of gobj a slow consumer?
+ *  Its queue are the messages waiting acknowledge
+ *  and the packets waiting in the write queue of the bottom.
+ ***************************************************************************/
+PRIVATE BOOL is_slow_consumer(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->slow_consumer_queue) {
+        return FALSE;
+    }
+    size_t queued = dl_size(&priv->dl_msgs_out);
+    hgobj gobj_bottom = gobj_bottom_gobj(gobj);
+    if(gobj_bottom && gobj_has_attr(gobj_bottom, "cur_tx_queue")) {
+        queued += gobj_read_uint32_attr(gobj_bottom, "cur_tx_queue");
+    }
+    BOOL slow = (queued >= priv->slow_consumer_queue)? TRUE : FALSE;
+    if(slow != priv->slow_consumer) {
+        priv->slow_consumer = slow;
+        log_warning(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", slow? "Mqtt: slow consumer" : "Mqtt: slow consumer recovered",
+            "client_id",    "%s", SAFE_PRINT(priv->client_id),
+            "policy",       "%s", SAFE_PRINT(priv->slow_consumer_policy),
+            "queued",       "%lu", (unsigned long)queued,
+            NULL
+        );
+    }
+    return slow;
+}
+
+/***************************************************************************
+ *  Return TRUE if the message must not be sent to a slow consumer
+ ***************************************************************************/
+PRIVATE BOOL slow_consumer_skip(hgobj gobj, hgobj gobj_subscriber, uint8_t qos)
+{
+    PRIVATE_DATA *priv_sub = gobj_priv_data(gobj_subscriber);
+
+    if(!is_slow_consumer(gobj_subscriber)) {
+        return FALSE;
+    }
+
+    const char *policy = SAFE_PRINT(priv_sub->slow_consumer_policy);
+    if(strcmp(policy, "disconnect")==0) {
+        if(priv_sub->protocol_version == mosq_p_mqtt5) {
+            send_disconnect(gobj_subscriber, MQTT_RC_QUOTA_EXCEEDED, NULL);
+        }
+        ws_close(gobj_subscriber, MQTT_RC_QUOTA_EXCEEDED);
+        return TRUE;
+
+    } else if(strcmp(policy, "throttle")==0) {
+        /*
+         *  The message is sent, but the publisher is slowed down
+         */
+        if(gobj != gobj_subscriber) {
+            throttle_input(gobj, 100);
+        }
+        return FALSE;
+
+    } else {
+        /*
+         *  "drop": the QoS 0 messages are held and the oldest are lost,
+         *  see qos0_hold(), the others are queued
+         */
+        return FALSE;
+    }
+}
+
+/***************************************************************************
+ *  Send a QoS 0 message
+ ***************************************************************************/
+PRIVATE int qos0_send(hgobj gobj, struct mosquitto_client_msg *msg)
+{
+    struct mosquitto_msg_store *stored = msg->store;
+
+    uint32_t expiry_interval = 0;
+    if(stored->message_expiry_time) {
+        if(time_in_seconds() > stored->message_expiry_time) {
+            /* Message is expired, must not send. */
+            return MOSQ_ERR_SUCCESS;
+        }
+        expiry_interval = (uint32_t)(stored->message_expiry_time - time_in_seconds());
+    }
+
+    return send_publish(
+        gobj,
+        msg->mid,
+        stored->topic,
+        stored->payloadlen,
+        stored->payload,
+        0,
+        msg->retain,
+        false,
+        msg->properties,
+        stored->properties,
+        expiry_interval,
+        stored
+    );
+}
+
+/***************************************************************************
+ *  Hold a QoS 0 message while the client is a slow consumer with "drop" policy.
+ *  The held messages are a queue of up to slow_consumer_queue,
+ *  when it's full the oldest, at the head, is lost.
+ *  Return TRUE if the message was held.
+ ***************************************************************************/
+PRIVATE BOOL qos0_hold(hgobj gobj, struct mosquitto_client_msg *msg)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(strcmp(SAFE_PRINT(priv->slow_consumer_policy), "drop")!=0) {
+        return FALSE;
+    }
+    if(dl_size(&priv->dl_msgs_qos0) == 0 && !priv->slow_consumer) {
+        return FALSE;
+    }
 
-        case mosq_ms_invalid:
-        case mosq_ms_send_pubrec:
-        case mosq_ms_resend_pubcomp:
-        case mosq_ms_wait_for_puback:
-        case mosq_ms_wait_for_pubrec:
-        case mosq_ms_wait_for_pubrel:
-        case mosq_ms_wait_for_pubcomp:
-        case mosq_ms_queued:
-            break;
+    dl_add(&priv->dl_msgs_qos0, msg);
+    while(dl_size(&priv->dl_msgs_qos0) > priv->slow_consumer_queue) {
+        dl_delete(&priv->dl_msgs_qos0, dl_first(&priv->dl_msgs_qos0), db_free_client_msg);
+        gobj_write_uint32_attr(gobj, "slow_consumer_drops",
+            gobj_read_uint32_attr(gobj, "slow_consumer_drops") + 1
+        );
     }
+    return TRUE;
+}
 
-    return rc;
+/***************************************************************************
+ *  Send the held QoS 0 messages, oldest first, while the client keeps up
+ ***************************************************************************/
+PRIVATE void qos0_flush(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    struct mosquitto_client_msg *msg;
+    while((msg = dl_first(&priv->dl_msgs_qos0)) && !is_slow_consumer(gobj)) {
+        dl_delete(&priv->dl_msgs_qos0, msg, 0);
+        qos0_send(gobj, msg);
+        db_free_client_msg(msg);
+    }
 }
 
 /***************************************************************************
- *
+ *  Keep a QoS>0 message for a session whose client is offline,
+ *  up to max_queued_messages.
  ***************************************************************************/
-PRIVATE int XXX_save_message_to_pubrec(
+PRIVATE int session_queue_offline(
     hgobj gobj,
+    mqtt_session_t *session,
     uint16_t mid,
     uint8_t qos,
     bool retain,
     struct mosquitto_msg_store *stored,
-    json_t *properties
+    json_t *properties // not owned
 )
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
-    int rc = 0;
 
-    //printf("================> IN Client %s\n", priv->client_id);
-    //print_queue("dl_msgs_in", &priv->dl_msgs_in);
-
-    struct mosquitto_client_msg *msg;
-    enum mosquitto_msg_state state = mosq_ms_invalid;
-//     int i;
-//     char **dest_ids;
-
-    if(qos == 2) {
-        state = mosq_ms_wait_for_pubrel;
-    } else {
-        JSON_DECREF(properties)
-        return 1;
+    if(priv->max_queued_messages > 0 &&
+            dl_size(&session->dl_msgs_offline) >= priv->max_queued_messages) {
+        return -1;
     }
 
-    msg = gbmem_malloc(sizeof(struct mosquitto_client_msg));
+    struct mosquitto_client_msg *msg = pool_alloc(&pool_client_msg);
     if(!msg) {
         // Error already logged
-        return MOSQ_ERR_NOMEM;
+        return -1;
     }
-
     msg->store = db_duplicate_msg(gobj, stored);
     msg->mid = mid;
+    msg->qos = qos;
+    msg->retain = retain;
     msg->timestamp = time_in_seconds();
-    msg->direction = mosq_md_in;
-    msg->state = state;
+    msg->direction = mosq_md_out;
+    msg->state = mosq_ms_queued;
     msg->dup = false;
-    if(qos > priv->max_qos) {
-        msg->qos = priv->max_qos;
-    } else {
-        msg->qos = qos;
-    }
-    msg->retain = retain;
-    msg->properties = properties;
-
-    dl_insert(&priv->dl_msgs_in, msg);
+    msg->properties = json_incref(properties);
 
-    return rc;
+    dl_add(&session->dl_msgs_offline, msg);
+    snapshot_log_message(session, SNAPSHOT_OP_MESSAGE, msg);
+    return 0;
 }
 
 /***************************************************************************
- *
+ *  Deliver to the client the messages queued while it was offline.
+ *  The read acl is checked now, with the credentials of the client.
  ***************************************************************************/
-PRIVATE uint16_t mosquitto__mid_generate(hgobj gobj, const char *client_id)
+PRIVATE void session_replay_offline(hgobj gobj, mqtt_session_t *session)
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
-
-    json_t *client = gobj_get_resource(priv->gobj_mqtt_clients, client_id, 0, 0);
-    uint16_t last_mid = (uint16_t)kw_get_int(client, "last_mid", 0, KW_REQUIRED);
-
-    last_mid++;
-    if(last_mid == 0) {
-        last_mid++;
+    if(dl_size(&session->dl_msgs_offline) == 0) {
+        return;
     }
-    gobj_save_resource(priv->gobj_mqtt_clients, client_id, client, 0);
 
-    return last_mid;
+    struct mosquitto_client_msg *msg;
+    while((msg = dl_first(&session->dl_msgs_offline))) {
+        dl_delete(&session->dl_msgs_offline, msg, 0);
+        if(mosquitto_acl_check(gobj, msg->store->topic, MOSQ_ACL_READ) == MOSQ_ERR_SUCCESS) {
+            XXX_db__message_insert(
+                gobj, msg->mid, msg->qos, msg->retain, msg->store, msg->properties
+            );
+        }
+        db_free_client_msg(msg);
+    }
+    snapshot_log_session(session, SNAPSHOT_OP_SESSION);
 }
 
 /***************************************************************************
  *  Publishing: send the message to subscriber
+ *  Return 1 if the message was queued to the subscriber, 0 if not.
  ***************************************************************************/
 PRIVATE int XXX_subs__send(
     hgobj gobj,
-    const char *client_id,
+    mqtt_session_t *session,
+    mqtt_subscription_t *subscription,
     const char *topic_name, // used in mosquitto_acl_check()
-    json_t *subscription,
     uint8_t qos,
     int retain,
     struct mosquitto_msg_store *stored
 )
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
-
     json_t *properties = json_object();
     int rc2;
 
-    /* Check for ACL topic access. */
-    rc2 = MOSQ_ERR_SUCCESS; // rc2 = mosquitto_acl_check()
+    /* Check for ACL topic access, on replay if the client is offline. */
+    if(session->gobj) {
+        rc2 = mosquitto_acl_check(session->gobj, topic_name, MOSQ_ACL_READ);
+    } else {
+        rc2 = MOSQ_ERR_SUCCESS;
+    }
     if(rc2 == MOSQ_ERR_ACL_DENIED) {
         JSON_DECREF(properties)
-        return MOSQ_ERR_SUCCESS;
+        return 0;
     }
 
     uint8_t msg_qos;
-    uint8_t client_qos = kw_get_int(subscription, "qos", 0, KW_REQUIRED);
+    uint8_t client_qos = subscription->qos;
     if(qos > client_qos) {
         msg_qos = client_qos;
     } else {
         msg_qos = qos;
     }
 
+    if(session->gobj && slow_consumer_skip(gobj, session->gobj, msg_qos)) {
+        JSON_DECREF(properties)
+        return 0;
+    }
+
     uint16_t mid;
     if(msg_qos) {
-        mid = mosquitto__mid_generate(gobj, client_id);
+        mid = mosquitto__mid_generate(session);
     } else {
         mid = 0;
     }
 
     bool client_retain;
-    if(kw_get_bool(subscription, "retain_as_published", 0, KW_REQUIRED)) {
+    if(subscription->retain_as_published) {
         client_retain = retain;
     } else {
         client_retain = false;
     }
-    int identifier = kw_get_int(subscription, "identifier", -1, KW_REQUIRED);
+    int identifier = (int)subscription->identifier;
     if(identifier > 0) {
         mosquitto_property_add_varint(gobj, properties, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, identifier);
     }
 
-    json_t *client = gobj_get_resource(priv->gobj_mqtt_clients, client_id, 0, 0);
-    BOOL isConnected = kw_get_bool(client, "isConnected", 0, KW_REQUIRED);
-    if(isConnected) {
-        hgobj gobj_client = (hgobj)(size_t)kw_get_int(client, "_gobj", 0, KW_REQUIRED);
-        if(gobj_client) {
-            XXX_db__message_insert(gobj_client, mid, msg_qos, client_retain, stored, properties);
+    int queued = 0;
+    if(session->gobj) {
+        if(XXX_db__message_insert(
+                session->gobj, mid, msg_qos, client_retain, stored, properties
+            )==MOSQ_ERR_SUCCESS) {
+            queued = 1;
+        }
+    } else if(msg_qos > 0) {
+        if(session_queue_offline(
+                gobj, session, mid, msg_qos, client_retain, stored, properties
+            )==0) {
+            queued = 1;
         }
-    } else {
-        // TODO save the message if qos > 0 ?
-        // gobj_save_resource(priv->gobj_mqtt_clients, client_id, client, 0);
     }
 
     JSON_DECREF(properties)
+    return queued;
+}
+
+/***************************************************************************
+ *  Deliver the pending batch of inbound publishes to the upper layer
+ ***************************************************************************/
+PRIVATE int batch_flush(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->gbuf_batch) {
+        return 0;
+    }
+
+    json_t *kw = json_pack("{s:s, s:I, s:I}",
+        "mqtt_action", "publishing_batch",
+        "messages", (json_int_t)priv->batch_count,
+        "gbuffer", (json_int_t)(size_t)priv->gbuf_batch
+    );
+    priv->gbuf_batch = 0;
+    priv->batch_count = 0;
+    priv->batch_deadline = 0;
+
+    return gobj_publish_event(gobj, "EV_ON_MESSAGE", kw);
+}
+
+/***************************************************************************
+ *  Deliver the pending batch if its time is over.
+ *  Return TRUE if it was delivered.
+ ***************************************************************************/
+PRIVATE BOOL batch_flush_if_due(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->gbuf_batch || time_in_miliseconds() < priv->batch_deadline) {
+        return FALSE;
+    }
+    batch_flush(gobj);
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Add a inbound publish to the batch.
+ *  The entries are appended to a single gbuffer:
+ *  mqtt_batch_entry_t, topic with null, payload, padding to 8 bytes.
+ ***************************************************************************/
+PRIVATE int batch_add(hgobj gobj, const char *topic_name, const void *payload, size_t payloadlen)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    static const char padding[8] = {0};
+
+    mqtt_batch_entry_t entry;
+    entry.topic_len = (uint32_t)strlen(topic_name);
+    entry.payload_len = (uint32_t)payloadlen;
+    size_t entry_size = sizeof(entry) + entry.topic_len + 1 + payloadlen;
+    size_t pad = (8 - (entry_size & 7)) & 7;
+
+    if(priv->gbuf_batch &&
+            gbuf_totalbytes(priv->gbuf_batch) + entry_size + pad > BATCH_MAX_SIZE) {
+        /*
+         *  Batch buffer full, deliver it and start other.
+         */
+        batch_flush(gobj);
+    }
+
+    if(!priv->gbuf_batch) {
+        size_t size = (entry_size + pad) * priv->batch_max_messages;
+        if(size < 4*1024) {
+            size = 4*1024;
+        } else if(size > 1024*1024) {
+            size = 1024*1024;
+        }
+        size_t max_size = BATCH_MAX_SIZE;
+        if(max_size < entry_size + pad) {
+            max_size = entry_size + pad;  // a batch always holds at least one message
+        }
+        priv->gbuf_batch = gbuf_create(size, max_size, 0, 0);
+        if(!priv->gbuf_batch) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "gbuf_create() FAILED",
+                NULL
+            );
+            return -1;
+        }
+        priv->batch_count = 0;
+        priv->batch_deadline = time_in_miliseconds() + (priv->batch_interval_us + 999)/1000;
+        keepalive_arm(gobj);
+    }
+
+    gbuf_append(priv->gbuf_batch, &entry, sizeof(entry));
+    gbuf_append(priv->gbuf_batch, (void *)topic_name, entry.topic_len + 1);
+    if(payloadlen > 0) {
+        gbuf_append(priv->gbuf_batch, (void *)payload, payloadlen);
+    }
+    if(pad) {
+        gbuf_append(priv->gbuf_batch, (void *)padding, pad);
+    }
+    priv->batch_count++;
+
+    if(priv->batch_count >= priv->batch_max_messages) {
+        batch_flush(gobj);
+    }
     return 0;
 }
 
 /***************************************************************************
  *  Publishing: send the message to subscribers
+ *  Return the number of subscribers
  ***************************************************************************/
 PRIVATE int XXX_sub__messages_queue(
     hgobj gobj,
-    json_t *jn_subscribers,
     const char *topic_name,
     uint8_t qos,
     int retain,
     struct mosquitto_msg_store *stored
 )
 {
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    int subscribers = 0;
+
     /*
-     *  Search subscriptions in clients
+     *  Subscriptions with the topic as filter, from the topic index
+     *  TODO match wildcard filters
      */
-    const char *client_id; json_t *client;
-    json_object_foreach(jn_subscribers, client_id, client) {
-        json_t *jn_subscriptions = kw_get_dict(client, "subscriptions", 0, KW_REQUIRED);
-        if(json_object_size(jn_subscriptions)==0) {
-            continue;
+    intern_str_t *is = intern_find(topic_name);
+    mqtt_subscription_t *subscription = is? is->subscribers : 0;
+    while(subscription) {
+        mqtt_subscription_t *next = subscription->next_subscriber;
+        mqtt_session_t *session = subscription->session;
+        if(session->gobj || subscription->qos > 0) {
+            subscribers += XXX_subs__send(gobj, session, subscription, topic_name, qos, retain, stored);
+        }
+        subscription = next;
+    }
+
+    if(retain) {
+        // TODO int rc2 = retain__store(topic, *stored, split_topics);
+        //if(rc2) {
+        //    rc = rc2;
+        //}
+    }
+
+    if(stored->spool_file) {
+        /*
+         *  Spooled payload, the spool file lives while the message is referenced:
+         *  the upper layer gets its own link to the file, it removes it when done.
+         */
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s.msg", stored->spool_file);
+        if(link(stored->spool_file, path)<0) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+                "msg",          "%s", "link() spool file FAILED",
+                "path",         "%s", path,
+                "errno",        "%d", errno,
+                "serrno",       "%s", strerror(errno),
+                NULL
+            );
+            return subscribers;
+        }
+        json_t *kw = json_pack("{s:s, s:s, s:s, s:I}",
+            "mqtt_action", "publishing",
+            "topic", topic_name,
+            "spool_file", path,
+            "payload_size", (json_int_t)stored->payloadlen
+        );
+        if(payload_is_deflated(stored->properties)) {
+            /*
+             *  The spooled payload is kept as it arrived, deflated
+             */
+            json_object_set_new(kw, "content_encoding", json_string(COMPRESSION_DEFLATE));
         }
-        const char *topic_name_; json_t *subscription;
-        json_object_foreach(jn_subscriptions, topic_name_, subscription) {
-            XXX_subs__send(gobj, client_id, topic_name, subscription, qos, retain, stored);
+        gobj_publish_event(gobj, "EV_ON_MESSAGE", kw);
+        return subscribers;
+    }
+
+    if(priv->batch_max_messages > 0) {
+        batch_add(gobj, topic_name, stored->payload, stored->payloadlen);
+        return subscribers;
+    }
+
+    GBUFFER *gbuf_message = gbuf_create(stored->payloadlen, stored->payloadlen, 0, 0);
+    if(gbuf_message) {
+        if(stored->payloadlen > 0) {
+            // Can become without payload
+            gbuf_append(gbuf_message, stored->payload, stored->payloadlen);
         }
+        json_t *kw = json_pack("{s:s, s:s, s:I}",
+            "mqtt_action", "publishing",
+            "topic", topic_name,
+            "gbuffer", (json_int_t)(size_t)gbuf_message
+        );
+        gobj_publish_event(gobj, "EV_ON_MESSAGE", kw);
+    }
+
+    return subscribers;
+}
+
+/***************************************************************************
+ *  Discard the will of the connection
+ ***************************************************************************/
+PRIVATE void will_clear(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    GBMEM_FREE(priv->will_payload);
+    priv->will_payloadlen = 0;
+    gobj_write_bool_attr(gobj, "will", FALSE);
+}
+
+/***************************************************************************
+ *  Publish the will through the subscriptions, like a PUBLISH
+ ***************************************************************************/
+PRIVATE void will_publish(hgobj gobj, struct mosquitto_msg_store *msg)
+{
+    if(gobj_trace_level(gobj) & TRACE_CONNECT_DISCONNECT) {
+        log_info(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "msgset",       "%s", MSGSET_CONNECT_DISCONNECT,
+            "msg",          "%s", "Mqtt: publishing Will",
+            "client_id",    "%s", msg->source_id,
+            "topic",        "%s", msg->topic,
+            NULL
+        );
+    }
+    XXX_sub__messages_queue(gobj, msg->topic, (uint8_t)msg->qos, msg->retain, msg);
+    db_free_msg_store(msg);
+}
+
+/***************************************************************************
+ *  Detach the delayed will from the gobj and its session
+ ***************************************************************************/
+PRIVATE struct mosquitto_msg_store *will_take_delayed(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    struct mosquitto_msg_store *msg = priv->will_msg;
+    if(!msg) {
+        return 0;
+    }
+    mqtt_session_t *session = session_find(priv->will_client_id);
+    if(session && session->will_gobj == gobj) {
+        session->will_gobj = 0;
+    }
+    intern_release(priv->will_client_id);
+    priv->will_client_id = 0;
+    priv->will_msg = 0;
+    priv->will_deadline = 0;
+    return msg;
+}
+
+/***************************************************************************
+ *  Publish now the delayed will, if any
+ ***************************************************************************/
+PRIVATE void will_send_delayed(hgobj gobj)
+{
+    struct mosquitto_msg_store *msg = will_take_delayed(gobj);
+    if(msg) {
+        will_publish(gobj, msg);
+    }
+}
+
+/***************************************************************************
+ *  Discard the delayed will, if any
+ ***************************************************************************/
+PRIVATE void will_cancel_delayed(hgobj gobj)
+{
+    struct mosquitto_msg_store *msg = will_take_delayed(gobj);
+    if(msg) {
+        db_free_msg_store(msg);
+    }
+}
+
+/***************************************************************************
+ *  The connection is lost without a normal DISCONNECT:
+ *  publish the will, or keep it until the will delay interval is over.
+ *  Called with the client already disconnected from its session:
+ *  `client_id` is the interned id of the session that the gobj had,
+ *  `session_taken` if the session was taken by a new connection.
+ ***************************************************************************/
+PRIVATE int will_queue(hgobj gobj, const char *client_id, BOOL session_taken)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->iamServer || !priv->in_session || !priv->will || !client_id ||
+            empty_string(priv->will_topic)) {
+        return 0;
+    }
+
+    uint32_t delay = priv->will_delay_interval;
+    if(priv->protocol_version == mosq_p_mqtt5 && priv->session_expiry_interval < delay) {
+        delay = priv->session_expiry_interval;
+    }
+    if(session_taken && delay > 0) {
+        /*
+         *  Session taken by a new connection of the client
+         */
+        will_clear(gobj);
+        return 0;
+    }
+
+    if(mosquitto_acl_check(gobj, priv->will_topic, MOSQ_ACL_WRITE) != MOSQ_ERR_SUCCESS) {
+        log_warning(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt: Denied Will",
+            "client_id",    "%s", priv->client_id,
+            "topic",        "%s", priv->will_topic,
+            NULL
+        );
+        will_clear(gobj);
+        return 0;
+    }
+
+    struct mosquitto_msg_store *msg = pool_alloc(&pool_msg_store);
+    if(!msg) {
+        // Error already logged
+        will_clear(gobj);
+        return MOSQ_ERR_NOMEM;
+    }
+    msg->ref_count = 1;
+    msg->topic = intern_string(priv->will_topic);
+    msg->payload = priv->will_payload;  // the will payload is moved to the store
+    msg->payloadlen = (int)priv->will_payloadlen;
+    msg->qos = (int)priv->will_qos;
+    msg->retain = priv->will_retain;
+    priv->will_payload = 0;
+    priv->will_payloadlen = 0;
+    will_clear(gobj);
+
+    if(!msg->topic) {
+        // Error already logged
+        db_free_msg_store(msg);
+        return MOSQ_ERR_NOMEM;
     }
-
-    if(retain) {
-        // TODO int rc2 = retain__store(topic, *stored, split_topics);
-        //if(rc2) {
-        //    rc = rc2;
-        //}
+    if(db__message_store(gobj, msg, priv->will_expiry_interval)<0) {
+        // Error already logged
+        return MOSQ_ERR_NOMEM;
     }
-    JSON_DECREF(jn_subscribers);
 
-    GBUFFER *gbuf_message = gbuf_create(stored->payloadlen, stored->payloadlen, 0, 0);
-    if(gbuf_message) {
-        if(stored->payloadlen > 0) {
-            // Can become without payload
-            gbuf_append(gbuf_message, stored->payload, stored->payloadlen);
-        }
-        json_t *kw = json_pack("{s:s, s:s, s:I}",
-            "mqtt_action", "publishing",
-            "topic", topic_name,
-            "gbuffer", (json_int_t)(size_t)gbuf_message
-        );
-        gobj_publish_event(gobj, "EV_ON_MESSAGE", kw);
+    if(delay == 0) {
+        will_publish(gobj, msg);
+        return 0;
     }
 
-    return MOSQ_ERR_SUCCESS;
+    will_send_delayed(gobj);    // previous connection of this gobj, not expected
+    priv->will_msg = msg;
+    priv->will_deadline = time_in_miliseconds() + (uint64_t)delay * 1000;
+    priv->will_client_id = intern_incref(client_id);
+    mqtt_session_t *session = session_find(client_id);
+    if(session) {
+        session->will_gobj = gobj;
+    }
+    return 0;
 }
 
 /***************************************************************************
@@ -4872,8 +10104,8 @@ PRIVATE int add_subscription(
     /*
      *  Find client
      */
-    json_t *client  = gobj_get_resource(priv->gobj_mqtt_clients, priv->client_id, 0, 0);
-    if(!client) {
+    mqtt_session_t *session = priv->session;
+    if(!session) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
@@ -4885,17 +10117,8 @@ PRIVATE int add_subscription(
         return -1;
     }
 
-    /*
-     *  Get subscriptions
-     */
-    json_t *subscriptions = kw_get_dict(client, "subscriptions", 0, KW_REQUIRED);
-    if(!subscriptions) {
-        // Error already logged
-        return -1;
-    }
-
-    json_t *subscription_record = kw_get_dict(subscriptions, sub, 0, 0);
-    if(subscription_record) {
+    mqtt_subscription_t *subscription = session_find_subscription(session, sub);
+    if(subscription) {
         /*
          *  Client making a second subscription to same topic.
          *  Only need to update QoS and identifier (TODO sure?)
@@ -4918,48 +10141,31 @@ PRIVATE int add_subscription(
                 NULL
             );
         }
-
-        json_t *kw_subscription = json_pack("{s:i, s:I}",
-            "qos", (int)qos,
-            "identifier", (json_int_t)identifier
-        );
-        if(!kw_subscription) {
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-                "msg",          "%s", "json_pack() FAILED",
-                NULL
-            );
-            return MOSQ_ERR_NOMEM;
-        }
-        json_object_update_new(subscription_record, kw_subscription);
+        subscription->qos = qos;
+        subscription->identifier = identifier;
 
     } else {
         /*
          *  New subscription
          */
-        subscription_record = json_pack("{s:s, s:i, s:I, s:b, s:b}",
-            "id", sub,
-            "qos", (int)qos,
-            "identifier", (json_int_t)identifier,
-            "no_local", no_local,
-            "retain_as_published", retain_as_published
-        );
-        if(!subscription_record) {
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-                "msg",          "%s", "json_pack() FAILED",
-                NULL
-            );
+        subscription = session_add_subscription(session, sub);
+        if(!subscription) {
+            // Error already logged
             return MOSQ_ERR_NOMEM;
         }
+        subscription->qos = qos;
+        subscription->identifier = identifier;
+        subscription->no_local = no_local;
+        subscription->retain_as_published = retain_as_published;
+
         if(gobj_trace_level(gobj) & SHOW_DECODE) {
-            log_debug_json(0, subscription_record, "new subscription");
+            trace_msg("  👈 new subscription: client '%s', topic '%s', qos %d, identifier %d",
+                priv->client_id,
+                sub,
+                (int)qos,
+                (int)identifier
+            );
         }
-        json_object_set_new(subscriptions, sub, subscription_record);
     }
 
     // TODO don't save if qos == 0
@@ -4984,8 +10190,8 @@ PRIVATE int remove_subscription(
     /*
      *  Find client
      */
-    json_t *client  = gobj_get_resource(priv->gobj_mqtt_clients, priv->client_id, 0, 0);
-    if(!client) {
+    mqtt_session_t *session = priv->session;
+    if(!session) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
@@ -4997,35 +10203,395 @@ PRIVATE int remove_subscription(
         return -1;
     }
 
+    mqtt_subscription_t *subscription = session_find_subscription(session, sub);
+    if(!subscription) {
+        *reason = MQTT_RC_NO_SUBSCRIPTION_EXISTED;
+    } else {
+        dl_delete(&session->dl_subscriptions, subscription, db_free_subscription);
+    }
+
+    return 0;
+}
+
+/***************************************************************************
+ *  Remove all subscriptions for a client.
+ ***************************************************************************/
+PRIVATE int sub__clean_session(hgobj gobj, mqtt_session_t *session)
+{
     /*
-     *  Get subscriptions
+     *  Reset subscriptions and the messages queued while offline
      */
-    json_t *subscriptions = kw_get_dict(client, "subscriptions", 0, KW_REQUIRED);
-    if(!subscriptions) {
+    session_clean_subscriptions(session);
+    dl_flush(&session->dl_msgs_offline, db_free_client_msg);
+
+    return 0;
+}
+
+/***************************************************************************
+ *  Match a topic with a subscription filter with wildcards
+ ***************************************************************************/
+PRIVATE BOOL sys_topic_match(const char *filter, const char *topic)
+{
+    if(*topic == '$' && (*filter == '+' || *filter == '#')) {
+        /*
+         *  The wildcards don't match the first level of $ topics
+         */
+        return FALSE;
+    }
+    while(*filter) {
+        if(*filter == '#') {
+            return TRUE;
+        }
+        if(*filter == '+') {
+            while(*topic && *topic != '/') {
+                topic++;
+            }
+            filter++;
+        } else {
+            while(*filter && *filter != '/') {
+                if(*filter != *topic) {
+                    return FALSE;
+                }
+                filter++;
+                topic++;
+            }
+            if(*topic && *topic != '/') {
+                return FALSE;
+            }
+        }
+        if(!*filter) {
+            break;
+        }
+        /*
+         *  filter is at '/'
+         */
+        if(*topic != '/') {
+            /*
+             *  "a/#" matches "a" too
+             */
+            return (strcmp(filter, "/#")==0 && !*topic)? TRUE : FALSE;
+        }
+        filter++;
+        topic++;
+    }
+    return (*topic)? FALSE : TRUE;
+}
+
+/***************************************************************************
+ *  Create the store of a $SYS value, shared by all its subscribers
+ ***************************************************************************/
+PRIVATE struct mosquitto_msg_store *sys_store_create(const char *topic, const char *value)
+{
+    struct mosquitto_msg_store *stored = pool_alloc(&pool_msg_store);
+    if(!stored) {
         // Error already logged
-        return -1;
+        return 0;
     }
+    stored->ref_count = 1;
+    stored->retain = TRUE;
+    stored->topic = intern_string(topic);
+    stored->payloadlen = (int)strlen(value);
+    stored->payload = gbmem_strdup(value);
+    if(!stored->topic || !stored->payload) {
+        // Error already logged
+        db_free_msg_store(stored);
+        return 0;
+    }
+    return stored;
+}
 
-    json_t *subs = kw_get_dict(subscriptions, sub, 0, KW_EXTRACT);
-    if(!subs) {
-        *reason = MQTT_RC_NO_SUBSCRIPTION_EXISTED;
+/***************************************************************************
+ *  Deliver a $SYS store to a subscription of a connected session.
+ *  The broker is the publisher, there is no publisher to throttle
+ *  nor slow consumer accounting as with the messages of the clients.
+ ***************************************************************************/
+PRIVATE int sys_deliver(
+    mqtt_session_t *session,
+    mqtt_subscription_t *subscription,
+    const char *topic,
+    struct mosquitto_msg_store *stored
+)
+{
+    hgobj gobj_subscriber = session->gobj;
+    if(!gobj_subscriber) {
+        return 0;
+    }
+    if(mosquitto_acl_check(gobj_subscriber, topic, MOSQ_ACL_READ) != MOSQ_ERR_SUCCESS) {
+        return 0;
     }
-    JSON_DECREF(subs);
 
-    return 0;
+    json_t *properties = json_object();
+    int identifier = (int)subscription->identifier;
+    if(identifier > 0) {
+        mosquitto_property_add_varint(
+            gobj_subscriber, properties, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, identifier
+        );
+    }
+    int ret = XXX_db__message_insert(
+        gobj_subscriber,
+        0,
+        0,
+        subscription->retain_as_published? true : false,
+        stored,
+        properties
+    );
+    JSON_DECREF(properties)
+    return ret;
 }
 
 /***************************************************************************
- *  Remove all subscriptions for a client.
+ *  Send a $SYS value to a subscription of a session
+ ***************************************************************************/
+PRIVATE int sys_send(
+    hgobj gobj,
+    mqtt_session_t *session,
+    mqtt_subscription_t *subscription,
+    const char *topic,
+    const char *value
+)
+{
+    struct mosquitto_msg_store *stored = sys_store_create(topic, value);
+    if(!stored) {
+        // Error already logged
+        return MOSQ_ERR_NOMEM;
+    }
+
+    sys_deliver(session, subscription, topic, stored);
+    db_free_msg_store(stored);
+    return MOSQ_ERR_SUCCESS;
+}
+
+/***************************************************************************
+ *  Publish a $SYS value if it has changed, and keep it retained
  ***************************************************************************/
-PRIVATE int sub__clean_session(hgobj gobj, json_t *client)
+PRIVATE void sys_publish_value(hgobj gobj, const char *topic, const char *fmt, ...)
 {
+    char value[64];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(value, sizeof(value), fmt, ap);
+    va_end(ap);
+
+    if(!sys_stats.retained) {
+        sys_stats.retained = json_object();
+    }
+    const char *prev = json_string_value(json_object_get(sys_stats.retained, topic));
+    if(prev && strcmp(prev, value)==0) {
+        return;
+    }
+    json_object_set_new(sys_stats.retained, topic, json_string(value));
+
     /*
-     *  Reset subscriptions
+     *  One store for all the subscribers, created with the first one
      */
-    json_object_set_new(client, "subscriptions", json_object());
+    struct mosquitto_msg_store *stored = 0;
+    mqtt_subscription_t *subscription = sys_stats.subscriptions;
+    while(subscription) {
+        mqtt_subscription_t *next = subscription->next_sys;
+        if(subscription->session->gobj && sys_topic_match(subscription->filter, topic)) {
+            if(!stored) {
+                stored = sys_store_create(topic, value);
+                if(!stored) {
+                    // Error already logged
+                    return;
+                }
+            }
+            sys_deliver(subscription->session, subscription, topic, stored);
+        }
+        subscription = next;
+    }
+    if(stored) {
+        db_free_msg_store(stored);
+    }
+}
 
-    return 0;
+/***************************************************************************
+ *  Publish the broker statistics if its time is over.
+ *  Return TRUE if they were published.
+ ***************************************************************************/
+PRIVATE BOOL sys_publish_if_due(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->sys_interval || !sys_stats.next_time) {
+        return FALSE;
+    }
+    uint64_t now = time_in_miliseconds();
+    if(now < sys_stats.next_time) {
+        return FALSE;
+    }
+
+    uint64_t lag = now - sys_stats.next_time;   // lateness of the timer
+    uint64_t elapsed = now - sys_stats.last_time;
+    if(elapsed == 0) {
+        elapsed = 1;
+    }
+
+    sys_publish_value(gobj, "$SYS/broker/clients/connected", "%u",
+        sys_stats.clients_connected
+    );
+    sys_publish_value(gobj, "$SYS/broker/messages/received", "%llu",
+        (unsigned long long)sys_stats.msgs_received
+    );
+    sys_publish_value(gobj, "$SYS/broker/messages/sent", "%llu",
+        (unsigned long long)sys_stats.msgs_sent
+    );
+    sys_publish_value(gobj, "$SYS/broker/bytes/received", "%llu",
+        (unsigned long long)sys_stats.bytes_received
+    );
+    sys_publish_value(gobj, "$SYS/broker/bytes/sent", "%llu",
+        (unsigned long long)sys_stats.bytes_sent
+    );
+    sys_publish_value(gobj, "$SYS/broker/load/messages/received", "%.2f",
+        (double)(sys_stats.msgs_received - sys_stats.last_msgs_received) * 1000 / elapsed
+    );
+    sys_publish_value(gobj, "$SYS/broker/load/messages/sent", "%.2f",
+        (double)(sys_stats.msgs_sent - sys_stats.last_msgs_sent) * 1000 / elapsed
+    );
+    sys_publish_value(gobj, "$SYS/broker/load/bytes/received", "%.2f",
+        (double)(sys_stats.bytes_received - sys_stats.last_bytes_received) * 1000 / elapsed
+    );
+    sys_publish_value(gobj, "$SYS/broker/load/bytes/sent", "%.2f",
+        (double)(sys_stats.bytes_sent - sys_stats.last_bytes_sent) * 1000 / elapsed
+    );
+    sys_publish_value(gobj, "$SYS/broker/messages/inflight", "%u",
+        pool_client_msg.in_use
+    );
+    sys_publish_value(gobj, "$SYS/broker/heap/current", "%lu",
+        (unsigned long)get_cur_system_memory()
+    );
+    sys_publish_value(gobj, "$SYS/broker/loop/lag", "%lu",
+        (unsigned long)lag
+    );
+    /*
+     *  Only the $SYS values are retained by now, this one included
+     */
+    const char *retained_count = "$SYS/broker/retained messages/count";
+    size_t retained = json_object_size(sys_stats.retained);
+    if(!json_object_get(sys_stats.retained, retained_count)) {
+        retained++;
+    }
+    sys_publish_value(gobj, retained_count, "%lu", (unsigned long)retained);
+
+    sys_stats.last_msgs_received = sys_stats.msgs_received;
+    sys_stats.last_bytes_received = sys_stats.bytes_received;
+    sys_stats.last_msgs_sent = sys_stats.msgs_sent;
+    sys_stats.last_bytes_sent = sys_stats.bytes_sent;
+    sys_stats.last_time = now;
+    sys_stats.next_time = now + (uint64_t)priv->sys_interval * 1000;
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Set the broker timer to the nearest broker-wide task
+ ***************************************************************************/
+PRIVATE void broker_timer_arm(void)
+{
+    if(!broker_timer.timer) {
+        return;
+    }
+    PRIVATE_DATA *priv = gobj_priv_data(broker_timer.gobj);
+    uint64_t now = time_in_miliseconds();
+    uint64_t next = 0;
+
+    if(priv->sys_interval > 0) {
+        if(!sys_stats.next_time) {
+            sys_stats.last_time = now;
+            sys_stats.next_time = now + (uint64_t)priv->sys_interval * 1000;
+        }
+        next = sys_stats.next_time;
+    }
+    if(snapshot.next_time && (!next || snapshot.next_time < next)) {
+        next = snapshot.next_time;
+    }
+    if(snapshot.wal_sync_time && (!next || snapshot.wal_sync_time < next)) {
+        next = snapshot.wal_sync_time;
+    }
+    if(snapshot.compact_pid > 0 && (!next || now + SNAPSHOT_REAP_MS < next)) {
+        next = now + SNAPSHOT_REAP_MS;
+    }
+    if(timer_wheel.size) {
+        uint64_t wheel_next = (timer_wheel.tick + 1) * WHEEL_TICK_MS;
+        if(!next || wheel_next < next) {
+            next = wheel_next;
+        }
+    }
+
+    if(next > 0) {
+        set_timeout(broker_timer.timer, (next > now)? (int)(next - now) : 1);
+    } else {
+        clear_timeout(broker_timer.timer);
+    }
+}
+
+/***************************************************************************
+ *  The server connection takes the broker timer if nobody has it
+ ***************************************************************************/
+PRIVATE void broker_timer_elect(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(broker_timer.gobj || !priv->iamServer) {
+        return;
+    }
+    broker_timer.timer = gobj_create("broker", GCLASS_TIMER, 0, gobj);
+    if(!broker_timer.timer) {
+        // Error already logged
+        return;
+    }
+    broker_timer.gobj = gobj;
+    gobj_start(broker_timer.timer);
+    broker_timer_arm();
+}
+
+/***************************************************************************
+ *  The owner of the broker timer leaves: pass it to other connection
+ ***************************************************************************/
+PRIVATE void broker_timer_resign(hgobj gobj)
+{
+    if(broker_timer.gobj != gobj) {
+        return;
+    }
+    hgobj timer = broker_timer.timer;
+    broker_timer.gobj = 0;
+    broker_timer.timer = 0;
+    if(!gobj_is_destroying(timer)) {
+        clear_timeout(timer);
+        gobj_stop(timer);
+        gobj_destroy(timer);
+    }
+
+    for(int i=0; i<=WHEEL_SLOTS && timer_wheel.size; i++) {
+        wheel_entry_t *entry = dl_first(&timer_wheel.slots[i]);
+        while(entry) {
+            if(entry->gobj != gobj) {
+                broker_timer_elect(entry->gobj);
+                return;
+            }
+            entry = dl_next(entry);
+        }
+    }
+    for(size_t i=0; i<session_table.nslabs; i++) {
+        mqtt_session_t *slab = session_table.slabs[i];
+        for(int j=0; j<SESSION_SLAB_SIZE; j++) {
+            mqtt_session_t *session = &slab[j];
+            if(session->client_id && session->gobj && session->gobj != gobj) {
+                broker_timer_elect(session->gobj);
+                return;
+            }
+        }
+    }
+}
+
+/***************************************************************************
+ *  Broker timer: run the broker-wide tasks that are due
+ ***************************************************************************/
+PRIVATE void broker_timer_fired(hgobj gobj)
+{
+    sys_publish_if_due(gobj);
+    snapshot_tick();
+    wheel_advance();
+    broker_timer_arm();
 }
 
 /***************************************************************************
@@ -5038,10 +10604,41 @@ PRIVATE int retain__queue(
     uint32_t subscription_identifier
 )
 {
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
     if(strncmp(sub, "$share/", strlen("$share/"))==0) {
         return MOSQ_ERR_SUCCESS;
     }
-    // TODO
+
+    /*
+     *  Retained $SYS values
+     */
+    mqtt_session_t *session = priv->session;
+    if(!session || !sys_stats.retained || strncmp(sub, "$SYS/", strlen("$SYS/"))!=0) {
+        // TODO retained messages of the clients
+        return MOSQ_ERR_SUCCESS;
+    }
+    mqtt_subscription_t *subscription = dl_first(&session->dl_subscriptions);
+    while(subscription) {
+        if(strcmp(subscription->filter, sub)==0) {
+            break;
+        }
+        subscription = dl_next(subscription);
+    }
+    if(!subscription) {
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    const char *topic;
+    json_t *jn_value;
+    json_object_foreach(sys_stats.retained, topic, jn_value) {
+        if(sys_topic_match(sub, topic)) {
+            if(sys_send(gobj, session, subscription, topic, json_string_value(jn_value))<0) {
+                // Error already logged
+                return MOSQ_ERR_NOMEM;
+            }
+        }
+    }
     return MOSQ_ERR_SUCCESS;
 }
 
@@ -5083,6 +10680,7 @@ PRIVATE int will_read(
         return MOSQ_ERR_PROTOCOL;
     }
     gobj_write_strn_attr(gobj, "will_topic", will_topic, tlen);
+    will_topic = (char *)gobj_read_str_attr(gobj, "will_topic"); // The string in gbuf is not null terminated
 
     if((ret=mosquitto_pub_topic_check(will_topic))<0) {
         log_error(0,
@@ -5101,19 +10699,23 @@ PRIVATE int will_read(
         // Error already logged
         return ret;
     }
+    GBMEM_FREE(priv->will_payload);
+    priv->will_payloadlen = 0;
     if(payloadlen > 0) {
-        GBUF_DECREF(priv->gbuf_will_payload);
-        priv->gbuf_will_payload = gbuf_create(payloadlen, payloadlen, 0, 0);
-        if(!priv->gbuf_will_payload) {
+        /*
+         *  Read in the buffer that will be the payload of the will message
+         */
+        priv->will_payload = gbmem_malloc(payloadlen);
+        if(!priv->will_payload) {
             // Error already logged
             return MOSQ_ERR_NOMEM;
         }
-        uint8_t *p = gbuf_cur_rd_pointer(priv->gbuf_will_payload);
-        if((ret=mqtt_read_bytes(gobj, gbuf, p, (uint32_t)payloadlen))<0) {
+        if((ret=mqtt_read_bytes(gobj, gbuf, priv->will_payload, (uint32_t)payloadlen))<0) {
             // Error already logged
+            GBMEM_FREE(priv->will_payload);
             return ret;
         }
-        gbuf_set_wr(priv->gbuf_will_payload, payloadlen);
+        priv->will_payloadlen = payloadlen;
     }
 
     return 0;
@@ -5136,7 +10738,7 @@ PRIVATE int save_topic_alias(hgobj gobj, int topic_alias, const char *topic)
 /***************************************************************************
  *
  ***************************************************************************/
-PRIVATE char *find_alias_topic(hgobj gobj, uint16_t alias)
+PRIVATE const char *find_alias_topic(hgobj gobj, uint16_t alias)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
@@ -5147,7 +10749,7 @@ PRIVATE char *find_alias_topic(hgobj gobj, uint16_t alias)
     if(!topic_name) {
         return 0;
     }
-    return gbmem_strdup(topic_name);
+    return intern_string(topic_name);
 }
 
 /***************************************************************************
@@ -5174,6 +10776,9 @@ PRIVATE int handle_auth(hgobj gobj, GBUFFER *gbuf)
          *      Client, no procede no?
          *-----------------------------------*/
         uint8_t reason_code;
+        if(!gbuf) {
+            return 0; // Reason code 0 and no properties
+        }
         if(mqtt_read_byte(gobj, gbuf, &reason_code)<0) {
             log_error(0,
                 "gobj",         "%s", gobj_full_name(gobj),
@@ -5274,8 +10879,12 @@ PRIVATE int save_client(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
+    if(priv->session && priv->client) {
+        session_to_json(priv->session, priv->client);
+    }
     if(!priv->assigned_id && !empty_string(priv->client_id)) {
         gobj_save_resource(priv->gobj_mqtt_clients, priv->client_id, priv->client, 0);
+        snapshot_log_session(priv->session, SNAPSHOT_OP_SESSION);
     }
     return 0;
 }
@@ -5286,13 +10895,25 @@ PRIVATE int save_client(hgobj gobj)
 PRIVATE int set_client_disconnected(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
-    if(priv->client) {
-        kw_set_dict_value(priv->client, "isConnected", json_false());
-        kw_set_dict_value(priv->client, "_gobj", json_integer(0));
-        kw_set_dict_value(priv->client, "_gobj_bottom", json_integer(0));
-        save_client(gobj);
-        priv->client = 0;
+    mqtt_session_t *session = priv->session;
+
+    if(session) {
+        if(session->gobj == gobj) {
+            /*
+             *  Don't touch the session if it was taken by a new connection
+             */
+            session->gobj = 0;
+            session->gobj_bottom = 0;
+            if(priv->client) {
+                save_client(gobj);
+            }
+        }
+        priv->session = 0;
+        if(session->assigned_id && !session->gobj) {
+            session_delete(session);
+        }
     }
+    priv->client = 0;
     return 0;
 }
 
@@ -5366,10 +10987,33 @@ PRIVATE int connect_on_authorised(
         return -1;
     }
 
+    /*
+     *  Get the session, the json client is only loaded the first time
+     */
+    mqtt_session_t *session = session_find(priv->client_id);
+    if(!session) {
+        session = session_create(priv->client_id);
+        if(!session) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+                "msg",          "%s", "Mqtt auth: cannot create session",
+                NULL
+            );
+            JSON_DECREF(connack_props);
+            return -1;
+        }
+        session_load_json(session, client);
+    }
+    session->assigned_id = priv->assigned_id;
+    priv->session = session;
+    acl_set_roles(gobj);
+
     /*
      *  Check if duplicate (device already connected)
      */
-    BOOL isConnected = kw_get_bool(client, "isConnected", 0, KW_CREATE);
+    BOOL isConnected = session->gobj? TRUE: FALSE;
 
     uint32_t prev_session_expiry_interval = kw_get_int(
         client, "session_expiry_interval", 0, KW_CREATE
@@ -5388,25 +11032,35 @@ PRIVATE int connect_on_authorised(
     }
 
     if(priv->clean_start == true) {
-        sub__clean_session(gobj, client);
+        sub__clean_session(gobj, session);
     }
     if((prev_protocol_version == mosq_p_mqtt5 && prev_session_expiry_interval == 0)
             || (prev_protocol_version != mosq_p_mqtt5 && prev_clean_start == true)
             || (priv->clean_start == true)
             ) {
-        // TODO context__send_will(found_context);
+        /*
+         *  The previous session ends: its delayed will is due now
+         */
+        if(session->will_gobj) {
+            will_send_delayed(session->will_gobj);
+        }
     }
 
     // TODO session_expiry__remove(found_context);
-    // TODO will_delay__remove(found_context);
-    // TODO will__clear(found_context);
+
+    /*
+     *  The client is back before the will delay
+     */
+    if(session->will_gobj) {
+        will_cancel_delayed(session->will_gobj);
+    }
 
     //found_context->clean_start = true;
     //found_context->session_expiry_interval = 0;
     //mosquitto__set_state(found_context, mosq_cs_duplicate);
 
     if(isConnected) {
-        hgobj gobj_bottom = (hgobj)(size_t)kw_get_int(client, "_gobj_bottom", 0, KW_REQUIRED);
+        hgobj gobj_bottom = session->gobj_bottom;
         if(gobj_bottom) {
             gobj_send_event(gobj_bottom, "EV_DROP", 0, gobj);
         }
@@ -5449,8 +11103,9 @@ PRIVATE int connect_on_authorised(
                 "msg",          "%s", "Mqtt: Will",
                 "client_id",    "%s", priv->client_id,
                 "username",     "%s", priv->username?priv->username:"",
-                "topic",        "%s", "", // TODO will->msg.topic
-                "will payload", "%ld", (long)0, // TODO (long)will->msg.payloadlen,
+                "topic",        "%s", SAFE_PRINT(priv->will_topic),
+                "will payload", "%ld", (long)priv->will_payloadlen,
+                "will_delay",   "%d", (int)priv->will_delay_interval,
                 "will_retain",  "%d", priv->will_retain,
                 "will_qos",     "%d", priv->will_qos,
                 NULL
@@ -5477,6 +11132,7 @@ PRIVATE int connect_on_authorised(
 
         kw_set_dict_value(client, "keepalive", json_integer(priv->max_keepalive));
         if(priv->protocol_version == mosq_p_mqtt5) {
+            gobj_write_uint32_attr(gobj, "keepalive", priv->max_keepalive);
             mqtt_property_add_int16(gobj, connack_props, MQTT_PROP_SERVER_KEEP_ALIVE, priv->keepalive);
         } else {
             send_connack(gobj, connect_ack, CONNACK_REFUSED_IDENTIFIER_REJECTED, NULL);
@@ -5504,6 +11160,15 @@ PRIVATE int connect_on_authorised(
                 return -1;
             }
         }
+        if(priv->compress) {
+            if(mqtt_property_add_user(
+                gobj, connack_props, COMPRESSION_PROPERTY, priv->compression)<0)
+            {
+                // Error already logged
+                JSON_DECREF(connack_props);
+                return -1;
+            }
+        }
         if(priv->auth_method) {
             // No tenemos auth method
         }
@@ -5513,25 +11178,29 @@ PRIVATE int connect_on_authorised(
 
     int ret = send_connack(gobj, connect_ack, CONNACK_ACCEPTED, connack_props);
     if(ret == 0) {
-        kw_set_dict_value(client, "isConnected", json_true());
-        kw_set_dict_value(
-            client, "_gobj", json_integer((json_int_t)(size_t)(gobj))
-        );
-        kw_set_dict_value(
-            client, "_gobj_bottom", json_integer((json_int_t)(size_t)gobj_bottom_gobj(gobj))
-        );
+        session->gobj = gobj;
+        session->gobj_bottom = gobj_bottom_gobj(gobj);
         gobj_write_bool_attr(gobj, "in_session", TRUE);
+        sys_stats.clients_connected++;
+        broker_timer_elect(gobj);
         gobj_write_json_attr(gobj, "client", client);
         gobj_write_bool_attr(gobj, "send_disconnect", TRUE);
         priv->must_broadcast_on_close = TRUE;
         priv->client = client;
         save_client(gobj);
 
+        /*
+         *  From now the handshake timeout is replaced by the keepalive
+         */
+        priv->handshake_deadline = 0;
+        keepalive_arm(gobj);
+
         json_t *kw = json_pack("{s:s}",
             "client_id", priv->client_id
         );
         gobj_publish_event(gobj, "EV_ON_OPEN", kw);
 
+        session_replay_offline(gobj, session);
         // db__message_write_queued_out(context); TODO
         //db__message_write_inflight_out_all(context); TODO
     }
@@ -6005,8 +11674,8 @@ PRIVATE int handle_connect(hgobj gobj, GBUFFER *gbuf)
             password_flag,
             keepalive
         );
-        if(priv->gbuf_will_payload) {
-            log_debug_gbuf(0, priv->gbuf_will_payload, "gbuf_will_payload");
+        if(priv->will_payload) {
+            log_debug_dump(0, priv->will_payload, priv->will_payloadlen, "will_payload");
         }
     }
 
@@ -6120,11 +11789,11 @@ PRIVATE int handle_disconnect(hgobj gobj, GBUFFER *gbuf)
             return MOSQ_ERR_PROTOCOL;
         }
     }
-    if(reason_code == MQTT_RC_DISCONNECT_WITH_WILL_MSG) {
-        // TODO mosquitto__set_state(context, mosq_cs_disconnect_with_will);
-    } else {
-        //will__clear(context);
-        //mosquitto__set_state(context, mosq_cs_disconnecting);
+    if(reason_code != MQTT_RC_DISCONNECT_WITH_WILL_MSG) {
+        /*
+         *  Normal disconnection, the will is discarded
+         */
+        will_clear(gobj);
     }
 
     do_disconnect(gobj, MOSQ_ERR_SUCCESS);
@@ -6140,12 +11809,12 @@ PRIVATE int handle_connack(hgobj gobj, GBUFFER *gbuf)
     uint8_t max_qos = 255;
     int ret = 0;
 
-    if(!priv->is_bridge) {
+    if(priv->iamServer && !priv->is_bridge) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
             "msgset",       "%s", MSGSET_MQTT_ERROR,
-            "msg",          "%s", "Mqtt CMD_CONNACK: i am not bridge",
+            "msg",          "%s", "Mqtt CMD_CONNACK: i am not client nor bridge",
             NULL
         );
         return -1;
@@ -6248,6 +11917,16 @@ PRIVATE int handle_connack(hgobj gobj, GBUFFER *gbuf)
         if(server_keepalive != -1) {
             priv->keepalive = server_keepalive;
         }
+
+        /* compression accepted by the broker */
+        json_t *user_property = property_get_property(properties, MQTT_PROP_USER_PROPERTY);
+        if(user_property &&
+                strcmp(kw_get_str(user_property, "name", "", 0), COMPRESSION_PROPERTY)==0) {
+            priv->compress = compression_accepted(
+                gobj,
+                kw_get_str(user_property, "value", "", 0)
+            );
+        }
         JSON_DECREF(properties)
     }
 
@@ -6265,7 +11944,21 @@ PRIVATE int handle_connack(hgobj gobj, GBUFFER *gbuf)
         //if(rc) return rc;
         //rc = db__message_write_inflight_out_all(context);
         //return rc;
-        return -1;
+
+        /*
+         *  Client side: the session is open, without compression if not echoed
+         */
+        clear_timeout(priv->timer);
+        priv->handshake_deadline = 0;
+        gobj_write_bool_attr(gobj, "in_session", TRUE);
+        gobj_write_bool_attr(gobj, "send_disconnect", TRUE);
+
+        json_t *kw = json_pack("{s:s, s:b}",
+            "client_id", SAFE_PRINT(priv->client_id),
+            "compress", priv->compress
+        );
+        gobj_publish_event(gobj, "EV_ON_OPEN", kw);
+        return 0;
     } else {
         if(priv->protocol_version == mosq_p_mqtt5) {
             switch(reason_code) {
@@ -6919,10 +12612,14 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
     uint8_t reason_code = 0;
     uint16_t mid = 0;
 
-    msg = gbmem_malloc(sizeof(struct mosquitto_msg_store));
+    msg = pool_alloc(&pool_msg_store);
     if(msg == NULL) {
         return MOSQ_ERR_NOMEM;
     }
+    msg->ref_count = 1;
+
+    sys_stats.msgs_received++;
+    sys_stats.bytes_received += priv->frame_head.frame_length;
 
     uint8_t header = priv->frame_head.flags;
     dup = (header & 0x08)>>3;
@@ -6988,7 +12685,14 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
         db_free_msg_store(msg);
         return MOSQ_ERR_MALFORMED_PACKET;
     }
-    msg->topic = gbmem_strndup(topic_, slen);
+    if(slen) {
+        msg->topic = intern_stringn(topic_, slen);
+        if(!msg->topic) {
+            // Error already logged
+            db_free_msg_store(msg);
+            return MOSQ_ERR_NOMEM;
+        }
+    }
 
     if(!slen && priv->protocol_version != mosq_p_mqtt5) {
         /* Invalid publish topic, disconnect client. */
@@ -7094,9 +12798,8 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
             //    return rc;
             //}
         } else {
-            char *alias = find_alias_topic(gobj, (uint16_t)topic_alias);
+            const char *alias = find_alias_topic(gobj, (uint16_t)topic_alias);
             if(alias) {
-                GBMEM_FREE(msg->topic);
                 msg->topic = alias;
             } else {
                 log_error(0,
@@ -7123,6 +12826,19 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
         //}
     }
 
+    if(!msg->topic) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MQTT_ERROR,
+            "msg",          "%s", "Mqtt: topic len 0 and no topic alias",
+            "client_id",    "%s", priv->client_id,
+            NULL
+        );
+        db_free_msg_store(msg);
+        return MOSQ_ERR_PROTOCOL;
+    }
+
     if(mosquitto_pub_topic_check(msg->topic)<0) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
@@ -7136,7 +12852,15 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
         return MOSQ_ERR_MALFORMED_PACKET;
     }
 
-    msg->payloadlen = gbuf_leftbytes(gbuf);
+    if(priv->spool_base) {
+        if(gbuf_leftbytes(gbuf) > 0) {
+            db_free_msg_store(msg);
+            return MOSQ_ERR_MALFORMED_PACKET;
+        }
+        msg->payloadlen = (int)priv->spool_payloadlen;
+    } else {
+        msg->payloadlen = gbuf_leftbytes(gbuf);
+    }
     //G_PUB_BYTES_RECEIVED_INC(msg->payloadlen);
 
     if(msg->payloadlen) {
@@ -7147,13 +12871,26 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
                 "msgset",           "%s", MSGSET_MQTT_ERROR,
                 "msg",              "%s", "Mqtt: Dropped too large PUBLISH",
                 "client_id",        "%s", priv->client_id,
-                "topic",            "%d", msg->topic,
+                "topic",            "%s", msg->topic,
                 NULL
             );
-            db_free_msg_store(msg);
             reason_code = MQTT_RC_PACKET_TOO_LARGE;
             goto process_bad_message;
         }
+    }
+    if(priv->spool_base) {
+        /*
+         *  The store takes the mapped frame
+         */
+        msg->payload = priv->spool_payload;
+        msg->spool_base = priv->spool_base;
+        msg->spool_len = priv->spool_len;
+        msg->spool_file = priv->spool_file;
+        priv->spool_base = 0;
+        priv->spool_file = 0;
+        priv->spool_payload = 0;
+
+    } else if(msg->payloadlen) {
         msg->payload = gbmem_malloc(msg->payloadlen + 1);
         if(msg->payload == NULL) {
             // Error already logged
@@ -7168,7 +12905,7 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
     }
 
     /* Check for topic access */
-    rc = 0; // TODO mosquitto_acl_check(gobj, msg, MOSQ_ACL_WRITE);
+    rc = mosquitto_acl_check(gobj, msg->topic, MOSQ_ACL_WRITE);
     if(rc == MOSQ_ERR_ACL_DENIED) {
         log_error(0,
             "gobj",             "%s", gobj_full_name(gobj),
@@ -7176,7 +12913,7 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
             "msgset",           "%s", MSGSET_MQTT_ERROR,
             "msg",              "%s", "Mqtt: Denied PUBLISH",
             "client_id",        "%s", priv->client_id,
-            "topic",            "%d", msg->topic,
+            "topic",            "%s", msg->topic,
             NULL
         );
         reason_code = MQTT_RC_NOT_AUTHORIZED;
@@ -7187,6 +12924,75 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
         return rc;
     }
 
+    /*
+     *  Deflated payload, only if the compression was negotiated.
+     *  Stored decompressed, subscribers and the upper layer get the original.
+     *  A spooled payload is left as is, with its content-encoding:
+     *  it's decompressed for the subscribers that don't use the compression,
+     *  and it's checked now that it doesn't decompress beyond the limit.
+     */
+    if(payload_is_deflated(msg->properties)) {
+        if(!priv->compress) {
+            log_error(0,
+                "gobj",             "%s", gobj_full_name(gobj),
+                "function",         "%s", __FUNCTION__,
+                "msgset",           "%s", MSGSET_MQTT_ERROR,
+                "msg",              "%s", "Mqtt: deflated PUBLISH without compression negotiated",
+                "client_id",        "%s", priv->client_id,
+                "topic",            "%s", msg->topic,
+                NULL
+            );
+            reason_code = MQTT_RC_PAYLOAD_FORMAT_INVALID;
+            goto process_bad_message;
+        }
+        if(msg->spool_base) {
+            /*
+             *  Not inflated here, but it must be inflatable for the subscribers
+             *  without compression: the publisher gets the reason code now.
+             */
+            rc = payload_inflate_check(
+                gobj,
+                msg->payload,
+                (uint32_t)msg->payloadlen,
+                payload_inflate_limit(gobj)
+            );
+            if(rc == MOSQ_ERR_PAYLOAD_SIZE) {
+                reason_code = MQTT_RC_PACKET_TOO_LARGE;
+                goto process_bad_message;
+            } else if(rc < 0) {
+                reason_code = MQTT_RC_PAYLOAD_FORMAT_INVALID;
+                goto process_bad_message;
+            }
+        } else if(msg->payloadlen) {
+            void *payload;
+            uint32_t payloadlen;
+            rc = payload_inflate(
+                gobj,
+                msg->payload,
+                (uint32_t)msg->payloadlen,
+                payload_inflate_limit(gobj),
+                &payload,
+                &payloadlen
+            );
+            if(rc == MOSQ_ERR_PAYLOAD_SIZE) {
+                reason_code = MQTT_RC_PACKET_TOO_LARGE;
+                goto process_bad_message;
+            } else if(rc < 0) {
+                reason_code = MQTT_RC_PAYLOAD_FORMAT_INVALID;
+                goto process_bad_message;
+            }
+            GBMEM_FREE(msg->payload);
+            msg->payload = payload;
+            msg->payloadlen = (int)payloadlen;
+            json_object_del(
+                msg->properties, mqtt_property_identifier_to_string(MQTT_PROP_USER_PROPERTY)
+            );
+            if(json_object_size(msg->properties)==0) {
+                JSON_DECREF(msg->properties)
+            }
+        }
+    }
+
     if(gobj_trace_level(gobj) & SHOW_DECODE) {
         trace_msg("  👈 Received PUBLISH from client '%s', topic '%s' (dup %d, qos %d, retain %d, mid %d, len %ld)",
             priv->client_id,
@@ -7208,7 +13014,11 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
         stored = db_message_store_find(gobj, msg->source_mid);
     }
 
-    if(stored && msg->source_mid != 0 &&
+    /*
+     *  A retransmission has the DUP flag, compare the payload only
+     *  when the client reuses a mid still in flight without it.
+     */
+    if(stored && msg->source_mid != 0 && !dup &&
             (stored->qos != msg->qos
              || stored->payloadlen != msg->payloadlen
              || strcmp(stored->topic, msg->topic)
@@ -7219,11 +13029,12 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
             "msgset",           "%s", MSGSET_INFO,
             "msg",              "%s", "Mqtt: Reused message ID",
             "client_id",        "%s", priv->client_id,
-            "topic",            "%d", msg->topic,
+            "topic",            "%s", msg->topic,
             "mid",              "%d", msg->source_mid,
             NULL
         );
         db__message_remove_incoming(gobj, msg->source_mid);
+        db_free_msg_store(stored);
         stored = NULL;
     }
 
@@ -7238,6 +13049,20 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
             }
         } else {
             /* Client isn't allowed any more incoming messages, so fail early */
+            log_warning(0,
+                "gobj",             "%s", gobj_full_name(gobj),
+                "function",         "%s", __FUNCTION__,
+                "msgset",           "%s", MSGSET_MQTT_ERROR,
+                "msg",              "%s", "Mqtt: receive maximum exceeded",
+                "client_id",        "%s", priv->client_id,
+                "receive_maximum",  "%d", (int)priv->max_inflight_messages,
+                NULL
+            );
+            if(priv->protocol_version == mosq_p_mqtt5) {
+                send_disconnect(gobj, MQTT_RC_RECEIVE_MAXIMUM_EXCEEDED, NULL);
+                db_free_msg_store(msg);
+                return MOSQ_ERR_PROTOCOL;
+            }
             reason_code = MQTT_RC_QUOTA_EXCEEDED;
             goto process_bad_message;
         }
@@ -7254,10 +13079,8 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
     switch(stored->qos) {
         case 0:
             {
-                json_t *jn_subscribers = sub_get_subscribers(gobj, stored->topic);
                 XXX_sub__messages_queue(
                     gobj,
-                    jn_subscribers,
                     stored->topic,
                     stored->qos,
                     stored->retain,
@@ -7268,19 +13091,14 @@ PRIVATE int handle_publish(hgobj gobj, GBUFFER *gbuf)
         case 1:
             /* stored may now be free, so don't refer to it */
             {
-                json_t *jn_subscribers = sub_get_subscribers(gobj, stored->topic);
-
-                BOOL has_subscribers = json_array_size(jn_subscribers)?TRUE:FALSE;
-                //util__decrement_receive_quota(context);
-                XXX_sub__messages_queue(
+                int subscribers = XXX_sub__messages_queue(
                     gobj,
-                    jn_subscribers,
                     stored->topic,
                     stored->qos,
                     stored->retain,
                     stored
                 );
-                if(has_subscribers || priv->protocol_version != mosq_p_mqtt5) {
+                if(subscribers > 0 || priv->protocol_version != mosq_p_mqtt5) {
                     if(send_puback(gobj, mid, 0, NULL)<0) {
                         rc = MOSQ_ERR_NOMEM;
                     }
@@ -7382,6 +13200,8 @@ PRIVATE int handle__subscribe(hgobj gobj, GBUFFER *gbuf)
                 JSON_DECREF(properties)
                 return MOSQ_ERR_MALFORMED_PACKET;
             }
+        } else {
+            subscription_identifier = 0;
         }
 
         JSON_DECREF(properties)
@@ -7398,6 +13218,22 @@ PRIVATE int handle__subscribe(hgobj gobj, GBUFFER *gbuf)
             JSON_DECREF(jn_list)
             return MOSQ_ERR_MALFORMED_PACKET;
         }
+        if(!sub_) {
+            /*
+             *  A zero length string is returned as NULL
+             */
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MQTT_ERROR,
+                "msg",          "%s", "Empty subscription string, disconnecting",
+                "client_id",    "%s", priv->client_id,
+                NULL
+            );
+            GBMEM_FREE(payload)
+            JSON_DECREF(jn_list)
+            return MOSQ_ERR_MALFORMED_PACKET;
+        }
         if(sub_) {
             if(!slen) {
                 log_error(0,
@@ -7477,8 +13313,23 @@ PRIVATE int handle__subscribe(hgobj gobj, GBUFFER *gbuf)
                 );
             }
 
-            allowed = true;
-            //rc2 = mosquitto_acl_check(context, sub, 0, NULL, qos, false, MOSQ_ACL_SUBSCRIBE);
+            allowed = (mosquitto_acl_check(gobj, sub, MOSQ_ACL_SUBSCRIBE) == MOSQ_ERR_SUCCESS);
+            if(!allowed) {
+                log_warning(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt: Denied SUBSCRIBE",
+                    "client_id",    "%s", priv->client_id,
+                    "topic",        "%s", sub,
+                    NULL
+                );
+                if(priv->protocol_version == mosq_p_mqtt5) {
+                    qos = MQTT_RC_NOT_AUTHORIZED;
+                } else {
+                    qos = 0x80;
+                }
+            }
 
             if(allowed) {
                 rc2 = add_subscription(
@@ -7620,14 +13471,15 @@ PRIVATE int handle__unsubscribe(hgobj gobj, GBUFFER *gbuf)
     json_t *jn_list = json_array();
 
     while(gbuf_leftbytes(gbuf)>0) {
+        char *sub_ = NULL;
         char *sub = NULL;
-        if(mqtt_read_string(gobj, gbuf, &sub, &slen)) {
+        if(mqtt_read_string(gobj, gbuf, &sub_, &slen)) {
             GBMEM_FREE(reason_codes)
             JSON_DECREF(jn_list)
             return MOSQ_ERR_MALFORMED_PACKET;
         }
 
-        if(!slen) {
+        if(!sub_ || !slen) {
             log_error(0,
                 "gobj",         "%s", gobj_full_name(gobj),
                 "function",     "%s", __FUNCTION__,
@@ -7640,6 +13492,7 @@ PRIVATE int handle__unsubscribe(hgobj gobj, GBUFFER *gbuf)
             JSON_DECREF(jn_list)
             return MOSQ_ERR_MALFORMED_PACKET;
         }
+        sub = gbmem_strndup(sub_, slen); // The string in gbuf is not null terminated
         if(mosquitto_sub_topic_check(sub)) {
             log_error(0,
                 "gobj",         "%s", gobj_full_name(gobj),
@@ -7649,6 +13502,7 @@ PRIVATE int handle__unsubscribe(hgobj gobj, GBUFFER *gbuf)
                 "client_id",    "%s", priv->client_id,
                 NULL
             );
+            GBMEM_FREE(sub)
             GBMEM_FREE(reason_codes);
             JSON_DECREF(jn_list)
             return MOSQ_ERR_MALFORMED_PACKET;
@@ -7671,12 +13525,14 @@ PRIVATE int handle__unsubscribe(hgobj gobj, GBUFFER *gbuf)
         }
 
         if(rc<0) {
+            GBMEM_FREE(sub)
             GBMEM_FREE(reason_codes);
             JSON_DECREF(jn_list)
             return rc;
         }
 
         json_array_append_new(jn_list, json_string(sub));
+        GBMEM_FREE(sub)
 
         reason_codes[reason_code_count] = reason;
         reason_code_count++;
@@ -7716,7 +13572,15 @@ PRIVATE int frame_completed(hgobj gobj)
     FRAME_HEAD *frame = &priv->frame_head;
     GBUFFER *gbuf = 0;
 
-    if(frame->frame_length) {
+    if(priv->spool_file) {
+        gbuf = spool_map_frame(gobj);
+        if(!gbuf) {
+            // Error already logged
+            spool_release(gobj);
+            start_wait_frame_header(gobj);
+            return MOSQ_ERR_MALFORMED_PACKET;
+        }
+    } else if(frame->frame_length) {
         gbuf = istream_pop_gbuffer(priv->istream_payload);
         istream_destroy(priv->istream_payload);
         priv->istream_payload = 0;
@@ -7724,6 +13588,30 @@ PRIVATE int frame_completed(hgobj gobj)
 
     int ret = 0;
 
+    if(!gbuf) {
+        /*
+         *  Only these commands can come without variable header
+         */
+        switch(frame->command) {
+            case CMD_PINGREQ:
+            case CMD_PINGRESP:
+            case CMD_DISCONNECT:
+            case CMD_AUTH:
+                break;
+            default:
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_MQTT_ERROR,
+                    "msg",          "%s", "Mqtt malformed packet, command without data",
+                    "command",      "%s", get_command_name(frame->command),
+                    NULL
+                );
+                start_wait_frame_header(gobj);
+                return MOSQ_ERR_MALFORMED_PACKET;
+        }
+    }
+
     switch(frame->command) {
         case CMD_PINGREQ:
             ret = handle_pingreq(gobj);
@@ -7781,6 +13669,7 @@ PRIVATE int frame_completed(hgobj gobj)
     }
 
     GBUF_DECREF(gbuf);
+    spool_release(gobj);    // if not taken by the message
 
     if(frame->command != CMD_CONNECT && priv->protocol_version == mosq_p_mqtt5) {
         if(ret == MOSQ_ERR_PROTOCOL || ret == MOSQ_ERR_DUPLICATE_PROPERTY) {
@@ -7821,27 +13710,42 @@ PRIVATE int ac_connected(hgobj gobj, const char *event, json_t *kw, hgobj src)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
+    /*
+     *  The gobj is reused by other connection,
+     *  don't wait more for the delayed will of the previous one.
+     */
+    will_send_delayed(gobj);
+
     gobj_reset_volatil_attrs(gobj);
     start_wait_frame_header(gobj);
     priv->send_disconnect = FALSE;
     gobj_write_bool_attr(gobj, "connected", TRUE);
-    GBUF_DECREF(priv->gbuf_will_payload);
+    GBMEM_FREE(priv->will_payload);
+    priv->will_payloadlen = 0;
     priv->jn_alias_list = json_object();
+    priv->last_rx_time = time_in_miliseconds();
+    priv->compress = FALSE;
+    priv->ws_upgraded = FALSE;
+    priv->ws_close_sent = FALSE;
+    priv->ws_header_len = 0;
+    priv->ws_in_frame = FALSE;
+    GBUF_DECREF(priv->gbuf_ws_request);
+
+    priv->handshake_deadline = priv->last_rx_time +
+        (uint64_t)gobj_read_int32_attr(gobj, "timeout_handshake");
 
     if (priv->iamServer) {
         /*
          * wait the request
          */
+        broker_timer_elect(gobj);
     } else {
         /*
          * send the request
          */
-        const char *host = gobj_read_str_attr(gobj_bottom_gobj(gobj), "rHost");
-        const char *port = gobj_read_str_attr(gobj_bottom_gobj(gobj), "rPort");
-        if(host && port) {
-        }
+        send_connect(gobj);
     }
-    set_timeout(priv->timer, gobj_read_int32_attr(gobj, "timeout_handshake"));
+    keepalive_arm(gobj);
     KW_DECREF(kw)
     return 0;
 }
@@ -7853,12 +13757,33 @@ PRIVATE int ac_disconnected(hgobj gobj, const char *event, json_t *kw, hgobj src
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
+    /*
+     *  The client is marked as disconnected before queueing its will,
+     *  the will must not be delivered to the connection that is closing.
+     */
+    mqtt_session_t *session = priv->session;
+    const char *client_id = session? intern_incref(session->client_id) : 0;
+    BOOL session_taken = (session && session->gobj != gobj)? TRUE : FALSE;
+
+    if(priv->in_session && sys_stats.clients_connected > 0) {
+        sys_stats.clients_connected--;
+    }
     set_client_disconnected(gobj);
+    wheel_cancel(gobj);
+    priv->payload_deadline = 0;
+    priv->handshake_deadline = 0;
+    broker_timer_resign(gobj);
+    will_queue(gobj, client_id, session_taken);
+    intern_release(client_id);
+    batch_flush(gobj);
 
     JSON_DECREF(priv->jn_alias_list);
+    JSON_DECREF(priv->acl_roles)
+    acl_cache_clear(gobj);
 
     gobj_reset_volatil_attrs(gobj);
-    GBUF_DECREF(priv->gbuf_will_payload);
+    GBMEM_FREE(priv->will_payload);
+    priv->will_payloadlen = 0;
 
     if(gobj_is_volatil(src)) {
         gobj_set_bottom_gobj(gobj, 0);
@@ -7868,6 +13793,15 @@ PRIVATE int ac_disconnected(hgobj gobj, const char *event, json_t *kw, hgobj src
         istream_destroy(priv->istream_payload);
         priv->istream_payload = 0;
     }
+    spool_release(gobj);
+    stream_reset(gobj);
+    GBUF_DECREF(priv->gbuf_throttled);
+    priv->throttle_until = 0;
+    priv->input_paused = FALSE;
+    priv->rl_last_time = 0;
+    priv->rl_msgs_tokens = 0;
+    priv->rl_bytes_tokens = 0;
+    priv->slow_consumer = FALSE;
     if (priv->must_broadcast_on_close) {
         priv->must_broadcast_on_close = FALSE;
 
@@ -7878,6 +13812,13 @@ PRIVATE int ac_disconnected(hgobj gobj, const char *event, json_t *kw, hgobj src
     }
     if(priv->timer) {
         clear_timeout(priv->timer);
+        if(priv->will_msg) {
+            uint64_t now = time_in_miliseconds();
+            set_timeout(
+                priv->timer,
+                (priv->will_deadline > now)? (int)(priv->will_deadline - now) : 1
+            );
+        }
     }
 
     JSON_DECREF(priv->jn_alias_list)
@@ -7886,8 +13827,9 @@ PRIVATE int ac_disconnected(hgobj gobj, const char *event, json_t *kw, hgobj src
     gobj_write_str_attr(gobj, "username", "");
     gobj_write_bool_attr(gobj, "connected", FALSE);
 
-    dl_flush(&priv->dl_msgs_in, db_free_client_msg);
+    msgs_in_flush(gobj);
     dl_flush(&priv->dl_msgs_out, db_free_client_msg);
+    dl_flush(&priv->dl_msgs_qos0, db_free_client_msg);
 
     KW_DECREF(kw)
     return 0;
@@ -7910,6 +13852,29 @@ PRIVATE int ac_stopped(hgobj gobj, const char *event, json_t *kw, hgobj src)
  ***************************************************************************/
 PRIVATE int ac_timeout_waiting_disconnected(hgobj gobj, const char *event, json_t *kw, hgobj src)
 {
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(src == broker_timer.timer) {
+        broker_timer_fired(gobj);
+        KW_DECREF(kw)
+        return 0;
+    }
+
+    if(priv->will_msg) {
+        /*
+         *  Waiting the will delay
+         */
+        uint64_t now = time_in_miliseconds();
+        if(now >= priv->will_deadline) {
+            will_send_delayed(gobj);
+            batch_flush(gobj);
+        } else {
+            set_timeout(priv->timer, (int)(priv->will_deadline - now));
+        }
+        KW_DECREF(kw)
+        return 0;
+    }
+
     log_warning(0,
         "gobj",         "%s", gobj_full_name(gobj),
         "msgset",       "%s", MSGSET_MQTT_ERROR,
@@ -7939,8 +13904,25 @@ PRIVATE int ac_process_frame_header(hgobj gobj, const char *event, json_t *kw, h
         );
     }
 
-    if(priv->pingT>0) {
-        set_timeout(priv->timer, priv->pingT);
+    priv->last_rx_time = time_in_miliseconds();
+
+    if(priv->websocket && src != gobj) {
+        /*
+         *  Raw input from the bottom, the data held or resent by this gobj is decoded
+         */
+        if(ws_decode_frames(gobj, gbuf)<0) {
+            ws_close(gobj, MQTT_RC_PROTOCOL_ERROR);
+            KW_DECREF(kw)
+            return -1;
+        }
+    }
+
+    if(throttle_hold_input(gobj, gbuf)) {
+        /*
+         *  Rate limited, the data is processed when the throttle is over
+         */
+        KW_DECREF(kw)
+        return 0;
     }
 
     while(gbuf_leftbytes(gbuf)) {
@@ -7964,6 +13946,9 @@ PRIVATE int ac_process_frame_header(hgobj gobj, const char *event, json_t *kw, h
                     (int)frame->frame_length
                 );
             }
+            if(frame->command == CMD_PUBLISH) {
+                rate_limit_consume(gobj, frame->frame_length);
+            }
             if(frame->frame_length) {
                 /*
                  *
@@ -7984,6 +13969,34 @@ PRIVATE int ac_process_frame_header(hgobj gobj, const char *event, json_t *kw, h
                  *  Creat a new buffer for payload data
                  */
                 size_t frame_length = frame->frame_length;
+                if(frame->command == CMD_PUBLISH && priv->spool_threshold > 0 &&
+                        frame_length > priv->spool_threshold) {
+                    /*
+                     *  Big frame, spool it to a file.
+                     *  The size limit is checked before writing it,
+                     *  the topic and the properties count in the limit.
+                     */
+                    if(priv->message_size_limit && frame_length > priv->message_size_limit) {
+                        log_error(0,
+                            "gobj",             "%s", gobj_full_name(gobj),
+                            "function",         "%s", __FUNCTION__,
+                            "msgset",           "%s", MSGSET_MQTT_ERROR,
+                            "msg",              "%s", "Mqtt: Dropped too large PUBLISH",
+                            "client_id",        "%s", priv->client_id,
+                            "frame_length",     "%lu", (unsigned long)frame_length,
+                            NULL
+                        );
+                        ws_close(gobj, MQTT_RC_PACKET_TOO_LARGE);
+                        break;
+                    }
+                    if(spool_open(gobj, frame_length)<0) {
+                        // Error already logged
+                        ws_close(gobj, MQTT_RC_UNSPECIFIED);
+                        break;
+                    }
+                    start_wait_payload_data(gobj);
+                    return gobj_send_event(gobj, "EV_RX_DATA", kw, gobj);
+                }
                 if(!frame_length) {
                     log_error(0,
                         "gobj",         "%s", gobj_full_name(gobj),
@@ -8017,7 +14030,7 @@ PRIVATE int ac_process_frame_header(hgobj gobj, const char *event, json_t *kw, h
                 }
                 istream_read_until_num_bytes(priv->istream_payload, frame_length, 0);
 
-                gobj_change_state(gobj, "ST_WAITING_PAYLOAD_DATA");
+                start_wait_payload_data(gobj);
                 return gobj_send_event(gobj, "EV_RX_DATA", kw, gobj);
 
             } else {
@@ -8035,17 +14048,31 @@ PRIVATE int ac_process_frame_header(hgobj gobj, const char *event, json_t *kw, h
 }
 
 /***************************************************************************
- *  No activity, send ping
+ *  Timeout of handshake or keepalive
  ***************************************************************************/
 PRIVATE int ac_timeout_waiting_frame_header(hgobj gobj, const char *event, json_t *kw, hgobj src)
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    if(src == broker_timer.timer) {
+        broker_timer_fired(gobj);
+        KW_DECREF(kw)
+        return 0;
+    }
 
-    if(priv->pingT > 0) {
-        set_timeout(priv->timer, priv->pingT);
-        //ping(gobj);
+    batch_flush_if_due(gobj);
+    if(throttle_resume_if_due(gobj)) {
+        keepalive_arm(gobj);
+        KW_DECREF(kw)
+        return 0;
+    }
+
+    if(deadlines_check(gobj)) {
+        KW_DECREF(kw)
+        return 0;
     }
 
+    keepalive_arm(gobj);
+    //ping(gobj);
+
     KW_DECREF(kw)
     return 0;
 }
@@ -8062,18 +14089,46 @@ PRIVATE int ac_process_payload_data(hgobj gobj, const char *event, json_t *kw, h
         log_debug_gbuf(LOG_DUMP_INPUT, gbuf, "PAYLOAD %s <== %s (accumulated %lu)",
             gobj_short_name(gobj),
             gobj_short_name(src),
-            (unsigned long)istream_length(priv->istream_payload)
+            priv->spool_file?
+                (unsigned long)(priv->spool_len - priv->spool_remaining) :
+                (unsigned long)istream_length(priv->istream_payload)
         );
     }
 
+    priv->last_rx_time = time_in_miliseconds();
+
+    if(priv->websocket && src != gobj) {
+        if(ws_decode_frames(gobj, gbuf)<0) {
+            spool_release(gobj);
+            ws_close(gobj, MQTT_RC_PROTOCOL_ERROR);
+            KW_DECREF(kw)
+            return -1;
+        }
+    }
+
     size_t bf_len = gbuf_leftbytes(gbuf);
     char *bf = gbuf_cur_rd_pointer(gbuf);
 
-    int consumed = istream_consume(priv->istream_payload, bf, bf_len);
-    if(consumed > 0) {
+    BOOL completed;
+    if(priv->spool_file) {
+        int consumed = spool_write(gobj, bf, bf_len);
+        if(consumed < 0) {
+            // Error already logged
+            spool_release(gobj);
+            ws_close(gobj, MQTT_RC_UNSPECIFIED);
+            KW_DECREF(kw)
+            return -1;
+        }
         gbuf_get(gbuf, consumed);  // take out the bytes consumed
+        completed = (priv->spool_remaining == 0)? TRUE : FALSE;
+    } else {
+        int consumed = istream_consume(priv->istream_payload, bf, bf_len);
+        if(consumed > 0) {
+            gbuf_get(gbuf, consumed);  // take out the bytes consumed
+        }
+        completed = istream_is_completed(priv->istream_payload);
     }
-    if(istream_is_completed(priv->istream_payload)) {
+    if(completed) {
         int ret;
         if((ret=frame_completed(gobj))<0) {
             if(gobj_trace_level(gobj) & SHOW_DECODE) {
@@ -8106,14 +14161,25 @@ PRIVATE int ac_process_payload_data(hgobj gobj, const char *event, json_t *kw, h
  ***************************************************************************/
 PRIVATE int ac_timeout_waiting_payload_data(hgobj gobj, const char *event, json_t *kw, hgobj src)
 {
-    log_info(0,
-        "gobj",         "%s", gobj_full_name(gobj),
-        "msgset",       "%s", MSGSET_MQTT_ERROR,
-        "msg",          "%s", "Timeout waiting mqtt PAYLOAD data",
-        NULL
-    );
+    if(src == broker_timer.timer) {
+        broker_timer_fired(gobj);
+        KW_DECREF(kw)
+        return 0;
+    }
+
+    batch_flush_if_due(gobj);
+    throttle_resume_if_due(gobj);
+
+    /*
+     *  The data still arriving doesn't extend the deadline of the payload
+     */
+    if(!deadlines_check(gobj)) {
+        /*
+         *  The timer was for the batch or the rate limit
+         */
+        keepalive_arm(gobj);
+    }
 
-    ws_close(gobj, MOSQ_ERR_PROTOCOL);
     KW_DECREF(kw)
     return 0;
 }
@@ -8219,7 +14285,21 @@ PRIVATE int ac_send_message(hgobj gobj, const char *event, json_t *kw, hgobj src
         }
     }
 
-    uint16_t mid = mosquitto__mid_generate(gobj, priv->client_id);
+    uint16_t mid = 0;
+    if(qos > 0) {
+        if(priv->session) {
+            mid = mosquitto__mid_generate(priv->session);
+        } else {
+            /*
+             *  Client or bridge connection, without session: the mids are of the connection
+             */
+            priv->last_mid++;
+            if(priv->last_mid == 0) {
+                priv->last_mid++;
+            }
+            mid = priv->last_mid;
+        }
+    }
     json_object_set_new(kw, "mid", json_integer(mid));
 
     send_publish(
@@ -8233,7 +14313,8 @@ PRIVATE int ac_send_message(hgobj gobj, const char *event, json_t *kw, hgobj src
         false,
         outgoing_properties,
         NULL,
-        0
+        0,
+        NULL
     );
 
 // TODO esto en el nivel superior
@@ -8265,6 +14346,19 @@ PRIVATE int ac_send_message(hgobj gobj, const char *event, json_t *kw, hgobj src
     return 0;
 }
 
+/***************************************************************************
+ *  The bottom has sent its data: continue the stream, if any,
+ *  and the QoS 0 messages held for a slow consumer
+ ***************************************************************************/
+PRIVATE int ac_tx_ready(hgobj gobj, const char *event, json_t *kw, hgobj src)
+{
+    stream_next_chunk(gobj);
+    qos0_flush(gobj);
+
+    KW_DECREF(kw)
+    return 0;
+}
+
 /***************************************************************************
  *
  ***************************************************************************/
@@ -8317,7 +14411,7 @@ PRIVATE EV_ACTION ST_WAITING_FRAME_HEADER[] = {
     {"EV_DISCONNECTED",     ac_disconnected,                    "ST_DISCONNECTED"},
     {"EV_TIMEOUT",          ac_timeout_waiting_frame_header,    0},
     {"EV_DROP",             ac_drop,                            0},
-    {"EV_TX_READY",         0,                                  0},
+    {"EV_TX_READY",         ac_tx_ready,                        0},
     {0,0,0}
 };
 PRIVATE EV_ACTION ST_WAITING_PAYLOAD_DATA[] = {
@@ -8326,7 +14420,7 @@ PRIVATE EV_ACTION ST_WAITING_PAYLOAD_DATA[] = {
     {"EV_DISCONNECTED",     ac_disconnected,                    "ST_DISCONNECTED"},
     {"EV_TIMEOUT",          ac_timeout_waiting_payload_data,    0},
     {"EV_DROP",             ac_drop,                            0},
-    {"EV_TX_READY",         0,                                  0},
+    {"EV_TX_READY",         ac_tx_ready,                        0},
     {0,0,0}
 };
 
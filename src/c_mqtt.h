@@ -33,6 +33,21 @@ extern "C"{
 #endif
 
 
+/*********************************************************************
+ *      Structures
+ *********************************************************************/
+/*
+ *  Entry of a batch of inbound publishes (EV_ON_MESSAGE with mqtt_action
+ *  "publishing_batch"). The "gbuffer" of the event holds "messages" entries,
+ *  each one followed by the topic (with the null) and the payload,
+ *  and padded to a multiple of 8 bytes.
+ */
+typedef struct {
+    uint32_t topic_len;     // without the null
+    uint32_t payload_len;
+} mqtt_batch_entry_t;
+
+
 /*********************************************************************
  *      GClass
  *********************************************************************/
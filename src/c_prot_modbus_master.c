@@ -27,7 +27,9 @@ Example of modbus configuration:
                 {
                     "type": "input_register",
                     "address": "4096",
-                    "size": 16
+                    "size": 16,
+                    "period_ms": 500,   // optional, default `timeout_polling`
+                    "priority": 1       // optional, default 0, higher first
                 }
             ],
             "conversion": [
@@ -43,13 +45,35 @@ Example of modbus configuration:
                     "type": "input_register",
                     "format": "int64",
                     "address": 4104,
-                    "multiplier": 1
+                    "multiplier": 1,
+                    "deadband": 10,             // optional, with report_by_exception
+                    "deadband_percent": 0.5,    // optional, of the last value published
+                    "max_silence": 60           // optional, overrides the attribute
                 }
             ]
         }
     ]
 },
 
+Columnar publishing (`publish_format` "columnar"): per slave, the schema is published once
+    {"slave_id": 3, "schema_id": 2166136261, "record_size": 17,
+        "schema": [{"id": "counter1", "type": "integer", "size": 8}, ...]}
+and then each cycle only the packed record
+    {"slave_id": 3, "schema_id": 2166136261, "values": 2, "gbuffer": <record>}
+Record: presence bitmap (1 bit per schema column, LSB first) and the present values in
+schema order, little endian: bool/integer int64, real double, string fixed width
+(2 bytes per word, zero padded).
+
+Slaves behind different gateways: with `url` in the slaves the gobj becomes a pool,
+one child master (and its own connection) per distinct url, polled concurrently.
+The messages of the children are published together when all the connected
+endpoints have completed a cycle.
+
+    "slaves": [
+        {"id": 1, "url": "tcp(10.0.0.5:502)", "mapping": [...], "conversion": [...]},
+        {"id": 1, "url": "tcp(10.0.0.6:502)", "mapping": [...], "conversion": [...]}
+    ]
+
 
  *          Copyright (c) 2021 Niyamaka.
  *          All Rights Reserved.
@@ -172,11 +196,6 @@ enum {
 
 #pragma pack(1)
 
-/*
-    Tabla de control: 4 * uint8_t[0xFFFF+1]     -> 262144
-    Tabla de datos:   2 * uint16_t[0xFFFF+1]    -> 262144
-    Total por nodo slave: 524288 bytes (1/2 mega)
-*/
 typedef struct { /* 1 word: 2 bytes */
     uint16_t bit_value: 1;  // Valor para las variables bit (nos cabe en la palabra de control)
     uint16_t updated: 1;    // Indica si el valor ha sido actualizado (reseteado cuando se publique)
@@ -187,16 +206,6 @@ typedef struct { /* 1 word: 2 bytes */
     uint16_t value_busy: 1;     // Si la celda (bit o word) está ocupada. Tamaño celdas: 0xFFFF
 } cell_control_t;
 
-typedef struct {
-    cell_control_t control[4][0xFFFF+1]; // 0x00000 control coil
-                                                // 0x10000 control discrete input
-                                                // 0x20000 control input register
-                                                // 0x30000 control holding register
-    uint16_t input_register[0xFFFF+1];          // 0x40000 data input register
-    uint16_t holding_register[0xFFFF+0];        // 0x60000 data holding register HACK last addr to slave_id
-    uint16_t slave_id;
-} slave_data_t;
-
 typedef struct {
     uint8_t slave_id;
     uint8_t function;
@@ -214,8 +223,168 @@ typedef struct {
 
 #pragma pack()
 
+typedef enum {
+    MODBUS_PROTOCOL_TCP     = 0,
+    MODBUS_PROTOCOL_RTU     = 1,
+    MODBUS_PROTOCOL_ASCII   = 2,
+} modbus_protocol_t;
+
+/*
+ *  Read request of the poll plan.
+ *  Compiled once from `slaves`/`mapping`, the frame is prebuilt:
+ *  per send only the TCP transaction id is patched.
+ *  TCP: MBAP (7) + function (1) + address (2) + number (2) = 12
+ *  RTU: slave (1) + function (1) + address (2) + number (2) + CRC (2) = 8
+ *  ASCII: ':' + 2 hex chars per byte of slave..number and LRC (2*7) + CRLF = 17
+ */
+#define MODBUS_READ_REQUEST_LENGTH  17
+
+/*
+ *  ASCII ADU: ':' + 2 hex chars per byte (address, PDU, LRC) + CRLF
+ */
+#define MODBUS_ASCII_MAX_ADU_LENGTH 513
+
+typedef struct {
+    int slave_idx;              // index in `slaves`
+    uint8_t slave_id;
+    uint8_t modbus_function;
+    modbus_object_type_t object_type;
+    uint16_t address;
+    uint16_t size;
+    uint16_t frame_len;
+    uint8_t frame[MODBUS_READ_REQUEST_LENGTH];
+
+    uint32_t period_ms;         // 0: `timeout_polling`
+    int priority;               // higher first with the same deadline
+    uint64_t next_due;          // deadline, time in miliseconds
+} poll_request_t;
+
+/*
+ *  Sparse image of the slave: only the mapped ranges have memory.
+ *  Adjacent maps of the same object type are joined in one contiguous block,
+ *  the blocks of each object type are sorted by address (binary search).
+ */
+typedef struct {
+    uint16_t address;           // first address of the block
+    uint16_t size;              // number of cells
+    cell_control_t *control;    // `size` cells
+    uint16_t *data;             // `size` words, only input and holding registers
+} register_block_t;
+
+/*
+ *  Conversion variable compiled at load: the decode kernel runs without
+ *  reading the json config, the value goes to the record of the descriptor.
+ */
+typedef enum {
+    VALUE_BOOL = 0,
+    VALUE_INTEGER,
+    VALUE_REAL,
+    VALUE_STRING,
+} value_type_t;
+
+#define KERNEL_BITS     (FORMAT_STRING+1)   // coils and discrete inputs, not strings
+#define MAX_KERNELS     (FORMAT_STRING+2)
+
+typedef struct {
+    const char *id;
+    variable_format_t variable_format;
+    endian_format_t endian_format;
+    int kernel;                 // variable_format or KERNEL_BITS
+    float multiplier;
+    int size;                   // words of the string
+    cell_control_t *control;    // first cell of the value
+    uint16_t *pv;               // first word, null in coils and discrete inputs
+    double deadband;
+    double deadband_percent;
+    int max_silence;            // -1: the `max_silence` attribute, read when reporting
+
+    /*
+     *  Output record
+     */
+    value_type_t value_type;
+    json_int_t integer;         // bool and integer values
+    double real;
+    char *string;               // size*2 + 1
+
+    /*
+     *  Report by exception
+     */
+    BOOL present;               // in the current publication
+    BOOL published;
+    json_int_t last_integer;
+    double last_real;
+    char *last_string;
+    uint64_t last_publish;      // time in miliseconds
+} conversion_t;
+
+/*
+ *  Run of descriptors with the same kernel, decoded in one call
+ */
+typedef void (*decode_kernel_fn)(conversion_t **list, int count);
+
+typedef struct {
+    decode_kernel_fn decode;
+    int first;                  // in decode_list
+    int count;
+} conversion_run_t;
+
+typedef struct {
+    uint16_t slave_id;
+    int max_blocks[4];                  // per object type
+    register_block_t *blocks[4];        // per object type, sorted by address
+    cell_control_t *control;            // memory of all block's controls
+    uint16_t *data;                     // memory of all block's data
+    int cells;
+    int words;
+    conversion_t *conversions;          // enabled items of `conversion`, same order
+    int max_conversions;
+    conversion_t **decode_list;         // conversions ordered by kernel
+    conversion_run_t *runs;
+    int max_runs;
+    uint32_t schema_id;                 // columnar publishing
+    int record_size;
+    BOOL schema_published;
+} slave_data_t;
+
+/*
+ *  Range of an enabled map, input of the poll planner
+ */
+typedef struct {
+    modbus_object_type_t object_type;
+    int address;
+    int size;
+    int period_ms;
+    int priority;
+} poll_range_t;
+
+/*
+ *  Outstanding transaction.
+ *  With Modbus TCP several can be in the air, the response is matched by t_id.
+ */
+#define MODBUS_MAX_INFLIGHT 16
+
+typedef struct {
+    BOOL busy;
+    uint16_t t_id;
+    uint8_t modbus_function;
+    poll_request_t *req;        // null in write requests
+} transaction_t;
+
+/*
+ *  Endpoint of the pool: child master with the slaves of one `url`
+ */
+typedef struct {
+    hgobj gobj;
+    const char *url;            // name of the child
+    BOOL connected;
+    BOOL cycle_done;            // cycle completed since the last pool cycle
+    uint32_t cycles;
+    uint32_t cycle_ms;          // duration of the last cycle
+} endpoint_t;
+
 typedef struct _FRAME_HEAD {
     // Common head
+    int t_id;
     int slave_id;
     int function;
     int byte_count;
@@ -242,23 +411,33 @@ typedef enum {
     if(priv->istream_head) istream_clear(priv->istream_head);   \
     memset(&priv->frame_head,0,sizeof(priv->frame_head));       \
     priv->modbus_function = -1;                                 \
+    priv->ascii_len = 0;                                        \
     priv->st = WAIT_HEAD;
 
 /***************************************************************************
  *              Prototypes
  ***************************************************************************/
 PRIVATE slave_data_t *get_slave_data(hgobj gobj, int slave_id, BOOL verbose);
+PRIVATE void dump_slave_data(slave_data_t *pslv, int address, int size);
 PRIVATE const char *modbus_function_name(int modbus_function);
 PRIVATE modbus_object_type_t get_object_type(hgobj gobj, const char *type);
 PRIVATE int build_slave_data(hgobj gobj);
 PRIVATE int free_slave_data(hgobj gobj);
 PRIVATE int load_modbus_config(hgobj gobj);
-PRIVATE int load_slave_mapping(hgobj gobj);
-PRIVATE int store_modbus_response_data(hgobj gobj, uint8_t *bf, int len);
+PRIVATE int compile_poll_plan(hgobj gobj);
+PRIVATE int free_poll_plan(hgobj gobj);
+PRIVATE int store_modbus_response_data(hgobj gobj, transaction_t *tr, uint8_t *bf, int len);
 PRIVATE endian_format_t get_endian_format(hgobj gobj, const char *format);
 PRIVATE variable_format_t get_variable_format(hgobj gobj, const char *format);
 PRIVATE int build_message_to_publish(hgobj gobj);
 PRIVATE int check_conversion_variables(hgobj gobj);
+PRIVATE int compile_conversions(hgobj gobj);
+PRIVATE int free_conversions(slave_data_t *pslv);
+PRIVATE void compile_schema(slave_data_t *pslv);
+PRIVATE void schedule_sift_down(hgobj gobj, int i);
+PRIVATE BOOL slaves_with_url(json_t *jn_slaves);
+PRIVATE int build_endpoints(hgobj gobj);
+PRIVATE int free_endpoints(hgobj gobj);
 
 /***************************************************************************
  *          Data: config, public data, private data
@@ -323,10 +502,37 @@ static const uint8_t table_crc_lo[] = {
     0x43, 0x83, 0x41, 0x81, 0x80, 0x40
 };
 
+/*
+ *  CRC16/MODBUS kernels, the fastest in this cpu is selected once
+ *  when the gclass is registered (see `bench-crc` command)
+ */
+typedef uint16_t (*crc16_fn_t)(const uint8_t *buffer, int buffer_length);
+
+typedef struct {
+    const char *name;
+    crc16_fn_t fn;
+} crc16_kernel_t;
+
+PRIVATE uint16_t crc16_bytewise(const uint8_t *buffer, int buffer_length);
+PRIVATE uint16_t crc16_slice8(const uint8_t *buffer, int buffer_length);
+PRIVATE void crc16_init(void);
+PRIVATE void crc16_select(void);
+
+PRIVATE uint16_t crc16_slice_table[8][256];
+
+#define CRC16_KERNELS 2
+PRIVATE const crc16_kernel_t crc16_kernels[CRC16_KERNELS] = {
+    {"bytewise",    crc16_bytewise},
+    {"slice8",      crc16_slice8},
+};
+PRIVATE const crc16_kernel_t *crc16_kernel = &crc16_kernels[0];
+
 PRIVATE json_t *cmd_help(hgobj gobj, const char *cmd, json_t *kw, hgobj src);
 PRIVATE json_t *cmd_authzs(hgobj gobj, const char *cmd, json_t *kw, hgobj src);
 PRIVATE json_t *cmd_dump_data(hgobj gobj, const char *cmd, json_t *kw, hgobj src);
 PRIVATE json_t *cmd_set_poll_timeout(hgobj gobj, const char *cmd, json_t *kw, hgobj src);
+PRIVATE json_t *cmd_view_endpoints(hgobj gobj, const char *cmd, json_t *kw, hgobj src);
+PRIVATE json_t *cmd_bench_crc(hgobj gobj, const char *cmd, json_t *kw, hgobj src);
 
 PRIVATE sdata_desc_t pm_help[] = {
 /*-PM----type-----------name------------flag------------default-----description---------- */
@@ -352,6 +558,11 @@ PRIVATE sdata_desc_t pm_timeout[] = {
 SDATAPM (ASN_INTEGER,   "timeout",      0,              "1000",      "Pollig timeout in miliseconds"),
 SDATA_END()
 };
+PRIVATE sdata_desc_t pm_bench_crc[] = {
+/*-PM----type-----------name------------flag------------default-----description---------- */
+SDATAPM (ASN_INTEGER,   "loops",        0,              "10000",    "Frames per kernel and size"),
+SDATA_END()
+};
 
 PRIVATE const char *a_help[] = {"h", "?", 0};
 
@@ -361,6 +572,8 @@ SDATACM (ASN_SCHEMA,    "help",             a_help,     pm_help,        cmd_help
 SDATACM (ASN_SCHEMA,    "authzs",           0,          pm_authzs,      cmd_authzs,     "Authorization's help"),
 SDATACM (ASN_SCHEMA,    "dump_data",        0,          pm_dump_data,   cmd_dump_data,  "Dump slave data"),
 SDATACM (ASN_SCHEMA,    "set-poll-timeout", 0,          pm_timeout,     cmd_set_poll_timeout, "Set polling timeout (in miliseconds)"),
+SDATACM (ASN_SCHEMA,    "view-endpoints",   0,          0,              cmd_view_endpoints, "View the endpoints of the pool and their cycle time"),
+SDATACM (ASN_SCHEMA,    "bench-crc",        0,          pm_bench_crc,   cmd_bench_crc,  "Benchmark the crc16 kernels with RTU frame sizes"),
 SDATA_END()
 };
 
@@ -373,10 +586,22 @@ SDATA (ASN_OCTET_STR,   "modbus_protocol",  SDF_RD,         "TCP",          "Mod
 SDATA (ASN_JSON,        "slaves",           SDF_WR,         "[]",           "Modbus configuration"),
 SDATA (ASN_INTEGER,     "timeout_polling",  SDF_WR|SDF_PERSIST,1*1000,      "Polling modbus time in miliseconds"),
 SDATA (ASN_INTEGER,     "timeout_response", SDF_WR|SDF_PERSIST, 10,         "Timeout response in seconds"),
+SDATA (ASN_INTEGER,     "baudrate",         SDF_RD,         19200,          "Serial line baud rate, RTU: the silent interval is 3.5 characters rounded up to ms (3 ms at 19200, 2 ms over 19200)"),
+SDATA (ASN_INTEGER,     "silent_interval_ms",SDF_RD,        0,              "RTU silent interval in miliseconds (0: derived from baudrate). Raise it with adapters delivering in chunks"),
+SDATA (ASN_BOOLEAN,     "silent_interval_check",SDF_RD,     1,              "RTU: discard a frame broken by a silent interval (derived from baudrate or silent_interval_ms). Set it to false if the bottom is not a serial line: gateways and tcp deliver a frame in chunks with any delay"),
+SDATA (ASN_INTEGER,     "max_inflight",     SDF_RD,         1,              "Max outstanding transactions, only Modbus TCP (1: stop and wait)"),
+SDATA (ASN_OCTET_STR,   "publish_format",   SDF_RD,         "json",         "Format of published values: json, columnar (schema id and packed record, the schema is published once)"),
+SDATA (ASN_BOOLEAN,     "report_by_exception",SDF_WR|SDF_PERSIST,0,         "Publish only the variables read and changed out of their deadband"),
+SDATA (ASN_INTEGER,     "max_silence",      SDF_WR|SDF_PERSIST,600,         "Report by exception: max seconds without publishing a variable (0: no heartbeat)"),
+SDATA (ASN_INTEGER,     "coalesce_gap",     SDF_RD,         0,              "Max hole of not mapped addresses to join two maps in one read request (0: only adjacent maps). The slave's `coalesce_gap` overrides it"),
+SDATA (ASN_JSON,        "kw_connex",        SDF_RD,         0,              "Kw to create the connex if there is no bottom gobj (set by the pool in its endpoints)"),
 SDATA (ASN_BOOLEAN,     "connected",        SDF_RD|SDF_STATS,0,             "Connection state. Important filter!"),
+SDATA (ASN_UNSIGNED,    "cycles",           SDF_RD|SDF_STATS,0,             "Poll cycles completed"),
+SDATA (ASN_UNSIGNED,    "cycle_ms",         SDF_RD|SDF_STATS,0,             "Duration of the last poll cycle in miliseconds"),
 SDATA (ASN_OCTET_STR,   "on_open_event_name",SDF_RD,        "EV_ON_OPEN",   "Must be empty if you don't want receive this event"),
 SDATA (ASN_OCTET_STR,   "on_close_event_name",SDF_RD,       "EV_ON_CLOSE",  "Must be empty if you don't want receive this event"),
 SDATA (ASN_OCTET_STR,   "on_message_event_name",SDF_RD,     "EV_ON_MESSAGE","Must be empty if you don't want receive this event"),
+SDATA (ASN_OCTET_STR,   "on_cycle_event_name",SDF_RD,       "",             "Published at end of poll cycle with the cycle time. Empty: not published"),
 SDATA (ASN_POINTER,     "user_data",        0,              0,              "user data"),
 SDATA (ASN_POINTER,     "user_data2",       0,              0,              "more user data"),
 SDATA (ASN_POINTER,     "subscriber",       0,              0,              "subscriber of output-events. If it's null then subscriber is the parent."),
@@ -411,25 +636,45 @@ PRIVATE const trace_level_t s_user_trace_level[16] = {
 typedef struct _PRIVATE_DATA {
     int timeout_polling;
     int timeout_response;
+    int coalesce_gap;
+    BOOL report_by_exception;
+    int max_silence;
+    const char *publish_format;
+    BOOL columnar;
     hgobj timer;
     TYPE_ASN_BOOLEAN *pconnected;
     const char *modbus_protocol;
+    modbus_protocol_t protocol;
 
     json_t *slaves_;
-    int idx_slaves;
     int max_slaves;
-    json_t *cur_slave_;
 
-    json_t *mapping_;
-    int idx_mapping;
-    int max_mapping;
-    json_t *cur_map_;
+    poll_request_t *poll_plan;
+    int max_requests;
+    int idx_request;
+    int *schedule;              // heap of poll_plan indexes, earliest deadline first
+    int cycle_requests;
+    uint64_t cycle_t0;          // deadlines until this time are polled in the cycle
+
+    /*
+     *  Pool of endpoints, when the slaves have `url`
+     */
+    endpoint_t *endpoints;
+    int max_endpoints;
+    uint64_t pool_t0;
 
     /* Extract from MODBUS Messaging on TCP/IP Implementation Guide V1.0b
        (page 23/46):
        The transaction identifier is used to associate the future response
        with the request. This identifier is unique on each TCP connection. */
     uint16_t t_id;
+    int max_inflight;
+    int inflight;
+    int baudrate;
+    int silent_interval_ms;     // RTU: turnaround and frame resync
+    BOOL silent_interval_check; // RTU: discard the frames broken by a silent interval
+    uint64_t last_rx;           // RTU: time of last received data
+    transaction_t transactions[MODBUS_MAX_INFLIGHT];
 
     slave_data_t *slave_data;
 
@@ -438,6 +683,7 @@ typedef struct _PRIVATE_DATA {
     const char *on_open_event_name;
     const char *on_close_event_name;
     const char *on_message_event_name;
+    const char *on_cycle_event_name;
     int inform_on_close;
 
     FRAME_HEAD frame_head;
@@ -445,6 +691,8 @@ typedef struct _PRIVATE_DATA {
     istream istream_payload;
     state_t st;
     int modbus_function;
+    char ascii_frame[MODBUS_ASCII_MAX_ADU_LENGTH];  // between ':' and CRLF
+    int ascii_len;
 
     json_t *jn_current_request;
     json_t *jn_request_queue;
@@ -486,9 +734,18 @@ PRIVATE void mt_create(hgobj gobj)
     SET_PRIV(on_open_event_name,    gobj_read_str_attr)
     SET_PRIV(on_close_event_name,   gobj_read_str_attr)
     SET_PRIV(on_message_event_name, gobj_read_str_attr)
+    SET_PRIV(on_cycle_event_name,   gobj_read_str_attr)
     SET_PRIV(modbus_protocol,       gobj_read_str_attr)
     SET_PRIV(timeout_polling,       gobj_read_int32_attr)
     SET_PRIV(timeout_response,      gobj_read_int32_attr)
+    SET_PRIV(coalesce_gap,          gobj_read_int32_attr)
+    SET_PRIV(report_by_exception,   gobj_read_bool_attr)
+    SET_PRIV(publish_format,        gobj_read_str_attr)
+    SET_PRIV(max_silence,           gobj_read_int32_attr)
+    SET_PRIV(max_inflight,          gobj_read_int32_attr)
+    SET_PRIV(baudrate,              gobj_read_int32_attr)
+    SET_PRIV(silent_interval_ms,    gobj_read_int32_attr)
+    SET_PRIV(silent_interval_check, gobj_read_bool_attr)
 
 }
 
@@ -501,7 +758,48 @@ PRIVATE void mt_writing(hgobj gobj, const char *path)
 
     IF_EQ_SET_PRIV(timeout_polling,         gobj_read_int32_attr)
     ELIF_EQ_SET_PRIV(timeout_response,      gobj_read_int32_attr)
+    ELIF_EQ_SET_PRIV(report_by_exception,   gobj_read_bool_attr)
+    ELIF_EQ_SET_PRIV(max_silence,           gobj_read_int32_attr)
     END_EQ_SET_PRIV()
+
+    if(priv->endpoints && (strcmp(path, "timeout_polling")==0 ||
+            strcmp(path, "timeout_response")==0 ||
+            strcmp(path, "report_by_exception")==0 ||
+            strcmp(path, "max_silence")==0)) {
+        /*
+         *  The endpoints of the pool got these attributes when created, update them
+         */
+        for(int i=0; i<priv->max_endpoints; i++) {
+            hgobj gobj_endpoint = priv->endpoints[i].gobj;
+            if(strcmp(path, "report_by_exception")==0) {
+                gobj_write_bool_attr(gobj_endpoint, path, priv->report_by_exception);
+            } else {
+                gobj_write_int32_attr(gobj_endpoint, path, gobj_read_int32_attr(gobj, path));
+            }
+        }
+    }
+
+    if(strcmp(path, "slaves")==0 && gobj_is_running(gobj) && priv->endpoints) {
+        /*
+         *  New configuration of the pool: recreate the endpoints.
+         *  Changing between pool and single connection needs a restart.
+         */
+        free_endpoints(gobj);
+        build_endpoints(gobj);
+
+    } else if(strcmp(path, "slaves")==0 && gobj_is_running(gobj)) {
+        /*
+         *  New configuration: rebuild the slave data and recompile the poll plan.
+         *  A response of the old plan still in the air will be ignored.
+         */
+        free_poll_plan(gobj);
+        free_slave_data(gobj);
+        load_modbus_config(gobj);
+        build_slave_data(gobj);
+        check_conversion_variables(gobj);
+        compile_conversions(gobj);
+        compile_poll_plan(gobj);
+    }
 }
 
 /***************************************************************************
@@ -514,12 +812,32 @@ PRIVATE int mt_start(hgobj gobj)
     priv->jn_conversion = json_array();
     priv->jn_request_queue = json_array();
 
-    load_modbus_config(gobj);
-    build_slave_data(gobj);
-    check_conversion_variables(gobj);
+    if(strcmp(priv->publish_format, "columnar")==0) {
+        priv->columnar = TRUE;
+    } else if(strcmp(priv->publish_format, "json")!=0) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "publish_format UNKNOWN, using json",
+            "publish_format","%s", priv->publish_format,
+            NULL
+        );
+    }
+
+    /*
+     *  Slaves behind several endpoints: be a pool of masters, one per endpoint.
+     */
+    if(slaves_with_url(gobj_read_json_attr(gobj, "slaves"))) {
+        gobj_change_state(gobj, "ST_POOL");
+        build_endpoints(gobj);
+        gobj_start(priv->timer);
+        return 0;
+    }
 
     SWITCHS(priv->modbus_protocol) {
         CASES("TCP")
+            priv->protocol = MODBUS_PROTOCOL_TCP;
             priv->istream_head = istream_create(
                 gobj,
                 sizeof(head_tcp_t),
@@ -537,8 +855,28 @@ PRIVATE int mt_start(hgobj gobj)
             }
             break;
 
-        CASES("RTU")
         CASES("ASCII")
+            /*
+             *  Frames delimited by ':' and CRLF, accumulated in ascii_frame
+             */
+            priv->protocol = MODBUS_PROTOCOL_ASCII;
+            break;
+
+        CASES("RTU")
+            priv->protocol = MODBUS_PROTOCOL_RTU;
+
+            /*
+             *  Silent interval of 3.5 characters of 11 bits, rounded up to ms:
+             *  2005 us (3 ms) at 19200 bauds, fixed to 1750 us (2 ms) over 19200
+             *  (Modbus over serial line V1.02, 2.5.1.1)
+             */
+            if(priv->silent_interval_ms <= 0) {
+                int t35_us = 1750;
+                if(priv->baudrate > 0 && priv->baudrate <= 19200) {
+                    t35_us = (int)((3.5 * 11 * 1000000) / priv->baudrate);
+                }
+                priv->silent_interval_ms = (t35_us + 999) / 1000;
+            }
             priv->istream_head = istream_create(
                 gobj,
                 sizeof(head_rtu_t),
@@ -560,8 +898,38 @@ PRIVATE int mt_start(hgobj gobj)
             break;
     } SWITCHS_END;
 
+    /*
+     *  Only Modbus TCP can match the responses, serial lines are stop and wait
+     */
+    if(priv->protocol != MODBUS_PROTOCOL_TCP || priv->max_inflight < 1) {
+        priv->max_inflight = 1;
+    } else if(priv->max_inflight > MODBUS_MAX_INFLIGHT) {
+        priv->max_inflight = MODBUS_MAX_INFLIGHT;
+    }
+
+    load_modbus_config(gobj);
+    build_slave_data(gobj);
+    check_conversion_variables(gobj);
+    compile_conversions(gobj);
+    compile_poll_plan(gobj);
+
     gobj_start(priv->timer);
 
+    /*
+     *  Endpoint of a pool, or manual connex configuration
+     */
+    hgobj bottom = gobj_bottom_gobj(gobj);
+    if(!bottom) {
+        json_t *kw_connex = gobj_read_json_attr(gobj, "kw_connex");
+        if(kw_connex) {
+            json_incref(kw_connex);
+            bottom = gobj_create(gobj_name(gobj), GCLASS_CONNEX, kw_connex, gobj);
+            gobj_set_bottom_gobj(gobj, bottom);
+            gobj_write_str_attr(bottom, "tx_ready_event_name", 0);
+            gobj_start(bottom);
+        }
+    }
+
     return 0;
 }
 
@@ -573,6 +941,8 @@ PRIVATE int mt_stop(hgobj gobj)
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
     JSON_DECREF(priv->jn_conversion);
+    free_endpoints(gobj);
+    free_poll_plan(gobj);
     free_slave_data(gobj);
 
     RESET_MACHINE();
@@ -650,12 +1020,12 @@ PRIVATE json_t *cmd_dump_data(hgobj gobj, const char *cmd, json_t *kw, hgobj src
     }
 
     if(slave_id == -1 && size == -1) {
-        log_debug_dump(
-            0,
-            (const char *)priv->slave_data,
-            priv->max_slaves * sizeof(slave_data_t),
-            "slaves"
-        );
+        slave_data_t *pslv = priv->slave_data;
+        for(int i=0; pslv && i<priv->max_slaves; i++) {
+            dump_slave_data(pslv, 0, 0xFFFF + 1);
+            // Next slave
+            pslv++;
+        }
         return msg_iev_build_webix(
             gobj,
             0,
@@ -692,48 +1062,12 @@ PRIVATE json_t *cmd_dump_data(hgobj gobj, const char *cmd, json_t *kw, hgobj src
                 kw  // owned
             );
         }
-
-        log_debug_dump(0, (const char *)pslv + 0x00000 + address, size,
-            "%d: Control Coil", slave_id
-        );
-        log_debug_dump(0, (const char *)pslv + 0x10000 + address, size,
-            "%d: Control Discrete input", slave_id
-        );
-        log_debug_dump(0, (const char *)pslv + 0x20000 + address, size,
-            "%d: Control Input register", slave_id
-        );
-        log_debug_dump(0, (const char *)pslv + 0x30000 + address, size,
-            "%d: Control Holding register", slave_id
-        );
-        log_debug_dump(0, (const char *)pslv + 0x40000 + address*2, size*2,
-            "%d: Data Input register", slave_id
-        );
-        log_debug_dump(0, (const char *)pslv + 0x60000 + address*2, size*2,
-            "%d: Data Holding register", slave_id
-        );
+        dump_slave_data(pslv, address, size);
 
     } else {
         slave_data_t *pslv = priv->slave_data;
-        for(int i=0; i<priv->max_slaves; i++) {
-            slave_id = pslv->slave_id;
-            log_debug_dump(0, (const char *)pslv + 0x00000 + address, size,
-                "%d: Control Coil", slave_id
-            );
-            log_debug_dump(0, (const char *)pslv + 0x10000 + address, size,
-                "%d: Control Discrete input", slave_id
-            );
-            log_debug_dump(0, (const char *)pslv + 0x20000 + address, size,
-                "%d: Control Input register", slave_id
-            );
-            log_debug_dump(0, (const char *)pslv + 0x30000 + address, size,
-                "%d: Control Holding register", slave_id
-            );
-            log_debug_dump(0, (const char *)pslv + 0x40000 + address*2, size*2,
-                "%d: Data Input register", slave_id
-            );
-            log_debug_dump(0, (const char *)pslv + 0x60000 + address*2, size*2,
-                "%d: Data Holding register", slave_id
-            );
+        for(int i=0; pslv && i<priv->max_slaves; i++) {
+            dump_slave_data(pslv, address, size);
             // Next slave
             pslv++;
         }
@@ -769,6 +1103,102 @@ PRIVATE json_t *cmd_set_poll_timeout(hgobj gobj, const char *cmd, json_t *kw, hg
     );
 }
 
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE json_t *cmd_view_endpoints(hgobj gobj, const char *cmd, json_t *kw, hgobj src)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->endpoints) {
+        return msg_iev_build_webix(
+            gobj,
+            -1,
+            json_sprintf("Not a pool, the slaves have no url"),
+            0,
+            0,
+            kw  // owned
+        );
+    }
+
+    json_t *jn_data = json_array();
+    for(int i=0; i<priv->max_endpoints; i++) {
+        endpoint_t *ep = &priv->endpoints[i];
+        json_array_append_new(jn_data, json_pack("{s:s, s:b, s:i, s:i}",
+            "url", ep->url,
+            "connected", ep->connected,
+            "cycles", (int)ep->cycles,
+            "cycle_ms", (int)ep->cycle_ms
+        ));
+    }
+
+    return msg_iev_build_webix(
+        gobj,
+        0,
+        0,
+        0,
+        jn_data,
+        kw  // owned
+    );
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE json_t *cmd_bench_crc(hgobj gobj, const char *cmd, json_t *kw, hgobj src)
+{
+    int loops = kw_get_int(kw, "loops", 10000, KW_WILD_NUMBER);
+
+    if(loops <= 0) {
+        loops = 1;
+    }
+
+    /*
+     *  Smallest request, typical response and biggest RTU frame
+     */
+    static const int sizes[] = {6, 64, MODBUS_MAX_ADU_LENGTH - 4};
+    uint8_t frame[MODBUS_MAX_ADU_LENGTH];
+    for(int i=0; i<(int)sizeof(frame); i++) {
+        frame[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    json_t *jn_data = json_array();
+    for(int s=0; s<(int)(sizeof(sizes)/sizeof(sizes[0])); s++) {
+        uint16_t reference = crc16_bytewise(frame, sizes[s]);
+        for(int k=0; k<CRC16_KERNELS; k++) {
+            const crc16_kernel_t *kernel = &crc16_kernels[k];
+            volatile uint16_t crc = 0;
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for(int l=0; l<loops; l++) {
+                frame[0] = (uint8_t)l;
+                crc ^= kernel->fn(frame, sizes[s]);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            frame[0] = 7;
+
+            double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+            json_array_append_new(jn_data, json_pack("{s:s, s:i, s:f, s:f, s:b, s:b}",
+                "kernel", kernel->name,
+                "size", sizes[s],
+                "ns_frame", ns / loops,
+                "mb_s", ns > 0? ((double)sizes[s] * loops * 1000.0) / ns : 0.0,
+                "match", kernel->fn(frame, sizes[s]) == reference,
+                "in_use", kernel == crc16_kernel
+            ));
+        }
+    }
+
+    return msg_iev_build_webix(
+        gobj,
+        0,
+        json_sprintf("Crc kernel in use: %s", crc16_kernel->name),
+        0,
+        jn_data,
+        kw  // owned
+    );
+}
+
 
 
 
@@ -874,16 +1304,17 @@ PRIVATE int send_data(hgobj gobj, GBUFFER *gbuf)
 }
 
 /***************************************************************************
- *  Calculate crc for tx messages
+ *  CRC16/MODBUS byte at a time with the hi/lo tables
+ *  Returned with the high byte to be sent first.
  ***************************************************************************/
-PRIVATE uint16_t crc16_tx(uint8_t *buffer, uint16_t buffer_length)
+PRIVATE uint16_t crc16_bytewise(const uint8_t *buffer, int buffer_length)
 {
     uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
     uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
     unsigned int i; /* will index into CRC lookup */
 
     /* pass through message buffer */
-    while (buffer_length--) {
+    while (buffer_length-- > 0) {
         i = crc_hi ^ *buffer++; /* calculate the CRC  */
         crc_hi = crc_lo ^ table_crc_hi[i];
         crc_lo = table_crc_lo[i];
@@ -893,50 +1324,188 @@ PRIVATE uint16_t crc16_tx(uint8_t *buffer, uint16_t buffer_length)
 }
 
 /***************************************************************************
- *  Calculate crc for rx messages
+ *  CRC16/MODBUS slicing by 8: eight bytes per step with eight tables
+ *  Returned with the high byte to be sent first, as crc16_bytewise().
  ***************************************************************************/
-PRIVATE uint16_t crc16_rx(FRAME_HEAD *frame, uint8_t *buffer, uint16_t buffer_length)
+PRIVATE uint16_t crc16_slice8(const uint8_t *buffer, int buffer_length)
 {
-    uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
-    uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
-    unsigned int i; /* will index into CRC lookup */
+    uint16_t (*t)[256] = crc16_slice_table;
+    uint16_t crc = 0xFFFF;
+
+    while(buffer_length >= 8) {
+        crc ^= buffer[0] | (buffer[1] << 8);
+        crc = t[7][crc & 0xFF] ^ t[6][crc >> 8] ^
+              t[5][buffer[2]] ^ t[4][buffer[3]] ^
+              t[3][buffer[4]] ^ t[2][buffer[5]] ^
+              t[1][buffer[6]] ^ t[0][buffer[7]];
+        buffer += 8;
+        buffer_length -= 8;
+    }
+    while(buffer_length-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *buffer++) & 0xFF];
+    }
 
-    {
-        i = crc_hi ^ frame->slave_id; /* calculate the CRC  */
-        crc_hi = crc_lo ^ table_crc_hi[i];
-        crc_lo = table_crc_lo[i];
+    return (uint16_t)((crc << 8) | (crc >> 8));
+}
+
+/***************************************************************************
+ *  Build the slicing tables (reflected polynomial 0xA001), once per process
+ ***************************************************************************/
+PRIVATE void crc16_init(void)
+{
+    if(crc16_slice_table[0][1]) {
+        return;
+    }
+    for(int b=0; b<256; b++) {
+        uint16_t crc = b;
+        for(int k=0; k<8; k++) {
+            crc = (crc & 1)? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+        crc16_slice_table[0][b] = crc;
+    }
+    for(int b=0; b<256; b++) {
+        for(int k=1; k<8; k++) {
+            uint16_t prev = crc16_slice_table[k-1][b];
+            crc16_slice_table[k][b] = (prev >> 8) ^ crc16_slice_table[0][prev & 0xFF];
+        }
     }
+}
 
-    {
-        i = crc_hi ^ frame->function; /* calculate the CRC  */
-        crc_hi = crc_lo ^ table_crc_hi[i];
-        crc_lo = table_crc_lo[i];
+/***************************************************************************
+ *  Select the fastest crc kernel that matches the bytewise one,
+ *  timing them with the biggest RTU frame. Once, for all the instances.
+ ***************************************************************************/
+PRIVATE void crc16_select(void)
+{
+    static BOOL selected = FALSE;
+    if(selected) {
+        return;
     }
+    selected = TRUE;
+    crc16_init();
 
-    {
-        i = crc_hi ^ frame->byte_count; /* calculate the CRC  */
-        crc_hi = crc_lo ^ table_crc_hi[i];
-        crc_lo = table_crc_lo[i];
+    uint8_t frame[MODBUS_MAX_ADU_LENGTH];
+    for(int i=0; i<(int)sizeof(frame); i++) {
+        frame[i] = (uint8_t)(i * 31 + 7);
     }
+    uint16_t reference = crc16_bytewise(frame, sizeof(frame));
 
-    /* pass through message buffer */
-    while (buffer_length--) {
-        i = crc_hi ^ *buffer++; /* calculate the CRC  */
-        crc_hi = crc_lo ^ table_crc_hi[i];
-        crc_lo = table_crc_lo[i];
+    double best = 0;
+    for(int k=0; k<CRC16_KERNELS; k++) {
+        const crc16_kernel_t *kernel = &crc16_kernels[k];
+        if(kernel->fn(frame, sizeof(frame)) != reference) {
+            continue;
+        }
+        volatile uint16_t crc = 0;
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(int l=0; l<1000; l++) {
+            crc ^= kernel->fn(frame, sizeof(frame));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+        if(k == 0 || ns < best) {
+            best = ns;
+            crc16_kernel = kernel;
+        }
     }
+}
 
-    return (crc_hi << 8 | crc_lo);
+/***************************************************************************
+ *  Calculate crc for tx messages
+ ***************************************************************************/
+PRIVATE uint16_t crc16_tx(uint8_t *buffer, uint16_t buffer_length)
+{
+    return crc16_kernel->fn(buffer, buffer_length);
 }
 
 /***************************************************************************
- * - HEADER_LENGTH_TCP (7) + function (1) + address (2) + number (2)
- * - HEADER_LENGTH_RTU (1) + function (1) + address (2) + number (2) + CRC (2)
- *
- *
- * <------------------------ MODBUS TCP/IP ADU(1) ------------------------->
- *              <----------- MODBUS PDU (1') ---------------->
- *  +-----------+---------------+------------------------------------------+
+ *  Check the crc of a rx frame, contiguous from slave address to crc:
+ *  the crc of a frame with its own crc appended is zero.
+ ***************************************************************************/
+PRIVATE BOOL crc16_check(const uint8_t *adu, int adu_length)
+{
+    return adu_length > 2 && crc16_kernel->fn(adu, adu_length) == 0;
+}
+
+/***************************************************************************
+ *  LRC of Modbus ASCII: two's complement of the sum of the bytes
+ ***************************************************************************/
+PRIVATE uint8_t lrc8(uint8_t *buffer, int buffer_length)
+{
+    uint8_t lrc = 0;
+    while(buffer_length--) {
+        lrc += *buffer++;
+    }
+    return (uint8_t)(-((int8_t)lrc));
+}
+
+/***************************************************************************
+ *  Serial line frame of `adu` (slave address and PDU):
+ *      RTU: adu + CRC (high byte first as sent by crc16_tx)
+ *      ASCII: ':' + hex(adu + LRC) + CRLF
+ *  Return the length of the frame or 0 if it doesn't fit.
+ ***************************************************************************/
+PRIVATE int build_serial_frame(hgobj gobj, uint8_t *adu, int len, uint8_t *frame, int frame_size)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    static const char hex[] = "0123456789ABCDEF";
+
+    if(priv->protocol == MODBUS_PROTOCOL_RTU) {
+        if(len + 2 > frame_size) {
+            return 0;
+        }
+        memmove(frame, adu, len);
+        uint16_t crc = crc16_tx(adu, len);
+        frame[len] = crc >> 8;
+        frame[len+1] = crc & 0x00FF;
+        return len + 2;
+    }
+
+    if(1 + (len + 1)*2 + 2 > frame_size) {
+        return 0;
+    }
+    uint8_t lrc = lrc8(adu, len);
+    int n = 0;
+    frame[n++] = ':';
+    for(int i=0; i<len; i++) {
+        frame[n++] = hex[adu[i] >> 4];
+        frame[n++] = hex[adu[i] & 0x0F];
+    }
+    frame[n++] = hex[lrc >> 4];
+    frame[n++] = hex[lrc & 0x0F];
+    frame[n++] = '\r';
+    frame[n++] = '\n';
+    return n;
+}
+
+/***************************************************************************
+ *  Max quantity of cells of a read request
+ ***************************************************************************/
+PRIVATE int max_read_size(modbus_object_type_t object_type)
+{
+    switch(object_type) {
+        case TYPE_COIL:
+        case TYPE_DISCRETE_INPUT:
+            return MODBUS_MAX_READ_BITS;
+        case TYPE_INPUT_REGISTER:
+        case TYPE_HOLDING_REGISTER:
+            return MODBUS_MAX_READ_REGISTERS;
+        default:
+            return 0;
+    }
+}
+
+/***************************************************************************
+ *  Compile a read request of the poll plan into a prebuilt frame.
+ *
+ * - HEADER_LENGTH_TCP (7) + function (1) + address (2) + number (2)
+ * - HEADER_LENGTH_RTU (1) + function (1) + address (2) + number (2) + CRC (2)
+ *
+ *
+ * <------------------------ MODBUS TCP/IP ADU(1) ------------------------->
+ *              <----------- MODBUS PDU (1') ---------------->
+ *  +-----------+---------------+------------------------------------------+
  *  | TID | PID | Length | UID  |Code | Data                               |
  *  +-----------+---------------+------------------------------------------+
  *  |     |     |        |      |
@@ -951,78 +1520,31 @@ PRIVATE uint16_t crc16_rx(FRAME_HEAD *frame, uint8_t *buffer, uint16_t buffer_le
  * (1)  ... Modbus TCP/IP Application Data Unit
  * (1') ... Modbus Protocol Data Unit
  ***************************************************************************/
-PRIVATE GBUFFER *build_modbus_request_read_message(hgobj gobj, json_t *jn_slave, json_t *jn_map)
+PRIVATE int compile_read_request(
+    hgobj gobj,
+    poll_request_t *req,
+    int slave_idx,
+    uint8_t slave_id,
+    modbus_object_type_t object_type,
+    uint16_t address,
+    uint16_t size
+)
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj); // WARNING must be used only for t_id
-
-    uint8_t req[12] = {0};
-    uint8_t slave_id = (uint8_t)kw_get_int(jn_slave, "id", 0, KW_REQUIRED);
-    uint16_t address = kw_get_int(jn_map, "address", 0, KW_REQUIRED|KW_WILD_NUMBER);
-    uint16_t size = kw_get_int(jn_map, "size", 0, KW_REQUIRED|KW_WILD_NUMBER);
-    const char *id = kw_get_str(jn_map, "id", "", 0);
-    const char *type = kw_get_str(jn_map, "type", "", KW_REQUIRED);
-    int object_type = get_object_type(gobj, type);
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
     uint8_t modbus_function = 0;
     switch(object_type) {
         case TYPE_COIL:
             modbus_function = MODBUS_FC_READ_COILS;
-            if(size > MODBUS_MAX_READ_BITS) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                    "msg",          "%s", "Modbus Too many coils requested",
-                    "type",         "%s", type,
-                    "size",         "%d", size,
-                    NULL
-                );
-                size = MODBUS_MAX_READ_BITS;
-            }
-
             break;
         case TYPE_DISCRETE_INPUT:
             modbus_function = MODBUS_FC_READ_DISCRETE_INPUTS;
-            if(size > MODBUS_MAX_READ_BITS) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                    "msg",          "%s", "Modbus Too many discrete inputs requested",
-                    "size",         "%d", size,
-                    NULL
-                );
-                size = MODBUS_MAX_READ_BITS;
-            }
             break;
-
         case TYPE_INPUT_REGISTER:
             modbus_function = MODBUS_FC_READ_INPUT_REGISTERS;
-            if(size > MODBUS_MAX_READ_REGISTERS) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                    "msg",          "%s", "Modbus Too many discrete inputs requested",
-                    "size",         "%d", size,
-                    NULL
-                );
-                size = MODBUS_MAX_READ_REGISTERS;
-            }
             break;
         case TYPE_HOLDING_REGISTER:
             modbus_function = MODBUS_FC_READ_HOLDING_REGISTERS;
-            if(size > MODBUS_MAX_READ_REGISTERS) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                    "msg",          "%s", "Modbus Too many discrete inputs requested",
-                    "size",         "%d", size,
-                    NULL
-                );
-                size = MODBUS_MAX_READ_REGISTERS;
-            }
             break;
         default:
             log_error(LOG_OPT_TRACE_STACK,
@@ -1030,59 +1552,74 @@ PRIVATE GBUFFER *build_modbus_request_read_message(hgobj gobj, json_t *jn_slave,
                 "function",     "%s", __FUNCTION__,
                 "msgset",       "%s", MSGSET_PARAMETER_ERROR,
                 "msg",          "%s", "Modbus object type UNKNOWN",
-                "type",         "%s", type,
+                "object_type",  "%d", object_type,
                 NULL
             );
-            return 0;
+            return -1;
     }
 
-    GBUFFER *gbuf = gbuf_create(32, 32, 0, 0);
+    if(size == 0 || size > max_read_size(object_type)) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+            "msg",          "%s", "Modbus read size OUT OF RANGE",
+            "object_type",  "%d", object_type,
+            "size",         "%d", size,
+            NULL
+        );
+        return -1;
+    }
 
-    SWITCHS(priv->modbus_protocol) {
-        CASES("TCP")
-            /* Increase transaction ID */
-            if (priv->t_id < UINT16_MAX)
-                priv->t_id++;
-            else
-                priv->t_id = 0;
+    req->slave_idx = slave_idx;
+    req->slave_id = slave_id;
+    req->modbus_function = modbus_function;
+    req->object_type = object_type;
+    req->address = address;
+    req->size = size;
 
-            req[0] = priv->t_id >> 8;
-            req[1] = priv->t_id & 0x00ff;
+    uint8_t *frame = req->frame;
+    switch(priv->protocol) {
+        case MODBUS_PROTOCOL_TCP:
+            /* Transaction ID, patched in each send */
+            frame[0] = 0;
+            frame[1] = 0;
 
             /* Protocol Modbus */
-            req[2] = 0;
-            req[3] = 0;
+            frame[2] = 0;
+            frame[3] = 0;
 
             /* Subtract the header length to the message length */
             int mbap_length = 12 - 6;
 
-            req[4] = mbap_length >> 8;
-            req[5] = mbap_length & 0x00FF;
-            req[6] = slave_id;
-            req[7] = modbus_function;
-            req[8] = address >> 8;
-            req[9] = address & 0x00ff;
-            req[10] = size >> 8;
-            req[11] = size & 0x00ff;
-            gbuf_append(gbuf, req, 12);
+            frame[4] = mbap_length >> 8;
+            frame[5] = mbap_length & 0x00FF;
+            frame[6] = slave_id;
+            frame[7] = modbus_function;
+            frame[8] = address >> 8;
+            frame[9] = address & 0x00ff;
+            frame[10] = size >> 8;
+            frame[11] = size & 0x00ff;
+            req->frame_len = 12;
             break;
 
-        CASES("RTU")
-            req[0] = slave_id;
-            req[1] = modbus_function;
-            req[2] = address >> 8;
-            req[3] = address & 0x00ff;
-            req[4] = size >> 8;
-            req[5] = size & 0x00ff;
-
-            uint16_t crc = crc16_tx(req, 6);
-            req[6] = crc >> 8;
-            req[7] = crc & 0x00FF;
-            gbuf_append(gbuf, req, 8);
+        case MODBUS_PROTOCOL_RTU:
+        case MODBUS_PROTOCOL_ASCII:
+            {
+                uint8_t adu[6];
+                adu[0] = slave_id;
+                adu[1] = modbus_function;
+                adu[2] = address >> 8;
+                adu[3] = address & 0x00ff;
+                adu[4] = size >> 8;
+                adu[5] = size & 0x00ff;
+
+                /* Nothing changes between sends: the crc/lrc is computed once */
+                req->frame_len = build_serial_frame(gobj, adu, sizeof(adu), frame, sizeof(req->frame));
+            }
             break;
 
-        CASES("ASCII")
-        DEFAULTS
+        default:
             log_error(0,
                 "gobj",         "%s", gobj_full_name(gobj),
                 "function",     "%s", __FUNCTION__,
@@ -1091,20 +1628,47 @@ PRIVATE GBUFFER *build_modbus_request_read_message(hgobj gobj, json_t *jn_slave,
                 "protocol",     "%s", priv->modbus_protocol,
                 NULL
             );
-            break;
-    } SWITCHS_END;
+            return -1;
+    }
 
-    priv->modbus_function = modbus_function;
+    return 0;
+}
+
+/***************************************************************************
+ *  Build the frame to send from the prebuilt request
+ ***************************************************************************/
+PRIVATE GBUFFER *build_modbus_request_read_message(hgobj gobj, poll_request_t *req)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj); // WARNING must be used only for t_id
+
+    GBUFFER *gbuf = gbuf_create(req->frame_len, req->frame_len, 0, 0);
+    if(!gbuf) {
+        // Error already logged
+        return 0;
+    }
+
+    if(priv->protocol == MODBUS_PROTOCOL_TCP) {
+        /* Increase transaction ID */
+        if (priv->t_id < UINT16_MAX)
+            priv->t_id++;
+        else
+            priv->t_id = 0;
+
+        req->frame[0] = priv->t_id >> 8;
+        req->frame[1] = priv->t_id & 0x00ff;
+    }
+    gbuf_append(gbuf, req->frame, req->frame_len);
+
+    priv->modbus_function = req->modbus_function;
 
     if(gobj_trace_level(gobj) & TRACE_DECODE) {
-        trace_msg("🍅🍅⏩ func: %d %s, slave_id: %d, addr: %d (0x%04X), size: %d, id: %s",
-            modbus_function,
-            modbus_function_name(modbus_function),
-            slave_id,
-            address,
-            address,
-            size,
-            id // ??? TODO revisa qué es
+        trace_msg("🍅🍅⏩ func: %d %s, slave_id: %d, addr: %d (0x%04X), size: %d",
+            req->modbus_function,
+            modbus_function_name(req->modbus_function),
+            req->slave_id,
+            req->address,
+            req->address,
+            req->size
         );
     }
 
@@ -1208,10 +1772,10 @@ PRIVATE GBUFFER *build_modbus_request_write_message(hgobj gobj, json_t *jn_reque
             return 0;
     }
 
-    GBUFFER *gbuf = gbuf_create(32, 32, 0, 0);
+    GBUFFER *gbuf = gbuf_create(32, MODBUS_ASCII_MAX_ADU_LENGTH, 0, 0);
 
-    SWITCHS(priv->modbus_protocol) {
-        CASES("TCP")
+    switch(priv->protocol) {
+        case MODBUS_PROTOCOL_TCP:
             /* Increase transaction ID */
             if (priv->t_id < UINT16_MAX)
                 priv->t_id++;
@@ -1247,22 +1811,29 @@ PRIVATE GBUFFER *build_modbus_request_write_message(hgobj gobj, json_t *jn_reque
             }
             break;
 
-        CASES("RTU")
-        CASES("ASCII")
-// TODO            req[0] = slave_id;
-//             req[1] = modbus_function;
-//             req[2] = address >> 8;
-//             req[3] = address & 0x00ff;
-//             req[4] = size >> 8;
-//             req[5] = size & 0x00ff;
-//
-//             uint16_t crc = crc16_tx(req, 6);
-//             req[7] = crc >> 8;
-//             req[8] = crc & 0x00FF;
-//             gbuf_append(gbuf, req, 9);
-//             break;
+        case MODBUS_PROTOCOL_RTU:
+        case MODBUS_PROTOCOL_ASCII:
+            {
+                uint8_t adu[MODBUS_MAX_ADU_LENGTH];
+                uint8_t frame[MODBUS_ASCII_MAX_ADU_LENGTH];
+                int len = 0;
+                adu[len++] = slave_id;
+                adu[len++] = modbus_function;
+                adu[len++] = address >> 8;
+                adu[len++] = address & 0x00ff;
+                adu[len++] = value >> 8;        // Add the first value, always come
+                adu[len++] = value & 0x00ff;
+                for(int i=1; i<size; i++) { // TODO No tested!!!
+                    uint16_t v = (uint16_t) jn2integer(json_array_get(jn_value, i));
+                    adu[len++] = v >> 8;
+                    adu[len++] = v & 0x00ff;
+                }
+                int frame_len = build_serial_frame(gobj, adu, len, frame, sizeof(frame));
+                gbuf_append(gbuf, frame, frame_len);
+            }
+            break;
 
-        DEFAULTS
+        default:
             log_error(0,
                 "gobj",         "%s", gobj_full_name(gobj),
                 "function",     "%s", __FUNCTION__,
@@ -1272,7 +1843,7 @@ PRIVATE GBUFFER *build_modbus_request_write_message(hgobj gobj, json_t *jn_reque
                 NULL
             );
             break;
-    } SWITCHS_END;
+    }
 
     priv->modbus_function = modbus_function;
 
@@ -1345,150 +1916,299 @@ PRIVATE modbus_object_type_t get_object_type(hgobj gobj, const char *type_)
 /***************************************************************************
  *
  ***************************************************************************/
-PRIVATE int build_slave_data(hgobj gobj)
+PRIVATE int cmp_block_address(const void *a, const void *b)
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    const register_block_t *ba = a;
+    const register_block_t *bb = b;
+    return (int)ba->address - (int)bb->address;
+}
 
-    if(!priv->slaves_) {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-            "msg",          "%s", "slaves_ NULL",
-            NULL
-        );
-        return -1;
+/***************************************************************************
+ *  Build the blocks of the slave with the maps that don't fail.
+ ***************************************************************************/
+PRIVATE int build_slave_blocks(hgobj gobj, slave_data_t *pslv, json_t *jn_slave)
+{
+    json_t *jn_mapping = kw_get_list(jn_slave, "mapping", 0, KW_REQUIRED);
+    int max_maps = json_array_size(jn_mapping);
+    if(!max_maps) {
+        return 0;
     }
-    if(!priv->max_slaves) {
+
+    /*
+     *  Accepted ranges, max_maps for each object type
+     */
+    register_block_t *ranges = gbmem_malloc(4 * max_maps * sizeof(register_block_t));
+    if(!ranges) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-            "msg",          "%s", "NO slave defined",
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for slave ranges",
+            "max_maps",     "%d", max_maps,
             NULL
         );
         return -1;
     }
+    int max_ranges[4] = {0};
+
+    int idx_map; json_t *jn_map;
+    json_array_foreach(jn_mapping, idx_map, jn_map) {
+        const char *type = kw_get_str(jn_map, "type", "", KW_REQUIRED);
+        int object_type = get_object_type(gobj, type);
+        if(object_type < 0) {
+            json_object_set_new(jn_map, "disabled", json_true());
+            continue;
+        };
 
-    /*
-     *  Alloc memory
-     */
-    int array_size = priv->max_slaves * sizeof(slave_data_t);
-    priv->slave_data = gbmem_malloc(array_size);
-    char temp[256];
-    char nice[64];
-    nice_size(nice, sizeof(nice), (uint64_t)array_size);
-    snprintf(temp, sizeof(temp), "Allocating Modbus Array of %s (%d) bytes, %d slaves",
-        nice,
-        array_size,
-        priv->max_slaves
-    );
-    log_info(0,
-        "gobj",         "%s", gobj_full_name(gobj),
-        "function",     "%s", __FUNCTION__,
-        "msgset",       "%s", MSGSET_INFO,
-        "msg",          "%s", temp,
-        NULL
-    );
-
-    /*
-     *  Fill data
-     */
-    slave_data_t *pslv = priv->slave_data;
-    int idx_slaves; json_t *jn_slave;
-    json_array_foreach(priv->slaves_, idx_slaves, jn_slave) {
-        int slave_id = kw_get_int(jn_slave, "id", 0, KW_REQUIRED);
-        pslv->slave_id = slave_id;
+        int32_t address = kw_get_int(jn_map, "address", -1, KW_REQUIRED|KW_WILD_NUMBER);
+        int32_t size = kw_get_int(jn_map, "size", -1, KW_REQUIRED|KW_WILD_NUMBER);
 
-        json_t *jn_mapping = kw_get_list(jn_slave, "mapping", 0, KW_REQUIRED);
-        int idx_map; json_t *jn_map;
-        json_array_foreach(jn_mapping, idx_map, jn_map) {
-            const char *type = kw_get_str(jn_map, "type", "", KW_REQUIRED);
-            int object_type = get_object_type(gobj, type);
-            if(object_type < 0) {
-                json_object_set_new(jn_map, "disabled", json_true());
-                continue;
-            };
+        if(address < 0 || address > 0xFFFF) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "Modbus object address OUT OF RANGE",
+                "type",         "%s", type,
+                "object_type",  "%d", object_type,
+                "address",      "%d", address,
+                "map",          "%j", jn_map,
+                NULL
+            );
+            json_object_set_new(jn_map, "disabled", json_true());
+            continue;
+        }
+        if(size < 0 || size > 0xFFFF) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "Modbus object size OUT OF RANGE",
+                "type",         "%s", type,
+                "object_type",  "%d", object_type,
+                "address",      "%d", address,
+                "size",         "%d", size,
+                "map",          "%j", jn_map,
+                NULL
+            );
+            json_object_set_new(jn_map, "disabled", json_true());
+            continue;
+        }
 
-            int32_t address = kw_get_int(jn_map, "address", -1, KW_REQUIRED|KW_WILD_NUMBER);
-            int32_t size = kw_get_int(jn_map, "size", -1, KW_REQUIRED|KW_WILD_NUMBER);
+        if((address + size) >= 0xFFFF) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "Modbus object data OUT OF RANGE",
+                "type",         "%s", type,
+                "object_type",  "%d", object_type,
+                "address",      "%d", address,
+                "size",         "%d", size,
+                "map",          "%j", jn_map,
+                NULL
+            );
+            json_object_set_new(jn_map, "disabled", json_true());
+            continue;
+        }
+        if(size == 0) {
+            continue;
+        }
 
-            if(address < 0 || address > 0xFFFF) {
+        register_block_t *r = ranges + object_type * max_maps;
+        BOOL override = FALSE;
+        for(int i=0; i<max_ranges[object_type]; i++) {
+            if(address < r[i].address + r[i].size && r[i].address < address + size) {
                 log_error(0,
                     "gobj",         "%s", gobj_full_name(gobj),
                     "function",     "%s", __FUNCTION__,
                     "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                    "msg",          "%s", "Modbus object address OUT OF RANGE",
+                    "msg",          "%s", "Map OVERRIDE",
                     "type",         "%s", type,
                     "object_type",  "%d", object_type,
                     "address",      "%d", address,
+                    "size",         "%d", size,
                     "map",          "%j", jn_map,
                     NULL
                 );
                 json_object_set_new(jn_map, "disabled", json_true());
-                continue;
+                override = TRUE;
+                break;
             }
-            if(size < 0 || size > 0xFFFF) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                    "msg",          "%s", "Modbus object size OUT OF RANGE",
-                    "type",         "%s", type,
-                    "object_type",  "%d", object_type,
-                    "address",      "%d", address,
-                    "size",         "%d", size,
-                    "map",          "%j", jn_map,
-                    NULL
-                );
-                json_object_set_new(jn_map, "disabled", json_true());
-                continue;
+        }
+        if(override) {
+            continue;
+        }
+        r[max_ranges[object_type]].address = address;
+        r[max_ranges[object_type]].size = size;
+        max_ranges[object_type]++;
+    }
+
+    /*
+     *  Sort and join the adjacent ranges
+     */
+    int cells = 0;
+    int words = 0;
+    for(int t=0; t<4; t++) {
+        register_block_t *r = ranges + t * max_maps;
+        int n = max_ranges[t];
+        if(!n) {
+            continue;
+        }
+        qsort(r, n, sizeof(register_block_t), cmp_block_address);
+        int j = 0;
+        for(int i=1; i<n; i++) {
+            if(r[j].address + r[j].size == r[i].address) {
+                r[j].size += r[i].size;
+            } else {
+                r[++j] = r[i];
             }
+        }
+        max_ranges[t] = j + 1;
 
-            if((address + size) >= 0xFFFF) {
-                log_error(0,
-                    "gobj",         "%s", gobj_full_name(gobj),
-                    "function",     "%s", __FUNCTION__,
-                    "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                    "msg",          "%s", "Modbus object data OUT OF RANGE",
-                    "type",         "%s", type,
-                    "object_type",  "%d", object_type,
-                    "address",      "%d", address,
-                    "size",         "%d", size,
-                    "map",          "%j", jn_map,
-                    NULL
-                );
-                json_object_set_new(jn_map, "disabled", json_true());
-                continue;
+        for(int i=0; i<max_ranges[t]; i++) {
+            cells += r[i].size;
+            if(t == TYPE_INPUT_REGISTER || t == TYPE_HOLDING_REGISTER) {
+                words += r[i].size;
             }
+        }
+    }
 
-            for(int i=0; i<size; i++) {
-                cell_control_t *cell_control = &pslv->control[object_type][address+i];
-                if(cell_control->value_busy) {
-                    log_error(0,
-                        "gobj",         "%s", gobj_full_name(gobj),
-                        "function",     "%s", __FUNCTION__,
-                        "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                        "msg",          "%s", "Map OVERRIDE",
-                        "type",         "%s", type,
-                        "object_type",  "%d", object_type,
-                        "address",      "%d", address,
-                        "size",         "%d", size,
-                        "i",            "%d", i,
-                        "map",          "%j", jn_map,
-                        NULL
-                    );
-                    json_object_set_new(jn_map, "disabled", json_true());
-                    break;
-                }
-                cell_control->value_busy = 1;
+    /*
+     *  Alloc the memory of the blocks
+     */
+    pslv->cells = cells;
+    pslv->words = words;
+    pslv->control = cells? gbmem_malloc(cells * sizeof(cell_control_t)) : 0;
+    pslv->data = words? gbmem_malloc(words * sizeof(uint16_t)) : 0;
+    if((cells && !pslv->control) || (words && !pslv->data)) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for slave data",
+            "slave_id",     "%d", pslv->slave_id,
+            "cells",        "%d", cells,
+            NULL
+        );
+        GBMEM_FREE(ranges);
+        return -1;
+    }
+
+    cell_control_t *control = pslv->control;
+    uint16_t *data = pslv->data;
+    for(int t=0; t<4; t++) {
+        int n = max_ranges[t];
+        if(!n) {
+            continue;
+        }
+        pslv->blocks[t] = gbmem_malloc(n * sizeof(register_block_t));
+        if(!pslv->blocks[t]) {
+            // Error already logged
+            continue;
+        }
+        pslv->max_blocks[t] = n;
+        memcpy(pslv->blocks[t], ranges + t * max_maps, n * sizeof(register_block_t));
+
+        for(int i=0; i<n; i++) {
+            register_block_t *block = &pslv->blocks[t][i];
+            block->control = control;
+            control += block->size;
+            if(t == TYPE_INPUT_REGISTER || t == TYPE_HOLDING_REGISTER) {
+                block->data = data;
+                data += block->size;
+            }
+            for(int k=0; k<block->size; k++) {
+                block->control[k].value_busy = 1;
             }
         }
+    }
+
+    GBMEM_FREE(ranges);
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int build_slave_data(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(!priv->slaves_) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+            "msg",          "%s", "slaves_ NULL",
+            NULL
+        );
+        return -1;
+    }
+    if(!priv->max_slaves) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+            "msg",          "%s", "NO slave defined",
+            NULL
+        );
+        return -1;
+    }
+
+    /*
+     *  Alloc memory
+     */
+    priv->slave_data = gbmem_malloc(priv->max_slaves * sizeof(slave_data_t));
+    if(!priv->slave_data) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for slave data",
+            "max_slaves",   "%d", priv->max_slaves,
+            NULL
+        );
+        return -1;
+    }
+
+    /*
+     *  Fill data
+     */
+    uint64_t array_size = priv->max_slaves * sizeof(slave_data_t);
+    slave_data_t *pslv = priv->slave_data;
+    int idx_slaves; json_t *jn_slave;
+    json_array_foreach(priv->slaves_, idx_slaves, jn_slave) {
+        int slave_id = kw_get_int(jn_slave, "id", 0, KW_REQUIRED);
+        pslv->slave_id = slave_id;
+
+        build_slave_blocks(gobj, pslv, jn_slave);
+        array_size += pslv->cells * sizeof(cell_control_t) + pslv->words * sizeof(uint16_t);
+
+        for(int t=0; t<4; t++) {
+            array_size += pslv->max_blocks[t] * sizeof(register_block_t);
+        }
 
         // Next slave
         pslv++;
     }
 
+    char temp[256];
+    char nice[64];
+    nice_size(nice, sizeof(nice), array_size);
+    snprintf(temp, sizeof(temp), "Allocating Modbus Array of %s (%d) bytes, %d slaves",
+        nice,
+        (int)array_size,
+        priv->max_slaves
+    );
+    log_info(0,
+        "gobj",         "%s", gobj_full_name(gobj),
+        "function",     "%s", __FUNCTION__,
+        "msgset",       "%s", MSGSET_INFO,
+        "msg",          "%s", temp,
+        NULL
+    );
+
     return 0;
 }
 
@@ -1498,6 +2218,20 @@ PRIVATE int build_slave_data(hgobj gobj)
 PRIVATE int free_slave_data(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(priv->slave_data) {
+        slave_data_t *pslv = priv->slave_data;
+        for(int i=0; i<priv->max_slaves; i++) {
+            for(int t=0; t<4; t++) {
+                GBMEM_FREE(pslv->blocks[t]);
+            }
+            GBMEM_FREE(pslv->control);
+            GBMEM_FREE(pslv->data);
+            free_conversions(pslv);
+            // Next slave
+            pslv++;
+        }
+    }
     GBMEM_FREE(priv->slave_data);
     return 0;
 }
@@ -1510,173 +2244,445 @@ PRIVATE int load_modbus_config(hgobj gobj)
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
     priv->slaves_ = gobj_read_json_attr(gobj, "slaves");
-    priv->idx_slaves = 0;
     priv->max_slaves = json_array_size(priv->slaves_);
 
-    load_slave_mapping(gobj);
-
     return 0;
 }
 
 /***************************************************************************
+ *  Order the ranges by object type, rate and address,
+ *  only the ranges with same period and priority can be joined.
+ ***************************************************************************/
+PRIVATE int cmp_poll_range(const void *a, const void *b)
+{
+    const poll_range_t *ra = a;
+    const poll_range_t *rb = b;
+    if(ra->object_type != rb->object_type) {
+        return (int)ra->object_type - (int)rb->object_type;
+    }
+    if(ra->period_ms != rb->period_ms) {
+        return ra->period_ms - rb->period_ms;
+    }
+    if(ra->priority != rb->priority) {
+        return rb->priority - ra->priority;
+    }
+    return ra->address - rb->address;
+}
+
+/***************************************************************************
+ *  Compile the enabled maps of all slaves into the flat poll plan.
+ *  Disabled maps (by build_slave_data) don't get request.
  *
+ *  The maps of a slave with the same object type, period and priority
+ *  are joined in the fewest requests: the next map is added to the current
+ *  request if the hole between both is not greater than `coalesce_gap`
+ *  addresses, and the request is cut when it reaches the max quantity
+ *  of the read function.
  ***************************************************************************/
-PRIVATE int load_slave_mapping(hgobj gobj)
+PRIVATE int compile_poll_plan(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    priv->cur_slave_ = kw_get_list_value(priv->slaves_, priv->idx_slaves, 0);
-    if(!priv->cur_slave_) {
+    priv->idx_request = -1;
+
+    /*
+     *  Upper bound of requests: all maps split and none joined
+     */
+    int max_requests = 0;
+    int max_maps = 0;
+    int idx_slaves; json_t *jn_slave;
+    json_array_foreach(priv->slaves_, idx_slaves, jn_slave) {
+        json_t *jn_mapping = kw_get_list(jn_slave, "mapping", 0, KW_REQUIRED);
+        if(json_array_size(jn_mapping) == 0) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "slave without mapping",
+                "idx_slaves",   "%d", idx_slaves,
+                "slave",        "%j", jn_slave,
+                NULL
+            );
+        }
+        if(json_array_size(jn_mapping) > max_maps) {
+            max_maps = json_array_size(jn_mapping);
+        }
+        int idx_map; json_t *jn_map;
+        json_array_foreach(jn_mapping, idx_map, jn_map) {
+            if(kw_get_bool(jn_map, "disabled", 0, 0)) {
+                continue;
+            }
+            int size = kw_get_int(jn_map, "size", 0, KW_REQUIRED|KW_WILD_NUMBER);
+            int max_size = max_read_size(
+                get_object_type(gobj, kw_get_str(jn_map, "type", "", KW_REQUIRED))
+            );
+            if(size > 0 && max_size > 0) {
+                max_requests += (size + max_size - 1) / max_size;
+            }
+        }
+    }
+    if(!max_requests) {
+        return -1;
+    }
+
+    priv->poll_plan = gbmem_malloc(max_requests * sizeof(poll_request_t));
+    poll_range_t *ranges = gbmem_malloc(max_maps * sizeof(poll_range_t));
+    if(!priv->poll_plan || !ranges) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-            "msg",          "%s", "cur_slave_ NULL",
-            "idx_slaves",   "%d", priv->idx_slaves,
-            "slaves_",      "%j", priv->slaves_?priv->slaves_:json_null(),
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for poll plan",
+            "max_requests", "%d", max_requests,
             NULL
         );
-        priv->idx_mapping = 0;
-        priv->max_mapping = 0;
+        GBMEM_FREE(priv->poll_plan);
+        GBMEM_FREE(ranges);
         return -1;
     }
-    priv->mapping_ = kw_get_list(priv->cur_slave_, "mapping", 0, KW_REQUIRED);
-    priv->idx_mapping = -1;
-    priv->max_mapping = json_array_size(priv->mapping_);
-    if(priv->max_mapping == 0) {
+
+    int max_maps_enabled = 0;
+    poll_request_t *req = priv->poll_plan;
+    json_array_foreach(priv->slaves_, idx_slaves, jn_slave) {
+        uint8_t slave_id = (uint8_t)kw_get_int(jn_slave, "id", 0, KW_REQUIRED);
+        int gap = kw_get_int(jn_slave, "coalesce_gap", priv->coalesce_gap, KW_WILD_NUMBER);
+
+        /*
+         *  Collect the ranges of the enabled maps
+         */
+        int max_ranges = 0;
+        json_t *jn_mapping = kw_get_list(jn_slave, "mapping", 0, KW_REQUIRED);
+        int idx_map; json_t *jn_map;
+        json_array_foreach(jn_mapping, idx_map, jn_map) {
+            if(kw_get_bool(jn_map, "disabled", 0, 0)) {
+                continue;
+            }
+            int size = kw_get_int(jn_map, "size", 0, KW_REQUIRED|KW_WILD_NUMBER);
+            if(size <= 0) {
+                continue;
+            }
+            poll_range_t *range = &ranges[max_ranges++];
+            range->object_type = get_object_type(gobj, kw_get_str(jn_map, "type", "", KW_REQUIRED));
+            range->address = kw_get_int(jn_map, "address", 0, KW_REQUIRED|KW_WILD_NUMBER);
+            range->size = size;
+            range->period_ms = kw_get_int(jn_map, "period_ms", 0, KW_WILD_NUMBER);
+            range->priority = kw_get_int(jn_map, "priority", 0, KW_WILD_NUMBER);
+            if(range->period_ms < 0) {
+                range->period_ms = 0;
+            }
+        }
+        max_maps_enabled += max_ranges;
+        qsort(ranges, max_ranges, sizeof(poll_range_t), cmp_poll_range);
+
+        /*
+         *  Join and split
+         */
+        BOOL have = FALSE;
+        modbus_object_type_t object_type = TYPE_COIL;
+        int period_ms = 0;
+        int priority = 0;
+        int start = 0;
+        int end = 0;
+        for(int i=0; i<=max_ranges; i++) {
+            poll_range_t *range = i<max_ranges? &ranges[i] : 0;
+            int a = range? range->address : 0;
+            int e = range? range->address + range->size : 0;
+            if(have && (!range || range->object_type != object_type ||
+                    range->period_ms != period_ms || range->priority != priority)) {
+                // Flush the request of the previous object type or rate
+                req->period_ms = period_ms;
+                req->priority = priority;
+                if(compile_read_request(gobj, req, idx_slaves, slave_id, object_type,
+                        start, end - start)==0) {
+                    req++;
+                }
+                have = FALSE;
+            }
+            if(!range) {
+                break;
+            }
+            int max_size = max_read_size(range->object_type);
+            while(a < e) {
+                if(have && a <= end + gap && a - start < max_size) {
+                    int new_end = e < start + max_size? e : start + max_size;
+                    end = new_end > end? new_end : end;
+                    a = new_end > a? new_end : a;
+                } else {
+                    if(have) {
+                        req->period_ms = period_ms;
+                        req->priority = priority;
+                        if(compile_read_request(gobj, req, idx_slaves, slave_id, object_type,
+                                start, end - start)==0) {
+                            req++;
+                        }
+                    }
+                    object_type = range->object_type;
+                    period_ms = range->period_ms;
+                    priority = range->priority;
+                    start = a;
+                    end = e < a + max_size? e : a + max_size;
+                    a = end;
+                    have = TRUE;
+                }
+            }
+        }
+    }
+    priv->max_requests = (int)(req - priv->poll_plan);
+    GBMEM_FREE(ranges);
+
+    /*
+     *  All the requests are due at start
+     */
+    priv->schedule = gbmem_malloc(priv->max_requests * sizeof(int));
+    if(!priv->schedule) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-            "msg",          "%s", "slave without mapping",
-            "idx_slaves",   "%d", priv->idx_slaves,
-            "cur_slave_",   "%j", priv->cur_slave_,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for schedule",
+            "max_requests", "%d", priv->max_requests,
             NULL
         );
+        GBMEM_FREE(priv->poll_plan);
+        priv->max_requests = 0;
         return -1;
     }
+    for(int i=0; i<priv->max_requests; i++) {
+        priv->schedule[i] = i;
+    }
+    for(int i=priv->max_requests/2 - 1; i>=0; i--) {
+        schedule_sift_down(gobj, i);
+    }
+
+    if(gobj_trace_level(gobj) & TRACE_POLLING) {
+        trace_msg("🔊⏩ poll plan: %d requests, %d maps, %d slaves",
+            priv->max_requests, max_maps_enabled, priv->max_slaves
+        );
+    }
+
     return 0;
 }
 
 /***************************************************************************
- *  Prepare next poll
- *  If end of cycle then publish and return -1
+ *
  ***************************************************************************/
-PRIVATE int next_map(hgobj gobj)
+PRIVATE int free_poll_plan(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    priv->cur_map_ = 0; // Reset cur map
+    /*
+     *  The transactions in the air are kept to consume their responses
+     */
+    for(int i=0; i<MODBUS_MAX_INFLIGHT; i++) {
+        priv->transactions[i].req = 0;
+    }
 
-    if(priv->idx_mapping < 0) {
-        priv->idx_mapping = 0;
-    } else {
-        priv->idx_mapping++;
+    GBMEM_FREE(priv->schedule);
+    GBMEM_FREE(priv->poll_plan);
+    priv->max_requests = 0;
+    priv->idx_request = -1;
+    return 0;
+}
+
+/***************************************************************************
+ *  Earliest deadline first, with the same deadline the higher priority
+ ***************************************************************************/
+PRIVATE BOOL request_before(poll_request_t *plan, int a, int b)
+{
+    if(plan[a].next_due != plan[b].next_due) {
+        return plan[a].next_due < plan[b].next_due;
     }
-    if(priv->idx_mapping < priv->max_mapping) {
-        // Next map in current slave
-        if(gobj_trace_level(gobj) & TRACE_POLLING) {
-            trace_msg("🔊🔊🔊🔊⏩ next map  : idx slave %d, idx map %d",
-                priv->idx_slaves, priv->idx_mapping
-            );
-        }
-        return 0; // do polling
+    if(plan[a].priority != plan[b].priority) {
+        return plan[a].priority > plan[b].priority;
     }
+    return a < b;
+}
 
-    priv->idx_slaves++;
-    if(priv->idx_slaves < priv->max_slaves) {
-        load_slave_mapping(gobj);
-        priv->idx_mapping = 0;;
-        if(gobj_trace_level(gobj) & TRACE_POLLING) {
-            trace_msg("🔊🔊🔊🔊🔊🔊🔊🔊⏩ next slave: idx slave %d, idx map %d",
-                priv->idx_slaves, priv->idx_mapping
-            );
+/***************************************************************************
+ *  Restore the heap of the schedule from the position `i`
+ ***************************************************************************/
+PRIVATE void schedule_sift_down(hgobj gobj, int i)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    int *heap = priv->schedule;
+    int n = priv->max_requests;
+
+    while(1) {
+        int first = i;
+        int l = 2*i + 1;
+        int r = l + 1;
+        if(l < n && request_before(priv->poll_plan, heap[l], heap[first])) {
+            first = l;
         }
-        return 0; // do polling
+        if(r < n && request_before(priv->poll_plan, heap[r], heap[first])) {
+            first = r;
+        }
+        if(first == i) {
+            break;
+        }
+        int tmp = heap[i];
+        heap[i] = heap[first];
+        heap[first] = tmp;
+        i = first;
+    }
+}
+
+/***************************************************************************
+ *  Prepare next poll: the request with the earliest deadline,
+ *  if it's due at the beginning of the cycle.
+ *  Return -1 if the requests of the cycle are exhausted
+ ***************************************************************************/
+PRIVATE int next_map(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(priv->max_requests <= 0) {
+        return -1;
+    }
+
+    int idx = priv->schedule[0];
+    poll_request_t *req = &priv->poll_plan[idx];
+    if(req->next_due > priv->cycle_t0) {
+        return -1; // End of cycle
     }
 
     /*
-     *  End of cycle, publish variables
+     *  Next deadline, without burst to catch up the lost ones
      */
-    build_message_to_publish(gobj);
+    int period = req->period_ms? (int)req->period_ms : priv->timeout_polling;
+    if(period < 1) {
+        period = 1;
+    }
+    req->next_due += period;
+    if(req->next_due <= priv->cycle_t0) {
+        req->next_due = priv->cycle_t0 + period;
+    }
+    schedule_sift_down(gobj, 0);
 
-    priv->idx_slaves = 0; // Begin cycle
-    load_slave_mapping(gobj);
+    priv->idx_request = idx;
+    priv->cycle_requests++;
 
-    return -1; // End of cycle
+    if(gobj_trace_level(gobj) & TRACE_POLLING) {
+        trace_msg("🔊🔊🔊🔊⏩ next map  : idx request %d, slave_id %d, priority %d, period %d",
+            idx, req->slave_id, req->priority, period
+        );
+    }
+    return 0; // do polling
 }
 
 /***************************************************************************
- *  Send current map
- *  If success return 0 and set response timeout
- *  If fails return -1 and don't set timeout
+ *  Annotate the request just sent as outstanding
  ***************************************************************************/
-PRIVATE int poll_modbus(hgobj gobj)
+PRIVATE int add_transaction(hgobj gobj, poll_request_t *req)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    if(priv->cur_map_) {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-            "msg",          "%s", "cur_map_ ALREADY loaded",
-            "idx_slaves",   "%d", priv->idx_slaves,
-            "idx_mapping",  "%d", priv->idx_mapping,
-            "cur_map_",     "%j", priv->cur_map_?priv->cur_map_:json_null(),
-            NULL
-        );
+    for(int i=0; i<MODBUS_MAX_INFLIGHT; i++) {
+        transaction_t *tr = &priv->transactions[i];
+        if(!tr->busy) {
+            tr->busy = TRUE;
+            tr->t_id = priv->t_id;
+            tr->modbus_function = priv->modbus_function;
+            tr->req = req;
+            priv->inflight++;
+            return 0;
+        }
     }
 
-    priv->cur_map_ = kw_get_list_value(priv->mapping_, priv->idx_mapping, KW_REQUIRED);
-    if(!priv->cur_map_) {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-            "msg",          "%s", "cur_map_ NULL",
-            "idx_slaves",   "%d", priv->idx_slaves,
-            "idx_mapping",  "%d", priv->idx_mapping,
-            "mapping_",     "%j", priv->mapping_?priv->mapping_:json_null(),
-            NULL
-        );
-        // Don't set timeout
-        return -1;
+    log_error(0,
+        "gobj",         "%s", gobj_full_name(gobj),
+        "function",     "%s", __FUNCTION__,
+        "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+        "msg",          "%s", "transaction table FULL",
+        "inflight",     "%d", priv->inflight,
+        NULL
+    );
+    return -1;
+}
+
+/***************************************************************************
+ *  Extract the transaction of the received frame.
+ *  Modbus TCP matches by t_id, serial lines have only one in the air.
+ ***************************************************************************/
+PRIVATE int take_transaction(hgobj gobj, FRAME_HEAD *frame, transaction_t *transaction)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    for(int i=0; i<MODBUS_MAX_INFLIGHT; i++) {
+        transaction_t *tr = &priv->transactions[i];
+        if(!tr->busy) {
+            continue;
+        }
+        if(priv->protocol == MODBUS_PROTOCOL_TCP && tr->t_id != frame->t_id) {
+            continue;
+        }
+        *transaction = *tr;
+        memset(tr, 0, sizeof(transaction_t));
+        priv->inflight--;
+        return 0;
     }
 
-    if(kw_get_bool(priv->cur_map_, "disabled", 0, 0)) {
+    log_error(0,
+        "gobj",         "%s", gobj_full_name(gobj),
+        "function",     "%s", __FUNCTION__,
+        "msgset",       "%s", MSGSET_PROTOCOL_ERROR,
+        "msg",          "%s", "Response without transaction, timeout?",
+        "t_id",         "%d", frame->t_id,
+        "slave_id",     "%d", frame->slave_id,
+        "function",     "%d", frame->function,
+        NULL
+    );
+    return -1;
+}
+
+/***************************************************************************
+ *  Forget the transactions in the air
+ ***************************************************************************/
+PRIVATE int clear_transactions(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    memset(priv->transactions, 0, sizeof(priv->transactions));
+    priv->inflight = 0;
+    return 0;
+}
+
+/***************************************************************************
+ *  Send current map
+ *  If success return 0
+ *  If fails return -1
+ ***************************************************************************/
+PRIVATE int poll_modbus(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    if(priv->idx_request < 0 || priv->idx_request >= priv->max_requests) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
             "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-            "msg",          "%s", "cur_map_ DISABLED",
-            "idx_slaves",   "%d", priv->idx_slaves,
-            "idx_mapping",  "%d", priv->idx_mapping,
-            "cur_map_",     "%j", priv->cur_map_,
+            "msg",          "%s", "idx_request out of range",
+            "idx_request",  "%d", priv->idx_request,
+            "max_requests", "%d", priv->max_requests,
             NULL
         );
-        // Don't set timeout
         return -1;
     }
 
-    if(gobj_trace_level(gobj) & TRACE_POLLING) {
-        log_debug_json(0, priv->cur_map_, "polling");
-    }
+    poll_request_t *req = &priv->poll_plan[priv->idx_request];
 
-    GBUFFER *gbuf = build_modbus_request_read_message(gobj, priv->cur_slave_, priv->cur_map_);
+    GBUFFER *gbuf = build_modbus_request_read_message(gobj, req);
+    if(!gbuf) {
+        return -1;
+    }
+    add_transaction(gobj, req);
     send_data(gobj, gbuf);
 
-    // Change state
-    gobj_change_state(gobj, "ST_WAIT_RESPONSE");
-
-    // Set response timeout
-    set_timeout(priv->timer, priv->timeout_response*1000);
-
     return 0;
 }
 
 /***************************************************************************
- *
+ *  Send the next enqueued write request, return FALSE if there is none
  ***************************************************************************/
 PRIVATE BOOL send_request(hgobj gobj)
 {
@@ -1695,15 +2701,95 @@ PRIVATE BOOL send_request(hgobj gobj)
     }
     GBUFFER *gbuf = build_modbus_request_write_message(gobj, jn_current_request);
     JSON_DECREF(jn_current_request);
-    send_data(gobj, gbuf);
+    if(gbuf) {
+        add_transaction(gobj, 0);
+        send_data(gobj, gbuf);
+    }
 
-    // Change state
-    gobj_change_state(gobj, "ST_WAIT_RESPONSE");
+    return TRUE;
+}
 
-    // Set response timeout
-    set_timeout(priv->timer, priv->timeout_response*1000);
+/***************************************************************************
+ *  Fill the window of outstanding transactions,
+ *  the enqueued write requests go first.
+ *  A cycle polls the requests due at its beginning.
+ *  When they are exhausted and nothing is in the air then publish
+ *  and wait to the next deadline, at least `min_wait` miliseconds
+ *  and no more than `timeout_polling` (the enqueued writes must go).
+ ***************************************************************************/
+PRIVATE int poll_cycle(hgobj gobj, int min_wait)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    return TRUE;
+    if(priv->idx_request < 0 && priv->inflight == 0) {
+        priv->cycle_t0 = time_in_miliseconds();
+        priv->cycle_requests = 0;
+    }
+
+    while(priv->inflight < priv->max_inflight) {
+        if(send_request(gobj)) {
+            continue;
+        }
+        if(next_map(gobj)<0) {
+            break;
+        }
+        if(poll_modbus(gobj)<0) {
+            /*
+             *  Problemas con el query actual, pasa al siguiente
+             */
+            continue;
+        }
+    }
+
+    if(priv->inflight > 0) {
+        // Change state
+        gobj_change_state(gobj, "ST_WAIT_RESPONSE");
+
+        // Set response timeout, restarted with each response
+        set_timeout(priv->timer, priv->timeout_response*1000);
+        return 0;
+    }
+
+    /*
+     *  End of cycle, publish variables if something has been read
+     */
+    priv->idx_request = -1; // Begin cycle
+    uint64_t now = time_in_miliseconds();
+
+    if(priv->cycle_requests > 0) {
+        build_message_to_publish(gobj);
+
+        uint32_t cycle_ms = (uint32_t)(now - priv->cycle_t0);
+        gobj_write_uint32_attr(gobj, "cycle_ms", cycle_ms);
+        gobj_write_uint32_attr(gobj, "cycles", gobj_read_uint32_attr(gobj, "cycles") + 1);
+        if(!empty_string(priv->on_cycle_event_name)) {
+            json_t *kw_cycle = json_pack("{s:i, s:i}",
+                "cycle_ms", (int)cycle_ms,
+                "requests", priv->cycle_requests
+            );
+            gobj_publish_event(gobj, priv->on_cycle_event_name, kw_cycle);
+        }
+    }
+
+    int wait = priv->timeout_polling;
+    if(priv->max_requests > 0) {
+        uint64_t next_due = priv->poll_plan[priv->schedule[0]].next_due;
+        int to_due = next_due > now? (int)(next_due - now) : 0;
+        if(to_due < wait) {
+            wait = to_due;
+        }
+    }
+    if(wait < min_wait) {
+        wait = min_wait;
+    }
+    if(wait < 1) {
+        wait = 1;
+    }
+
+    gobj_change_state(gobj, "ST_SESSION");
+    set_timeout(priv->timer, wait);
+
+    return -1;
 }
 
 /***************************************************************************
@@ -1749,19 +2835,18 @@ PRIVATE int framehead_consume(hgobj gobj, FRAME_HEAD *frame, istream istream, ch
         /*
          * waiting the common head
          */
-        SWITCHS(priv->modbus_protocol) {
-            CASES("TCP")
+        switch(priv->protocol) {
+            case MODBUS_PROTOCOL_TCP:
                 istream_read_until_num_bytes(istream, sizeof(head_tcp_t), 0); // idempotent
                 break;
 
-            CASES("RTU")
-            CASES("ASCII")
+            case MODBUS_PROTOCOL_RTU:
                 istream_read_until_num_bytes(istream, sizeof(head_rtu_t), 0); // idempotent
                 break;
 
-            DEFAULTS
+            default:
                 break;
-        } SWITCHS_END
+        }
 
         consumed = istream_consume(istream, bf, len);
         total_consumed += consumed;
@@ -1776,33 +2861,52 @@ PRIVATE int framehead_consume(hgobj gobj, FRAME_HEAD *frame, istream istream, ch
          */
         framehead_prepare_new_frame(frame);  // `busy` flag is set.
 
-        SWITCHS(priv->modbus_protocol) {
-            CASES("TCP")
-                head_tcp_t *head = (head_tcp_t *)istream_extract_matched_data(istream, 0);
-                frame->function = head->function;
-                frame->slave_id = head->slave_id;
-                frame->byte_count = head->byte_count;
-                head->length = ntohs(head->length);
-                frame->payload_length = head->length - 3;
+        switch(priv->protocol) {
+            case MODBUS_PROTOCOL_TCP:
+                {
+                    head_tcp_t *head = (head_tcp_t *)istream_extract_matched_data(istream, 0);
+                    frame->t_id = ntohs(head->t_id);
+                    frame->function = head->function;
+                    frame->slave_id = head->slave_id;
+                    frame->byte_count = head->byte_count;
+                    head->length = ntohs(head->length);
+                    frame->payload_length = head->length - 3;
+                }
                 break;
 
-            CASES("RTU")
-            CASES("ASCII")
-                head_rtu_t *head = (head_rtu_t *)istream_extract_matched_data(istream, 0);
-                frame->function = head->function;
-                frame->slave_id = head->slave_id;
-                frame->byte_count = head->byte_count;
-                frame->payload_length = head->byte_count + sizeof(uint16_t); // + crc
+            case MODBUS_PROTOCOL_RTU:
+                {
+                    head_rtu_t *head = (head_rtu_t *)istream_extract_matched_data(istream, 0);
+                    frame->function = head->function;
+                    frame->slave_id = head->slave_id;
+                    frame->byte_count = head->byte_count;
+                    switch(frame->function) {
+                        case MODBUS_FC_WRITE_SINGLE_COIL:
+                        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+                        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+                        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+                            // Echo of address and value/quantity, `byte_count` is the address high
+                            frame->payload_length = 3 + sizeof(uint16_t); // + crc
+                            break;
+                        default:
+                            frame->payload_length = head->byte_count + sizeof(uint16_t); // + crc
+                            break;
+                    }
+                }
                 break;
 
-            DEFAULTS
+            default:
                 break;
-        } SWITCHS_END
+        }
     }
 
     if(frame->function & 0x80) {
         frame->error_code = priv->frame_head.byte_count;
-        frame->payload_length = sizeof(uint16_t); // + crc
+        if(priv->protocol != MODBUS_PROTOCOL_TCP) {
+            frame->payload_length = sizeof(uint16_t); // + crc
+        } else {
+            frame->payload_length = 0; // MBAP length is 3, the frame is completed
+        }
         log_error(0,
             "gobj",             "%s", gobj_full_name(gobj),
             "function",         "%s", __FUNCTION__,
@@ -1810,7 +2914,8 @@ PRIVATE int framehead_consume(hgobj gobj, FRAME_HEAD *frame, istream istream, ch
             "msg",              "%s", "modbus exception",
             "error_code",       "%d", frame->error_code,
             "error_name",       "%s", modbus_exception_name(frame->error_code),
-            "cur_map_",         "%j", priv->cur_map_,
+            "slave_id",         "%d", frame->slave_id,
+            "t_id",             "%d", frame->t_id,
             NULL
         );
     } else {
@@ -1824,8 +2929,166 @@ PRIVATE int framehead_consume(hgobj gobj, FRAME_HEAD *frame, istream istream, ch
         }
     }
 
-    frame->header_complete = TRUE;
-    return total_consumed;
+    frame->header_complete = TRUE;
+    return total_consumed;
+}
+
+/***************************************************************************
+ *  Value of a hex char, -1 if not valid
+ ***************************************************************************/
+PRIVATE int hex_value(char c)
+{
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if(c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    if(c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/***************************************************************************
+ *  Process a Modbus ASCII frame, the hex chars between ':' and CRLF
+ ***************************************************************************/
+PRIVATE int ascii_frame_completed(hgobj gobj, char *hex, int len)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    FRAME_HEAD *frame = &priv->frame_head;
+
+    /*
+     *  As in RTU the transaction is answered, right or wrong:
+     *  a bad frame fails it now, without waiting the timeout response.
+     */
+    framehead_prepare_new_frame(frame);
+    transaction_t tr;
+    if(take_transaction(gobj, frame, &tr)<0) {
+        // Error already logged
+        return -1;
+    }
+
+    uint8_t adu[MODBUS_MAX_ADU_LENGTH];
+    int n = len/2;
+    if((len & 1) || n < 3 || n > (int)sizeof(adu)) {
+        log_error(0,
+            "gobj",             "%s", gobj_full_name(gobj),
+            "function",         "%s", __FUNCTION__,
+            "msgset",           "%s", MSGSET_PROTOCOL_ERROR,
+            "msg",              "%s", "Modbus ASCII frame with bad length",
+            "len",              "%d", len,
+            NULL
+        );
+        return -1;
+    }
+    for(int i=0; i<n; i++) {
+        int hi = hex_value(hex[2*i]);
+        int lo = hex_value(hex[2*i+1]);
+        if(hi < 0 || lo < 0) {
+            log_error(0,
+                "gobj",             "%s", gobj_full_name(gobj),
+                "function",         "%s", __FUNCTION__,
+                "msgset",           "%s", MSGSET_PROTOCOL_ERROR,
+                "msg",              "%s", "Modbus ASCII frame with bad hex char",
+                "len",              "%d", len,
+                NULL
+            );
+            return -1;
+        }
+        adu[i] = (uint8_t)((hi << 4) | lo);
+    }
+
+    /* Check LRC of msg */
+    uint8_t lrc_calculated = lrc8(adu, n-1);
+    if(lrc_calculated != adu[n-1]) {
+        log_error(0,
+            "gobj",             "%s", gobj_full_name(gobj),
+            "function",         "%s", __FUNCTION__,
+            "msgset",           "%s", MSGSET_PROTOCOL_ERROR,
+            "msg",              "%s", "LRC error",
+            "lrc received",     "%d", adu[n-1],
+            "lrc calculated",   "%d", lrc_calculated,
+            NULL
+        );
+        return -1;
+    }
+
+    frame->slave_id = adu[0];
+    frame->function = adu[1];
+    frame->byte_count = n > 3? adu[2] : 0;
+    if(frame->function & 0x80) {
+        frame->error_code = frame->byte_count;
+        log_error(0,
+            "gobj",             "%s", gobj_full_name(gobj),
+            "function",         "%s", __FUNCTION__,
+            "msgset",           "%s", MSGSET_PROTOCOL_ERROR,
+            "msg",              "%s", "modbus exception",
+            "error_code",       "%d", frame->error_code,
+            "error_name",       "%s", modbus_exception_name(frame->error_code),
+            "slave_id",         "%d", frame->slave_id,
+            NULL
+        );
+    } else if(gobj_trace_level(gobj) & TRACE_DECODE) {
+        trace_msg("🍅🍅⏪ func: %d %s, slave_id: %d, count: %d",
+            frame->function,
+            modbus_function_name(frame->function),
+            frame->slave_id,
+            frame->byte_count
+        );
+    }
+
+    if(!frame->error_code && n > 4) {
+        store_modbus_response_data(gobj, &tr, adu + 3, n - 4); // without head and lrc
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Consume Modbus ASCII data, return the number of frames completed
+ ***************************************************************************/
+PRIVATE int ascii_consume(hgobj gobj, char *bf, int len)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+    int frames = 0;
+
+    for(int i=0; i<len; i++) {
+        char c = bf[i];
+        if(c == ':') {
+            // Begin of frame, a partial one is discarded
+            priv->ascii_len = 0;
+            priv->frame_head.busy = TRUE;
+            continue;
+        }
+        if(!priv->frame_head.busy) {
+            continue; // noise between frames
+        }
+        if(c == '\n' && priv->ascii_len > 0 && priv->ascii_frame[priv->ascii_len-1] == '\r') {
+            if(gobj_trace_level(gobj) & TRACE_TRAFFIC) {
+                log_debug_dump(LOG_DUMP_INPUT, priv->ascii_frame, priv->ascii_len-1,
+                    "%s", gobj_short_name(gobj)
+                );
+            }
+            ascii_frame_completed(gobj, priv->ascii_frame, priv->ascii_len-1);
+            frames++;
+            RESET_MACHINE()
+            continue;
+        }
+        if(priv->ascii_len >= (int)sizeof(priv->ascii_frame)) {
+            log_error(0,
+                "gobj",             "%s", gobj_full_name(gobj),
+                "function",         "%s", __FUNCTION__,
+                "msgset",           "%s", MSGSET_PROTOCOL_ERROR,
+                "msg",              "%s", "Modbus ASCII frame too long",
+                NULL
+            );
+            RESET_MACHINE()
+            continue;
+        }
+        priv->ascii_frame[priv->ascii_len++] = c;
+    }
+
+    return frames;
 }
 
 /***************************************************************************
@@ -1835,20 +3098,27 @@ PRIVATE int frame_completed(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    GBUFFER *gbuf = istream_get_gbuffer(priv->istream_payload);
+    transaction_t tr;
+    if(take_transaction(gobj, &priv->frame_head, &tr)<0) {
+        // Error already logged
+        return -1;
+    }
+
+    /*
+     *  An exception of Modbus TCP has no payload
+     */
+    GBUFFER *gbuf = priv->istream_payload? istream_get_gbuffer(priv->istream_payload) : 0;
+    int len = gbuf? gbuf_leftbytes(gbuf) : 0;
+    uint8_t *bf = len? gbuf_get(gbuf, len) : 0;
 
-    SWITCHS(priv->modbus_protocol) {
-        CASES("TCP")
-            int len = gbuf_leftbytes(gbuf);
-            uint8_t *bf = gbuf_get(gbuf, len);
+    switch(priv->protocol) {
+        case MODBUS_PROTOCOL_TCP:
             if(!priv->frame_head.error_code) {
-                store_modbus_response_data(gobj, bf, len);
+                store_modbus_response_data(gobj, &tr, bf, len);
             }
             break;
 
-        CASES("RTU")
-            int len = gbuf_leftbytes(gbuf);
-            uint8_t *bf = gbuf_get(gbuf, len);
+        case MODBUS_PROTOCOL_RTU:
              if (len < 2 || !bf) {
                  log_error(0,
                     "gobj",             "%s", gobj_full_name(gobj),
@@ -1861,11 +3131,30 @@ PRIVATE int frame_completed(hgobj gobj)
                  return -1;
              }
 
-            int crc_calculated = crc16_rx(&priv->frame_head, bf, len - 2);
-            int crc_received = (bf[len - 2] << 8) | bf[len - 1];
+            /*
+             *  The head is consumed by istream_head, join it to the payload
+             */
+            uint8_t adu[MODBUS_MAX_ADU_LENGTH];
+            if(len + 3 > (int)sizeof(adu)) {
+                 log_error(0,
+                    "gobj",             "%s", gobj_full_name(gobj),
+                    "function",         "%s", __FUNCTION__,
+                    "msgset",           "%s", MSGSET_PROTOCOL_ERROR,
+                    "msg",              "%s", "Modbus RTU frame too long",
+                    "len",              "%d", len,
+                    NULL
+                 );
+                 return -1;
+            }
+            adu[0] = priv->frame_head.slave_id;
+            adu[1] = priv->frame_head.function;
+            adu[2] = priv->frame_head.byte_count;
+            memcpy(adu + 3, bf, len);
 
              /* Check CRC of msg */
-             if (crc_calculated != crc_received) {
+             if (!crc16_check(adu, len + 3)) {
+                 int crc_calculated = crc16_tx(adu, len + 1);
+                 int crc_received = (bf[len - 2] << 8) | bf[len - 1];
                  log_error(0,
                     "gobj",             "%s", gobj_full_name(gobj),
                     "function",         "%s", __FUNCTION__,
@@ -1878,12 +3167,11 @@ PRIVATE int frame_completed(hgobj gobj)
                  return -1;
              }
              if(!priv->frame_head.error_code) {
-                 store_modbus_response_data(gobj, bf, len - 2);
+                 store_modbus_response_data(gobj, &tr, bf, len - 2);
              }
              break;
 
-        CASES("ASCII")
-        DEFAULTS
+        default:
             log_error(LOG_OPT_TRACE_STACK,
                 "gobj",         "%s", __FILE__,
                 "function",     "%s", __FUNCTION__,
@@ -1892,7 +3180,7 @@ PRIVATE int frame_completed(hgobj gobj)
                 NULL
             );
             break;
-    } SWITCHS_END
+    }
 
     return 0;
 }
@@ -1927,77 +3215,137 @@ PRIVATE slave_data_t *get_slave_data(hgobj gobj, int slave_id, BOOL verbose)
 }
 
 /***************************************************************************
- *
+ *  Return the index of the first block of `object_type` ending after `address`
  ***************************************************************************/
-PRIVATE int store_slave_bit(hgobj gobj, int slave_id, int object_type, int address, int value)
+PRIVATE int lower_block(slave_data_t *pslv, int object_type, int address)
 {
-    slave_data_t *pslv = get_slave_data(gobj, slave_id, TRUE);
-    if(!pslv) {
-        // Error already logged
-        return -1;
+    register_block_t *blocks = pslv->blocks[object_type];
+    int lo = 0;
+    int hi = pslv->max_blocks[object_type];
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(blocks[mid].address + blocks[mid].size <= address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    cell_control_t *cell_control = &pslv->control[object_type][address];
-    cell_control->bit_value = value?1:0;
-    cell_control->updated = 1;
-
-    return 0;
+    return lo;
 }
 
 /***************************************************************************
- *
+ *  Return the block with the cell `address` or null
  ***************************************************************************/
-PRIVATE int store_slave_word(hgobj gobj, int slave_id, int object_type, int address, uint8_t *bf)
+PRIVATE register_block_t *find_block(slave_data_t *pslv, int object_type, int address)
 {
-    slave_data_t *pslv = get_slave_data(gobj, slave_id, TRUE);
-    if(!pslv) {
-        // Error already logged
-        return -1;
+    if(object_type < TYPE_COIL || object_type > TYPE_HOLDING_REGISTER) {
+        return 0;
     }
-    cell_control_t *cell_control = &pslv->control[object_type][address];
+    int idx = lower_block(pslv, object_type, address);
+    if(idx >= pslv->max_blocks[object_type]) {
+        return 0;
+    }
+    register_block_t *block = &pslv->blocks[object_type][idx];
+    if(address < block->address) {
+        return 0;
+    }
+    return block;
+}
 
-    if(address > 0xFFFF) {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-            "msg",          "%s", "BAD address",
-            "slave_id",     "%d", slave_id,
-            "object_type",  "%d", object_type,
-            "address",      "%d", address,
-            NULL
-        );
-        return -1;
+/***************************************************************************
+ *  Dump the blocks of the slave in the range [address, address+size)
+ ***************************************************************************/
+PRIVATE void dump_slave_data(slave_data_t *pslv, int address, int size)
+{
+    static const char *object_names[4] = {
+        "Coil", "Discrete input", "Input register", "Holding register"
+    };
+
+    int end = address + size;
+    for(int t=0; t<4; t++) {
+        int idx = lower_block(pslv, t, address);
+        for(; idx < pslv->max_blocks[t]; idx++) {
+            register_block_t *block = &pslv->blocks[t][idx];
+            if(block->address >= end) {
+                break;
+            }
+            int first = block->address > address? block->address : address;
+            int last = block->address + block->size < end? block->address + block->size : end;
+
+            log_debug_dump(0,
+                (const char *)&block->control[first - block->address],
+                (last - first) * sizeof(cell_control_t),
+                "%d: Control %s, address %d (0x%04X)",
+                pslv->slave_id, object_names[t], first, first
+            );
+            if(block->data) {
+                log_debug_dump(0,
+                    (const char *)&block->data[first - block->address],
+                    (last - first) * sizeof(uint16_t),
+                    "%d: Data %s, address %d (0x%04X)",
+                    pslv->slave_id, object_names[t], first, first
+                );
+            }
+        }
     }
+}
 
-    switch(object_type) {
-        case TYPE_INPUT_REGISTER:
-            memmove(&pslv->input_register[address], bf, 2);
-            cell_control->updated = 1;
+/***************************************************************************
+ *  Store `count` bits (packed as in the response) from `address`.
+ *  The cells not mapped are skipped.
+ ***************************************************************************/
+PRIVATE int store_slave_bits(slave_data_t *pslv, int object_type, int address, int count, uint8_t *bf)
+{
+    int end = address + count;
+    int idx = lower_block(pslv, object_type, address);
+    for(; idx < pslv->max_blocks[object_type]; idx++) {
+        register_block_t *block = &pslv->blocks[object_type][idx];
+        if(block->address >= end) {
             break;
-        case TYPE_HOLDING_REGISTER:
-            memmove(&pslv->holding_register[address], bf, 2);
+        }
+        int first = block->address > address? block->address : address;
+        int last = block->address + block->size < end? block->address + block->size : end;
+        for(int a=first; a<last; a++) {
+            int pos = a - address;
+            cell_control_t *cell_control = &block->control[a - block->address];
+            cell_control->bit_value = (bf[pos >> 3] & (1 << (pos & 7)))? 1:0;
             cell_control->updated = 1;
-            break;
-        default:
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-                "msg",          "%s", "BAD object type",
-                "slave_id",     "%d", slave_id,
-                "object_type",  "%d", object_type,
-                NULL
-            );
-            return -1;
+        }
     }
+    return 0;
+}
 
+/***************************************************************************
+ *  Store `count` words (as received, big endian) from `address`.
+ *  The cells not mapped are skipped.
+ ***************************************************************************/
+PRIVATE int store_slave_words(slave_data_t *pslv, int object_type, int address, int count, uint8_t *bf)
+{
+    int end = address + count;
+    int idx = lower_block(pslv, object_type, address);
+    for(; idx < pslv->max_blocks[object_type]; idx++) {
+        register_block_t *block = &pslv->blocks[object_type][idx];
+        if(block->address >= end) {
+            break;
+        }
+        int first = block->address > address? block->address : address;
+        int last = block->address + block->size < end? block->address + block->size : end;
+        memmove(
+            &block->data[first - block->address],
+            bf + ((first - address) << 1),
+            (last - first) << 1
+        );
+        for(int a=first; a<last; a++) {
+            block->control[a - block->address].updated = 1;
+        }
+    }
     return 0;
 }
 
 /***************************************************************************
  *
  ***************************************************************************/
-PRIVATE int store_modbus_response_data(hgobj gobj, uint8_t *bf, int len)
+PRIVATE int store_modbus_response_data(hgobj gobj, transaction_t *tr, uint8_t *bf, int len)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
@@ -2028,9 +3376,14 @@ PRIVATE int store_modbus_response_data(hgobj gobj, uint8_t *bf, int len)
         return 0;
     }
 
-    uint8_t req_slave_id = (uint8_t)kw_get_int(priv->cur_slave_, "id", 0, KW_REQUIRED);
-    uint16_t req_address = kw_get_int(priv->cur_map_, "address", 0, KW_REQUIRED|KW_WILD_NUMBER);
-    uint16_t req_size = kw_get_int(priv->cur_map_, "size", 0, KW_REQUIRED|KW_WILD_NUMBER);
+    poll_request_t *req = tr->req;
+    if(!req || !priv->slave_data) {
+        // Poll plan recompiled while waiting the response
+        return 0;
+    }
+    uint8_t req_slave_id = req->slave_id;
+    uint16_t req_address = req->address;
+    uint16_t req_size = req->size;
 
     /*------------------------------*
      *      Check protocol
@@ -2048,13 +3401,13 @@ PRIVATE int store_modbus_response_data(hgobj gobj, uint8_t *bf, int len)
         return -1;
     }
 
-    if(priv->modbus_function != modbus_function) {
+    if(tr->modbus_function != modbus_function) {
         log_error(0,
             "gobj",             "%s", gobj_full_name(gobj),
             "function",         "%s", __FUNCTION__,
             "msgset",           "%s", MSGSET_PROTOCOL_ERROR,
             "msg",              "%s", "modbus function NOT MATCH",
-            "function esperada","%s", modbus_function_name(priv->modbus_function),
+            "function esperada","%s", modbus_function_name(tr->modbus_function),
             "function recibida","%s", modbus_function_name(modbus_function),
             NULL
         );
@@ -2125,80 +3478,17 @@ PRIVATE int store_modbus_response_data(hgobj gobj, uint8_t *bf, int len)
         return -1;
     }
 
+    slave_data_t *pslv = &priv->slave_data[req->slave_idx];
+
     switch(modbus_function) {
         case MODBUS_FC_READ_COILS:
-            {
-                int pos = 0;
-                for(int i = 0; i < len; i++) {
-                    /* Shift reg hi_byte to temp */
-                    int temp = bf[i];
-
-                    for (int bit = 0x01; (bit & 0xff) && (pos < req_size);) {
-                        BOOL value = (temp & bit) ? TRUE : FALSE;
-                        store_slave_bit(
-                            gobj,
-                            slave_id,
-                            TYPE_COIL,
-                            req_address + pos,
-                            value
-                        );
-                        pos++;
-                        bit = bit << 1;
-                    }
-                }
-            }
-            break;
-
         case MODBUS_FC_READ_DISCRETE_INPUTS:
-            {
-                int pos = 0;
-                for(int i = 0; i < len; i++) {
-                    /* Shift reg hi_byte to temp */
-                    int temp = bf[i];
-
-                    for (int bit = 0x01; (bit & 0xff) && (pos < req_size);) {
-                        BOOL value = (temp & bit) ? TRUE : FALSE;
-                        store_slave_bit(
-                            gobj,
-                            slave_id,
-                            TYPE_DISCRETE_INPUT,
-                            req_address + pos,
-                            value
-                        );
-                        pos++;
-                        bit = bit << 1;
-                    }
-                }
-            }
+            store_slave_bits(pslv, req->object_type, req_address, req_size, bf);
             break;
 
         case MODBUS_FC_READ_HOLDING_REGISTERS:
-            {
-                for(int i = 0; i < len/2; i++) {
-                    store_slave_word(
-                        gobj,
-                        slave_id,
-                        TYPE_HOLDING_REGISTER,
-                        req_address + i,
-                        bf + (i << 1)
-                    );
-                }
-            }
-            break;
-
         case MODBUS_FC_READ_INPUT_REGISTERS:
-            {
-                for(int i = 0; i < len/2; i++) {
-                    /* shift reg hi_byte to temp OR with lo_byte */
-                    store_slave_word(
-                        gobj,
-                        slave_id,
-                        TYPE_INPUT_REGISTER,
-                        req_address + i,
-                        bf + (i << 1)
-                    );
-                }
-            }
+            store_slave_words(pslv, req->object_type, req_address, len/2, bf);
             break;
 
         case MODBUS_FC_WRITE_SINGLE_COIL:
@@ -2540,273 +3830,401 @@ PRIVATE double endian_double(endian_format_t endian_format, uint8_t *pv)
 }
 
 /***************************************************************************
- *
+ *  Decode kernels, one per variable format.
+ *  Called with a run of descriptors of the same format,
+ *  the value is left in the record of the descriptor.
  ***************************************************************************/
-PRIVATE json_t *get_variable_value(hgobj gobj, slave_data_t *pslv, json_t *jn_variable)
+PRIVATE void decode_bits(conversion_t **list, int count)
 {
-    json_t *jn_value = json_null();
+    for(int i=0; i<count; i++) {
+        conversion_t *c = list[i];
+        c->integer = c->control->bit_value;
+    }
+}
 
-    /*
-     *  These values are been checked in check_conversion_variable()
-     */
-    const char *type = kw_get_str(jn_variable, "type", "", KW_REQUIRED);
-    int object_type = get_object_type(gobj, type);
-    if(object_type < 0) {
-        return jn_value;
+PRIVATE void decode_bool(conversion_t **list, int count)
+{
+    for(int i=0; i<count; i++) {
+        conversion_t *c = list[i];
+        c->integer = *c->pv? 1:0;
     }
+}
 
-    int address = kw_get_int(jn_variable, "address", -1, KW_REQUIRED|KW_WILD_NUMBER);
-    float multiplier = kw_get_real(jn_variable, "multiplier", 1, KW_WILD_NUMBER);
-    if(multiplier == 0.0) {
-        multiplier = 1.0;
+PRIVATE void decode_int16(conversion_t **list, int count)
+{
+    for(int i=0; i<count; i++) {
+        conversion_t *c = list[i];
+        int16_t v = endian_16(c->endian_format, (uint8_t *)c->pv);
+        if(c->value_type == VALUE_REAL) {
+            float v_ = (float)v * c->multiplier;
+            c->real = v_;
+        } else {
+            v = v*c->multiplier;
+            c->integer = v;
+        }
     }
+}
 
-    const char *format = kw_get_str(jn_variable, "format", "", KW_REQUIRED);
-    variable_format_t variable_format = get_variable_format(gobj, format);
+PRIVATE void decode_uint16(conversion_t **list, int count)
+{
+    for(int i=0; i<count; i++) {
+        conversion_t *c = list[i];
+        uint16_t v = endian_16(c->endian_format, (uint8_t *)c->pv);
+        if(c->value_type == VALUE_REAL) {
+            float v_ = (float)v * c->multiplier;
+            c->real = v_;
+        } else {
+            v = v*c->multiplier;
+            c->integer = v;
+        }
+    }
+}
 
-    const char *endian = kw_get_str(jn_variable, "endian", "big endian", 0);
-    endian_format_t endian_format = get_endian_format(gobj, endian);
+PRIVATE void decode_int32(conversion_t **list, int count)
+{
+    for(int i=0; i<count; i++) {
+        conversion_t *c = list[i];
+        int32_t v = endian_32(c->endian_format, (uint8_t *)c->pv);
+        if(c->value_type == VALUE_REAL) {
+            float v_ = (float)v * c->multiplier;
+            c->real = v_;
+        } else {
+            v = v*c->multiplier;
+            c->integer = v;
+        }
+    }
+}
 
-    switch(variable_format) {
-        case FORMAT_BOOL:
-            {
-                cell_control_t *cell_control = &pslv->control[object_type][address];
-                cell_control->updated = 0;
-                switch(object_type) {
-                    case TYPE_COIL:
-                    case TYPE_DISCRETE_INPUT:
-                        jn_value = cell_control->bit_value?json_true():json_false();
-                        break;
-                    case TYPE_INPUT_REGISTER:
-                        jn_value = pslv->input_register[address]?json_true():json_false();
-                        break;
-                    case TYPE_HOLDING_REGISTER:
-                        jn_value = pslv->holding_register[address]?json_true():json_false();
-                        break;
-                }
-            }
-            break;
+PRIVATE void decode_uint32(conversion_t **list, int count)
+{
+    for(int i=0; i<count; i++) {
+        conversion_t *c = list[i];
+        uint32_t v = endian_32(c->endian_format, (uint8_t *)c->pv);
+        if(c->value_type == VALUE_REAL) {
+            float v_ = (float)v * c->multiplier;
+            c->real = v_;
+        } else {
+            v = v*c->multiplier;
+            c->integer = v;
+        }
+    }
+}
 
-        case FORMAT_INT16:
-        case FORMAT_UINT16:
-            {
-                cell_control_t *cell_control = &pslv->control[object_type][address];
-                cell_control->updated = 0;
-                uint16_t *pv = 0;
-                switch(object_type) {
-                    case TYPE_COIL:
-                    case TYPE_DISCRETE_INPUT:
-                        jn_value = cell_control->bit_value?json_integer(1):json_integer(0);
-                        break;
-                    case TYPE_INPUT_REGISTER:
-                        pv = &pslv->input_register[address];
-                        break;
-                    case TYPE_HOLDING_REGISTER:
-                        pv = &pslv->holding_register[address];
-                        break;
-                }
+PRIVATE void decode_int64(conversion_t **list, int count)
+{
+    for(int i=0; i<count; i++) {
+        conversion_t *c = list[i];
+        int64_t v = endian_64(c->endian_format, (uint8_t *)c->pv);
+        if(c->value_type == VALUE_REAL) {
+            c->real = (double)v * c->multiplier;
+        } else {
+            v = v*c->multiplier;
+            c->integer = v;
+        }
+    }
+}
 
-                if(pv) {
-                    if(variable_format == FORMAT_INT16) {
-                        int16_t v = endian_16(endian_format, (uint8_t *)pv);
-                        if(multiplier < 1.0 &&  multiplier > 0.0) {
-                            float v_ = (float)v * multiplier;
-                            jn_value = json_real(v_);
-                        } else {
-                            v = v*multiplier;
-                            jn_value = json_integer(v);
-                        }
-                    } else {
-                        uint16_t v = endian_16(endian_format, (uint8_t *)pv);
-                        if(multiplier < 1.0 &&  multiplier > 0.0) {
-                            float v_ = (float)v * multiplier;
-                            jn_value = json_real(v_);
-                        } else {
-                            v = v*multiplier;
-                            jn_value = json_integer(v);
-                        }
-                    }
-                }
-            }
-            break;
+PRIVATE void decode_uint64(conversion_t **list, int count)
+{
+    for(int i=0; i<count; i++) {
+        conversion_t *c = list[i];
+        uint64_t v = endian_64(c->endian_format, (uint8_t *)c->pv);
+        if(c->value_type == VALUE_REAL) {
+            c->real = (double)v * c->multiplier;
+        } else {
+            v = v*c->multiplier;
+            c->integer = v;
+        }
+    }
+}
 
-        case FORMAT_INT32:
-        case FORMAT_UINT32:
-            {
-                cell_control_t *cell_control = &pslv->control[object_type][address];
-                cell_control->updated = 0;
-                uint16_t *pv = 0;
-                switch(object_type) {
-                    case TYPE_COIL:
-                    case TYPE_DISCRETE_INPUT:
-                        jn_value = cell_control->bit_value?json_integer(1):json_integer(0);
-                        break;
-                    case TYPE_INPUT_REGISTER:
-                        pv = &pslv->input_register[address];
-                        break;
-                    case TYPE_HOLDING_REGISTER:
-                        pv = &pslv->holding_register[address];
-                        break;
-                }
+PRIVATE void decode_float(conversion_t **list, int count)
+{
+    for(int i=0; i<count; i++) {
+        conversion_t *c = list[i];
+        float v = endian_float(c->endian_format, (uint8_t *)c->pv);
+        v = v*c->multiplier;
+        c->real = v;
+    }
+}
 
-                if(pv) {
-                    if(variable_format == FORMAT_INT32) {
-                        int32_t v = endian_32(endian_format, (uint8_t *)pv);
-                        if(multiplier < 1.0 &&  multiplier > 0.0) {
-                            float v_ = (float)v * multiplier;
-                            jn_value = json_real(v_);
-                        } else {
-                            v = v*multiplier;
-                            jn_value = json_integer(v);
-                        }
-                    } else {
-                        uint32_t v = endian_32(endian_format, (uint8_t *)pv);
-                        if(multiplier < 1.0 &&  multiplier > 0.0) {
-                            float v_ = (float)v * multiplier;
-                            jn_value = json_real(v_);
-                        } else {
-                            v = v*multiplier;
-                            jn_value = json_integer(v);
-                        }
-                    }
-                }
-            }
+PRIVATE void decode_double(conversion_t **list, int count)
+{
+    for(int i=0; i<count; i++) {
+        conversion_t *c = list[i];
+        double v = endian_double(c->endian_format, (uint8_t *)c->pv);
+        v = v*c->multiplier;
+        c->real = v;
+    }
+}
+
+PRIVATE void decode_string(conversion_t **list, int count)
+{
+    for(int i=0; i<count; i++) {
+        conversion_t *c = list[i];
+        char *p = c->string;
+        for(int w=0; c->pv && w<c->size; w++) {
+            uint32_t word = endian_16(c->endian_format, (uint8_t *)(c->pv + w));
+            uint8_t b1 = (uint8_t)(word >> 8); // get the higher byte;
+            uint8_t b2 = (uint8_t)(word & 0xFF); // get the lower byte
+            // convert the nulls into space
+            *p++ = b1? b1 : ' ';
+            *p++ = b2? b2 : ' ';
+        }
+        *p = 0;
+        left_justify(c->string);
+    }
+}
+
+PRIVATE const decode_kernel_fn decode_kernels[MAX_KERNELS] = {
+    [FORMAT_INT16]  = decode_int16,
+    [FORMAT_UINT16] = decode_uint16,
+    [FORMAT_BOOL]   = decode_bool,
+    [FORMAT_INT32]  = decode_int32,
+    [FORMAT_UINT32] = decode_uint32,
+    [FORMAT_INT64]  = decode_int64,
+    [FORMAT_UINT64] = decode_uint64,
+    [FORMAT_FLOAT]  = decode_float,
+    [FORMAT_DOUBLE] = decode_double,
+    [FORMAT_STRING] = decode_string,
+    [KERNEL_BITS]   = decode_bits,
+};
+
+/***************************************************************************
+ *  Decode all the conversion variables of the slave, run by run
+ ***************************************************************************/
+PRIVATE void decode_slave_conversions(slave_data_t *pslv)
+{
+    for(int r=0; r<pslv->max_runs; r++) {
+        conversion_run_t *run = &pslv->runs[r];
+        run->decode(&pslv->decode_list[run->first], run->count);
+    }
+}
+
+/***************************************************************************
+ *  Json of the value in the record
+ ***************************************************************************/
+PRIVATE json_t *conversion_value_json(conversion_t *c)
+{
+    switch(c->value_type) {
+        case VALUE_BOOL:
+            return c->integer? json_true():json_false();
+        case VALUE_INTEGER:
+            return json_integer(c->integer);
+        case VALUE_REAL:
+            return json_real(c->real);
+        case VALUE_STRING:
+            return json_string(c->string);
+    }
+    return json_null();
+}
+
+/***************************************************************************
+ *  Has the value changed out of the deadband of the variable?
+ *  The band is the greater of `deadband` (absolute)
+ *  and `deadband_percent` of the last value published.
+ ***************************************************************************/
+PRIVATE BOOL value_changed(conversion_t *c)
+{
+    double last, delta;
+
+    switch(c->value_type) {
+        case VALUE_BOOL:
+            return c->integer != c->last_integer;
+        case VALUE_STRING:
+            return strcmp(c->string, c->last_string)!=0;
+        case VALUE_INTEGER:
+            last = (double)c->last_integer;
+            delta = (double)c->integer - last;
             break;
+        case VALUE_REAL:
+        default:
+            last = c->last_real;
+            delta = c->real - last;
+            break;
+    }
+    if(delta < 0) {
+        delta = -delta;
+    }
+    if(last < 0) {
+        last = -last;
+    }
+    double band = last * c->deadband_percent / 100.0;
+    if(c->deadband > band) {
+        band = c->deadband;
+    }
+    if(band <= 0) {
+        return delta != 0;
+    }
+    return delta > band;
+}
+
+/***************************************************************************
+ *  Report by exception: must the variable be published?
+ *  Silent if not read since the last publication (`updated` cell bit)
+ *  or not changed out of its deadband, unless it's silent for `max_silence`,
+ *  of the variable or else of the attribute (writable, taken as it is now).
+ ***************************************************************************/
+PRIVATE BOOL report_exception(hgobj gobj, conversion_t *c, uint64_t now)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    int max_silence = (c->max_silence >= 0)? c->max_silence : priv->max_silence;
+    BOOL heartbeat = c->published && max_silence > 0 &&
+        now - c->last_publish >= (uint64_t)max_silence * 1000;
+
+    if(!c->control->updated && !heartbeat) {
+        return FALSE;   // nothing new
+    }
+    if(c->published && !heartbeat && !value_changed(c)) {
+        return FALSE;
+    }
+
+    c->published = TRUE;
+    c->last_publish = now;
+    c->last_integer = c->integer;
+    c->last_real = c->real;
+    if(c->value_type == VALUE_STRING) {
+        strcpy(c->last_string, c->string);
+    }
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Bytes of the value in the columnar record
+ ***************************************************************************/
+PRIVATE int column_size(conversion_t *c)
+{
+    return c->value_type == VALUE_STRING? c->size*2 : 8;
+}
+
+PRIVATE const char *value_type_name(value_type_t value_type)
+{
+    switch(value_type) {
+        case VALUE_BOOL:
+            return "bool";
+        case VALUE_INTEGER:
+            return "integer";
+        case VALUE_REAL:
+            return "real";
+        case VALUE_STRING:
+            return "string";
+    }
+    return "";
+}
 
-        case FORMAT_INT64:
-        case FORMAT_UINT64:
-            {
-                cell_control_t *cell_control = &pslv->control[object_type][address];
-                cell_control->updated = 0;
-                uint16_t *pv = 0;
-                switch(object_type) {
-                    case TYPE_COIL:
-                    case TYPE_DISCRETE_INPUT:
-                        jn_value = cell_control->bit_value?json_integer(1):json_integer(0);
-                        break;
-                    case TYPE_INPUT_REGISTER:
-                        pv = &pslv->input_register[address];
-                        break;
-                    case TYPE_HOLDING_REGISTER:
-                        pv = &pslv->holding_register[address];
-                        break;
-                }
+/***************************************************************************
+ *  Schema id (FNV-1a of slave id, variable ids and types) and record size
+ ***************************************************************************/
+PRIVATE void compile_schema(slave_data_t *pslv)
+{
+    uint32_t h = 2166136261u;
+    #define FNV_BYTE(b) {h ^= (uint8_t)(b); h *= 16777619u;}
+
+    FNV_BYTE(pslv->slave_id >> 8)
+    FNV_BYTE(pslv->slave_id)
+    pslv->record_size = (pslv->max_conversions + 7) / 8;
+    for(int i=0; i<pslv->max_conversions; i++) {
+        conversion_t *c = &pslv->conversions[i];
+        for(const char *p = c->id; *p; p++) {
+            FNV_BYTE(*p)
+        }
+        FNV_BYTE(0)
+        FNV_BYTE(c->value_type)
+        FNV_BYTE(column_size(c))
+        pslv->record_size += column_size(c);
+    }
+    #undef FNV_BYTE
 
-                if(pv) {
-                    if(variable_format == FORMAT_INT64) {
-                        int64_t v = endian_64(endian_format, (uint8_t *)pv);
-                        if(multiplier < 1.0 &&  multiplier > 0.0) {
-                            double v_ = (double)v * multiplier;
-                            jn_value = json_real(v_);
-                        } else {
-                            v = v*multiplier;
-                            jn_value = json_integer(v);
-                        }
-                    } else {
-                        uint64_t v = endian_64(endian_format, (uint8_t *)pv);
-                        if(multiplier < 1.0 &&  multiplier > 0.0) {
-                            double v_ = (double)v * multiplier;
-                            jn_value = json_real(v_);
-                        } else {
-                            v = v*multiplier;
-                            jn_value = json_integer(v);
-                        }
-                    }
-                }
-            }
-            break;
+    pslv->schema_id = h;
+    pslv->schema_published = FALSE;
+}
 
-        case FORMAT_FLOAT:
-            {
-                cell_control_t *cell_control = &pslv->control[object_type][address];
-                cell_control->updated = 0;
-                uint16_t *pv = 0;
-                switch(object_type) {
-                    case TYPE_COIL:
-                    case TYPE_DISCRETE_INPUT:
-                        jn_value = cell_control->bit_value?json_integer(1):json_integer(0);
-                        break;
-                    case TYPE_INPUT_REGISTER:
-                        pv = &pslv->input_register[address];
-                        break;
-                    case TYPE_HOLDING_REGISTER:
-                        pv = &pslv->holding_register[address];
-                        break;
-                }
+/***************************************************************************
+ *  Publish the schema of the columnar records of the slave
+ ***************************************************************************/
+PRIVATE int publish_schema(hgobj gobj, slave_data_t *pslv)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-                if(pv) {
-                    float v = endian_float(endian_format, (uint8_t *)pv);
-                    v = v*multiplier;
-                    jn_value = json_real(v);
-                }
-            }
-            break;
+    json_t *jn_schema = json_array();
+    for(int i=0; i<pslv->max_conversions; i++) {
+        conversion_t *c = &pslv->conversions[i];
+        json_array_append_new(jn_schema, json_pack("{s:s, s:s, s:i}",
+            "id", c->id,
+            "type", value_type_name(c->value_type),
+            "size", column_size(c)
+        ));
+    }
 
-        case FORMAT_DOUBLE:
-            {
-                cell_control_t *cell_control = &pslv->control[object_type][address];
-                cell_control->updated = 0;
-                uint16_t *pv = 0;
-                switch(object_type) {
-                    case TYPE_COIL:
-                    case TYPE_DISCRETE_INPUT:
-                        jn_value = cell_control->bit_value?json_integer(1):json_integer(0);
-                        break;
-                    case TYPE_INPUT_REGISTER:
-                        pv = &pslv->input_register[address];
-                        break;
-                    case TYPE_HOLDING_REGISTER:
-                        pv = &pslv->holding_register[address];
-                        break;
-                }
+    json_t *kw_schema = json_pack("{s:i, s:I, s:i, s:o}",
+        "slave_id", (int)pslv->slave_id,
+        "schema_id", (json_int_t)pslv->schema_id,
+        "record_size", pslv->record_size,
+        "schema", jn_schema
+    );
+    if(gobj_trace_level(gobj) & TRACE_MESSAGES) {
+        log_debug_json(0, kw_schema, "PUBLISH %s", gobj_short_name(gobj));
+    }
+    pslv->schema_published = TRUE;
+    return gobj_publish_event(gobj, priv->on_message_event_name, kw_schema);
+}
 
-                if(pv) {
-                    double v = endian_double(endian_format, (uint8_t *)pv);
-                    v = v*multiplier;
-                    jn_value = json_real(v);
-                }
-            }
-            break;
+/***************************************************************************
+ *  Pack the present values of the slave in a columnar record
+ ***************************************************************************/
+PRIVATE GBUFFER *build_columnar_record(slave_data_t *pslv)
+{
+    GBUFFER *gbuf = gbuf_create(pslv->record_size, pslv->record_size, 0, 0);
+    if(!gbuf) {
+        return 0;
+    }
 
-        case FORMAT_STRING:
-            {
-                cell_control_t *cell_control = &pslv->control[object_type][address];
-                cell_control->updated = 0;
-                int size = (int)kw_get_int(jn_variable, "multiplier", 1, KW_WILD_NUMBER);
-                GBUFFER *gbuf_string = gbuf_create(size*2, size*2, 0, 0);
-
-                for(int i=0; i<size; i++) {
-                    uint16_t *pv = 0;
-                    switch(object_type) {
-                        case TYPE_INPUT_REGISTER:
-                            pv = &pslv->input_register[address+i];
-                            break;
-                        case TYPE_HOLDING_REGISTER:
-                            pv = &pslv->holding_register[address+i];
-                            break;
-                    }
+    /*
+     *  Presence bitmap
+     */
+    uint8_t byte = 0;
+    for(int i=0; i<pslv->max_conversions; i++) {
+        if(pslv->conversions[i].present) {
+            byte |= 1 << (i & 7);
+        }
+        if((i & 7) == 7 || i == pslv->max_conversions-1) {
+            gbuf_append(gbuf, &byte, 1);
+            byte = 0;
+        }
+    }
 
-                    uint32_t word = endian_16(endian_format, (uint8_t *)pv);
-                    uint8_t b1 = (uint8_t)(word >> 8); // get the higher byte;
-                    uint8_t b2 = (uint8_t)(word & 0xFF); // get the lower byte
-                    // convert the nulls into space
-                    if(b1==0) {
-                        b1 = ' ';
-                    }
-                    if(b2==0) {
-                        b2 = ' ';
-                    }
-                    gbuf_append(gbuf_string, &b1, 1);
-                    gbuf_append(gbuf_string, &b2, 1);
-                }
-                left_justify(gbuf_cur_rd_pointer(gbuf_string));
-                jn_value = json_string(gbuf_cur_rd_pointer(gbuf_string));
-                GBUF_DECREF(gbuf_string)
+    /*
+     *  Values, little endian
+     */
+    for(int i=0; i<pslv->max_conversions; i++) {
+        conversion_t *c = &pslv->conversions[i];
+        if(!c->present) {
+            continue;
+        }
+        if(c->value_type == VALUE_STRING) {
+            int len = strlen(c->string);
+            gbuf_append(gbuf, c->string, len);
+            for(; len < c->size*2; len++) {
+                gbuf_append(gbuf, &byte, 1); // zero
             }
-            break;
+            continue;
+        }
+
+        uint64_t v;
+        if(c->value_type == VALUE_REAL) {
+            memcpy(&v, &c->real, sizeof(v));
+        } else {
+            v = (uint64_t)c->integer;
+        }
+        uint8_t le[8];
+        for(int b=0; b<8; b++) {
+            le[b] = (uint8_t)(v >> 8*b);
+        }
+        gbuf_append(gbuf, le, sizeof(le));
     }
 
-    return jn_value;
+    return gbuf;
 }
 
 /***************************************************************************
@@ -2816,30 +4234,55 @@ PRIVATE int build_message_to_publish(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    int idx_slaves; json_t *jn_slave;
-    json_array_foreach(priv->slaves_, idx_slaves, jn_slave) {
-        int slave_id = kw_get_int(jn_slave, "id", 0, KW_REQUIRED);
-        slave_data_t *pslv = get_slave_data(gobj, slave_id, TRUE);
-        if(!pslv) {
+    uint64_t now = time_in_miliseconds();
+
+    slave_data_t *pslv = priv->slave_data;
+    for(int i=0; pslv && i<priv->max_slaves; i++, pslv++) {
+        if(!pslv->max_conversions) {
             continue;
         }
-        json_t *jn_conversion = kw_get_list(jn_slave, "conversion", 0, KW_REQUIRED);
-        if(!jn_conversion) {
-            continue;
+
+        decode_slave_conversions(pslv);
+
+        int values = 0;
+        for(int v=0; v<pslv->max_conversions; v++) {
+            conversion_t *c = &pslv->conversions[v];
+            c->present = !priv->report_by_exception || report_exception(gobj, c, now);
+            if(c->present) {
+                values++;
+            }
+            c->control->updated = 0;
         }
 
-        json_t *kw_data = json_object();
-        json_object_set_new(kw_data, "slave_id", json_integer(slave_id));
+        if(priv->report_by_exception && !values) {
+            continue;
+        }
 
-        int idx_conversion; json_t *jn_variable;
-        json_array_foreach(jn_conversion, idx_conversion, jn_variable) {
-            BOOL disabled = kw_get_bool(jn_variable, "disabled", 0, 0);
-            if(disabled) {
+        json_t *kw_data;
+        if(priv->columnar) {
+            if(!pslv->schema_published) {
+                publish_schema(gobj, pslv);
+            }
+            GBUFFER *gbuf = build_columnar_record(pslv);
+            if(!gbuf) {
                 continue;
             }
-            const char *variable_id = kw_get_str(jn_variable, "id", "", KW_REQUIRED);
-            json_t *jn_value = get_variable_value(gobj, pslv, jn_variable);
-            json_object_set_new(kw_data, variable_id, jn_value);
+            kw_data = json_pack("{s:i, s:I, s:i, s:I}",
+                "slave_id", (int)pslv->slave_id,
+                "schema_id", (json_int_t)pslv->schema_id,
+                "values", values,
+                "gbuffer", (json_int_t)(size_t)gbuf
+            );
+
+        } else {
+            kw_data = json_object();
+            json_object_set_new(kw_data, "slave_id", json_integer(pslv->slave_id));
+            for(int v=0; v<pslv->max_conversions; v++) {
+                conversion_t *c = &pslv->conversions[v];
+                if(c->present) {
+                    json_object_set_new(kw_data, c->id, conversion_value_json(c));
+                }
+            }
         }
 
         if(gobj_trace_level(gobj) & TRACE_MESSAGES) {
@@ -2967,45 +4410,362 @@ PRIVATE int check_conversion_variable(hgobj gobj, slave_data_t *pslv, json_t *jn
             break;
     }
 
-    for(int i=0; i<compound_value; i++) {
-        cell_control_t *cell_control = &pslv->control[object_type][address+i];
-        if(!cell_control->value_busy) {
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                "msg",          "%s", "Conversion: cell not defined",
-                "slave_id",     "%d", slave_id,
-                "type",         "%s", type,
-                "object_type",  "%d", object_type,
-                "address",      "%d", address,
-                "i",            "%d", i,
-                "variable",     "%j", jn_variable,
-                NULL
-            );
-            json_object_set_new(jn_variable, "disabled", json_true());
-            break;
+    /*
+     *  Contiguous addresses are in the same block, the value can't cross blocks
+     */
+    register_block_t *block = find_block(pslv, object_type, address);
+    for(int i=0; i<compound_value; i++) {
+        cell_control_t *cell_control = 0;
+        if(block && address + i < block->address + block->size) {
+            cell_control = &block->control[address + i - block->address];
+        }
+        if(!cell_control || !cell_control->value_busy) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "Conversion: cell not defined",
+                "slave_id",     "%d", slave_id,
+                "type",         "%s", type,
+                "object_type",  "%d", object_type,
+                "address",      "%d", address,
+                "i",            "%d", i,
+                "variable",     "%j", jn_variable,
+                NULL
+            );
+            json_object_set_new(jn_variable, "disabled", json_true());
+            break;
+        }
+        if(cell_control->compound_value) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "Conversion: OVERRIDE compound value",
+                "slave_id",     "%d", slave_id,
+                "type",         "%s", type,
+                "object_type",  "%d", object_type,
+                "address",      "%d", address,
+                "i",            "%d", i,
+                "variable",     "%j", jn_variable,
+                NULL
+            );
+            json_object_set_new(jn_variable, "disabled", json_true());
+            break;
+        }
+        if(compound_value > 1) {
+            cell_control->compound_value = 1;
+        }
+    }
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int check_conversion_variables(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    int idx_slaves; json_t *jn_slave;
+    json_array_foreach(priv->slaves_, idx_slaves, jn_slave) {
+        int slave_id = kw_get_int(jn_slave, "id", 0, KW_REQUIRED);
+        slave_data_t *pslv = get_slave_data(gobj, slave_id, TRUE);
+        if(!pslv) {
+            continue;
+        }
+        json_t *jn_conversion = kw_get_list(jn_slave, "conversion", 0, KW_REQUIRED);
+        if(!jn_conversion) {
+            continue;
+        }
+
+        int idx_conversion; json_t *jn_variable;
+        json_array_foreach(jn_conversion, idx_conversion, jn_variable) {
+            check_conversion_variable(gobj, pslv, jn_variable);
+        }
+    }
+
+    return 0;
+}
+
+/***************************************************************************
+ *  Order of decoding: by kernel, endian and address
+ ***************************************************************************/
+PRIVATE int cmp_conversion_kernel(const void *a, const void *b)
+{
+    const conversion_t *ca = *(conversion_t * const *)a;
+    const conversion_t *cb = *(conversion_t * const *)b;
+    if(ca->kernel != cb->kernel) {
+        return ca->kernel - cb->kernel;
+    }
+    if(ca->endian_format != cb->endian_format) {
+        return (int)ca->endian_format - (int)cb->endian_format;
+    }
+    return (ca->control > cb->control) - (ca->control < cb->control);
+}
+
+/***************************************************************************
+ *  Compile the enabled conversion variables (checked in
+ *  check_conversion_variables()) of each slave in typed descriptors
+ *  with the cells already resolved, and group them in runs by kernel.
+ ***************************************************************************/
+PRIVATE int compile_conversions(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    slave_data_t *pslv = priv->slave_data;
+    int idx_slaves; json_t *jn_slave;
+    json_array_foreach(priv->slaves_, idx_slaves, jn_slave) {
+        if(!pslv) {
+            break;
+        }
+        json_t *jn_conversion = kw_get_list(jn_slave, "conversion", 0, 0);
+        int max_conversions = 0;
+        int idx_conversion; json_t *jn_variable;
+        json_array_foreach(jn_conversion, idx_conversion, jn_variable) {
+            if(!kw_get_bool(jn_variable, "disabled", 0, 0)) {
+                max_conversions++;
+            }
+        }
+        if(!max_conversions) {
+            pslv++;
+            continue;
+        }
+
+        pslv->conversions = gbmem_malloc(max_conversions * sizeof(conversion_t));
+        pslv->decode_list = gbmem_malloc(max_conversions * sizeof(conversion_t *));
+        pslv->runs = gbmem_malloc(max_conversions * sizeof(conversion_run_t));
+        if(!pslv->conversions || !pslv->decode_list || !pslv->runs) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "no memory for conversions",
+                "slave_id",     "%d", pslv->slave_id,
+                "conversions",  "%d", max_conversions,
+                NULL
+            );
+            free_conversions(pslv);
+            pslv++;
+            continue;
+        }
+
+        json_array_foreach(jn_conversion, idx_conversion, jn_variable) {
+            if(kw_get_bool(jn_variable, "disabled", 0, 0)) {
+                continue;
+            }
+            int object_type = get_object_type(gobj, kw_get_str(jn_variable, "type", "", KW_REQUIRED));
+            int address = kw_get_int(jn_variable, "address", -1, KW_REQUIRED|KW_WILD_NUMBER);
+            register_block_t *block = find_block(pslv, object_type, address);
+            if(!block) {
+                continue;   // Logged in check_conversion_variable()
+            }
+
+            conversion_t *c = &pslv->conversions[pslv->max_conversions];
+            c->id = kw_get_str(jn_variable, "id", "", KW_REQUIRED);
+            c->variable_format = get_variable_format(
+                gobj, kw_get_str(jn_variable, "format", "", KW_REQUIRED)
+            );
+            c->endian_format = get_endian_format(
+                gobj, kw_get_str(jn_variable, "endian", "big endian", 0)
+            );
+            c->multiplier = kw_get_real(jn_variable, "multiplier", 1, KW_WILD_NUMBER);
+            if(c->multiplier == 0.0) {
+                c->multiplier = 1.0;
+            }
+            c->control = &block->control[address - block->address];
+            c->pv = block->data? &block->data[address - block->address] : 0;
+            c->deadband = kw_get_real(jn_variable, "deadband", 0, KW_WILD_NUMBER);
+            c->deadband_percent = kw_get_real(jn_variable, "deadband_percent", 0, KW_WILD_NUMBER);
+            c->max_silence = kw_get_int(jn_variable, "max_silence", -1, KW_WILD_NUMBER);
+
+            switch(c->variable_format) {
+                case FORMAT_BOOL:
+                    c->value_type = VALUE_BOOL;
+                    break;
+                case FORMAT_STRING:
+                    c->value_type = VALUE_STRING;
+                    c->size = (int)kw_get_int(jn_variable, "multiplier", 1, KW_WILD_NUMBER);
+                    if(c->size < 0) {
+                        c->size = 0;
+                    }
+                    c->string = gbmem_malloc(c->size*2 + 1);
+                    c->last_string = gbmem_malloc(c->size*2 + 1);
+                    if(!c->string || !c->last_string) {
+                        GBMEM_FREE(c->string);
+                        GBMEM_FREE(c->last_string);
+                        continue;
+                    }
+                    break;
+                case FORMAT_FLOAT:
+                case FORMAT_DOUBLE:
+                    c->value_type = c->pv? VALUE_REAL : VALUE_INTEGER;
+                    break;
+                default:
+                    c->value_type = (c->pv && c->multiplier < 1.0 && c->multiplier > 0.0)?
+                        VALUE_REAL : VALUE_INTEGER;
+                    break;
+            }
+            c->kernel = (c->pv || c->variable_format == FORMAT_STRING)?
+                (int)c->variable_format : KERNEL_BITS;
+
+            pslv->decode_list[pslv->max_conversions] = c;
+            pslv->max_conversions++;
+        }
+
+        /*
+         *  Runs of the same kernel
+         */
+        qsort(pslv->decode_list, pslv->max_conversions, sizeof(conversion_t *), cmp_conversion_kernel);
+        for(int i=0; i<pslv->max_conversions; i++) {
+            int kernel = pslv->decode_list[i]->kernel;
+            if(pslv->max_runs == 0 || pslv->decode_list[i-1]->kernel != kernel) {
+                conversion_run_t *run = &pslv->runs[pslv->max_runs++];
+                run->decode = decode_kernels[kernel];
+                run->first = i;
+            }
+            pslv->runs[pslv->max_runs-1].count++;
+        }
+
+        compile_schema(pslv);
+
+        if(gobj_trace_level(gobj) & TRACE_DECODE) {
+            trace_msg("🔊⏩ slave %d: %d conversions, %d kernel runs",
+                pslv->slave_id, pslv->max_conversions, pslv->max_runs
+            );
+        }
+
+        // Next slave
+        pslv++;
+    }
+
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int free_conversions(slave_data_t *pslv)
+{
+    for(int i=0; pslv->conversions && i<pslv->max_conversions; i++) {
+        GBMEM_FREE(pslv->conversions[i].string);
+        GBMEM_FREE(pslv->conversions[i].last_string);
+    }
+    GBMEM_FREE(pslv->conversions);
+    GBMEM_FREE(pslv->decode_list);
+    GBMEM_FREE(pslv->runs);
+    pslv->max_conversions = 0;
+    pslv->max_runs = 0;
+    return 0;
+}
+
+
+
+
+            /***************************
+             *      Pool of endpoints
+             ***************************/
+
+
+
+
+/***************************************************************************
+ *  Some slave with `url`? then the gobj is a pool of endpoints
+ ***************************************************************************/
+PRIVATE BOOL slaves_with_url(json_t *jn_slaves)
+{
+    int idx_slaves; json_t *jn_slave;
+    json_array_foreach(jn_slaves, idx_slaves, jn_slave) {
+        if(!empty_string(kw_get_str(jn_slave, "url", "", 0))) {
+            return TRUE;
         }
-        if(cell_control->compound_value) {
+    }
+    return FALSE;
+}
+
+/***************************************************************************
+ *  Create a child master, with its own connection, for each distinct url.
+ *  The slaves without url are ignored.
+ ***************************************************************************/
+PRIVATE int build_endpoints(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    /*
+     *  Group the slaves by url
+     */
+    json_t *jn_urls = json_object();  // {url: [slaves]}
+    int idx_slaves; json_t *jn_slave;
+    json_array_foreach(gobj_read_json_attr(gobj, "slaves"), idx_slaves, jn_slave) {
+        const char *url = kw_get_str(jn_slave, "url", "", 0);
+        if(empty_string(url)) {
             log_error(0,
                 "gobj",         "%s", gobj_full_name(gobj),
                 "function",     "%s", __FUNCTION__,
                 "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                "msg",          "%s", "Conversion: OVERRIDE compound value",
-                "slave_id",     "%d", slave_id,
-                "type",         "%s", type,
-                "object_type",  "%d", object_type,
-                "address",      "%d", address,
-                "i",            "%d", i,
-                "variable",     "%j", jn_variable,
+                "msg",          "%s", "Slave without url in a pool of endpoints, ignored",
+                "slave_id",     "%d", (int)kw_get_int(jn_slave, "id", 0, 0),
                 NULL
             );
-            json_object_set_new(jn_variable, "disabled", json_true());
-            break;
+            continue;
         }
-        if(compound_value > 1) {
-            cell_control->compound_value = 1;
+        json_t *jn_list = kw_get_list(jn_urls, url, json_array(), KW_CREATE);
+        json_t *jn_slave_ = json_deep_copy(jn_slave);
+        json_object_del(jn_slave_, "url");
+        json_array_append_new(jn_list, jn_slave_);
+    }
+
+    int max_endpoints = json_object_size(jn_urls);
+    if(max_endpoints == 0) {
+        JSON_DECREF(jn_urls);
+        return 0;
+    }
+    priv->endpoints = gbmem_malloc(sizeof(endpoint_t) * max_endpoints);
+    if(!priv->endpoints) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "no memory for endpoints",
+            "endpoints",    "%d", max_endpoints,
+            NULL
+        );
+        JSON_DECREF(jn_urls);
+        return -1;
+    }
+
+    const char *url; json_t *jn_list;
+    json_object_foreach(jn_urls, url, jn_list) {
+        json_t *kw_endpoint = json_pack("{s:s, s:O, s:i, s:i, s:i, s:i, s:b, s:i, s:s, s:s, s:{s:[s]}}",
+            "modbus_protocol", priv->modbus_protocol,
+            "slaves", jn_list,
+            "timeout_polling", priv->timeout_polling,
+            "timeout_response", priv->timeout_response,
+            "max_inflight", priv->max_inflight,
+            "coalesce_gap", priv->coalesce_gap,
+            "report_by_exception", priv->report_by_exception,
+            "max_silence", priv->max_silence,
+            "publish_format", priv->publish_format,
+            "on_cycle_event_name", "EV_ON_CYCLE",
+            "kw_connex",
+                "urls", url
+        );
+        hgobj gobj_endpoint = gobj_create(url, GCLASS_PROT_MODBUS_MASTER, kw_endpoint, gobj);
+        if(!gobj_endpoint) {
+            continue;
         }
+        endpoint_t *ep = &priv->endpoints[priv->max_endpoints++];
+        ep->gobj = gobj_endpoint;
+        ep->url = gobj_name(gobj_endpoint);
+        gobj_start(gobj_endpoint);
+    }
+    JSON_DECREF(jn_urls);
+
+    priv->pool_t0 = time_in_miliseconds();
+
+    if(gobj_trace_level(gobj) & TRACE_POLLING) {
+        trace_msg("🔊⏩ pool: %d endpoints", priv->max_endpoints);
     }
 
     return 0;
@@ -3014,26 +4774,105 @@ PRIVATE int check_conversion_variable(hgobj gobj, slave_data_t *pslv, json_t *jn
 /***************************************************************************
  *
  ***************************************************************************/
-PRIVATE int check_conversion_variables(hgobj gobj)
+PRIVATE int free_endpoints(hgobj gobj)
 {
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
-    int idx_slaves; json_t *jn_slave;
-    json_array_foreach(priv->slaves_, idx_slaves, jn_slave) {
-        int slave_id = kw_get_int(jn_slave, "id", 0, KW_REQUIRED);
-        slave_data_t *pslv = get_slave_data(gobj, slave_id, TRUE);
-        if(!pslv) {
-            continue;
+    for(int i=0; i<priv->max_endpoints; i++) {
+        endpoint_t *ep = &priv->endpoints[i];
+        if(gobj_is_running(ep->gobj)) {
+            gobj_stop_tree(ep->gobj);
         }
-        json_t *jn_conversion = kw_get_list(jn_slave, "conversion", 0, KW_REQUIRED);
-        if(!jn_conversion) {
-            continue;
+        gobj_destroy(ep->gobj);
+    }
+    GBMEM_FREE(priv->endpoints);
+    priv->max_endpoints = 0;
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE endpoint_t *find_endpoint(hgobj gobj, hgobj gobj_endpoint)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    for(int i=0; i<priv->max_endpoints; i++) {
+        if(priv->endpoints[i].gobj == gobj_endpoint) {
+            return &priv->endpoints[i];
         }
+    }
 
-        int idx_conversion; json_t *jn_variable;
-        json_array_foreach(jn_conversion, idx_conversion, jn_variable) {
-            check_conversion_variable(gobj, pslv, jn_variable);
+    log_error(0,
+        "gobj",         "%s", gobj_full_name(gobj),
+        "function",     "%s", __FUNCTION__,
+        "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+        "msg",          "%s", "Endpoint NOT FOUND",
+        "endpoint",     "%s", gobj_short_name(gobj_endpoint),
+        NULL
+    );
+    return 0;
+}
+
+/***************************************************************************
+ *  Has the endpoint something to poll? Without poll plan it never ends a cycle.
+ ***************************************************************************/
+PRIVATE BOOL endpoint_polls(endpoint_t *ep)
+{
+    PRIVATE_DATA *priv_ep = gobj_priv_data(ep->gobj);
+
+    return (priv_ep->max_requests > 0)? TRUE : FALSE;
+}
+
+/***************************************************************************
+ *  When all the connected endpoints with something to poll
+ *  have completed a cycle, publish the timing of the pool cycle.
+ *  The messages of the endpoints are published as they arrive.
+ ***************************************************************************/
+PRIVATE int check_pool_cycle(hgobj gobj)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    int polling = 0;
+    for(int i=0; i<priv->max_endpoints; i++) {
+        endpoint_t *ep = &priv->endpoints[i];
+        if(!ep->connected || !endpoint_polls(ep)) {
+            continue;
+        }
+        if(!ep->cycle_done) {
+            return 0; // Wait the slowest
         }
+        polling++;
+    }
+    if(!polling) {
+        return 0;
+    }
+
+    uint64_t now = time_in_miliseconds();
+    uint32_t cycle_ms = (uint32_t)(now - priv->pool_t0);
+    priv->pool_t0 = now;
+    gobj_write_uint32_attr(gobj, "cycle_ms", cycle_ms);
+    gobj_write_uint32_attr(gobj, "cycles", gobj_read_uint32_attr(gobj, "cycles") + 1);
+
+    json_t *jn_endpoints = json_array();
+    for(int i=0; i<priv->max_endpoints; i++) {
+        endpoint_t *ep = &priv->endpoints[i];
+        ep->cycle_done = FALSE;
+        json_array_append_new(jn_endpoints, json_pack("{s:s, s:b, s:i}",
+            "url", ep->url,
+            "connected", ep->connected,
+            "cycle_ms", (int)ep->cycle_ms
+        ));
+    }
+
+    if(!empty_string(priv->on_cycle_event_name)) {
+        json_t *kw_cycle = json_pack("{s:i, s:o}",
+            "cycle_ms", (int)cycle_ms,
+            "endpoints", jn_endpoints
+        );
+        gobj_publish_event(gobj, priv->on_cycle_event_name, kw_cycle);
+    } else {
+        JSON_DECREF(jn_endpoints);
     }
 
     return 0;
@@ -3057,6 +4896,15 @@ PRIVATE int ac_connected(hgobj gobj, const char *event, json_t *kw, hgobj src)
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
     RESET_MACHINE();
+    clear_transactions(gobj);
+
+    /*
+     *  The columnar schemas are published again in the new session
+     */
+    slave_data_t *pslv = priv->slave_data;
+    for(int i=0; pslv && i<priv->max_slaves; i++, pslv++) {
+        pslv->schema_published = FALSE;
+    }
 
     *priv->pconnected = 1;
 
@@ -3081,6 +4929,7 @@ PRIVATE int ac_disconnected(hgobj gobj, const char *event, json_t *kw, hgobj src
     PRIVATE_DATA *priv = gobj_priv_data(gobj);
 
     RESET_MACHINE();
+    clear_transactions(gobj);
 
     *priv->pconnected = 0;
 
@@ -3114,11 +4963,38 @@ PRIVATE int ac_rx_data(hgobj gobj, const char *event, json_t *kw, hgobj src)
     GBUFFER *gbuf = (GBUFFER *)(size_t)kw_get_int(kw, "gbuffer", 0, 0);
 
     /*---------------------------------------------*
-     *
+     *  Several responses can come in the same data
      *---------------------------------------------*/
     BOOL response_completed = FALSE;
     int lnn;
     BOOL fin = FALSE;
+
+    if(priv->protocol == MODBUS_PROTOCOL_ASCII) {
+        lnn = gbuf_leftbytes(gbuf);
+        if(ascii_consume(gobj, gbuf_get(gbuf, lnn), lnn) > 0) {
+            response_completed = TRUE;
+        }
+        fin = TRUE;
+
+    } else if(priv->protocol == MODBUS_PROTOCOL_RTU && priv->silent_interval_check) {
+        /*
+         *  A silent interval in the middle of a frame breaks it
+         */
+        uint64_t now = time_in_miliseconds();
+        if(priv->frame_head.busy && now - priv->last_rx > (uint64_t)priv->silent_interval_ms) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PROTOCOL_ERROR,
+                "msg",          "%s", "Modbus RTU frame broken by a silent interval, discarded",
+                "silent_ms",    "%d", (int)(now - priv->last_rx),
+                NULL
+            );
+            RESET_MACHINE()
+        }
+        priv->last_rx = now;
+    }
+
     while(!fin && (lnn=gbuf_leftbytes(gbuf))>0) {
         char *bf = gbuf_cur_rd_pointer(gbuf);
 
@@ -3146,7 +5022,9 @@ PRIVATE int ac_rx_data(hgobj gobj, const char *event, json_t *kw, hgobj src)
                 if(priv->frame_head.header_complete) {
                     if(priv->frame_head.payload_length <= 0) {
                         // Error already logged. Can be an exception
+                        frame_completed(gobj);
                         response_completed = TRUE;
+                        RESET_MACHINE()
                         break;
                     }
 
@@ -3169,7 +5047,8 @@ PRIVATE int ac_rx_data(hgobj gobj, const char *event, json_t *kw, hgobj src)
                             "payload_length", "%d", priv->frame_head.payload_length,
                             NULL
                         );
-                        response_completed = TRUE;
+                        fin = TRUE;
+                        gobj_send_event(gobj_bottom_gobj(gobj), "EV_DROP", 0, gobj);
                         break;
                     }
                     istream_read_until_num_bytes(
@@ -3194,9 +5073,12 @@ PRIVATE int ac_rx_data(hgobj gobj, const char *event, json_t *kw, hgobj src)
                            istream_get_gbuffer(priv->istream_payload), "%s", gobj_short_name(src)
                        );
                     }
-                    frame_completed(gobj);
+                    if(frame_completed(gobj)<0 && priv->protocol == MODBUS_PROTOCOL_RTU) {
+                        // Bad frame, the rest of data is not trusted
+                        gbuf_get(gbuf, gbuf_leftbytes(gbuf));
+                    }
                     response_completed = TRUE;
-                    fin = TRUE;
+                    RESET_MACHINE()
                 }
             }
             break;
@@ -3207,42 +5089,19 @@ PRIVATE int ac_rx_data(hgobj gobj, const char *event, json_t *kw, hgobj src)
      *      Next map
      *---------------------------*/
     if(response_completed) {
-        if(gbuf_leftbytes(gbuf)>0) {
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_PROTOCOL_ERROR,
-                "msg",          "%s", "Modbus: response too large",
-                NULL
-            );
-            log_debug_full_gbuf(0, gbuf, "Modbus: response too large");
-        }
-
         /*---------------------------------------------*
          *   Reset response timer
          *---------------------------------------------*/
         clear_timeout(priv->timer);
 
-        RESET_MACHINE()
-        gobj_change_state(gobj, "ST_SESSION");
-
-        if(!send_request(gobj)) {
-            if(next_map(gobj)<0) {
-                /*
-                 *  NO map or end of cycle, wait timeout_polling
-                 */
-                set_timeout(priv->timer, priv->timeout_polling);
-            } else {
-                if(poll_modbus(gobj)<0) {
-                    /*
-                     *  Problemas con el query actual, pasa al siguiente después del timeout
-                     */
-                    next_map(gobj);
-                    set_timeout(priv->timer, priv->timeout_polling);
-                } else {
-                    // timeout set by poll_modbus
-                }
-            }
+        if(priv->protocol == MODBUS_PROTOCOL_RTU && priv->inflight == 0) {
+            /*
+             *  The bus must be silent 3.5 characters before the next request
+             */
+            gobj_change_state(gobj, "ST_SESSION");
+            set_timeout(priv->timer, priv->silent_interval_ms);
+        } else {
+            poll_cycle(gobj, 0);
         }
     }
 
@@ -3283,29 +5142,10 @@ PRIVATE int ac_drop(hgobj gobj, const char *event, json_t *kw, hgobj src)
  ***************************************************************************/
 PRIVATE int ac_timeout_polling(hgobj gobj, const char *event, json_t *kw, hgobj src)
 {
-    PRIVATE_DATA *priv = gobj_priv_data(gobj);
-
     /*
-     *  Next map
+     *  Begin cycle
      */
-    if(!send_request(gobj)) {
-        if(next_map(gobj)<0) {
-            /*
-             *  NO map or end of cycle, wait timeout_polling
-             */
-            set_timeout(priv->timer, priv->timeout_polling);
-        } else {
-            if(poll_modbus(gobj)<0) {
-                /*
-                 *  Problemas con el query actual, pasa al siguiente después del timeout
-                 */
-                next_map(gobj);
-                set_timeout(priv->timer, priv->timeout_polling);
-            } else {
-                // timeout set by poll_modbus
-            }
-        }
-    }
+    poll_cycle(gobj, 0);
 
     KW_DECREF(kw);
     return 0;
@@ -3323,36 +5163,154 @@ PRIVATE int ac_timeout_response(hgobj gobj, const char *event, json_t *kw, hgobj
         "function",     "%s", __FUNCTION__,
         "msgset",       "%s", MSGSET_PROTOCOL_ERROR,
         "msg",          "%s", "Modbus Timeout",
+        "inflight",     "%d", priv->inflight,
         NULL
     );
 
     RESET_MACHINE()
+    clear_transactions(gobj);
     gobj_change_state(gobj, "ST_SESSION");
 
     /*
-     *  Next map
+     *  Next map, if end of cycle wait timeout_response
      */
-    if(next_map(gobj)<0) {
-        /*
-         *  NO map or end of cycle, wait timeout_polling
-         */
-        set_timeout(priv->timer, priv->timeout_response*1000);
-    } else {
-        if(poll_modbus(gobj)<0) {
-            /*
-             *  Problemas con el query actual, pasa al siguiente después del timeout
-             */
-            next_map(gobj);
-            set_timeout(priv->timer, priv->timeout_response*1000);
-        } else {
-            // timeout set by poll_modbus
+    poll_cycle(gobj, priv->timeout_response*1000);
+
+    KW_DECREF(kw);
+    return 0;
+}
+
+/***************************************************************************
+ *  Endpoint of the pool connected
+ ***************************************************************************/
+PRIVATE int ac_pool_open(hgobj gobj, const char *event, json_t *kw, hgobj src)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    endpoint_t *ep = find_endpoint(gobj, src);
+    if(ep) {
+        ep->connected = TRUE;
+        ep->cycle_done = FALSE;
+        *priv->pconnected = 1;
+
+        priv->inform_on_close = TRUE;
+        if(!empty_string(priv->on_open_event_name)) {
+            gobj_publish_event(gobj, priv->on_open_event_name,
+                json_pack("{s:s}", "url", ep->url)
+            );
+        }
+    }
+
+    KW_DECREF(kw);
+    return 0;
+}
+
+/***************************************************************************
+ *  Endpoint of the pool disconnected, don't wait it.
+ ***************************************************************************/
+PRIVATE int ac_pool_close(hgobj gobj, const char *event, json_t *kw, hgobj src)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    endpoint_t *ep = find_endpoint(gobj, src);
+    if(ep) {
+        ep->connected = FALSE;
+        ep->cycle_done = FALSE;
+
+        BOOL connected = FALSE;
+        for(int i=0; i<priv->max_endpoints; i++) {
+            if(priv->endpoints[i].connected) {
+                connected = TRUE;
+            }
+        }
+        *priv->pconnected = connected;
+
+        if(!empty_string(priv->on_close_event_name)) {
+            gobj_publish_event(gobj, priv->on_close_event_name,
+                json_pack("{s:s}", "url", ep->url)
+            );
         }
+        check_pool_cycle(gobj);
+    }
+
+    KW_DECREF(kw);
+    return 0;
+}
+
+/***************************************************************************
+ *  Slave message of an endpoint, published as it comes, with its url
+ ***************************************************************************/
+PRIVATE int ac_pool_message(hgobj gobj, const char *event, json_t *kw, hgobj src)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    endpoint_t *ep = find_endpoint(gobj, src);
+    if(!ep) {
+        KW_DECREF(kw);
+        return -1;
+    }
+
+    json_object_set_new(kw, "url", json_string(ep->url));
+
+    if(gobj_trace_level(gobj) & TRACE_MESSAGES) {
+        log_debug_json(0, kw, "PUBLISH %s", gobj_short_name(gobj));
+    }
+    return gobj_publish_event(gobj, priv->on_message_event_name, kw);
+}
+
+/***************************************************************************
+ *  Endpoint of the pool with cycle completed
+ ***************************************************************************/
+PRIVATE int ac_pool_cycle(hgobj gobj, const char *event, json_t *kw, hgobj src)
+{
+    endpoint_t *ep = find_endpoint(gobj, src);
+    if(ep) {
+        ep->cycle_done = TRUE;
+        ep->cycles++;
+        ep->cycle_ms = (uint32_t)kw_get_int(kw, "cycle_ms", 0, 0);
+        check_pool_cycle(gobj);
     }
 
     KW_DECREF(kw);
     return 0;
 }
 
+/***************************************************************************
+ *  Write request to the pool: to the endpoint of `url`,
+ *  or to the first endpoint with the slave `id`.
+ ***************************************************************************/
+PRIVATE int ac_pool_send_message(hgobj gobj, const char *event, json_t *kw, hgobj src)
+{
+    PRIVATE_DATA *priv = gobj_priv_data(gobj);
+
+    const char *url = kw_get_str(kw, "url", "", 0);
+    int slave_id = kw_get_int(kw, "id", 1, 0);
+
+    for(int i=0; i<priv->max_endpoints; i++) {
+        endpoint_t *ep = &priv->endpoints[i];
+        if(!empty_string(url)) {
+            if(strcmp(url, ep->url)!=0) {
+                continue;
+            }
+        } else if(!get_slave_data(ep->gobj, slave_id, FALSE)) {
+            continue;
+        }
+        return gobj_send_event(ep->gobj, "EV_SEND_MESSAGE", kw, gobj);
+    }
+
+    log_error(0,
+        "gobj",         "%s", gobj_full_name(gobj),
+        "function",     "%s", __FUNCTION__,
+        "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+        "msg",          "%s", "No endpoint for the write request",
+        "url",          "%s", url,
+        "slave_id",     "%d", slave_id,
+        NULL
+    );
+    KW_DECREF(kw);
+    return -1;
+}
+
 /***************************************************************************
  *  Child stopped
  ***************************************************************************/
@@ -3379,6 +5337,11 @@ PRIVATE const EVENT input_events[] = {
     {"EV_TX_READY",         0,  0,  ""},
     {"EV_TIMEOUT",          0,  0,  ""},
     {"EV_STOPPED",          0,  0,  ""},
+    // endpoints of the pool
+    {"EV_ON_OPEN",          0,  0,  ""},
+    {"EV_ON_CLOSE",         0,  0,  ""},
+    {"EV_ON_MESSAGE",       0,  0,  ""},
+    {"EV_ON_CYCLE",         0,  0,  ""},
     // internal
     {NULL, 0, 0, ""}
 };
@@ -3386,6 +5349,7 @@ PRIVATE const EVENT output_events[] = {
     {"EV_ON_OPEN",          0,  0,  ""},
     {"EV_ON_CLOSE",         0,  0,  ""},
     {"EV_ON_MESSAGE",       0,  0,  ""},
+    {"EV_ON_CYCLE",         0,  0,  ""},
     {NULL, 0, 0, ""}
 };
 PRIVATE const char *state_names[] = {
@@ -3393,6 +5357,7 @@ PRIVATE const char *state_names[] = {
     "ST_WAIT_CONNECTED",
     "ST_SESSION",
     "ST_WAIT_RESPONSE",
+    "ST_POOL",
     NULL
 };
 
@@ -3424,12 +5389,22 @@ PRIVATE EV_ACTION ST_WAIT_RESPONSE[] = {
     {"EV_DISCONNECTED",     ac_disconnected,            "ST_DISCONNECTED"},
     {0,0,0}
 };
+PRIVATE EV_ACTION ST_POOL[] = {
+    {"EV_ON_OPEN",          ac_pool_open,               0},
+    {"EV_ON_CLOSE",         ac_pool_close,              0},
+    {"EV_ON_MESSAGE",       ac_pool_message,            0},
+    {"EV_ON_CYCLE",         ac_pool_cycle,              0},
+    {"EV_SEND_MESSAGE",     ac_pool_send_message,       0},
+    {"EV_STOPPED",          ac_stopped,                 0},
+    {0,0,0}
+};
 
 PRIVATE EV_ACTION *states[] = {
     ST_DISCONNECTED,
     ST_WAIT_CONNECTED,
     ST_SESSION,
     ST_WAIT_RESPONSE,
+    ST_POOL,
     NULL
 };
 
@@ -3537,5 +5512,6 @@ PRIVATE GCLASS _gclass = {
  ***************************************************************************/
 PUBLIC GCLASS *gclass_prot_modbus_master(void)
 {
+    crc16_select();
     return &_gclass;
 }